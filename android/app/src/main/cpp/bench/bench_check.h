@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdio>
+
+// Correctness checks shared by the host benchmarks: a failed check is
+// reported on stderr and counted, and main() exits non-zero if any failed.
+inline int g_failures = 0;
+
+inline void check(bool ok, const char* what) {
+    if (!ok) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        g_failures++;
+    }
+}
@@ -0,0 +1,711 @@
+// q4f16_0 CPU kernels and the CPU chat module: correctness checks against a
+// scalar reference and tokens/s at Llama-3.2-1B dimensions.
+//
+// Checks every kernel (including column and K tails) against plain loops
+// over the dequantized weights, then runs a two-layer model through
+// CpuChatModule and compares prefill, decode, verify, fork and rollback
+// logits with a scalar reference forward pass, both inline and split across
+// pool threads, and that evicting a block re-rotates the keys after it. The benchmark uses random
+// q4 weights with the real shapes, so it measures speed only. Exits
+// non-zero if a check fails.
+//
+//   cpu_kernels_bench [layers] [prompt_tokens] [decode_tokens] [performance_workers]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench_check.h"
+#include "cpu_chat_module.h"
+#include "cpu_kernels.h"
+#include "fp16.h"
+#include "thread_pool.h"
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<float> random_floats(std::mt19937& rng, size_t count, float stddev) {
+    std::normal_distribution<float> noise(0.0f, stddev);
+    std::vector<float> values(count);
+    for (float& x : values) x = noise(rng);
+    return values;
+}
+
+// A quantized matrix that owns its storage
+struct OwnedQ4 {
+    std::vector<uint32_t> data;
+    std::vector<uint16_t> scales;
+    Q4Matrix matrix;
+    bool kn = true;
+};
+
+OwnedQ4 quantized(std::mt19937& rng, int32_t out_features, int32_t in_features, bool kn, float stddev = 0.1f) {
+    OwnedQ4 owned;
+    owned.kn = kn;
+    owned.matrix.in_features = in_features;
+    owned.matrix.out_features = out_features;
+    owned.data.resize(owned.matrix.data_words());
+    owned.scales.resize(owned.matrix.scale_count());
+    const std::vector<float> weight = random_floats(rng, static_cast<size_t>(out_features) * in_features, stddev);
+    if (kn) q4_quantize_kn(weight.data(), out_features, in_features, owned.data.data(), owned.scales.data());
+    else q4_quantize_nk(weight.data(), out_features, in_features, owned.data.data(), owned.scales.data());
+    owned.matrix.data = owned.data.data();
+    owned.matrix.scales = owned.scales.data();
+    return owned;
+}
+
+// ---- scalar reference ----
+
+float reference_weight(const Q4Matrix& w, bool kn, int32_t n, int32_t k) {
+    const size_t in = static_cast<size_t>(w.in_features);
+    const size_t out = static_cast<size_t>(w.out_features);
+    const size_t word = kn ? (k / kQ4PerWord) * out + n : n * (in / kQ4PerWord) + k / kQ4PerWord;
+    const size_t scale = kn ? (k / kQ4GroupSize) * out + n : n * (in / kQ4GroupSize) + k / kQ4GroupSize;
+    const int32_t q = static_cast<int32_t>((w.data[word] >> (4 * (k % kQ4PerWord))) & 0xfu);
+    return static_cast<float>(q - kQ4ZeroPoint) * half_to_float(w.scales[scale]);
+}
+
+// Dequantized row-major [out][in]
+std::vector<float> reference_dequantize(const Q4Matrix& w, bool kn) {
+    std::vector<float> dense(static_cast<size_t>(w.out_features) * w.in_features);
+    for (int32_t n = 0; n < w.out_features; n++) {
+        for (int32_t k = 0; k < w.in_features; k++) {
+            dense[static_cast<size_t>(n) * w.in_features + k] = reference_weight(w, kn, n, k);
+        }
+    }
+    return dense;
+}
+
+void reference_matmul(const std::vector<float>& dense, int32_t out_features, int32_t in_features, const float* x,
+                      float* y) {
+    for (int32_t n = 0; n < out_features; n++) {
+        double sum = 0.0;
+        for (int32_t k = 0; k < in_features; k++) sum += double(dense[size_t(n) * in_features + k]) * x[k];
+        y[n] = static_cast<float>(sum);
+    }
+}
+
+void reference_rms_norm(const float* x, const float* weight, size_t count, float eps, float* out) {
+    double squares = 0.0;
+    for (size_t i = 0; i < count; i++) squares += double(x[i]) * x[i];
+    const double inverse = 1.0 / std::sqrt(squares / count + eps);
+    for (size_t i = 0; i < count; i++) out[i] = static_cast<float>(x[i] * inverse * weight[i]);
+}
+
+// Largest |a - b| relative to the largest |b|
+float relative_error(const float* a, const float* b, size_t count) {
+    float worst = 0.0f;
+    float scale = 0.0f;
+    for (size_t i = 0; i < count; i++) {
+        worst = std::max(worst, std::fabs(a[i] - b[i]));
+        scale = std::max(scale, std::fabs(b[i]));
+    }
+    return scale > 0.0f ? worst / scale : worst;
+}
+
+// ---- kernel checks ----
+
+void check_quantize() {
+    std::mt19937 rng(1);
+    const int32_t out = 24;
+    const int32_t in = 128;
+    const std::vector<float> weight = random_floats(rng, size_t(out) * in, 1.0f);
+    for (bool kn : {true, false}) {
+        std::vector<uint32_t> data(size_t(out) * in / kQ4PerWord);
+        std::vector<uint16_t> scales(size_t(out) * in / kQ4GroupSize);
+        if (kn) q4_quantize_kn(weight.data(), out, in, data.data(), scales.data());
+        else q4_quantize_nk(weight.data(), out, in, data.data(), scales.data());
+        const Q4Matrix w{data.data(), scales.data(), in, out};
+        // Within half a step of the group's scale (the fp16 rounding of the
+        // scale can push the largest value a hair past it)
+        bool within = true;
+        for (int32_t n = 0; n < out; n++) {
+            for (int32_t k = 0; k < in; k++) {
+                const size_t group = kn ? size_t(k / kQ4GroupSize) * out + n : size_t(n) * (in / kQ4GroupSize) + k / kQ4GroupSize;
+                const float step = half_to_float(scales[group]);
+                const float error = std::fabs(reference_weight(w, kn, n, k) - weight[size_t(n) * in + k]);
+                within &= error <= 0.5f * step * 1.01f + 1e-6f;
+            }
+        }
+        check(within, kn ? "q4 KN quantization error within half a step" : "q4 NK quantization error within half a step");
+    }
+}
+
+void check_gemv() {
+    std::mt19937 rng(2);
+    // Output counts cover the 32-column blocks, the 8-column blocks and the scalar tail
+    const struct {
+        int32_t in;
+        int32_t out;
+    } shapes[] = {{32, 1}, {64, 8}, {96, 45}, {256, 77}, {2048, 300}};
+    for (const auto& shape : shapes) {
+        for (bool kn : {true, false}) {
+            const OwnedQ4 w = quantized(rng, shape.out, shape.in, kn);
+            const std::vector<float> x = random_floats(rng, size_t(shape.in), 1.0f);
+            const std::vector<float> dense = reference_dequantize(w.matrix, kn);
+            std::vector<float> expected(size_t(shape.out)), actual(size_t(shape.out));
+            reference_matmul(dense, shape.out, shape.in, x.data(), expected.data());
+            if (kn) q4_gemv_kn(w.matrix, x.data(), actual.data());
+            else q4_gemv_nk(w.matrix, x.data(), actual.data());
+            check(relative_error(actual.data(), expected.data(), expected.size()) < 1e-4f,
+                  kn ? "q4_gemv_kn matches the reference" : "q4_gemv_nk matches the reference");
+
+            if (!kn) {
+                std::vector<float> row(size_t(shape.in));
+                const int32_t index = shape.out - 1;
+                q4_dequantize_row_nk(w.matrix, index, row.data());
+                check(relative_error(row.data(), dense.data() + size_t(index) * shape.in, row.size()) == 0.0f,
+                      "q4_dequantize_row_nk matches the reference");
+            }
+        }
+    }
+}
+
+void check_gemm() {
+    std::mt19937 rng(3);
+    // K crosses the 128-deep tile, N the 64-wide tile with a tail
+    const int32_t in = 288;
+    const int32_t out = 150;
+    const OwnedQ4 w = quantized(rng, out, in, true);
+    const std::vector<float> dense = reference_dequantize(w.matrix, true);
+    for (size_t rows : {size_t(1), size_t(2), size_t(5), size_t(64), size_t(70)}) {
+        const std::vector<float> x = random_floats(rng, rows * in, 1.0f);
+        std::vector<float> expected(rows * out), actual(rows * out);
+        for (size_t r = 0; r < rows; r++) {
+            reference_matmul(dense, out, in, x.data() + r * in, expected.data() + r * out);
+        }
+        q4_gemm_kn(w.matrix, x.data(), rows, actual.data());
+        check(relative_error(actual.data(), expected.data(), expected.size()) < 1e-4f,
+              "q4_gemm_kn matches the reference");
+    }
+}
+
+void check_vector_ops() {
+    std::mt19937 rng(4);
+    const size_t count = 67;
+    const std::vector<float> a = random_floats(rng, count, 1.0f);
+    const std::vector<float> b = random_floats(rng, count, 1.0f);
+
+    double expected_dot = 0.0;
+    for (size_t i = 0; i < count; i++) expected_dot += double(a[i]) * b[i];
+    check(std::fabs(dot(a.data(), b.data(), count) - expected_dot) < 1e-4, "dot matches the reference");
+
+    std::vector<float> y = b;
+    axpy(0.5f, a.data(), y.data(), count);
+    bool axpy_ok = true;
+    for (size_t i = 0; i < count; i++) axpy_ok &= std::fabs(y[i] - (b[i] + 0.5f * a[i])) < 1e-6f;
+    check(axpy_ok, "axpy matches the reference");
+
+    std::vector<float> out(count);
+    silu_mul(a.data(), b.data(), out.data(), count);
+    bool silu_ok = true;
+    for (size_t i = 0; i < count; i++) {
+        const float expected = a[i] / (1.0f + std::exp(-a[i])) * b[i];
+        silu_ok &= std::fabs(out[i] - expected) < 1e-5f;
+    }
+    check(silu_ok, "silu_mul matches the reference");
+
+    const std::vector<float> weight = random_floats(rng, count, 1.0f);
+    std::vector<float> expected(count), normed(count);
+    reference_rms_norm(a.data(), weight.data(), count, 1e-5f, expected.data());
+    rms_norm(a.data(), weight.data(), count, 1e-5f, normed.data());
+    check(relative_error(normed.data(), expected.data(), count) < 1e-5f, "rms_norm matches the reference");
+    std::vector<float> in_place = a;
+    rms_norm(in_place.data(), weight.data(), count, 1e-5f, in_place.data());
+    check(relative_error(in_place.data(), expected.data(), count) < 1e-5f, "rms_norm works in place");
+}
+
+void check_rope() {
+    const int32_t head_dim = 64;
+    const int32_t half = head_dim / 2;
+    std::vector<float> plain(half), scaled(half);
+    rope_inv_freq(head_dim, 500000.0f, RopeScaling(), plain.data());
+    bool unscaled_ok = true;
+    for (int32_t i = 0; i < half; i++) {
+        const double expected = std::pow(500000.0, -2.0 * i / head_dim);
+        unscaled_ok &= std::fabs(plain[i] - expected) <= 1e-6 * expected;
+    }
+    check(unscaled_ok, "rope frequencies without scaling");
+
+    // Llama-3.1 scaling: short wavelengths are kept, long ones divided by
+    // the factor, the band in between interpolated
+    const RopeScaling llama3 = {32.0f, 1.0f, 4.0f, 8192};
+    rope_inv_freq(head_dim, 500000.0f, llama3, scaled.data());
+    check(scaled[0] == plain[0], "rope scaling keeps high frequencies");
+    check(std::fabs(scaled[half - 1] - plain[half - 1] / 32.0f) <= 1e-6f * plain[half - 1],
+          "rope scaling divides low frequencies");
+    bool between = true;
+    for (int32_t i = 0; i < half; i++) between &= scaled[i] <= plain[i] && scaled[i] >= plain[i] / 32.0f * 0.999f;
+    check(between, "rope scaling stays between the two");
+
+    std::mt19937 rng(5);
+    const int32_t heads = 3;
+    const int64_t position = 1234;
+    std::vector<float> vectors = random_floats(rng, size_t(heads) * head_dim, 1.0f);
+    std::vector<float> expected = vectors;
+    for (int32_t h = 0; h < heads; h++) {
+        float* v = expected.data() + size_t(h) * head_dim;
+        for (int32_t i = 0; i < half; i++) {
+            const double angle = double(position) * plain[i];
+            const double x0 = v[i];
+            const double x1 = v[i + half];
+            v[i] = static_cast<float>(x0 * std::cos(angle) - x1 * std::sin(angle));
+            v[i + half] = static_cast<float>(x1 * std::cos(angle) + x0 * std::sin(angle));
+        }
+    }
+    std::vector<float> cos_sin(head_dim);
+    rope_angles(plain.data(), head_dim, position, cos_sin.data());
+    apply_rope(vectors.data(), heads, head_dim, cos_sin.data());
+    check(relative_error(vectors.data(), expected.data(), vectors.size()) < 1e-4f, "apply_rope matches the reference");
+}
+
+// ---- model checks ----
+
+// Named parameters in the MLC layout, served to CpuChatModule::create()
+struct TensorStore {
+    std::map<std::string, std::vector<uint8_t>> tensors;
+
+    void add(const std::string& name, const void* data, size_t bytes) {
+        const auto* begin = static_cast<const uint8_t*>(data);
+        tensors[name].assign(begin, begin + bytes);
+    }
+    void add_q4(const std::string& prefix, const OwnedQ4& w) {
+        add(prefix + ".q_weight", w.data.data(), w.data.size() * sizeof(uint32_t));
+        add(prefix + ".q_scale", w.scales.data(), w.scales.size() * sizeof(uint16_t));
+    }
+    TensorLookup lookup() const {
+        return [this](const std::string& name, size_t bytes) -> const void* {
+            auto it = tensors.find(name);
+            return it != tensors.end() && it->second.size() == bytes ? it->second.data() : nullptr;
+        };
+    }
+};
+
+// Dense float copy of a tiny Llama, for the reference forward pass
+struct ReferenceModel {
+    CpuLlamaConfig config;
+    std::vector<float> embedding, lm_head, final_norm;
+    struct Layer {
+        std::vector<float> qkv, out, gate_up, down, input_norm, post_attention_norm;
+    };
+    std::vector<Layer> layers;
+};
+
+std::vector<float> random_norm(std::mt19937& rng, int32_t size, TensorStore* store, const std::string& name) {
+    std::uniform_real_distribution<float> gain(0.5f, 1.5f);
+    std::vector<uint16_t> half(static_cast<size_t>(size));
+    std::vector<float> weight(static_cast<size_t>(size));
+    for (int32_t i = 0; i < size; i++) {
+        half[i] = float_to_half(gain(rng));
+        weight[i] = half_to_float(half[i]);
+    }
+    store->add(name, half.data(), half.size() * sizeof(uint16_t));
+    return weight;
+}
+
+ReferenceModel make_tiny_model(const CpuLlamaConfig& config, TensorStore* store) {
+    std::mt19937 rng(6);
+    ReferenceModel model;
+    model.config = config;
+    const int32_t hidden = config.hidden_size;
+    const int32_t q_width = config.num_attention_heads * config.head_dim;
+    const int32_t qkv_width = q_width + 2 * config.num_key_value_heads * config.head_dim;
+
+    const OwnedQ4 embedding = quantized(rng, config.vocab_size, hidden, false, 1.0f);
+    store->add_q4("model.embed_tokens", embedding);
+    model.embedding = reference_dequantize(embedding.matrix, false);
+    model.final_norm = random_norm(rng, hidden, store, "model.norm.weight");
+    if (config.tie_word_embeddings) {
+        model.lm_head = model.embedding;
+    } else {
+        const OwnedQ4 lm_head = quantized(rng, config.vocab_size, hidden, true);
+        store->add_q4("lm_head", lm_head);
+        model.lm_head = reference_dequantize(lm_head.matrix, true);
+    }
+
+    for (int32_t i = 0; i < config.num_hidden_layers; i++) {
+        const std::string prefix = "model.layers." + std::to_string(i) + ".";
+        ReferenceModel::Layer layer;
+        const OwnedQ4 qkv = quantized(rng, qkv_width, hidden, true, 0.2f);
+        const OwnedQ4 out = quantized(rng, hidden, q_width, true);
+        const OwnedQ4 gate_up = quantized(rng, 2 * config.intermediate_size, hidden, true);
+        const OwnedQ4 down = quantized(rng, hidden, config.intermediate_size, true);
+        store->add_q4(prefix + "self_attn.qkv_proj", qkv);
+        store->add_q4(prefix + "self_attn.o_proj", out);
+        store->add_q4(prefix + "mlp.gate_up_proj", gate_up);
+        store->add_q4(prefix + "mlp.down_proj", down);
+        layer.qkv = reference_dequantize(qkv.matrix, true);
+        layer.out = reference_dequantize(out.matrix, true);
+        layer.gate_up = reference_dequantize(gate_up.matrix, true);
+        layer.down = reference_dequantize(down.matrix, true);
+        layer.input_norm = random_norm(rng, hidden, store, prefix + "input_layernorm.weight");
+        layer.post_attention_norm = random_norm(rng, hidden, store, prefix + "post_attention_layernorm.weight");
+        model.layers.push_back(std::move(layer));
+    }
+    return model;
+}
+
+// Logits after every token, straight from the definition. K and V go
+// through fp16 as they do in the KV cache.
+std::vector<float> reference_forward(const ReferenceModel& model, const std::vector<int32_t>& tokens) {
+    const CpuLlamaConfig& c = model.config;
+    const size_t count = tokens.size();
+    const size_t hidden = size_t(c.hidden_size);
+    const size_t head_dim = size_t(c.head_dim);
+    const size_t half = head_dim / 2;
+    const size_t heads = size_t(c.num_attention_heads);
+    const size_t kv_heads = size_t(c.num_key_value_heads);
+    const size_t q_width = heads * head_dim;
+    const size_t kv_width = kv_heads * head_dim;
+    const size_t intermediate = size_t(c.intermediate_size);
+    const size_t vocab = size_t(c.vocab_size);
+
+    std::vector<float> inv_freq(half);
+    rope_inv_freq(c.head_dim, c.rope_theta, c.rope_scaling, inv_freq.data());
+    auto rotate = [&](float* v, size_t position) {
+        for (size_t i = 0; i < half; i++) {
+            const double angle = double(position) * inv_freq[i];
+            const double x0 = v[i];
+            const double x1 = v[i + half];
+            v[i] = static_cast<float>(x0 * std::cos(angle) - x1 * std::sin(angle));
+            v[i + half] = static_cast<float>(x1 * std::cos(angle) + x0 * std::sin(angle));
+        }
+    };
+
+    std::vector<float> x(count * hidden);
+    for (size_t t = 0; t < count; t++) {
+        std::copy_n(model.embedding.data() + size_t(tokens[t]) * hidden, hidden, x.data() + t * hidden);
+    }
+    std::vector<float> normed(hidden), qkv(q_width + 2 * kv_width), attended(q_width), projected(hidden);
+    std::vector<float> gate_up(2 * intermediate), activated(intermediate);
+    std::vector<float> queries(count * q_width), keys(count * kv_width), values(count * kv_width);
+    for (const ReferenceModel::Layer& layer : model.layers) {
+        for (size_t t = 0; t < count; t++) {
+            reference_rms_norm(x.data() + t * hidden, layer.input_norm.data(), hidden, c.rms_norm_eps, normed.data());
+            reference_matmul(layer.qkv, int32_t(qkv.size()), c.hidden_size, normed.data(), qkv.data());
+            for (size_t h = 0; h < heads + kv_heads; h++) rotate(qkv.data() + h * head_dim, t);
+            std::copy_n(qkv.data(), q_width, queries.data() + t * q_width);
+            for (size_t i = 0; i < kv_width; i++) {
+                keys[t * kv_width + i] = half_to_float(float_to_half(qkv[q_width + i]));
+                values[t * kv_width + i] = half_to_float(float_to_half(qkv[q_width + kv_width + i]));
+            }
+        }
+        for (size_t t = 0; t < count; t++) {
+            for (size_t h = 0; h < heads; h++) {
+                const size_t g = h / (heads / kv_heads);
+                std::vector<double> scores(t + 1);
+                double max_score = -INFINITY;
+                for (size_t j = 0; j <= t; j++) {
+                    double s = 0.0;
+                    for (size_t d = 0; d < head_dim; d++) {
+                        s += double(queries[t * q_width + h * head_dim + d]) * keys[j * kv_width + g * head_dim + d];
+                    }
+                    scores[j] = s / std::sqrt(double(head_dim));
+                    max_score = std::max(max_score, scores[j]);
+                }
+                double total = 0.0;
+                for (double& s : scores) total += (s = std::exp(s - max_score));
+                for (size_t d = 0; d < head_dim; d++) {
+                    double sum = 0.0;
+                    for (size_t j = 0; j <= t; j++) sum += scores[j] * values[j * kv_width + g * head_dim + d];
+                    attended[h * head_dim + d] = static_cast<float>(sum / total);
+                }
+            }
+            float* row = x.data() + t * hidden;
+            reference_matmul(layer.out, c.hidden_size, int32_t(q_width), attended.data(), projected.data());
+            for (size_t i = 0; i < hidden; i++) row[i] += projected[i];
+            reference_rms_norm(row, layer.post_attention_norm.data(), hidden, c.rms_norm_eps, normed.data());
+            reference_matmul(layer.gate_up, int32_t(2 * intermediate), c.hidden_size, normed.data(), gate_up.data());
+            for (size_t i = 0; i < intermediate; i++) {
+                const float gate = gate_up[i];
+                activated[i] = gate / (1.0f + std::exp(-gate)) * gate_up[intermediate + i];
+            }
+            reference_matmul(layer.down, c.hidden_size, c.intermediate_size, activated.data(), projected.data());
+            for (size_t i = 0; i < hidden; i++) row[i] += projected[i];
+        }
+    }
+
+    std::vector<float> logits(count * vocab);
+    for (size_t t = 0; t < count; t++) {
+        reference_rms_norm(x.data() + t * hidden, model.final_norm.data(), hidden, c.rms_norm_eps, normed.data());
+        reference_matmul(model.lm_head, c.vocab_size, c.hidden_size, normed.data(), logits.data() + t * vocab);
+    }
+    return logits;
+}
+
+void check_model(bool tied) {
+    CpuLlamaConfig config;
+    config.hidden_size = 64;
+    config.intermediate_size = 96;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    config.head_dim = 16;
+    config.num_hidden_layers = 2;
+    config.vocab_size = 300;
+    config.tie_word_embeddings = tied;
+
+    TensorStore store;
+    const ReferenceModel reference = make_tiny_model(config, &store);
+    KvCacheLayout layout;
+    layout.block_tokens = 16;
+    std::unique_ptr<CpuChatModule> module =
+        CpuChatModule::create(config, store.lookup(), nullptr, 0, nullptr, {}, layout, 0);
+    check(module != nullptr, "tiny model loads");
+    if (!module) return;
+
+    // Longer than one prefill chunk, so the chunk boundary is covered
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int32_t> token(0, config.vocab_size - 1);
+    std::vector<int32_t> tokens(CpuChatModule::kChunkTokens + 40);
+    for (int32_t& t : tokens) t = token(rng);
+    const size_t prompt = tokens.size() - 4;
+    const size_t vocab = size_t(config.vocab_size);
+    const std::vector<float> expected = reference_forward(reference, tokens);
+    const float tolerance = 2e-3f;
+    auto row = [&](size_t t) { return expected.data() + t * vocab; };
+
+    std::vector<float> logits(vocab);
+    module->add_sequence(0);
+    check(module->prefill(0, tokens.data(), prompt, logits.data()), "tiny model prefill");
+    check(relative_error(logits.data(), row(prompt - 1), vocab) < tolerance, "prefill logits match the reference");
+    bool decode_ok = true;
+    for (size_t t = prompt; t < tokens.size(); t++) {
+        decode_ok &= module->decode(0, tokens[t], logits.data());
+        decode_ok &= relative_error(logits.data(), row(t), vocab) < tolerance;
+    }
+    check(decode_ok, "decode logits match the reference");
+
+    std::vector<float> all(tokens.size() * vocab);
+    module->add_sequence(1);
+    check(module->verify(1, tokens.data(), tokens.size(), all.data()), "tiny model verify");
+    check(relative_error(all.data(), expected.data(), all.size()) < tolerance, "verify logits match the reference");
+
+    // A fork continues from the shared prefix; a rollback re-decodes the same
+    module->add_sequence(2);
+    const size_t shared = 50;
+    check(module->fork_sequence(0, 3, shared), "tiny model fork");
+    check(module->decode(3, tokens[shared], logits.data()) &&
+              relative_error(logits.data(), row(shared), vocab) < tolerance,
+          "forked sequence matches the reference");
+    check(module->pop_tokens(1, 3) && module->decode(1, tokens[tokens.size() - 3], logits.data()) &&
+              relative_error(logits.data(), row(tokens.size() - 3), vocab) < tolerance,
+          "rolled-back sequence matches the reference");
+
+    const int32_t out_of_range = config.vocab_size;
+    check(!module->decode(2, out_of_range, logits.data()), "out-of-range token is rejected");
+
+    TensorStore broken = store;
+    broken.tensors.erase("model.layers.1.mlp.down_proj.q_scale");
+    check(CpuChatModule::create(config, broken.lookup(), nullptr, 0, nullptr, {}, layout, 0) == nullptr,
+          "missing parameter is rejected");
+}
+
+// With a single layer, keys and values depend only on each token and its
+// position, so after evicting a block the cache must hold exactly what a
+// prefill of the remaining tokens would have written
+void check_eviction() {
+    CpuLlamaConfig config;
+    config.hidden_size = 64;
+    config.intermediate_size = 96;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    config.head_dim = 16;
+    config.num_hidden_layers = 1;
+    config.vocab_size = 300;
+
+    TensorStore store;
+    const ReferenceModel reference = make_tiny_model(config, &store);
+    KvCacheLayout layout;
+    layout.layers = 1;
+    layout.kv_heads = 2;
+    layout.head_dim = 16;
+    std::unique_ptr<CpuChatModule> module =
+        CpuChatModule::create(config, store.lookup(), nullptr, 0, nullptr, {}, layout, 0);
+    check(module != nullptr, "one-layer model loads");
+    if (!module) return;
+    check(module->eviction_granularity() == 16, "eviction granularity is one KV block");
+
+    std::mt19937 rng(13);
+    std::uniform_int_distribution<int32_t> token(0, config.vocab_size - 1);
+    std::vector<int32_t> tokens(70);
+    for (int32_t& t : tokens) t = token(rng);
+    const size_t vocab = size_t(config.vocab_size);
+    std::vector<float> logits(vocab);
+    module->add_sequence(0);
+    check(module->prefill(0, tokens.data(), tokens.size() - 1, logits.data()), "one-layer prefill");
+    module->fork_sequence(0, 1, 48); // shares the blocks the eviction rewrites
+
+    check(!module->evict_tokens(0, 8, 16), "eviction off a block boundary is rejected");
+    check(module->evict_tokens(0, 16, 32) && module->kv_cache().length(0) == tokens.size() - 33,
+          "evict two blocks after the sinks");
+    check(module->decode(0, tokens.back(), logits.data()), "decode after eviction");
+
+    std::vector<int32_t> remaining(tokens.begin(), tokens.begin() + 16);
+    remaining.insert(remaining.end(), tokens.begin() + 48, tokens.end());
+    const std::vector<float> expected = reference_forward(reference, remaining);
+    check(relative_error(logits.data(), expected.data() + (remaining.size() - 1) * vocab, vocab) < 2e-3f,
+          "evicted sequence matches a prefill of the remaining tokens");
+
+    const std::vector<float> shared = reference_forward(reference, std::vector<int32_t>(tokens.begin(), tokens.begin() + 49));
+    check(module->decode(1, tokens[48], logits.data()) &&
+              relative_error(logits.data(), shared.data() + 48 * vocab, vocab) < 2e-3f,
+          "eviction leaves a forked sequence intact");
+}
+
+// ---- benchmark ----
+
+// Random q4 weights with the given shape, generated directly (quantizing a
+// float matrix of this size would take longer than the benchmark)
+struct RandomQ4 {
+    std::vector<uint32_t> data;
+    std::vector<uint16_t> scales;
+};
+
+void fill_random(RandomQ4* w, size_t words, size_t scales, uint64_t* state) {
+    w->data.resize(words);
+    w->scales.resize(scales);
+    for (uint32_t& word : w->data) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        // Keep every nibble within 0..14 like the quantizer does
+        word = static_cast<uint32_t>(*state) & 0x77777777u;
+    }
+    const uint16_t scale = float_to_half(0.02f);
+    std::fill(w->scales.begin(), w->scales.end(), scale);
+}
+
+void run_benchmark(int32_t layers, size_t prompt_tokens, size_t decode_tokens) {
+    CpuLlamaConfig config;
+    config.num_hidden_layers = layers;
+    const int32_t hidden = config.hidden_size;
+    const int32_t q_width = config.num_attention_heads * config.head_dim;
+    const int32_t qkv_width = q_width + 2 * config.num_key_value_heads * config.head_dim;
+
+    std::printf("cpu kernels (%s), Llama-3.2-1B shapes, %d layers, random q4f16_0 weights, %zu + 1 threads\n",
+                cpu_kernels_isa(), layers, ThreadPool::shared()->worker_count(CoreClass::kPerformance));
+    const auto build_start = std::chrono::steady_clock::now();
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    std::map<std::string, RandomQ4> q4;
+    auto add = [&](const std::string& prefix, int32_t in, int32_t out) {
+        fill_random(&q4[prefix], size_t(in) / kQ4PerWord * out, size_t(in) / kQ4GroupSize * out, &state);
+    };
+    add("model.embed_tokens", hidden, config.vocab_size);
+    for (int32_t i = 0; i < layers; i++) {
+        const std::string prefix = "model.layers." + std::to_string(i) + ".";
+        add(prefix + "self_attn.qkv_proj", hidden, qkv_width);
+        add(prefix + "self_attn.o_proj", q_width, hidden);
+        add(prefix + "mlp.gate_up_proj", hidden, 2 * config.intermediate_size);
+        add(prefix + "mlp.down_proj", config.intermediate_size, hidden);
+    }
+    const std::vector<uint16_t> ones(size_t(hidden), float_to_half(1.0f));
+    int64_t total_bytes = 0;
+    for (const auto& entry : q4) {
+        total_bytes += int64_t(entry.second.data.size() * sizeof(uint32_t) + entry.second.scales.size() * sizeof(uint16_t));
+    }
+    TensorLookup lookup = [&](const std::string& name, size_t bytes) -> const void* {
+        if (name.size() > 7 && name.compare(name.size() - 7, 7, ".weight") == 0) {
+            return bytes == ones.size() * sizeof(uint16_t) ? ones.data() : nullptr;
+        }
+        const size_t dot_at = name.rfind('.');
+        auto it = q4.find(name.substr(0, dot_at));
+        if (it == q4.end()) return nullptr;
+        const bool is_data = name.compare(dot_at, std::string::npos, ".q_weight") == 0;
+        const size_t size = is_data ? it->second.data.size() * sizeof(uint32_t)
+                                    : it->second.scales.size() * sizeof(uint16_t);
+        if (size != bytes) return nullptr;
+        return is_data ? static_cast<const void*>(it->second.data.data()) : it->second.scales.data();
+    };
+    std::unique_ptr<CpuChatModule> module =
+        CpuChatModule::create(config, lookup, nullptr, total_bytes, nullptr, {}, KvCacheLayout(), 0);
+    if (!module) {
+        std::fprintf(stderr, "benchmark model failed to load\n");
+        g_failures++;
+        return;
+    }
+    std::printf("  %.0f MB of weights generated in %.1f s\n", total_bytes / 1048576.0, seconds_since(build_start));
+
+    // The largest projection alone: decode is bound by streaming weights
+    {
+        const RandomQ4& gate_up = q4["model.layers.0.mlp.gate_up_proj"];
+        const Q4Matrix w{gate_up.data.data(), gate_up.scales.data(), hidden, 2 * config.intermediate_size};
+        std::vector<float> x(size_t(hidden), 0.5f), y(size_t(w.out_features));
+        const int iterations = 20;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) q4_gemv_kn(w, x.data(), y.data());
+        const double elapsed = seconds_since(start) / iterations;
+        const double bytes = double(w.data_words() * sizeof(uint32_t) + w.scale_count() * sizeof(uint16_t));
+        std::printf("  gemv %d -> %d:      %8.2f ms  %6.2f GB/s of weights\n", hidden, w.out_features, elapsed * 1e3,
+                    bytes / elapsed / 1e9);
+
+        const size_t rows = CpuChatModule::kChunkTokens;
+        std::vector<float> xs(rows * hidden, 0.5f), ys(rows * w.out_features);
+        const auto gemm_start = std::chrono::steady_clock::now();
+        q4_gemm_kn(w, xs.data(), rows, ys.data());
+        const double gemm_elapsed = seconds_since(gemm_start);
+        std::printf("  gemm %zu x %d -> %d: %8.2f ms  %6.2f GFLOP/s\n", rows, hidden, w.out_features,
+                    gemm_elapsed * 1e3, 2.0 * rows * hidden * w.out_features / gemm_elapsed / 1e9);
+    }
+
+    std::vector<int32_t> prompt(prompt_tokens);
+    for (size_t i = 0; i < prompt_tokens; i++) prompt[i] = int32_t((i * 7919) % size_t(config.vocab_size));
+    std::vector<float> logits(size_t(config.vocab_size));
+    module->add_sequence(0);
+    const auto prefill_start = std::chrono::steady_clock::now();
+    const bool prefilled = module->prefill(0, prompt.data(), prompt.size(), logits.data());
+    const double prefill_elapsed = seconds_since(prefill_start);
+    check(prefilled, "benchmark prefill");
+
+    int32_t next = 1;
+    const auto decode_start = std::chrono::steady_clock::now();
+    bool decoded = true;
+    for (size_t i = 0; i < decode_tokens; i++) {
+        decoded &= module->decode(0, next, logits.data());
+        next = int32_t(std::max_element(logits.begin(), logits.end()) - logits.begin());
+    }
+    const double decode_elapsed = seconds_since(decode_start);
+    check(decoded, "benchmark decode");
+
+    std::printf("  prefill %4zu tokens: %8.1f tok/s\n", prompt_tokens, prompt_tokens / prefill_elapsed);
+    std::printf("  decode  %4zu tokens: %8.1f tok/s\n", decode_tokens, decode_tokens / decode_elapsed);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const int32_t layers = argc > 1 ? std::max(1, std::atoi(argv[1])) : 16;
+    const size_t prompt_tokens = argc > 2 ? size_t(std::max(1, std::atoi(argv[2]))) : 128;
+    const size_t decode_tokens = argc > 3 ? size_t(std::max(1, std::atoi(argv[3]))) : 32;
+    const int workers = argc > 4 ? std::atoi(argv[4]) : -1;
+
+    check_quantize();
+    check_vector_ops();
+    check_rope();
+    // Inline, then split across helper threads whatever the core count
+    for (int helpers : {0, 3}) {
+        ThreadPool::configure_shared(ThreadPoolOptions{helpers, 0});
+        check_gemv();
+        check_gemm();
+        check_model(true);
+        check_model(false);
+        check_eviction();
+    }
+    ThreadPool::configure_shared(ThreadPoolOptions{workers, 0});
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d CPU kernel check(s) failed\n", g_failures);
+        return 1;
+    }
+
+    run_benchmark(layers, prompt_tokens, decode_tokens);
+    return g_failures > 0 ? 1 : 0;
+}
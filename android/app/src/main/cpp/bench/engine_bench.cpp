@@ -0,0 +1,749 @@
+// End-to-end benchmark of the native inference layer on a Linux host.
+//
+// Drives the real InferenceEngine (scheduler, prefix cache, sampler, memory
+// pool) against StubChatModule, so everything but the model kernels is on
+// the measured path, and prints one JSON object:
+//
+//   single        TTFT (cold and with a prefix-cache hit), prefill and
+//                 decode tok/s, p50/p99 inter-token latency
+//   concurrent    the same under `concurrency` simultaneous requests
+//   marshalling   native side of a stream poll (ring drain + token batch
+//                 encode) and of getMemoryStatsNative
+//   memory        peak RSS and per-category peaks
+//   speculative   prompt-lookup speculation on a workload that copies
+//                 from its context (--copy-percent of steps), against the
+//                 same workload without it
+//   snapshot      TTFT of a resumed session's next turn in a fresh engine,
+//                 restored from its KV snapshot versus prefilled
+//   tracing       cost of one recorded trace span
+//
+// Greedy decoding is first checked to be deterministic across engines,
+// across a prefix-cache hit, with speculation on and after restoring a
+// session snapshot; the benchmark exits non-zero if it is not. A windowed
+// session is checked to stay within its sinks plus window and to resume its
+// next turn without prefilling the conversation again (or to fail when the
+// module cannot evict), and a token batch to
+// cut an oversized piece only between UTF-8 characters; the prefix cache
+// must re-index a shared prefix when the entry holding it is evicted. Model
+// switching is checked too: staged load progress, cancellation leaving the
+// previous model serving, and a newer switch superseding an older one.
+//
+//   engine_bench [--runs=N] [--prompt-tokens=N] [--max-tokens=N] [--concurrency=N]
+//                [--vocab=N] [--prefill-ns-per-token=N] [--decode-ns-per-step=N]
+//                [--decode-ns-per-row=N] [--copy-percent=N] [--trace=out.json]
+//
+// With --trace, spans are recorded during the benchmark and written as a
+// Chrome/Perfetto JSON trace.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench_check.h"
+#include "inference_engine.h"
+#include "kv_snapshot.h"
+#include "memory_accounting.h"
+#include "memory_pool.h"
+#include "model_load.h"
+#include "model_residency.h"
+#include "prefix_cache.h"
+#include "result_protocol.h"
+#include "stub_chat_module.h"
+#include "token_stream.h"
+#include "trace.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int runs = 5;
+    int prompt_tokens = 512;
+    int max_tokens = 128;
+    int concurrency = 4;
+    int32_t vocab_size = 128256;
+    StubChatModule::Timing timing;
+    int copy_percent = 60;
+    std::string trace_path;
+};
+
+bool parse_option(const char* arg, const char* name, int64_t* value) {
+    const size_t length = std::strlen(name);
+    if (std::strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+    *value = std::atoll(arg + length + 1);
+    return true;
+}
+
+bool parse_options(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; i++) {
+        int64_t value = 0;
+        if (std::strncmp(argv[i], "--trace=", 8) == 0) {
+            options->trace_path = argv[i] + 8;
+        } else if (parse_option(argv[i], "--runs", &value)) {
+            options->runs = static_cast<int>(std::max<int64_t>(1, value));
+        } else if (parse_option(argv[i], "--prompt-tokens", &value)) {
+            options->prompt_tokens = static_cast<int>(std::max<int64_t>(1, value));
+        } else if (parse_option(argv[i], "--max-tokens", &value)) {
+            options->max_tokens = static_cast<int>(std::max<int64_t>(2, value));
+        } else if (parse_option(argv[i], "--concurrency", &value)) {
+            options->concurrency = static_cast<int>(std::max<int64_t>(1, value));
+        } else if (parse_option(argv[i], "--vocab", &value)) {
+            options->vocab_size = static_cast<int32_t>(std::max<int64_t>(256, value));
+        } else if (parse_option(argv[i], "--prefill-ns-per-token", &value)) {
+            options->timing.prefill_ns_per_token = value;
+        } else if (parse_option(argv[i], "--decode-ns-per-step", &value)) {
+            options->timing.decode_ns_per_step = value;
+        } else if (parse_option(argv[i], "--decode-ns-per-row", &value)) {
+            options->timing.decode_ns_per_row = value;
+        } else if (parse_option(argv[i], "--copy-percent", &value)) {
+            options->copy_percent = static_cast<int>(std::min<int64_t>(100, std::max<int64_t>(0, value)));
+        } else {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lowercase text, one token per byte with the stub tokenizer. Different
+// seeds differ in the first token, so they never share a cached prefix.
+std::string make_prompt(uint32_t seed, int length) {
+    std::string prompt(static_cast<size_t>(length), ' ');
+    uint32_t state = seed * 2654435761u + 1;
+    for (char& c : prompt) {
+        state = state * 1664525u + 1013904223u;
+        c = static_cast<char>('a' + (state >> 24) % 26);
+    }
+    prompt[0] = static_cast<char>('A' + seed % 26);
+    return prompt;
+}
+
+int64_t elapsed_ns(Clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - since).count();
+}
+
+// Timeline of one request, relative to its submission
+struct RequestTrace {
+    std::string text;
+    std::vector<int32_t> tokens;
+    std::vector<int64_t> token_ns;
+    int64_t prefill_us = 0;
+    size_t prompt_tokens = 0;
+    int status = -3;
+};
+
+// Submits every prompt at once and waits for all of them to complete.
+std::vector<RequestTrace> run_requests(InferenceEngine& engine, const std::vector<std::string>& prompts,
+                                       const GenerationParams& params, const std::string& session_id = "") {
+    std::vector<RequestTrace> traces(prompts.size());
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending = prompts.size();
+
+    const Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < prompts.size(); i++) {
+        RequestTrace* trace = &traces[i];
+        trace->prompt_tokens = prompts[i].size();
+        InferenceRequest request;
+        request.prompt = prompts[i];
+        request.params = params;
+        request.session_id = session_id;
+        request.on_token = [trace, start](int32_t token, const std::string& piece) {
+            trace->token_ns.push_back(elapsed_ns(start));
+            trace->tokens.push_back(token);
+            trace->text += piece;
+            return true;
+        };
+        request.on_prefill_chunk = [trace](size_t, size_t, int64_t micros) { trace->prefill_us += micros; };
+        request.on_complete = [trace, &mutex, &done, &pending](int status) {
+            std::lock_guard<std::mutex> lock(mutex);
+            trace->status = status;
+            if (--pending == 0) done.notify_all();
+        };
+        if (!engine.submit(std::move(request))) {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending--;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return pending == 0; });
+    return traces;
+}
+
+std::unique_ptr<InferenceEngine> make_engine(const Options& options, bool speculative = true, int copy_percent = 0,
+                                             const StubChatModule::Timing* timing = nullptr,
+                                             std::shared_ptr<KvSnapshotStore> snapshots = nullptr) {
+    ModelRuntimeConfig config;
+    config.vocab_size = options.vocab_size;
+    config.max_concurrent_requests = std::max(4, options.concurrency);
+    config.speculative_decoding = speculative;
+    auto chat = std::make_shared<StubChatModule>(options.vocab_size, timing != nullptr ? *timing : options.timing,
+                                                 copy_percent);
+    return std::unique_ptr<InferenceEngine>(new InferenceEngine("stub", chat, config,
+                                                                InferenceEngine::kDefaultQueueCapacity, snapshots));
+}
+
+// Nearest-rank percentile; sorts `values`
+double percentile(std::vector<int64_t>& values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    const size_t rank = static_cast<size_t>(p * values.size() + 0.999999);
+    return static_cast<double>(values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1]);
+}
+
+double mean(const std::vector<double>& values) {
+    double sum = 0.0;
+    for (double value : values) sum += value;
+    return values.empty() ? 0.0 : sum / values.size();
+}
+
+// Decode throughput of one request: tokens after the first over the time
+// from the first to the last
+double decode_tok_s(const RequestTrace& trace) {
+    if (trace.token_ns.size() < 2) return 0.0;
+    const int64_t span = trace.token_ns.back() - trace.token_ns.front();
+    return span > 0 ? (trace.token_ns.size() - 1) * 1e9 / span : 0.0;
+}
+
+// Snapshot store in a fresh temporary directory
+std::shared_ptr<KvSnapshotStore> make_snapshot_store(std::string* directory) {
+    char path[] = "/tmp/engine_bench_XXXXXX";
+    if (mkdtemp(path) == nullptr) return nullptr;
+    *directory = path;
+    return std::make_shared<KvSnapshotStore>(*directory, int64_t(256) << 20);
+}
+
+void remove_snapshot_store(KvSnapshotStore& store, const std::string& directory) {
+    store.set_byte_budget(0); // evicts every file
+    rmdir(directory.c_str());
+}
+
+// The prompt of the turn after `reply`: everything so far plus a new message
+std::string next_turn(const std::string& prompt, const std::string& reply, uint32_t seed) {
+    return prompt + reply + make_prompt(seed, 32);
+}
+
+void run_checks(const Options& options) {
+    GenerationParams greedy;
+    greedy.temperature = 0.0f;
+    greedy.max_tokens = options.max_tokens;
+    const std::vector<std::string> prompt = {make_prompt(1000, options.prompt_tokens)};
+
+    auto first = make_engine(options);
+    const std::vector<RequestTrace> cold = run_requests(*first, prompt, greedy);
+    const std::vector<RequestTrace> cached = run_requests(*first, prompt, greedy);
+    const uint64_t reused = first->reused_prefix_tokens();
+    first.reset();
+
+    auto second = make_engine(options);
+    const std::vector<RequestTrace> fresh = run_requests(*second, prompt, greedy);
+    second.reset();
+
+    check(cold[0].status == 0 && cached[0].status == 0 && fresh[0].status == 0, "requests complete");
+    check(cold[0].token_ns.size() == static_cast<size_t>(options.max_tokens), "generation runs to max_tokens");
+    check(cold[0].text == fresh[0].text, "greedy output is identical across engines");
+    check(reused > 0, "a repeated prompt reuses the prefix cache");
+    check(cold[0].text == cached[0].text, "greedy output is identical after a prefix-cache hit");
+
+    // Speculation must not change greedy output, including on a workload
+    // where most drafts are accepted
+    const std::vector<std::string> copying = {make_prompt(2000, options.prompt_tokens)};
+    auto plain = make_engine(options, false, options.copy_percent);
+    const std::vector<RequestTrace> expected = run_requests(*plain, copying, greedy);
+    plain.reset();
+    auto speculative = make_engine(options, true, options.copy_percent);
+    const std::vector<RequestTrace> drafted = run_requests(*speculative, copying, greedy);
+    const uint64_t accepted = speculative->accepted_draft_tokens();
+    speculative.reset();
+
+    check(drafted[0].status == 0 && drafted[0].token_ns.size() == static_cast<size_t>(options.max_tokens),
+          "speculative generation runs to max_tokens");
+    check(expected[0].text == drafted[0].text, "greedy output is identical with speculation");
+    check(options.copy_percent == 0 || accepted > 0, "drafts are accepted on a copying workload");
+
+    // A session resumed in a new engine restores its earlier turns from the
+    // snapshot and must continue exactly as if they had been prefilled
+    std::string directory;
+    std::shared_ptr<KvSnapshotStore> store = make_snapshot_store(&directory);
+    check(store != nullptr, "snapshot directory created");
+    if (store == nullptr) return;
+    auto saving = make_engine(options, true, 0, nullptr, store);
+    const std::vector<RequestTrace> turn = run_requests(*saving, prompt, greedy, "session");
+    saving.reset();
+    store->flush(); // snapshots are written in the background
+    const std::vector<std::string> resumed_prompt = {next_turn(prompt[0], turn[0].text, 1001)};
+    auto resuming = make_engine(options, true, 0, nullptr, store);
+    const std::vector<RequestTrace> resumed = run_requests(*resuming, resumed_prompt, greedy, "session");
+    const uint64_t restored = resuming->restored_tokens();
+    resuming.reset();
+    auto prefilling = make_engine(options);
+    const std::vector<RequestTrace> prefilled = run_requests(*prefilling, resumed_prompt, greedy);
+    prefilling.reset();
+    store->flush();
+    const KvSnapshotStore::Stats stats = store->stats();
+    remove_snapshot_store(*store, directory);
+
+    check(stats.saves == 2 && stats.restores == 1, "each turn saves its session and the second restores it");
+    check(restored >= prompt[0].size(), "the previous turn is restored from the snapshot");
+    check(resumed[0].status == 0 && resumed[0].text == prefilled[0].text,
+          "greedy output is identical after restoring a snapshot");
+}
+
+// Evicting the entry that indexed a shared prefix hands it back to an
+// older entry that still covers it
+void run_prefix_cache_checks() {
+    PrefixCache cache(1 << 20, 1);
+    std::vector<int32_t> shared(64), other(64);
+    for (size_t i = 0; i < shared.size(); i++) {
+        shared[i] = static_cast<int32_t>(i);
+        other[i] = i < 32 ? shared[i] : static_cast<int32_t>(1000 + i);
+    }
+    cache.insert(1, other);
+    cache.insert(2, shared); // takes over the two common blocks
+    cache.lookup(other);     // leaves `shared` least recently used
+    const std::vector<SequenceId> evicted = cache.shrink(1);
+    const PrefixCache::Match match = cache.lookup(shared);
+    check(evicted.size() == 1 && evicted[0] == 2, "shrink evicts the least recently used entry");
+    check(match.seq == 1 && match.length == 32, "an evicted entry's shared prefix is re-indexed");
+}
+
+// A piece too large for a whole token batch is cut, but never inside a
+// UTF-8 character
+void run_protocol_checks() {
+    const TokenEvent piece{7, "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9"}; // four two-byte characters
+    std::vector<uint8_t> buffer(kResultHeaderBytes + 16 + 5);   // room for 5 bytes of text
+    size_t encoded = 0;
+    const int64_t size = encode_token_batch(buffer.data(), buffer.size(), &piece, 1, 0, &encoded);
+    uint32_t length = 0;
+    if (size > 0) std::memcpy(&length, buffer.data() + kResultHeaderBytes + 12, sizeof(length));
+    check(size > 0 && encoded == 1 && length == 4, "an oversized piece is cut at a character boundary");
+}
+
+// Stands in for a model library without evict_tokens
+class NoEvictChatModule : public StubChatModule {
+public:
+    using StubChatModule::StubChatModule;
+    size_t eviction_granularity() const override { return 0; }
+};
+
+// A long windowed session evicts instead of growing, and its next turn
+// continues from the kept window. Without eviction, windowed requests fail.
+void run_window_checks(const Options& options) {
+    ModelRuntimeConfig config;
+    config.vocab_size = 257; // every token is a byte, so a reply can be fed back verbatim
+    config.speculative_decoding = true;
+    auto chat = std::make_shared<StubChatModule>(config.vocab_size, options.timing, options.copy_percent);
+    InferenceEngine engine("stub", chat, config);
+
+    GenerationParams windowed;
+    windowed.temperature = 0.0f;
+    windowed.max_tokens = 400;
+    windowed.sink_tokens = 4;
+    windowed.window_tokens = 96;
+    const std::vector<std::string> prompt = {make_prompt(3000, 200)};
+    const std::vector<RequestTrace> turn = run_requests(engine, prompt, windowed, "windowed");
+    const size_t first_peak = chat->peak_length();
+    const uint64_t evicted = engine.evicted_tokens();
+
+    std::string reply;
+    for (int32_t token : turn[0].tokens) reply += static_cast<char>(token - 1);
+    const std::vector<std::string> next_prompt = {next_turn(prompt[0], reply, 3001)};
+    const uint64_t prefilled_before = engine.prefilled_tokens();
+    const std::vector<RequestTrace> next = run_requests(engine, next_prompt, windowed, "windowed");
+    const uint64_t prefilled = engine.prefilled_tokens() - prefilled_before;
+    engine.shutdown();
+
+    check(turn[0].status == 0 && turn[0].tokens.size() == 400, "windowed generation runs to max_tokens");
+    check(evicted > 0, "a windowed session evicts once it outgrows the window");
+    check(first_peak <= 100 && chat->peak_length() <= 100, "a windowed session stays within sinks plus window");
+    check(next[0].status == 0 && engine.resumed_window_tokens() > 0, "the next turn resumes the kept window");
+    check(prefilled <= 33, "the next turn prefills only its new tokens");
+
+    InferenceEngine unsupported("stub", std::make_shared<NoEvictChatModule>(config.vocab_size), config);
+    const std::vector<RequestTrace> refused = run_requests(unsupported, prompt, windowed, "windowed");
+    unsupported.shutdown();
+    check(!unsupported.supports_window() && refused[0].status == -1, "a module that cannot evict fails windowed requests");
+}
+
+// Stands in for load_engine(): verify, map and upload are timed loops that
+// honour cancellation, then the engine's stub module is warmed up. Model
+// "slow" stays in its upload stage until cancelled, "missing" fails.
+std::shared_ptr<InferenceEngine> load_stub_engine(const Options& options, const std::string& model_id,
+                                                  ModelLoadTask* task) {
+    task->begin_stage(LoadStage::kVerify);
+    if (model_id == "missing") {
+        task->set_error("Model directory not found: missing");
+        return nullptr;
+    }
+    for (LoadStage stage : {LoadStage::kMapWeights, LoadStage::kUpload}) {
+        task->begin_stage(stage);
+        const bool hold = model_id == "slow" && stage == LoadStage::kUpload;
+        const auto deadline = Clock::now() + std::chrono::seconds(5);
+        for (int step = 1; step <= 10 || (hold && Clock::now() < deadline); step++) {
+            if (task->cancelled()) return nullptr;
+            task->set_fraction(std::min(step, 10) / 10.0);
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+    if (model_id == "slow") return nullptr;
+
+    ModelRuntimeConfig config;
+    config.vocab_size = options.vocab_size;
+    auto chat = std::make_shared<StubChatModule>(options.vocab_size);
+    task->begin_stage(LoadStage::kWarmup);
+    if (!warm_up_chat_module(*chat, task)) return nullptr;
+    return std::make_shared<InferenceEngine>(model_id, chat, config);
+}
+
+// Waits for a load to finish; `monotonic` is cleared if its stage or
+// overall progress ever went backwards
+ModelLoadTask::Progress follow_load(const ModelLoadTask& task, bool* monotonic = nullptr,
+                                    LoadStage until = LoadStage::kReady) {
+    ModelLoadTask::Progress progress = task.progress();
+    const auto deadline = Clock::now() + std::chrono::seconds(10);
+    while (!progress.finished && progress.stage < until && Clock::now() < deadline) {
+        const ModelLoadTask::Progress next = task.wait(progress.version, 100);
+        if (monotonic && (next.stage < progress.stage || next.overall < progress.overall)) *monotonic = false;
+        progress = next;
+    }
+    return progress;
+}
+
+void run_residency_checks(const Options& options) {
+    ModelResidency residency(
+        [&options](const std::string& model_id, ModelLoadTask* task) { return load_stub_engine(options, model_id, task); });
+
+    bool monotonic = true;
+    std::shared_ptr<ModelLoadTask> first = residency.activate_async("first");
+    const ModelLoadTask::Progress loaded = follow_load(*first, &monotonic);
+    check(loaded.finished && loaded.stage == LoadStage::kReady && !loaded.resident, "an async load becomes ready");
+    check(monotonic && loaded.overall == 1.0, "load progress only moves forward");
+    check(loaded.stage_us[0] > 0 && loaded.stage_us[3] > 0, "every load stage is timed");
+    check(residency.current_id() == "first", "a finished load becomes the current model");
+
+    // The previous model serves until a switch completes, and survives its cancellation
+    std::shared_ptr<ModelLoadTask> slow = residency.activate_async("slow");
+    follow_load(*slow, nullptr, LoadStage::kUpload);
+    check(residency.current_id() == "first" && residency.current() != nullptr,
+          "the previous model keeps serving while another loads");
+    slow->cancel();
+    const ModelLoadTask::Progress cancelled = follow_load(*slow);
+    check(cancelled.finished && cancelled.stage == LoadStage::kCancelled, "a cancelled load finishes as cancelled");
+    check(residency.current_id() == "first" && !residency.is_resident("slow"),
+          "a cancelled load leaves the previous model current");
+
+    // Only the newest switch counts
+    std::shared_ptr<ModelLoadTask> superseded = residency.activate_async("slow");
+    std::shared_ptr<ModelLoadTask> second = residency.activate_async("second");
+    check(follow_load(*superseded).stage == LoadStage::kCancelled, "a superseded switch is cancelled");
+    check(follow_load(*second).stage == LoadStage::kReady && residency.current_id() == "second",
+          "the newest switch wins");
+
+    std::shared_ptr<ModelLoadTask> back = residency.activate_async("first");
+    const ModelLoadTask::Progress switched = follow_load(*back);
+    check(switched.stage == LoadStage::kReady && switched.resident, "switching to a resident model skips loading");
+
+    std::shared_ptr<ModelLoadTask> missing = residency.activate_async("missing");
+    check(follow_load(*missing).stage == LoadStage::kFailed && !missing->error().empty(),
+          "a failed load reports its error");
+    check(residency.current_id() == "first", "a failed load leaves the previous model current");
+    residency.clear();
+}
+
+struct Speculation {
+    StubChatModule::Timing timing;
+    double plain_decode_tok_s = 0.0;
+    double speculative_decode_tok_s = 0.0;
+    double acceptance_rate = 0.0;
+    double tokens_per_step = 0.0;
+};
+
+// Single requests on a copying workload with speculation off and on. Without
+// simulated model cost every call is nearly free, so a decode step defaults
+// to 2 ms (a 1B model on a phone GPU is 15-40 ms).
+Speculation measure_speculation(const Options& options, const GenerationParams& params) {
+    Speculation result;
+    result.timing = options.timing;
+    if (result.timing.decode_ns_per_step == 0) result.timing.decode_ns_per_step = 2000000;
+
+    for (bool speculative : {false, true}) {
+        auto engine = make_engine(options, speculative, options.copy_percent, &result.timing);
+        std::vector<double> tok_s;
+        for (int run = 0; run < options.runs; run++) {
+            const std::vector<std::string> prompt = {
+                make_prompt(static_cast<uint32_t>(3000 + run), options.prompt_tokens)};
+            tok_s.push_back(decode_tok_s(run_requests(*engine, prompt, params)[0]));
+        }
+        (speculative ? result.speculative_decode_tok_s : result.plain_decode_tok_s) = mean(tok_s);
+        if (speculative) {
+            const uint64_t drafted = engine->draft_tokens();
+            const uint64_t steps = engine->decode_batches();
+            result.acceptance_rate = drafted > 0 ? static_cast<double>(engine->accepted_draft_tokens()) / drafted : 0.0;
+            result.tokens_per_step = steps > 0 ? static_cast<double>(engine->decoded_tokens()) / steps : 0.0;
+        }
+    }
+    return result;
+}
+
+struct Snapshot {
+    StubChatModule::Timing timing;
+    double ttft_prefilled_us = 0.0;
+    double ttft_restored_us = 0.0;
+    double restored_tokens = 0.0;
+    int64_t file_bytes = 0;
+};
+
+// The second turn of a conversation in a freshly started engine, as after
+// an app restart: with the first turn's snapshot, and prefilled from
+// scratch. Prefill defaults to 250 us per token (a 1B model prefills a few
+// thousand tokens/s on a phone GPU, a few hundred on CPU).
+Snapshot measure_snapshot(const Options& options, const GenerationParams& params) {
+    Snapshot result;
+    result.timing = options.timing;
+    if (result.timing.prefill_ns_per_token == 0) result.timing.prefill_ns_per_token = 250000;
+    std::string directory;
+    std::shared_ptr<KvSnapshotStore> store = make_snapshot_store(&directory);
+    if (store == nullptr) return result;
+
+    std::vector<double> prefilled_us, restored_us, restored_tokens;
+    for (int run = 0; run < options.runs; run++) {
+        const std::string session = "bench-" + std::to_string(run);
+        const std::vector<std::string> prompt = {make_prompt(static_cast<uint32_t>(4000 + run), options.prompt_tokens)};
+        auto first = make_engine(options, true, 0, &result.timing, store);
+        const std::string reply = run_requests(*first, prompt, params, session)[0].text;
+        first.reset();
+        store->flush();
+        result.file_bytes = std::max(result.file_bytes, store->stats().bytes);
+
+        const std::vector<std::string> resumed = {next_turn(prompt[0], reply, static_cast<uint32_t>(5000 + run))};
+        for (bool restore : {false, true}) {
+            auto engine = make_engine(options, true, 0, &result.timing, restore ? store : nullptr);
+            const RequestTrace trace = run_requests(*engine, resumed, params, session)[0];
+            if (trace.token_ns.empty()) continue;
+            (restore ? restored_us : prefilled_us).push_back(trace.token_ns.front() / 1000.0);
+            if (restore) restored_tokens.push_back(static_cast<double>(engine->restored_tokens()));
+        }
+    }
+    remove_snapshot_store(*store, directory);
+    result.ttft_prefilled_us = mean(prefilled_us);
+    result.ttft_restored_us = mean(restored_us);
+    result.restored_tokens = mean(restored_tokens);
+    return result;
+}
+
+struct Marshalling {
+    double token_batch_ns_per_token = 0.0;
+    double token_batch_bytes_per_token = 0.0;
+    double memory_stats_ns_per_call = 0.0;
+};
+
+// What pollStreamNative and getMemoryStatsNative do besides the JNI call
+// itself: drain the token ring and encode into the caller's direct buffer.
+Marshalling measure_marshalling(StubChatModule& chat) {
+    constexpr size_t kBatch = 32;
+    constexpr int kBatches = 4000;
+    std::vector<uint8_t> buffer(64 * 1024);
+    std::vector<TokenEvent> drained;
+    drained.reserve(kBatch);
+    TokenStream stream;
+    int64_t bytes = 0;
+    int32_t token = 1;
+
+    Marshalling result;
+    Clock::time_point start = Clock::now();
+    for (int batch = 0; batch < kBatches; batch++) {
+        for (size_t i = 0; i < kBatch; i++, token++) {
+            TokenEvent event;
+            event.token_id = token;
+            event.text = chat.token_to_piece(token);
+            stream.push(std::move(event));
+        }
+        drained.clear();
+        stream.drain(drained, kBatch, 0);
+        size_t encoded = 0;
+        bytes += encode_token_batch(buffer.data(), buffer.size(), drained.data(), drained.size(), 0, &encoded);
+    }
+    const double tokens = static_cast<double>(kBatch) * kBatches;
+    result.token_batch_ns_per_token = elapsed_ns(start) / tokens;
+    result.token_batch_bytes_per_token = bytes / tokens;
+
+    constexpr int kCalls = 100000;
+    int64_t fields[kMemoryStatsFieldCount] = {};
+    volatile int64_t sink = 0;
+    start = Clock::now();
+    for (int i = 0; i < kCalls; i++) {
+        fields[kStatJniBytes] = i;
+        sink = encode_memory_stats(buffer.data(), buffer.size(), fields, kMemoryStatsFieldCount);
+    }
+    result.memory_stats_ns_per_call = static_cast<double>(elapsed_ns(start)) / kCalls;
+    (void)sink;
+    return result;
+}
+
+// Recording cost of one span, with tracing switched on for the measurement
+double measure_span_ns() {
+    constexpr int kSpans = 100000;
+    const bool was_enabled = tracing_enabled();
+    set_tracing_enabled(true);
+    const Clock::time_point start = Clock::now();
+    for (int i = 0; i < kSpans; i++) {
+        TraceScope trace(TraceSpan::kSample, i);
+    }
+    const double ns = static_cast<double>(elapsed_ns(start)) / kSpans;
+    set_tracing_enabled(was_enabled);
+    return ns;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_options(argc, argv, &options)) return 2;
+
+    run_checks(options);
+    run_window_checks(options);
+    run_protocol_checks();
+    run_prefix_cache_checks();
+    run_residency_checks(options);
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d engine check(s) failed\n", g_failures);
+        return 1;
+    }
+
+    set_tracing_enabled(!options.trace_path.empty());
+    GenerationParams params;
+    params.max_tokens = options.max_tokens;
+    auto engine = make_engine(options);
+
+    // Single request at a time, each with a prompt the prefix cache has not seen
+    std::vector<int64_t> ttft_ns;
+    std::vector<int64_t> gaps_ns;
+    std::vector<double> prefill_tok_s;
+    std::vector<double> single_decode_tok_s;
+    std::string last_prompt;
+    for (int run = 0; run < options.runs; run++) {
+        last_prompt = make_prompt(static_cast<uint32_t>(run), options.prompt_tokens);
+        const RequestTrace trace = run_requests(*engine, {last_prompt}, params)[0];
+        if (trace.token_ns.empty()) continue;
+        ttft_ns.push_back(trace.token_ns.front());
+        for (size_t i = 1; i < trace.token_ns.size(); i++) gaps_ns.push_back(trace.token_ns[i] - trace.token_ns[i - 1]);
+        prefill_tok_s.push_back(trace.prompt_tokens * 1e6 / std::max<int64_t>(trace.prefill_us, 1));
+        single_decode_tok_s.push_back(decode_tok_s(trace));
+    }
+
+    // Same prompt again: only the last prompt token is prefilled
+    const RequestTrace cached = run_requests(*engine, {last_prompt}, params)[0];
+    const double ttft_cached_us = cached.token_ns.empty() ? 0.0 : cached.token_ns.front() / 1000.0;
+
+    // Simultaneous requests sharing decode batches
+    std::vector<int64_t> concurrent_ttft_ns;
+    std::vector<int64_t> concurrent_gaps_ns;
+    std::vector<double> concurrent_tok_s;
+    const uint64_t batches_before = engine->decode_batches();
+    const uint64_t decoded_before = engine->decoded_tokens();
+    for (int run = 0; run < options.runs; run++) {
+        std::vector<std::string> prompts;
+        for (int i = 0; i < options.concurrency; i++) {
+            prompts.push_back(make_prompt(static_cast<uint32_t>(100 + run * options.concurrency + i),
+                                          options.prompt_tokens));
+        }
+        const std::vector<RequestTrace> traces = run_requests(*engine, prompts, params);
+        int64_t first = INT64_MAX;
+        int64_t last = 0;
+        size_t tokens = 0;
+        for (const RequestTrace& trace : traces) {
+            if (trace.token_ns.empty()) continue;
+            concurrent_ttft_ns.push_back(trace.token_ns.front());
+            for (size_t i = 1; i < trace.token_ns.size(); i++) {
+                concurrent_gaps_ns.push_back(trace.token_ns[i] - trace.token_ns[i - 1]);
+            }
+            first = std::min(first, trace.token_ns.front());
+            last = std::max(last, trace.token_ns.back());
+            tokens += trace.token_ns.size();
+        }
+        if (last > first) concurrent_tok_s.push_back(tokens * 1e9 / (last - first));
+    }
+    const uint64_t batches = engine->decode_batches() - batches_before;
+    const double rows_per_batch =
+        batches > 0 ? static_cast<double>(engine->decoded_tokens() - decoded_before) / batches : 0.0;
+
+    StubChatModule marshalling_chat(options.vocab_size);
+    const Marshalling marshalling = measure_marshalling(marshalling_chat);
+    engine.reset();
+
+    if (!options.trace_path.empty()) {
+        std::FILE* out = std::fopen(options.trace_path.c_str(), "w");
+        const int64_t spans = out != nullptr ? trace_write_chrome_json(out) : -1;
+        if (out == nullptr || std::fclose(out) != 0 || spans < 0) {
+            std::fprintf(stderr, "cannot write trace to %s\n", options.trace_path.c_str());
+            return 1;
+        }
+        std::fprintf(stderr, "%lld trace spans written to %s\n", static_cast<long long>(spans),
+                     options.trace_path.c_str());
+    }
+    const double span_ns = measure_span_ns();
+    const Speculation speculation = measure_speculation(options, params);
+    const Snapshot snapshot = measure_snapshot(options, params);
+
+    ProcessMemory process;
+    read_process_memory(&process);
+    const MemoryAccounting& accounting = MemoryAccounting::instance();
+
+    std::printf("{\n");
+    std::printf("  \"config\": {\"runs\": %d, \"prompt_tokens\": %d, \"max_tokens\": %d, \"concurrency\": %d, "
+                "\"vocab\": %d, \"prefill_ns_per_token\": %lld, \"decode_ns_per_step\": %lld, "
+                "\"decode_ns_per_row\": %lld, \"sampler\": \"%s\"},\n",
+                options.runs, options.prompt_tokens, options.max_tokens, options.concurrency, options.vocab_size,
+                static_cast<long long>(options.timing.prefill_ns_per_token),
+                static_cast<long long>(options.timing.decode_ns_per_step),
+                static_cast<long long>(options.timing.decode_ns_per_row), Sampler::kernel_name());
+    std::printf("  \"single\": {\"ttft_us_p50\": %.1f, \"ttft_us_p99\": %.1f, \"ttft_cached_us\": %.1f, "
+                "\"prefill_tok_s\": %.0f, \"decode_tok_s\": %.0f, \"token_latency_us_p50\": %.1f, "
+                "\"token_latency_us_p99\": %.1f},\n",
+                percentile(ttft_ns, 0.50) / 1000.0, percentile(ttft_ns, 0.99) / 1000.0, ttft_cached_us,
+                mean(prefill_tok_s), mean(single_decode_tok_s), percentile(gaps_ns, 0.50) / 1000.0,
+                percentile(gaps_ns, 0.99) / 1000.0);
+    std::printf("  \"concurrent\": {\"requests\": %d, \"ttft_us_p50\": %.1f, \"ttft_us_p99\": %.1f, "
+                "\"decode_tok_s\": %.0f, \"rows_per_batch\": %.2f, \"token_latency_us_p50\": %.1f, "
+                "\"token_latency_us_p99\": %.1f},\n",
+                options.concurrency, percentile(concurrent_ttft_ns, 0.50) / 1000.0,
+                percentile(concurrent_ttft_ns, 0.99) / 1000.0, mean(concurrent_tok_s), rows_per_batch,
+                percentile(concurrent_gaps_ns, 0.50) / 1000.0, percentile(concurrent_gaps_ns, 0.99) / 1000.0);
+    std::printf("  \"marshalling\": {\"token_batch_ns_per_token\": %.1f, \"token_batch_bytes_per_token\": %.1f, "
+                "\"memory_stats_ns_per_call\": %.1f},\n",
+                marshalling.token_batch_ns_per_token, marshalling.token_batch_bytes_per_token,
+                marshalling.memory_stats_ns_per_call);
+    std::printf("  \"memory\": {\"peak_rss_bytes\": %lld, \"kv_cache_peak_bytes\": %lld, "
+                "\"scratch_peak_bytes\": %lld, \"jni_peak_bytes\": %lld},\n",
+                static_cast<long long>(process.peak_rss_bytes),
+                static_cast<long long>(accounting.peak(MemoryCategory::kKvCache)),
+                static_cast<long long>(accounting.peak(MemoryCategory::kScratch)),
+                static_cast<long long>(accounting.peak(MemoryCategory::kJni)));
+    std::printf("  \"speculative\": {\"copy_percent\": %d, \"decode_ns_per_step\": %lld, "
+                "\"decode_tok_s_plain\": %.0f, \"decode_tok_s\": %.0f, \"speedup\": %.2f, "
+                "\"acceptance_rate\": %.3f, \"tokens_per_step\": %.2f},\n",
+                options.copy_percent, static_cast<long long>(speculation.timing.decode_ns_per_step),
+                speculation.plain_decode_tok_s, speculation.speculative_decode_tok_s,
+                speculation.plain_decode_tok_s > 0 ? speculation.speculative_decode_tok_s / speculation.plain_decode_tok_s
+                                                   : 0.0,
+                speculation.acceptance_rate, speculation.tokens_per_step);
+    std::printf("  \"snapshot\": {\"prefill_ns_per_token\": %lld, \"restored_tokens\": %.0f, "
+                "\"ttft_prefilled_us\": %.1f, \"ttft_restored_us\": %.1f, \"file_bytes\": %lld},\n",
+                static_cast<long long>(snapshot.timing.prefill_ns_per_token), snapshot.restored_tokens,
+                snapshot.ttft_prefilled_us, snapshot.ttft_restored_us, static_cast<long long>(snapshot.file_bytes));
+    std::printf("  \"tracing\": {\"compiled_in\": %s, \"span_ns\": %.1f}\n", MLC_TRACING ? "true" : "false",
+                span_ns);
+    std::printf("}\n");
+    return 0;
+}
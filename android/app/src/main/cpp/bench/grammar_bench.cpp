@@ -0,0 +1,408 @@
+// Grammar-constrained decoding: correctness checks and masking costs.
+//
+// Checks EBNF parsing (and its errors), the byte-level matcher on literals,
+// repetitions, UTF-8 character classes and JSON-schema grammars, token masks
+// against a brute-force walk of every token over a 128256-entry vocabulary,
+// the SIMD mask kernel against a scalar reference, and constrained requests
+// through the real InferenceEngine (a bounded grammar must complete and
+// stop; schema output must stay inside the grammar). Then reports the cold
+// mask time per state, the cached lookup + apply cost per token and decode
+// throughput with and without a grammar. Exits non-zero if a check fails.
+//
+//   grammar_bench [--runs=N]
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bench_check.h"
+#include "grammar.h"
+#include "inference_engine.h"
+#include "sampler.h"
+#include "stub_chat_module.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int32_t kVocabSize = 128256;
+
+int64_t elapsed_ns(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+const char kPersonSchema[] = R"({
+  "type": "object",
+  "properties": {
+    "name": {"type": "string"},
+    "age": {"type": "integer"},
+    "mood": {"enum": ["happy", "sad", null]},
+    "tags": {"type": "array", "items": {"type": "string"}, "maxItems": 3},
+    "friend": {"$ref": "#/$defs/friend"}
+  },
+  "required": ["name", "age"],
+  "$defs": {
+    "friend": {
+      "type": "object",
+      "properties": {"name": {"type": "string"}, "friend": {"$ref": "#/$defs/friend"}}
+    }
+  }
+})";
+
+const char kPersonJson[] =
+    "{\"name\": \"Zoë \\\"Z\\\" Ortiz\", \"age\": -42, \"mood\": null, \"tags\": [\"a\", \"日本\"], "
+    "\"friend\": {\"name\": \"Ann\", \"friend\": {}}}";
+
+std::shared_ptr<const Grammar> ebnf(const char* text) {
+    std::string error;
+    std::shared_ptr<const Grammar> grammar = Grammar::parse_ebnf(text, &error);
+    if (!grammar) std::fprintf(stderr, "grammar error: %s\n", error.c_str());
+    return grammar;
+}
+
+// Feeds `text` one byte at a time; true if every byte was accepted
+bool accepts(const std::shared_ptr<const Grammar>& grammar, const std::string& text, bool* can_stop = nullptr) {
+    if (!grammar) return false;
+    GrammarMatcher matcher(grammar);
+    for (char c : text) {
+        if (!matcher.accept(std::string(1, c))) return false;
+    }
+    if (can_stop) *can_stop = matcher.can_stop();
+    return true;
+}
+
+bool complete(const std::shared_ptr<const Grammar>& grammar, const std::string& text) {
+    bool can_stop = false;
+    return accepts(grammar, text, &can_stop) && can_stop;
+}
+
+void run_parse_checks() {
+    std::string error;
+    check(!Grammar::parse_ebnf("item ::= \"a\"", &error) && !error.empty(), "grammar without root is rejected");
+    check(!Grammar::parse_ebnf("root ::= item", &error), "undefined rule is rejected");
+    check(!Grammar::parse_ebnf("root ::= root \"a\" | \"b\"", &error), "left recursion is rejected");
+    check(!Grammar::parse_ebnf("root ::= x\nx ::= y? root", &error), "indirect left recursion is rejected");
+    check(!Grammar::parse_ebnf("root ::= \"abc", &error), "unterminated literal is rejected");
+    check(!Grammar::parse_ebnf("root ::= (\"a\" | \"b\"", &error), "unclosed group is rejected");
+    check(!Grammar::parse_ebnf("root ::= \"a\"{3,2}", &error), "reversed repetition is rejected");
+    check(!Grammar::parse_ebnf("root ::= \"a\"\nroot ::= \"b\"", &error), "duplicate rule is rejected");
+
+    auto greeting = ebnf("# comment\nroot ::= \"hi\" \" \"+ name \"!\"?\nname ::= [A-Z] [a-z]*");
+    check(complete(greeting, "hi  Ann!"), "literal, + and ? accept");
+    check(complete(greeting, "hi Bo"), "optional suffix can be left out");
+    check(!accepts(greeting, "hi bo"), "character class rejects");
+    check(accepts(greeting, "hi ") && !complete(greeting, "hi "), "prefix is not complete");
+
+    auto counted = ebnf("root ::= [0-9]{2,3} \"-\" [ab]{2} ( \"x\" | \"yz\" ){1,}");
+    check(complete(counted, "12-abx") && complete(counted, "123-bbyzx"), "bounded repetitions accept");
+    check(!accepts(counted, "1-") && !accepts(counted, "1234"), "bounded repetitions reject");
+    check(!accepts(counted, "12-a-"), "exact repetition rejects");
+
+    auto greek = ebnf("root ::= [α-ω]+ [^a-z] .");
+    check(complete(greek, "λογοA\xf0\x9f\x98\x80"), "UTF-8 classes and . accept");
+    check(!accepts(greek, "a"), "UTF-8 class rejects ASCII");
+    check(!accepts(greek, "\xce\x91"), "UTF-8 class rejects an out-of-range code point");
+    check(complete(ebnf("root ::= [^\"]"), "\xe2\x82\xac"), "negated class accepts multi-byte code points");
+    check(complete(ebnf("root ::= \"\\x41\\u00e9\\n\""), "A\xc3\xa9\n"), "literal escapes");
+
+    // A long right-recursive repetition keeps a bounded parser state
+    auto letters = ebnf("root ::= [a-z]*");
+    GrammarMatcher matcher(letters);
+    size_t max_key = 0;
+    for (int i = 0; i < 2000; i++) {
+        matcher.accept("q");
+        max_key = std::max(max_key, matcher.state_key().size());
+    }
+    check(max_key <= 16 && matcher.can_stop(), "repetition state does not grow");
+}
+
+void run_schema_checks() {
+    std::string error;
+    auto person = Grammar::from_json_schema(kPersonSchema, &error);
+    check(person != nullptr, "schema compiles");
+    if (!person) {
+        std::fprintf(stderr, "schema error: %s\n", error.c_str());
+        return;
+    }
+    check(complete(person, kPersonJson), "schema accepts a full document");
+    check(complete(person, "{\"name\":\"A\",\"age\":0}"), "schema accepts required members only");
+    check(!accepts(person, "{\"age\": 1"), "required members keep their order");
+    check(!accepts(person, "{\"name\": \"A\", \"age\": 01"), "integers have no leading zero");
+    check(!accepts(person, "{\"name\": \"A\", \"age\": 1.5"), "integer rejects a fraction");
+    check(!accepts(person, "{\"name\": \"A\", \"age\": 1, \"mood\": \"ok\""), "enum rejects other values");
+    check(!accepts(person, "{\"name\": \"A\", \"age\": 1, \"tags\": [\"a\", \"b\", \"c\", "),
+          "maxItems is enforced");
+    check(!accepts(person, "{\"name\": \"a\nb\""), "strings reject raw control characters");
+    check(!complete(person, "{\"name\": \"A\"}"), "missing required member is incomplete");
+
+    auto options = Grammar::from_json_schema(
+        R"({"type":"object","properties":{"a":{"type":"boolean"},"b":{"const":7},"c":{"type":["number","null"]}}})",
+        &error);
+    check(complete(options, "{}") && complete(options, "{\"b\": 7}") && complete(options, "{\"a\": true, \"c\": null}"),
+          "optional members accept any ordered subset");
+    check(!accepts(options, "{\"c\": 1, \"a\""), "optional members keep their order");
+    check(!accepts(options, "{\"b\": 8"), "const rejects other values");
+
+    auto list = Grammar::from_json_schema(R"({"type":"array","items":{"anyOf":[{"type":"integer"},{"type":"string"}]},
+                                              "minItems":2})",
+                                          &error);
+    check(complete(list, "[1, \"x\"]") && !complete(list, "[1]"), "minItems and anyOf");
+    check(!Grammar::from_json_schema("{\"$ref\": \"#/$defs/missing\"}", &error), "unresolved $ref is rejected");
+    check(!Grammar::from_json_schema("{\"type\": ", &error), "malformed schema is rejected");
+
+    std::string ebnf_text;
+    check(Grammar::json_schema_to_ebnf(kPersonSchema, &ebnf_text, &error) &&
+              ebnf_text.compare(0, 9, "root ::= ") == 0,
+          "schema converts to EBNF");
+}
+
+// Synthetic Llama-3-sized vocabulary: every single byte, JSON punctuation
+// runs, words with and without a leading space, numbers and multi-byte text,
+// with duplicates like a real BPE vocabulary's byte-fallback overlaps
+std::vector<std::string> synthetic_vocab() {
+    static const char* const kPieces[] = {
+        "{", "}", "[", "]", "\"", ":", ",", " ", "\n", "  ", "\\", "\\\"", "\\n", "\\u00", "true", "false", "null",
+        "name", "age", "mood", "tags", "friend", "happy", "sad", "-", ".", "e", "0", "1", "42", "日本", "é", "ë", "😀",
+        "Ann", "Z", "the", " and", "ing", "\t", "x", "é\"", "\":", "\",", "{\"", "\"}", "[\"", "\"]", ", \"", "\": ",
+    };
+    const size_t piece_count = sizeof(kPieces) / sizeof(kPieces[0]);
+    std::vector<std::string> vocab(kVocabSize);
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    auto next = [&state]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    for (int32_t t = 1; t < kVocabSize; t++) {
+        std::string& piece = vocab[t];
+        if (t <= 256) {
+            piece.assign(1, static_cast<char>(t - 1));
+            continue;
+        }
+        const int parts = 1 + static_cast<int>(next() % 3);
+        for (int p = 0; p < parts; p++) {
+            if (next() % 4 == 0) {
+                const int letters = 1 + static_cast<int>(next() % 6);
+                for (int l = 0; l < letters; l++) piece.push_back(static_cast<char>('a' + next() % 26));
+            } else {
+                piece += kPieces[next() % piece_count];
+            }
+        }
+    }
+    return vocab;
+}
+
+// Allowed tokens by accepting each token's bytes on a copy of the matcher
+std::vector<uint32_t> brute_force_mask(const GrammarMatcher& matcher, const std::vector<std::string>& vocab) {
+    std::vector<uint32_t> words((vocab.size() + 31) / 32, 0);
+    std::unique_ptr<GrammarMatcher> probe(new GrammarMatcher(matcher));
+    for (size_t t = 0; t < vocab.size(); t++) {
+        const bool allowed = t == 0 ? matcher.can_stop() : probe->accept(vocab[t]);
+        if (!allowed) continue;
+        words[t >> 5] |= 1u << (t & 31);
+        if (t != 0) probe.reset(new GrammarMatcher(matcher));
+    }
+    return words;
+}
+
+void run_mask_checks(const std::vector<std::string>& vocab, int runs) {
+    std::string error;
+    auto person = Grammar::from_json_schema(kPersonSchema, &error);
+    if (!person) return;
+
+    const auto start_trie = Clock::now();
+    auto trie = std::make_shared<TokenTrie>(
+        kVocabSize, [&vocab](int32_t token) { return vocab[token]; }, [](int32_t token) { return token == 0; });
+    const double trie_ms = elapsed_ns(start_trie) / 1e6;
+    TokenMaskCache cache(trie);
+
+    // Parser states along a document: its start, inside strings, keys,
+    // numbers, nested objects and the completed parse
+    const std::string text = kPersonJson;
+    const size_t offsets[] = {0, 1, 3, 9, 14, 29, 35, 58, 70, 95, text.size()};
+    std::vector<GrammarMatcher> states;
+    GrammarMatcher matcher(person);
+    size_t at = 0;
+    for (size_t offset : offsets) {
+        matcher.accept(text.substr(at, offset - at));
+        at = offset;
+        states.push_back(matcher);
+    }
+
+    bool all_match = true;
+    size_t allowed_total = 0;
+    for (const GrammarMatcher& state : states) {
+        std::shared_ptr<const TokenMask> mask = cache.lookup(state);
+        const std::vector<uint32_t> expected = brute_force_mask(state, vocab);
+        all_match = all_match && mask->words == expected;
+        allowed_total += mask->allowed;
+    }
+    check(all_match, "token masks match brute force");
+    check(states.back().can_stop() && cache.lookup(states.back())->allowed == 1, "completed parse allows only stop");
+
+    // Same grammar compiled again (a repeated request) hits the cache
+    auto again = Grammar::from_json_schema(kPersonSchema, &error);
+    bool computed = true;
+    cache.lookup(GrammarMatcher(again), &computed);
+    check(!computed, "repeated request reuses cached masks");
+
+    // Cold: every state computed from scratch
+    double cold_ms = 0.0;
+    for (int run = 0; run < runs; run++) {
+        cache.clear();
+        const auto start = Clock::now();
+        for (const GrammarMatcher& state : states) cache.lookup(state);
+        cold_ms += elapsed_ns(start) / 1e6 / states.size();
+    }
+    cold_ms /= runs;
+
+    // Warm: lookup + apply, as the engine does for every constrained token
+    std::vector<float> logits(kVocabSize, 0.5f);
+    const int iterations = 2000;
+    const auto start = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+        const GrammarMatcher& state = states[i % states.size()];
+        Sampler::apply_token_mask(logits.data(), cache.lookup(state)->words.data(), kVocabSize);
+    }
+    const double warm_us = elapsed_ns(start) / 1e3 / iterations;
+
+    std::printf("vocab trie:        %zu nodes, %.1f MB, built in %.0f ms\n", trie->node_count(),
+                trie->bytes() / (1024.0 * 1024.0), trie_ms);
+    std::printf("mask (cold):       %.2f ms per state, %zu allowed tokens on average\n", cold_ms,
+                allowed_total / states.size());
+    std::printf("mask (cached):     %.1f us per token (lookup + apply over %d logits)\n", warm_us, kVocabSize);
+    std::printf("mask cache:        %zu masks, %zu KB, %llu hits, %llu misses\n", cache.stats().masks,
+                cache.stats().bytes / 1024, static_cast<unsigned long long>(cache.stats().hits),
+                static_cast<unsigned long long>(cache.stats().misses));
+}
+
+void run_kernel_checks() {
+    const size_t vocab = kVocabSize + 7; // a partial final word
+    std::vector<uint32_t> mask((vocab + 31) / 32);
+    uint64_t state = 12345;
+    for (size_t w = 0; w < mask.size(); w++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        const int kind = static_cast<int>(w % 4);
+        mask[w] = kind == 0 ? 0u : kind == 1 ? ~0u : static_cast<uint32_t>(state >> 32);
+    }
+    std::vector<float> logits(vocab), expected(vocab);
+    for (size_t t = 0; t < vocab; t++) logits[t] = expected[t] = static_cast<float>(t % 97) - 48.0f;
+    for (size_t t = 0; t < vocab; t++) {
+        if (((mask[t >> 5] >> (t & 31)) & 1) == 0) expected[t] = -std::numeric_limits<float>::infinity();
+    }
+    Sampler::apply_token_mask(logits.data(), mask.data(), vocab);
+    check(std::memcmp(logits.data(), expected.data(), vocab * sizeof(float)) == 0,
+          "apply_token_mask matches the scalar reference");
+}
+
+struct Generation {
+    std::string text;
+    int status = -3;
+    int tokens = 0;
+    int64_t ns = 0;
+};
+
+Generation generate(InferenceEngine& engine, const std::string& prompt, const GenerationParams& params) {
+    Generation result;
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+
+    InferenceRequest request;
+    request.prompt = prompt;
+    request.params = params;
+    request.on_token = [&result](int32_t, const std::string& piece) {
+        result.text += piece;
+        result.tokens++;
+        return true;
+    };
+    request.on_complete = [&](int status) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result.status = status;
+        finished = true;
+        done.notify_all();
+    };
+    const auto start = Clock::now();
+    if (!engine.submit(std::move(request))) return result;
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return finished; });
+    result.ns = elapsed_ns(start);
+    return result;
+}
+
+void run_engine_checks(int runs) {
+    ModelRuntimeConfig config;
+    config.vocab_size = kVocabSize;
+    config.speculative_decoding = true;
+    auto chat = std::make_shared<StubChatModule>(kVocabSize);
+    InferenceEngine engine("stub", chat, config);
+
+    GenerationParams params;
+    params.max_tokens = 64;
+    params.grammar = ebnf("root ::= \"{\" [a-z]{1,8} \"}\"");
+    const Generation bounded = generate(engine, "Give me a word in braces.", params);
+    check(bounded.status == 0, "bounded grammar request completes");
+    check(complete(params.grammar, bounded.text), "bounded grammar output is complete");
+
+    std::string error;
+    params.grammar = Grammar::from_json_schema(kPersonSchema, &error);
+    params.max_tokens = 96;
+    bool valid = true;
+    for (const char* prompt : {"Describe a person as JSON.", "Another person, please.", "One more person."}) {
+        const Generation person = generate(engine, prompt, params);
+        valid = valid && person.status == 0 && accepts(params.grammar, person.text);
+    }
+    check(valid, "schema output stays inside the grammar");
+
+    // Throughput with and without the grammar, masks already cached
+    params.max_tokens = 128;
+    params.temperature = 0.0f;
+    double constrained = 0.0, free = 0.0;
+    for (int run = 0; run < runs; run++) {
+        const Generation with = generate(engine, "Throughput prompt.", params);
+        GenerationParams plain = params;
+        plain.grammar.reset();
+        const Generation without = generate(engine, "Throughput prompt.", plain);
+        constrained += with.tokens * 1e9 / std::max<int64_t>(with.ns, 1);
+        free += without.tokens * 1e9 / std::max<int64_t>(without.ns, 1);
+    }
+    std::printf("engine (stub):     %.0f tok/s constrained, %.0f tok/s unconstrained\n", constrained / runs,
+                free / runs);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int runs = 3;
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--runs=", 7) == 0) {
+            runs = std::max(1, std::atoi(argv[i] + 7));
+        } else {
+            std::fprintf(stderr, "usage: %s [--runs=N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::printf("=== grammar_bench (kernels: %s) ===\n", Sampler::kernel_name());
+    run_parse_checks();
+    run_schema_checks();
+    run_kernel_checks();
+    run_mask_checks(synthetic_vocab(), runs);
+    run_engine_checks(runs);
+
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d check(s) FAILED\n", g_failures);
+        return 1;
+    }
+    std::printf("All checks passed\n");
+    return 0;
+}
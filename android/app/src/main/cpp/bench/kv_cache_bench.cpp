@@ -0,0 +1,401 @@
+// Paged KV cache: correctness checks and footprint / throughput numbers for
+// the Llama-3.2-1B layout (16 layers, 8 KV heads, head_dim 64).
+//
+// Checks fp16 conversion, the reconstruction error of each block format,
+// block sharing on fork, rollback with pop_tokens, evicting blocks from
+// the middle, the byte budget, restoring a sequence from a session
+// snapshot captured before it changed and queueing saves behind a slow
+// one, then
+// reports bytes per token, what several sessions cost paged versus a full
+// context window each, and store/load throughput. Exits non-zero if a check
+// fails.
+//
+//   kv_cache_bench [tokens]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench_check.h"
+#include "fp16.h"
+#include "kv_cache.h"
+#include "kv_snapshot.h"
+
+namespace {
+
+constexpr int32_t kContextWindow = 131072;
+
+KvCacheLayout llama_layout(KvQuantization quantization) {
+    KvCacheLayout layout;
+    layout.quantization = quantization;
+    return layout;
+}
+
+size_t token_values(const KvCacheLayout& layout) {
+    return static_cast<size_t>(layout.kv_heads) * layout.head_dim;
+}
+
+// K and V of one position and layer, as the model would store() them
+void make_token(std::mt19937& rng, const KvCacheLayout& layout, std::vector<float>* key, std::vector<float>* value) {
+    std::normal_distribution<float> noise(0.0f, 1.5f);
+    key->resize(token_values(layout));
+    value->resize(token_values(layout));
+    for (float& x : *key) x = noise(rng);
+    for (float& x : *value) x = noise(rng);
+}
+
+// Appends `count` random positions; `reference` keeps them per layer as
+// [position][kv_heads][head_dim] for K then V.
+bool append_tokens(PagedKvCache& cache, SequenceId seq, size_t count, std::mt19937& rng,
+                   std::vector<std::vector<float>>* reference) {
+    const KvCacheLayout& layout = cache.layout();
+    const size_t start = cache.length(seq);
+    if (!cache.extend(seq, count)) return false;
+    reference->resize(static_cast<size_t>(layout.layers) * 2);
+    std::vector<float> key, value;
+    for (size_t position = start; position < start + count; position++) {
+        for (int32_t layer = 0; layer < layout.layers; layer++) {
+            make_token(rng, layout, &key, &value);
+            cache.store(seq, layer, position, key.data(), value.data());
+            auto& keys = (*reference)[layer * 2];
+            auto& values = (*reference)[layer * 2 + 1];
+            keys.insert(keys.end(), key.begin(), key.end());
+            values.insert(values.end(), value.begin(), value.end());
+        }
+    }
+    return true;
+}
+
+// Largest |loaded - reference| over positions [0, length), relative to the
+// largest reference magnitude
+float max_error(const PagedKvCache& cache, SequenceId seq, size_t length,
+                const std::vector<std::vector<float>>& reference) {
+    const KvCacheLayout& layout = cache.layout();
+    const size_t heads = layout.kv_heads;
+    const size_t dim = layout.head_dim;
+    std::vector<float> keys(heads * length * dim), values(heads * length * dim);
+    float worst = 0.0f;
+    float scale = 0.0f;
+    for (int32_t layer = 0; layer < layout.layers; layer++) {
+        cache.load(seq, layer, 0, length, keys.data(), values.data());
+        for (size_t head = 0; head < heads; head++) {
+            for (size_t position = 0; position < length; position++) {
+                for (size_t d = 0; d < dim; d++) {
+                    const size_t in = (position * heads + head) * dim + d;
+                    const size_t out = (head * length + position) * dim + d;
+                    const float k = reference[layer * 2][in];
+                    const float v = reference[layer * 2 + 1][in];
+                    worst = std::max(worst, std::max(std::fabs(keys[out] - k), std::fabs(values[out] - v)));
+                    scale = std::max(scale, std::max(std::fabs(k), std::fabs(v)));
+                }
+            }
+        }
+    }
+    return scale > 0.0f ? worst / scale : worst;
+}
+
+void check_fp16() {
+    check(float_to_half(1.0f) == 0x3c00, "fp16 1.0");
+    check(float_to_half(-2.0f) == 0xc000, "fp16 -2.0");
+    check(float_to_half(65504.0f) == 0x7bff, "fp16 max");
+    check(float_to_half(1e6f) == 0x7c00, "fp16 overflow to infinity");
+    check(float_to_half(std::ldexp(1.0f, -24)) == 0x0001, "fp16 smallest subnormal");
+    check(float_to_half(1.0f + std::ldexp(1.0f, -11)) == 0x3c00, "fp16 ties round to even");
+    check(half_to_float(0x0001) == std::ldexp(1.0f, -24), "fp16 subnormal decode");
+    check(std::isnan(half_to_float(float_to_half(NAN))), "fp16 NaN");
+    bool round_trip = true;
+    for (uint32_t bits = 0; bits < 0x7c00; bits++) {
+        round_trip &= float_to_half(half_to_float(static_cast<uint16_t>(bits))) == bits;
+    }
+    check(round_trip, "fp16 round-trips every finite half");
+}
+
+void check_formats() {
+    // Relative to the row's largest value: fp16 rounding, or half a
+    // quantization step (plus the fp16 staging of the open block)
+    const struct {
+        KvQuantization quantization;
+        float tolerance;
+    } formats[] = {
+        {KvQuantization::kFloat16, 1e-3f},
+        {KvQuantization::kInt8, 0.5f / 127 + 1e-3f},
+        {KvQuantization::kInt4, 0.5f / 7 + 1e-3f},
+    };
+    for (const auto& format : formats) {
+        KvCacheLayout layout = llama_layout(format.quantization);
+        layout.layers = 2;
+        PagedKvCache cache(layout);
+        std::mt19937 rng(11);
+        std::vector<std::vector<float>> reference;
+        cache.add_sequence(1);
+        append_tokens(cache, 1, 100, rng, &reference);
+        append_tokens(cache, 1, 1, rng, &reference); // seals the six full blocks
+        check(cache.stats().blocks == 7 && cache.stats().sealed_blocks == 6, "full blocks are sealed on extend");
+        check(max_error(cache, 1, 101, reference) <= format.tolerance, "stored KV reads back within tolerance");
+
+        const size_t expected = 6 * layout.sealed_block_bytes() + layout.open_block_bytes();
+        check(cache.stats().bytes == expected, "bytes count sealed and open blocks");
+        cache.remove_sequence(1);
+        check(cache.stats().blocks == 0 && cache.stats().bytes == 0, "removing the sequence frees its blocks");
+    }
+}
+
+void check_fork_and_pop() {
+    KvCacheLayout layout = llama_layout(KvQuantization::kInt8);
+    layout.layers = 2;
+    PagedKvCache cache(layout);
+    std::mt19937 rng(5);
+    std::vector<std::vector<float>> parent_reference;
+    cache.add_sequence(1);
+    append_tokens(cache, 1, 40, rng, &parent_reference);
+
+    // Two full blocks are shared, the partial third is copied
+    check(cache.fork_sequence(1, 2, 40), "fork");
+    check(cache.stats().shared_blocks == 2 && cache.stats().blocks == 4, "fork shares full blocks");
+    std::vector<std::vector<float>> child_reference = parent_reference;
+    append_tokens(cache, 2, 30, rng, &child_reference);
+    append_tokens(cache, 1, 5, rng, &parent_reference);
+    check(max_error(cache, 1, 45, parent_reference) < 0.01f, "parent unaffected by the child's writes");
+    check(max_error(cache, 2, 70, child_reference) < 0.01f, "child reads shared and own blocks");
+
+    check(cache.pop_tokens(2, 30) && cache.length(2) == 40, "pop within the private tail block");
+    check(max_error(cache, 2, 40, parent_reference) < 0.01f, "pop keeps the remaining positions");
+    check(!cache.pop_tokens(2, 41), "cannot pop more than the length");
+
+    // The second block is sealed and shared: rolling back into it gives the
+    // child a private open copy, which it can then overwrite
+    check(cache.pop_tokens(2, 20) && cache.length(2) == 20, "pop into a shared sealed block");
+    check(cache.stats().shared_blocks == 1, "the reopened block is no longer shared");
+    std::vector<std::vector<float>> regrown;
+    for (const auto& row : parent_reference) {
+        regrown.emplace_back(row.begin(), row.begin() + 20 * token_values(layout));
+    }
+    append_tokens(cache, 2, 10, rng, &regrown);
+    check(max_error(cache, 2, 30, regrown) < 0.01f, "reopened block takes new positions");
+    check(max_error(cache, 1, 45, parent_reference) < 0.01f, "the parent keeps its block");
+
+    cache.remove_sequence(1);
+    cache.remove_sequence(2);
+    check(cache.stats().blocks == 0 && cache.stats().shared_blocks == 0, "all blocks released");
+}
+
+void check_evict() {
+    KvCacheLayout layout = llama_layout(KvQuantization::kInt8);
+    layout.layers = 2;
+    PagedKvCache cache(layout);
+    std::mt19937 rng(3);
+    std::vector<std::vector<float>> reference;
+    cache.add_sequence(1);
+    append_tokens(cache, 1, 100, rng, &reference);
+    check(cache.fork_sequence(1, 2, 64), "fork before evicting");
+
+    // Negating stands in for the re-rotation; it is exact in every format
+    auto negate = [](float* key) {
+        for (int32_t d = 0; d < 64; d++) key[d] = -key[d];
+    };
+    check(!cache.evict(1, 8, 16, negate) && !cache.evict(1, 96, 16, negate), "misaligned or too long evict rejected");
+    const size_t blocks = cache.stats().blocks;
+    check(cache.evict(1, 16, 32, negate) && cache.length(1) == 68, "evict two blocks after the first");
+    check(cache.stats().blocks == blocks + 1, "only the shared moved block gains a copy");
+
+    const size_t values = token_values(layout);
+    std::vector<std::vector<float>> expected;
+    for (size_t row = 0; row < reference.size(); row++) {
+        std::vector<float> kept(reference[row].begin(), reference[row].begin() + 16 * values);
+        kept.insert(kept.end(), reference[row].begin() + 48 * values, reference[row].end());
+        if (row % 2 == 0) {
+            for (size_t i = 16 * values; i < kept.size(); i++) kept[i] = -kept[i];
+        }
+        expected.push_back(std::move(kept));
+    }
+    check(max_error(cache, 1, 68, expected) < 0.5f / 127 + 1e-3f, "evicted sequence holds the moved, rekeyed KV");
+    check(max_error(cache, 2, 64, reference) < 0.5f / 127 + 1e-3f, "the fork keeps the original KV");
+    append_tokens(cache, 1, 20, rng, &expected);
+    check(max_error(cache, 1, 88, expected) < 0.5f / 127 + 1e-3f, "appends continue after the eviction");
+
+    cache.remove_sequence(1);
+    cache.remove_sequence(2);
+    check(cache.stats().blocks == 0 && cache.stats().tokens == 0, "evicted sequence releases its blocks");
+}
+
+void check_budget() {
+    KvCacheLayout layout = llama_layout(KvQuantization::kFloat16);
+    layout.layers = 1;
+    PagedKvCache cache(layout, 3 * layout.open_block_bytes());
+    std::mt19937 rng(9);
+    std::vector<std::vector<float>> reference;
+    cache.add_sequence(1);
+    check(append_tokens(cache, 1, 40, rng, &reference), "extend within budget");
+    check(!cache.extend(1, 20), "extend past the budget fails");
+    check(cache.length(1) == 40 && cache.stats().blocks == 3, "failed extend changes nothing");
+    check(cache.stats().allocation_failures == 1, "failure counted");
+}
+
+void check_snapshot() {
+    char directory[] = "/tmp/kv_cache_bench_XXXXXX";
+    check(mkdtemp(directory) != nullptr, "snapshot directory created");
+    KvSnapshotStore store(directory, 64 << 20);
+
+    // Half a 4-bit step, plus fp16 rounding when staged and when reopened
+    const float tolerance = 0.5f / 7 + 2e-3f;
+    KvCacheLayout layout = llama_layout(KvQuantization::kInt4);
+    layout.layers = 2;
+    PagedKvCache saved(layout);
+    std::mt19937 rng(3);
+    std::vector<std::vector<float>> reference;
+    saved.add_sequence(1);
+    append_tokens(saved, 1, 40, rng, &reference);
+    const std::vector<int32_t> tokens(40, 7);
+    KvSnapshotCapture capture = saved.capture_sequence(1);
+    check(capture != nullptr, "capture a sequence");
+
+    // The snapshot is written as captured, whatever the sequence does after
+    std::vector<std::vector<float>> discarded;
+    check(saved.pop_tokens(1, 10) && append_tokens(saved, 1, 10, rng, &discarded), "rewrite the captured tail");
+    saved.remove_sequence(1);
+    check(store.save("session", "model", saved.snapshot_format(), tokens, capture), "save a sequence");
+    capture = nullptr;
+    store.flush();
+    check(saved.add_sequence(2) && saved.stats().blocks == 0, "a written capture releases its blocks");
+
+    // Two full blocks are used in place, the partial third is copied
+    PagedKvCache restored(layout);
+    auto snapshot = store.open("session", "model", restored.snapshot_format());
+    check(snapshot && restored.restore_sequence(5, snapshot, 40), "restore a sequence");
+    check(restored.stats().mapped_blocks == 2 && restored.stats().bytes == layout.open_block_bytes(),
+          "full blocks are mapped from the snapshot");
+    check(max_error(restored, 5, 40, reference) <= tolerance, "restored KV matches the saved sequence");
+
+    // A shorter common prefix ends inside a sealed block, which is reopened
+    check(restored.restore_sequence(6, snapshot, 20) && restored.length(6) == 20, "restore a prefix");
+    check(max_error(restored, 6, 20, reference) <= tolerance, "restored prefix matches");
+    // Sequence 6 still maps its own first block
+    check(restored.pop_tokens(5, 30) && restored.stats().mapped_blocks == 1, "pop into a mapped block copies it");
+    std::vector<std::vector<float>> regrown;
+    for (const auto& row : reference) regrown.emplace_back(row.begin(), row.begin() + 10 * token_values(layout));
+    append_tokens(restored, 5, 20, rng, &regrown);
+    check(max_error(restored, 5, 30, regrown) <= tolerance, "a restored sequence keeps growing");
+    restored.remove_sequence(5);
+    restored.remove_sequence(6);
+    check(restored.stats().blocks == 0 && restored.stats().mapped_blocks == 0, "restored blocks released");
+
+    KvCacheLayout other = layout;
+    other.quantization = KvQuantization::kInt8;
+    check(!store.open("session", "model", PagedKvCache(other).snapshot_format()),
+          "a snapshot of another format is rejected");
+    check(store.stats().files == 0 && store.stats().rejected == 1, "a rejected snapshot is deleted");
+    rmdir(directory);
+}
+
+// Saves made while one is still being written return at once; of those
+// waiting behind it, only the newest is written
+void check_snapshot_queue() {
+    char directory[] = "/tmp/kv_cache_bench_XXXXXX";
+    check(mkdtemp(directory) != nullptr, "snapshot directory created");
+    KvSnapshotStore store(directory, 64 << 20);
+
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    auto writes = [released](int32_t turn, bool slow) {
+        return [released, turn, slow](KvSnapshotWriter* writer) {
+            if (slow) released.wait();
+            writer->begin_section();
+            writer->write(&turn, sizeof(turn));
+            writer->end_section();
+            return writer->ok();
+        };
+    };
+    const std::vector<int32_t> tokens(4, 7);
+    for (int32_t turn = 1; turn <= 3; turn++) {
+        store.save("session", "model", "test", tokens, writes(turn, turn == 1));
+    }
+    release.set_value();
+    store.flush();
+
+    int32_t written = 0;
+    size_t bytes = 0;
+    auto snapshot = store.open("session", "model", "test");
+    const uint8_t* section = snapshot ? snapshot->section(0, &bytes) : nullptr;
+    if (section != nullptr && bytes == sizeof(written)) std::memcpy(&written, section, bytes);
+    const KvSnapshotStore::Stats stats = store.stats();
+    check(stats.saves == 2 && stats.coalesced == 1 && written == 3, "a queued save is replaced by a newer one");
+    snapshot.reset();
+    store.set_byte_budget(0);
+    rmdir(directory);
+}
+
+template <typename Fn>
+double ns_per_call(int iterations, Fn&& fn) {
+    fn();
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) fn();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t tokens = argc > 1 ? std::max(16, std::atoi(argv[1])) : 2048;
+
+    check_fp16();
+    check_formats();
+    check_fork_and_pop();
+    check_evict();
+    check_budget();
+    check_snapshot();
+    check_snapshot_queue();
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d KV cache check(s) failed\n", g_failures);
+        return 1;
+    }
+
+    const KvQuantization formats[] = {KvQuantization::kFloat16, KvQuantization::kInt8, KvQuantization::kInt4};
+    const double contiguous = 4.0 * kContextWindow * llama_layout(KvQuantization::kFloat16).open_block_bytes() /
+                              llama_layout(KvQuantization::kFloat16).block_tokens;
+    std::printf("kv cache: 16 layers x 8 heads x 64, 16-token blocks, %zu tokens\n", tokens);
+    std::printf("  4 sessions x %d-token window, fp16, contiguous: %10.0f MB\n", kContextWindow, contiguous / (1 << 20));
+
+    for (KvQuantization quantization : formats) {
+        const KvCacheLayout layout = llama_layout(quantization);
+        PagedKvCache cache(layout);
+        std::mt19937 rng(1);
+        std::vector<float> key, value;
+        make_token(rng, layout, &key, &value);
+
+        // Four sessions of `tokens` each; one extend per position, as decode does
+        const auto start = std::chrono::steady_clock::now();
+        for (SequenceId seq = 0; seq < 4; seq++) {
+            cache.add_sequence(seq);
+            for (size_t position = 0; position < tokens; position++) {
+                cache.extend(seq, 1);
+                for (int32_t layer = 0; layer < layout.layers; layer++) {
+                    cache.store(seq, layer, position, key.data(), value.data());
+                }
+            }
+        }
+        const double store_ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count() / (4.0 * tokens);
+
+        // One layer's attention read of the whole first session
+        std::vector<float> keys(token_values(layout) * tokens), values(token_values(layout) * tokens);
+        const double load_ns = ns_per_call(20, [&] {
+            cache.load(0, static_cast<int32_t>(tokens) % layout.layers, 0, tokens, keys.data(), values.data());
+        });
+
+        std::printf("  %-4s %8zu bytes/token  4 sessions paged: %7.1f MB  store %7.0f ns/token  load %6.2f GB/s/layer\n",
+                    kv_quantization_name(quantization), layout.sealed_block_bytes() / layout.block_tokens,
+                    cache.stats().bytes / double(1 << 20), store_ns,
+                    2.0 * keys.size() * sizeof(float) / load_ns);
+    }
+    return 0;
+}
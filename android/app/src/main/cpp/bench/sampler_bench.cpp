@@ -0,0 +1,215 @@
+// Microbenchmarks for the native sampler at Llama-3 vocab size.
+//
+// Reports ns per sampled token for each sampling mode next to a naive
+// full-softmax + full-sort reference, after checking the vectorized kernels
+// against scalar results. Exits non-zero if a check fails.
+//
+//   sampler_bench [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "bench_check.h"
+#include "sampler.h"
+
+namespace {
+
+constexpr size_t kVocab = 128256;
+
+// Roughly what a chat model produces: most of the vocab far below a handful
+// of plausible continuations.
+std::vector<float> make_logits(uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> noise(-2.0f, 2.5f);
+    std::vector<float> logits(kVocab);
+    for (float& logit : logits) logit = noise(rng);
+    std::uniform_int_distribution<size_t> pick(0, kVocab - 1);
+    for (int i = 0; i < 32; i++) logits[pick(rng)] = 8.0f + 0.25f * i;
+    return logits;
+}
+
+// The straightforward implementation the sampler replaces
+int32_t naive_sample(const std::vector<float>& logits, const SamplerConfig& config, std::mt19937& rng) {
+    std::vector<std::pair<float, int32_t>> probs(logits.size());
+    const float max_logit = *std::max_element(logits.begin(), logits.end());
+    float total = 0.0f;
+    for (size_t i = 0; i < logits.size(); i++) {
+        probs[i] = {std::exp((logits[i] - max_logit) / config.temperature), static_cast<int32_t>(i)};
+        total += probs[i].first;
+    }
+    std::sort(probs.begin(), probs.end(), [](const std::pair<float, int32_t>& a, const std::pair<float, int32_t>& b) {
+        return a.first > b.first;
+    });
+
+    size_t keep = probs.size();
+    if (config.top_k > 0) keep = std::min(keep, static_cast<size_t>(config.top_k));
+    float kept = 0.0f;
+    for (size_t i = 0; i < keep; i++) {
+        kept += probs[i].first;
+        if (config.top_p < 1.0f && kept >= config.top_p * total) {
+            keep = i + 1;
+            break;
+        }
+    }
+
+    const float target = std::uniform_real_distribution<float>(0.0f, kept)(rng);
+    float cumulative = 0.0f;
+    for (size_t i = 0; i < keep; i++) {
+        cumulative += probs[i].first;
+        if (cumulative > target) return probs[i].second;
+    }
+    return probs[keep - 1].second;
+}
+
+void run_checks() {
+    std::vector<float> logits = make_logits(7);
+    const size_t expected_argmax = std::max_element(logits.begin(), logits.end()) - logits.begin();
+    check(Sampler::argmax(logits.data(), logits.size()) == expected_argmax, "argmax matches std::max_element");
+
+    // Unaligned, odd-length tail
+    check(Sampler::argmax(logits.data() + 3, 1001) ==
+              static_cast<size_t>(std::max_element(logits.begin() + 3, logits.begin() + 1004) - (logits.begin() + 3)),
+          "argmax on an unaligned tail");
+
+    std::vector<float> values(1003);
+    for (size_t i = 0; i < values.size(); i++) values[i] = -30.0f + 0.03f * i;
+    std::vector<float> exps = values;
+    const float sum = Sampler::exp_sum(exps.data(), exps.size(), 0.0f, 1.0f);
+    double reference_sum = 0.0;
+    float worst = 0.0f;
+    for (size_t i = 0; i < values.size(); i++) {
+        const float reference = std::exp(values[i]);
+        reference_sum += reference;
+        worst = std::max(worst, std::fabs(exps[i] - reference) / reference);
+    }
+    check(worst < 1e-6f, "exp_sum relative error below 1e-6");
+    check(std::fabs(sum - reference_sum) / reference_sum < 1e-5, "exp_sum total");
+
+    // Every sampled token must come from the reference top-k / nucleus
+    std::vector<int32_t> order(kVocab);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int32_t a, int32_t b) { return logits[a] > logits[b]; });
+
+    Sampler sampler(42);
+    SamplerConfig top_k;
+    top_k.temperature = 1.0f;
+    top_k.top_k = 8;
+    top_k.top_p = 1.0f;
+    bool in_top_k = true;
+    for (int i = 0; i < 2000; i++) {
+        const int32_t token = sampler.sample(logits.data(), kVocab, top_k, nullptr, 0);
+        in_top_k &= std::find(order.begin(), order.begin() + top_k.top_k, token) != order.begin() + top_k.top_k;
+    }
+    check(in_top_k, "top-k samples stay within the k best tokens");
+
+    SamplerConfig top_p;
+    top_p.temperature = 1.0f;
+    top_p.top_k = 0;
+    top_p.top_p = 0.5f;
+    std::vector<double> probs(kVocab);
+    double total = 0.0;
+    for (size_t i = 0; i < kVocab; i++) total += probs[i] = std::exp(logits[i] - logits[order[0]]);
+    size_t nucleus = 0;
+    for (double mass = 0.0; mass < top_p.top_p * total; nucleus++) mass += probs[order[nucleus]];
+    bool in_nucleus = true;
+    for (int i = 0; i < 2000; i++) {
+        const int32_t token = sampler.sample(logits.data(), kVocab, top_p, nullptr, 0);
+        in_nucleus &= std::find(order.begin(), order.begin() + nucleus, token) != order.begin() + nucleus;
+    }
+    check(in_nucleus, "top-p samples stay within the nucleus");
+
+    // A strong repetition penalty moves greedy decoding off the repeated token
+    SamplerConfig greedy;
+    greedy.temperature = 0.0f;
+    greedy.repetition_penalty = 100.0f;
+    std::vector<float> penalized = logits;
+    const int32_t repeated = order[0];
+    check(sampler.sample(penalized.data(), kVocab, greedy, &repeated, 1) == order[1],
+          "repetition penalty demotes the repeated token");
+
+    SamplerConfig frequency;
+    frequency.temperature = 0.0f;
+    frequency.frequency_penalty = 1.0f;
+    penalized = logits;
+    const int32_t history[] = {order[0], order[0], order[0]};
+    sampler.sample(penalized.data(), kVocab, frequency, history, 3);
+    check(penalized[order[0]] == logits[order[0]] - 3.0f, "frequency penalty counts occurrences");
+}
+
+template <typename Fn>
+double ns_per_call(int iterations, Fn&& fn) {
+    for (int i = 0; i < iterations / 10 + 1; i++) fn();
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) fn();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const int iterations = argc > 1 ? std::max(1, std::atoi(argv[1])) : 2000;
+
+    run_checks();
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d sampler check(s) failed\n", g_failures);
+        return 1;
+    }
+
+    std::vector<float> logits = make_logits(1);
+    Sampler sampler(1);
+    volatile int32_t sink = 0;
+
+    struct Mode {
+        const char* name;
+        SamplerConfig config;
+        bool penalties;
+    };
+    SamplerConfig greedy;
+    greedy.temperature = 0.0f;
+    SamplerConfig top_k;
+    top_k.top_p = 1.0f;
+    SamplerConfig top_p;
+    top_p.top_k = 0;
+    SamplerConfig full;
+    full.repetition_penalty = 1.1f;
+    full.presence_penalty = 0.2f;
+    full.frequency_penalty = 0.1f;
+    const Mode modes[] = {
+        {"greedy", greedy, false},
+        {"top_k=40", top_k, false},
+        {"top_p=0.9", top_p, false},
+        {"top_k=40 top_p=0.9", SamplerConfig(), false},
+        {"top_k=40 top_p=0.9 +penalties", full, true},
+    };
+
+    // Penalties rewrite the logits in place; the drift over a run does not
+    // change the cost of a step, so the buffer is not restored between calls.
+    std::vector<int32_t> history(150);
+    std::mt19937 history_rng(3);
+    for (int32_t& token : history) token = static_cast<int32_t>(history_rng() % kVocab);
+
+    std::printf("sampler kernels: %s, vocab %zu, %d iterations\n", Sampler::kernel_name(), kVocab, iterations);
+    for (const Mode& mode : modes) {
+        std::vector<float> work = logits;
+        const double ns = ns_per_call(iterations, [&] {
+            sink = sampler.sample(work.data(), kVocab, mode.config, mode.penalties ? history.data() : nullptr,
+                                  mode.penalties ? history.size() : 0);
+        });
+        std::printf("  %-32s %10.0f ns/token\n", mode.name, ns);
+    }
+
+    std::mt19937 naive_rng(5);
+    const double naive_ns = ns_per_call(std::max(1, iterations / 20), [&] {
+        sink = naive_sample(logits, SamplerConfig(), naive_rng);
+    });
+    std::printf("  %-32s %10.0f ns/token\n", "naive sort (top_k=40 top_p=0.9)", naive_ns);
+    (void)sink;
+    return 0;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "chat_module.h"
+#include "kv_snapshot.h"
+
+// Deterministic ChatModule for host benchmarks: no model, just the
+// interface costs the engine sees on a device (full-vocab logits written
+// every step) plus optional simulated compute.
+//
+// Tokenization is byte-level (token = byte + 1, token 0 is the stop token).
+// Each step's logits are a flat floor with a few dozen plausible tokens
+// whose scores are hashed from the sequence's history, so greedy decoding
+// of a prompt always produces the same text and never hits the stop token.
+// With `copy_percent`, that share of steps instead favours copying from the
+// context, like a reply quoting its prompt: the continuation of the latest
+// earlier match of the last 3, 2 or 1 tokens, or else a hashed position.
+class StubChatModule : public ChatModule {
+public:
+    struct Timing {
+        int64_t prefill_ns_per_token = 0;
+        int64_t decode_ns_per_step = 0; // per model call, batched or verify
+        int64_t decode_ns_per_row = 0;
+    };
+
+    explicit StubChatModule(int32_t vocab_size) : vocab_size_(vocab_size) {}
+    StubChatModule(int32_t vocab_size, const Timing& timing, int copy_percent = 0)
+        : vocab_size_(vocab_size), timing_(timing), copy_percent_(copy_percent) {}
+
+    int32_t vocab_size() const override { return vocab_size_; }
+
+    std::vector<int32_t> tokenize(const std::string& text) override {
+        std::vector<int32_t> tokens;
+        tokens.reserve(text.size());
+        for (unsigned char c : text) tokens.push_back(static_cast<int32_t>(c) + 1);
+        return tokens;
+    }
+
+    std::string token_to_piece(int32_t token) override {
+        // Printable ASCII so the output is readable and valid UTF-8
+        return std::string(1, static_cast<char>(' ' + token % 95));
+    }
+
+    bool is_stop_token(int32_t token) const override { return token == 0; }
+
+    bool add_sequence(SequenceId seq) override {
+        Sequence& sequence = sequences_[seq];
+        sequence.tokens.clear();
+        sequence.states.assign(1, kSeed);
+        return true;
+    }
+
+    bool fork_sequence(SequenceId parent, SequenceId child, size_t length) override {
+        auto it = sequences_.find(parent);
+        if (it == sequences_.end() || it->second.tokens.size() < length) return false;
+        Sequence forked;
+        forked.tokens.assign(it->second.tokens.begin(), it->second.tokens.begin() + length);
+        forked.states.assign(it->second.states.begin(), it->second.states.begin() + length + 1);
+        sequences_[child] = std::move(forked);
+        return true;
+    }
+
+    void remove_sequence(SequenceId seq) override { sequences_.erase(seq); }
+
+    bool prefill(SequenceId seq, const int32_t* tokens, size_t count, float* logits) override {
+        auto it = sequences_.find(seq);
+        if (it == sequences_.end()) return false;
+        for (size_t i = 0; i < count; i++) append(it->second, tokens[i]);
+        spin(timing_.prefill_ns_per_token * static_cast<int64_t>(count));
+        write_logits(it->second, logits);
+        return true;
+    }
+
+    bool decode(SequenceId seq, int32_t token, float* logits) override {
+        spin(timing_.decode_ns_per_step + timing_.decode_ns_per_row);
+        return step(seq, token, logits);
+    }
+
+    bool batch_decode(const SequenceId* seqs, const int32_t* tokens, size_t count, float* const* logits) override {
+        spin(timing_.decode_ns_per_step + timing_.decode_ns_per_row * static_cast<int64_t>(count));
+        for (size_t i = 0; i < count; i++) {
+            if (!step(seqs[i], tokens[i], logits[i])) return false;
+        }
+        return true;
+    }
+
+    bool supports_verify() const override { return true; }
+
+    // Costs what a batch of `count` rows would
+    bool verify(SequenceId seq, const int32_t* tokens, size_t count, float* logits) override {
+        spin(timing_.decode_ns_per_step + timing_.decode_ns_per_row * static_cast<int64_t>(count));
+        for (size_t i = 0; i < count; i++) {
+            if (!step(seq, tokens[i], logits + i * static_cast<size_t>(vocab_size_))) return false;
+        }
+        return true;
+    }
+
+    bool pop_tokens(SequenceId seq, size_t count) override {
+        auto it = sequences_.find(seq);
+        if (it == sequences_.end() || it->second.tokens.size() < count) return false;
+        it->second.tokens.resize(it->second.tokens.size() - count);
+        it->second.states.resize(it->second.states.size() - count);
+        return true;
+    }
+
+    // Longest any sequence has been, in positions
+    size_t peak_length() const { return peak_length_; }
+
+    // Keeps the states of the surviving positions, as a real cache keeps
+    // their values; the hash chain is not recomputed
+    size_t eviction_granularity() const override { return 16; }
+
+    bool evict_tokens(SequenceId seq, size_t begin, size_t count) override {
+        auto it = sequences_.find(seq);
+        if (it == sequences_.end() || count == 0 || begin + count > it->second.tokens.size()) return false;
+        Sequence& sequence = it->second;
+        sequence.tokens.erase(sequence.tokens.begin() + begin, sequence.tokens.begin() + begin + count);
+        sequence.states.erase(sequence.states.begin() + begin + 1, sequence.states.begin() + begin + count + 1);
+        return true;
+    }
+
+    // The per-position hashes stand in for KV: one section of states
+    std::string snapshot_format() const override { return "stub/" + std::to_string(vocab_size_); }
+
+    KvSnapshotCapture capture_sequence(SequenceId seq) override {
+        auto it = sequences_.find(seq);
+        if (it == sequences_.end()) return nullptr;
+        return [states = it->second.states](KvSnapshotWriter* writer) {
+            writer->begin_section();
+            writer->write(states.data(), states.size() * sizeof(uint64_t));
+            writer->end_section();
+            return writer->ok();
+        };
+    }
+
+    bool restore_sequence(SequenceId seq, const std::shared_ptr<const KvSnapshot>& snapshot, size_t length) override {
+        size_t bytes = 0;
+        const uint8_t* states = snapshot->section(0, &bytes);
+        if (length > snapshot->token_count() || states == nullptr || bytes < (length + 1) * sizeof(uint64_t)) {
+            return false;
+        }
+        Sequence& sequence = sequences_[seq];
+        sequence.tokens.assign(snapshot->tokens(), snapshot->tokens() + length);
+        sequence.states.resize(length + 1);
+        std::memcpy(sequence.states.data(), states, sequence.states.size() * sizeof(uint64_t));
+        return true;
+    }
+
+private:
+    static constexpr int kPlausibleTokens = 32;
+    static constexpr uint64_t kSeed = 0x9e3779b97f4a7c15ull;
+
+    // states[i] is the hash after the first i tokens, so forks and pops
+    // need no replay
+    struct Sequence {
+        std::vector<int32_t> tokens;
+        std::vector<uint64_t> states;
+    };
+
+    static uint64_t mix(uint64_t state, int32_t token) {
+        state ^= static_cast<uint64_t>(static_cast<uint32_t>(token)) + 0x9e3779b97f4a7c15ull + (state << 6) + (state >> 2);
+        state ^= state >> 31;
+        state *= 0xbf58476d1ce4e5b9ull;
+        return state ^ (state >> 29);
+    }
+
+    // Busy-waits like a kernel would occupy the core, rather than sleeping
+    static void spin(int64_t ns) {
+        if (ns <= 0) return;
+        const auto end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+        while (std::chrono::steady_clock::now() < end) {
+        }
+    }
+
+    void append(Sequence& sequence, int32_t token) {
+        sequence.states.push_back(mix(sequence.states.back(), token));
+        sequence.tokens.push_back(token);
+        peak_length_ = std::max(peak_length_, sequence.tokens.size());
+    }
+
+    bool step(SequenceId seq, int32_t token, float* logits) {
+        auto it = sequences_.find(seq);
+        if (it == sequences_.end()) return false;
+        append(it->second, token);
+        write_logits(it->second, logits);
+        return true;
+    }
+
+    void write_logits(const Sequence& sequence, float* logits) const {
+        uint64_t state = sequence.states.back();
+        std::fill(logits, logits + vocab_size_, -4.0f);
+        for (int i = 0; i < kPlausibleTokens; i++) {
+            state = mix(state, i);
+            // Never the stop token; scores spread over a few logits
+            const int32_t token = 1 + static_cast<int32_t>(state % static_cast<uint64_t>(vocab_size_ - 1));
+            logits[token] = 4.0f + static_cast<float>((state >> 40) % 1000) * 0.004f;
+        }
+        if (copy_percent_ > 0 && !sequence.tokens.empty() && static_cast<int>((state >> 20) % 100) < copy_percent_) {
+            logits[copied_token(sequence.tokens, state)] = 12.0f;
+        }
+    }
+
+    static int32_t copied_token(const std::vector<int32_t>& tokens, uint64_t state) {
+        const size_t count = tokens.size();
+        for (size_t n = std::min<size_t>(3, count - 1); n >= 1; n--) {
+            for (size_t start = count - n; start-- > 0;) {
+                if (std::equal(tokens.begin() + start, tokens.begin() + start + n, tokens.end() - n)) {
+                    return tokens[start + n];
+                }
+            }
+        }
+        return tokens[state % count];
+    }
+
+    int32_t vocab_size_;
+    Timing timing_;
+    int copy_percent_ = 0;
+    size_t peak_length_ = 0;
+    std::map<SequenceId, Sequence> sequences_;
+};
@@ -0,0 +1,311 @@
+// Core-class thread pool: correctness checks and dispatch overhead.
+//
+// Checks topology detection against a fake /sys/devices/system/cpu tree
+// (cpu_capacity, the cpufreq fallback, a homogeneous CPU), that parallel_for
+// covers every index exactly once (nested, tiny counts, more chunks than
+// threads), that submitted tasks run on a worker of the requested class,
+// that idle workers steal and that the counters add up. Then reports the
+// cost of an empty parallel_for and of a submit round trip. Exits non-zero
+// if a check fails.
+//
+//   thread_pool_bench [performance_workers]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench_check.h"
+#include "thread_pool.h"
+
+namespace {
+
+void write_file(const std::string& path, const std::string& text) {
+    if (std::FILE* file = std::fopen(path.c_str(), "w")) {
+        std::fputs(text.c_str(), file);
+        std::fclose(file);
+    }
+}
+
+// cpuN directories with the given capacities; 0 leaves a core without a
+// cpu_capacity file, negative values go into cpufreq/cpuinfo_max_freq
+std::string fake_sysfs(const std::vector<int>& capacities, std::vector<std::string>* created) {
+    char path[] = "/tmp/thread_pool_bench_XXXXXX";
+    if (mkdtemp(path) == nullptr) return std::string();
+    const std::string root = path;
+    for (size_t i = 0; i < capacities.size(); i++) {
+        const std::string cpu = root + "/cpu" + std::to_string(i);
+        mkdir(cpu.c_str(), 0700);
+        created->push_back(cpu);
+        if (capacities[i] > 0) {
+            write_file(cpu + "/cpu_capacity", std::to_string(capacities[i]) + "\n");
+            created->push_back(cpu + "/cpu_capacity");
+        } else if (capacities[i] < 0) {
+            mkdir((cpu + "/cpufreq").c_str(), 0700);
+            write_file(cpu + "/cpufreq/cpuinfo_max_freq", std::to_string(-capacities[i]) + "\n");
+            created->push_back(cpu + "/cpufreq");
+            created->push_back(cpu + "/cpufreq/cpuinfo_max_freq");
+        }
+    }
+    // Siblings the scan has to skip
+    mkdir((root + "/cpufreq").c_str(), 0700);
+    mkdir((root + "/cpuidle").c_str(), 0700);
+    created->push_back(root + "/cpufreq");
+    created->push_back(root + "/cpuidle");
+    return root;
+}
+
+void remove_sysfs(const std::string& root, std::vector<std::string>* created) {
+    std::reverse(created->begin(), created->end());
+    for (const std::string& path : *created) {
+        if (unlink(path.c_str()) != 0) rmdir(path.c_str());
+    }
+    rmdir(root.c_str());
+    created->clear();
+}
+
+void check_topology() {
+    std::vector<std::string> created;
+
+    // Typical 1+3+4 phone: prime, big and little clusters
+    std::string root = fake_sysfs({160, 160, 160, 160, 700, 700, 700, 1024}, &created);
+    CpuTopology topology = CpuTopology::detect(root);
+    check(topology.efficiency == std::vector<int>({0, 1, 2, 3}), "little cores from cpu_capacity");
+    check(topology.performance == std::vector<int>({4, 5, 6, 7}), "big and prime cores from cpu_capacity");
+    remove_sysfs(root, &created);
+
+    // No cpu_capacity: cluster max frequency in kHz
+    root = fake_sysfs({-1800000, -1800000, -2400000, -2400000, -3000000, -3000000}, &created);
+    topology = CpuTopology::detect(root);
+    check(topology.efficiency.empty() && topology.performance.size() == 6,
+          "frequencies within 2x are all performance cores");
+    remove_sysfs(root, &created);
+    root = fake_sysfs({-500000, -500000, -2000000, -2000000}, &created);
+    topology = CpuTopology::detect(root);
+    check(topology.efficiency == std::vector<int>({0, 1}) && topology.performance == std::vector<int>({2, 3}),
+          "cpufreq fallback splits clusters");
+    remove_sysfs(root, &created);
+
+    // Nothing readable: everything counts as performance
+    root = fake_sysfs({0, 0, 0}, &created);
+    topology = CpuTopology::detect(root);
+    check(topology.performance == std::vector<int>({0, 1, 2}) && topology.efficiency.empty(),
+          "unknown capacities are performance cores");
+    remove_sysfs(root, &created);
+
+    topology = CpuTopology::detect("/nonexistent");
+    check(!topology.performance.empty(), "missing sysfs falls back to hardware_concurrency");
+}
+
+// A small topology so both classes have workers whatever the host has
+CpuTopology host_topology() {
+    CpuTopology topology;
+    topology.performance.push_back(0);
+    topology.efficiency.push_back(0);
+    return topology;
+}
+
+void check_parallel_for(ThreadPool& pool) {
+    for (size_t count : {size_t(0), size_t(1), size_t(7), size_t(1000), size_t(100003)}) {
+        for (size_t grain : {size_t(1), size_t(16), size_t(4096)}) {
+            std::vector<std::atomic<int>> hits(count);
+            for (auto& hit : hits) hit.store(0);
+            bool ordered = true;
+            pool.parallel_for(count, grain, [&](size_t begin, size_t end) {
+                if (begin >= end || end > count) ordered = false;
+                for (size_t i = begin; i < end; i++) hits[i].fetch_add(1);
+            });
+            bool once = ordered;
+            for (auto& hit : hits) once = once && hit.load() == 1;
+            check(once, "parallel_for covers every index exactly once");
+        }
+    }
+
+    // Nested: every outer chunk splits its range again
+    const size_t outer = 64;
+    const size_t inner = 512;
+    std::vector<std::atomic<int>> hits(outer * inner);
+    for (auto& hit : hits) hit.store(0);
+    pool.parallel_for(outer, 1, [&](size_t begin, size_t end) {
+        for (size_t o = begin; o < end; o++) {
+            pool.parallel_for(inner, 8, [&](size_t b, size_t e) {
+                for (size_t i = b; i < e; i++) hits[o * inner + i].fetch_add(1);
+            });
+        }
+    });
+    bool once = true;
+    for (auto& hit : hits) once = once && hit.load() == 1;
+    check(once, "nested parallel_for covers every index exactly once");
+
+    // Tasks submitted from inside a parallel_for chunk still complete
+    std::atomic<int> submitted{0};
+    pool.parallel_for(32, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            pool.submit(CoreClass::kPerformance, [&submitted] { submitted.fetch_add(1); });
+        }
+    });
+    while (submitted.load() < 32) std::this_thread::yield();
+    check(submitted.load() == 32, "submit from a chunk");
+}
+
+void check_classes() {
+    ThreadPool pool(ThreadPoolOptions{3, 2}, host_topology());
+    check(pool.worker_count(CoreClass::kPerformance) == 3, "performance worker count");
+    check(pool.worker_count(CoreClass::kEfficiency) == 2, "efficiency worker count");
+
+    // Each task records which class's worker ran it via the thread ids
+    std::vector<std::thread::id> ran(64);
+    std::atomic<int> done{0};
+    for (size_t i = 0; i < ran.size(); i++) {
+        const CoreClass core_class = i % 2 == 0 ? CoreClass::kPerformance : CoreClass::kEfficiency;
+        pool.submit(core_class, [&, i] {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            ran[i] = std::this_thread::get_id();
+            done.fetch_add(1);
+        });
+    }
+    while (done.load() < static_cast<int>(ran.size())) std::this_thread::yield();
+    bool split = true;
+    for (size_t i = 0; i < ran.size(); i += 2) {
+        for (size_t j = 1; j < ran.size(); j += 2) split = split && ran[i] != ran[j];
+    }
+    check(split, "performance and efficiency tasks run on separate workers");
+    for (size_t i = 0; i < ran.size(); i++) {
+        check(ran[i] != std::this_thread::get_id(), "submit does not run on the caller");
+    }
+
+    // One worker queues everything on its own deque; the others steal
+    std::atomic<int> spawned{0};
+    pool.submit(CoreClass::kPerformance, [&] {
+        for (int i = 0; i < 30; i++) {
+            pool.submit(CoreClass::kPerformance, [&] {
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+                spawned.fetch_add(1);
+            });
+        }
+    });
+    while (spawned.load() < 30) std::this_thread::yield();
+
+    const std::vector<ThreadPool::WorkerStats> stats = pool.stats();
+    check(stats.size() == 5, "stats for every worker");
+    uint64_t performance_tasks = 0;
+    uint64_t efficiency_tasks = 0;
+    uint64_t steals = 0;
+    bool sane = true;
+    for (const auto& worker : stats) {
+        (worker.core_class == CoreClass::kPerformance ? performance_tasks : efficiency_tasks) += worker.tasks;
+        steals += worker.steals;
+        sane = sane && worker.busy_us >= 0 && worker.busy_us <= worker.uptime_us + 1000;
+    }
+    // The last task's counter is bumped after it signals; give it a moment
+    for (int i = 0; i < 100 && performance_tasks < 32 + 31; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        performance_tasks = 0;
+        for (const auto& worker : pool.stats()) {
+            if (worker.core_class == CoreClass::kPerformance) performance_tasks += worker.tasks;
+        }
+    }
+    check(performance_tasks == 32 + 31, "performance task count");
+    check(efficiency_tasks >= 31 && efficiency_tasks <= 32, "efficiency task count");
+    check(steals > 0, "idle workers steal from a busy one");
+    check(sane, "busy time within uptime");
+
+    // No efficiency workers: background work runs inline
+    ThreadPool inline_pool(ThreadPoolOptions{1, 0}, host_topology());
+    std::thread::id where;
+    inline_pool.submit(CoreClass::kEfficiency, [&] { where = std::this_thread::get_id(); });
+    check(where == std::this_thread::get_id(), "class without workers runs inline");
+
+    // The destructor runs what is still queued
+    std::atomic<int> drained{0};
+    {
+        ThreadPool draining(ThreadPoolOptions{1, 1}, host_topology());
+        for (int i = 0; i < 20; i++) {
+            draining.submit(CoreClass::kEfficiency, [&] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                drained.fetch_add(1);
+            });
+        }
+    }
+    check(drained.load() == 20, "destructor drains queued tasks");
+}
+
+void check_shared() {
+    ThreadPool::configure_shared(ThreadPoolOptions{2, 1});
+    std::shared_ptr<ThreadPool> first = ThreadPool::shared();
+    check(first->worker_count(CoreClass::kPerformance) == 2, "configured before first use");
+    ThreadPool::configure_shared(ThreadPoolOptions{2, 1});
+    check(ThreadPool::shared() == first, "same options keep the pool");
+    ThreadPool::configure_shared(ThreadPoolOptions{1, 1});
+    std::shared_ptr<ThreadPool> second = ThreadPool::shared();
+    check(second != first && second->worker_count(CoreClass::kPerformance) == 1, "new options replace the pool");
+    // The old pool is still usable by whoever holds it
+    std::atomic<int> sum{0};
+    first->parallel_for(100, 1, [&](size_t begin, size_t end) { sum.fetch_add(static_cast<int>(end - begin)); });
+    check(sum.load() == 100, "replaced pool keeps working");
+}
+
+template <typename Fn>
+double nanoseconds_per_call(int iterations, Fn fn) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) fn();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    check_topology();
+    {
+        ThreadPool pool(ThreadPoolOptions{3, 1}, host_topology());
+        check_parallel_for(pool);
+    }
+    {
+        ThreadPool pool(ThreadPoolOptions{0, 0}, host_topology());
+        check_parallel_for(pool);
+    }
+    check_classes();
+    check_shared();
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d thread pool check(s) failed\n", g_failures);
+        return 1;
+    }
+
+    const CpuTopology topology = CpuTopology::detect();
+    std::printf("topology: %zu performance cores, %zu efficiency cores\n", topology.performance.size(),
+                topology.efficiency.size());
+    const int workers = argc > 1 ? std::atoi(argv[1]) : -1;
+    ThreadPool pool(ThreadPoolOptions{workers, -1}, topology);
+    std::printf("pool: %zu performance workers, %zu efficiency workers\n",
+                pool.worker_count(CoreClass::kPerformance), pool.worker_count(CoreClass::kEfficiency));
+
+    std::atomic<size_t> sink{0};
+    const double empty = nanoseconds_per_call(20000, [&] {
+        pool.parallel_for(1024, 1, [&](size_t begin, size_t end) { sink.fetch_add(end - begin); });
+    });
+    std::printf("parallel_for(1024):  %8.0f ns/call\n", empty);
+
+    const double inline_call = nanoseconds_per_call(20000, [&] {
+        pool.parallel_for(1, 1, [&](size_t begin, size_t end) { sink.fetch_add(end - begin); });
+    });
+    std::printf("parallel_for(1):     %8.0f ns/call (inline)\n", inline_call);
+
+    const CoreClass background =
+        pool.worker_count(CoreClass::kEfficiency) > 0 ? CoreClass::kEfficiency : CoreClass::kPerformance;
+    std::atomic<int> returned{0};
+    const double round_trip = nanoseconds_per_call(5000, [&] {
+        const int expected = returned.load() + 1;
+        pool.submit(background, [&] { returned.fetch_add(1); });
+        while (returned.load() < expected) std::this_thread::yield();
+    });
+    std::printf("submit round trip:   %8.0f ns/call\n", round_trip);
+    return sink.load() > 0 ? 0 : 1;
+}
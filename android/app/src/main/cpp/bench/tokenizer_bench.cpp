@@ -0,0 +1,445 @@
+// Native BPE tokenizer and incremental detokenizer: correctness checks and
+// throughput numbers.
+//
+// Without arguments a byte-level BPE vocabulary is trained on a built-in
+// chat corpus and loaded through the same tokenizer.json parser the app
+// uses; with a path, the model's own tokenizer.json is loaded instead.
+//
+// Checks the Llama-3 pre-tokenizer splits, special tokens, byte-exact round
+// trips (multi-byte UTF-8, emoji, newlines, invalid bytes), the merge table
+// against a naive min-rank BPE, cached against uncached encoding, and that
+// the detokenizer only ever emits complete UTF-8. Then reports encode MB/s
+// with a cold and a warm word cache, tokens/s and detokenize ns/token.
+// Exits non-zero if a check fails.
+//
+//   tokenizer_bench [tokenizer.json]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench_check.h"
+#include "tokenizer.h"
+
+namespace {
+
+const char* const kSpecialTokens[] = {
+    "<|begin_of_text|>", "<|end_of_text|>", "<|start_header_id|>", "<|end_header_id|>", "<|eot_id|>",
+};
+
+// Chat-like text: prose, code, numbers, accents, CJK and emoji
+const char kCorpus[] =
+    "Hello! I'm your offline assistant. How can I help you today?\n\n"
+    "Sure, here's a quick summary of the article you shared: the team measured "
+    "latency on 3 devices and found that the 1B model answers in 250ms while "
+    "the 3B model takes 1.2 seconds. They're planning to ship the smaller one.\n"
+    "```python\ndef fibonacci(n):\n    a, b = 0, 1\n    for _ in range(n):\n"
+    "        a, b = b, a + b\n    return a\n```\n"
+    "Let's break it down step by step:\n1. Read the input.\n2. Parse the numbers.\n"
+    "3. Print the result.\n\nWe'll also need to handle errors; you'd want retries.\n"
+    "Café au lait, crème brûlée and naïve façades are common in French text. "
+    "Ich möchte gern über die Straße gehen. ¿Dónde está la estación?\n"
+    "你好，世界！今天天气很好。我们一起去公园吧。\n"
+    "こんにちは、元気ですか？ 안녕하세요 반갑습니다.\n"
+    "Привет, как дела? Всё хорошо, спасибо.\n"
+    "Great job 👍🏽 see you soon 👋 🎉🎉 ❤️\n"
+    "The total is $1,234.56 (about €1 150) as of 2024-10-16 at 09:30.\n"
+    "    indented line with trailing spaces   \n"
+    "Tabs\tand\tnew\r\nlines\r\n";
+
+// ---- synthetic vocabulary ----
+
+// GPT-2 byte-level alphabet: the printable character standing for each byte
+std::string byte_char(unsigned char byte) {
+    static const std::vector<std::string> chars = [] {
+        std::vector<std::string> table(256);
+        int shifted = 0;
+        for (int b = 0; b < 256; b++) {
+            const bool printable = (b >= 0x21 && b <= 0x7E) || (b >= 0xA1 && b <= 0xAC) || b >= 0xAE;
+            const int code = printable ? b : 256 + shifted++;
+            std::string utf8;
+            if (code < 0x80) {
+                utf8.push_back(static_cast<char>(code));
+            } else {
+                utf8.push_back(static_cast<char>(0xC0 | code >> 6));
+                utf8.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            }
+            table[b] = utf8;
+        }
+        return table;
+    }();
+    return chars[byte];
+}
+
+std::string json_string(const std::string& bytes, bool byte_level) {
+    std::string text = byte_level ? "" : bytes;
+    if (byte_level) {
+        for (const char c : bytes) text += byte_char(static_cast<unsigned char>(c));
+    }
+    std::string out = "\"";
+    for (const char c : text) {
+        if (c == '"' || c == '\\') out.push_back('\\');
+        out.push_back(c);
+    }
+    return out + "\"";
+}
+
+struct TrainedVocab {
+    std::vector<std::string> tokens; // id -> bytes
+    std::vector<std::pair<std::string, std::string>> merges;
+    std::map<std::pair<std::string, std::string>, size_t> ranks;
+};
+
+// Classic BPE training over the corpus' pre-tokenized words
+TrainedVocab train(const std::string& corpus, size_t merge_count) {
+    TrainedVocab vocab;
+    std::map<std::string, int> ids;
+    for (int b = 0; b < 256; b++) {
+        vocab.tokens.push_back(std::string(1, static_cast<char>(b)));
+        ids[vocab.tokens.back()] = b;
+    }
+
+    std::vector<std::string_view> pieces;
+    BpeTokenizer::split(corpus, &pieces);
+    std::map<std::string, int> counts;
+    for (const std::string_view piece : pieces) counts[std::string(piece)]++;
+    std::vector<std::pair<std::vector<std::string>, int>> words;
+    for (const auto& entry : counts) {
+        std::vector<std::string> parts;
+        for (const char c : entry.first) parts.push_back(std::string(1, c));
+        words.emplace_back(parts, entry.second);
+    }
+
+    while (vocab.merges.size() < merge_count) {
+        std::map<std::pair<std::string, std::string>, int> pairs;
+        for (const auto& word : words) {
+            for (size_t i = 0; i + 1 < word.first.size(); i++) pairs[{word.first[i], word.first[i + 1]}] += word.second;
+        }
+        if (pairs.empty()) break;
+        auto best = pairs.begin();
+        for (auto it = pairs.begin(); it != pairs.end(); ++it) {
+            if (it->second > best->second) best = it;
+        }
+        const auto pair = best->first;
+        vocab.ranks[pair] = vocab.merges.size();
+        vocab.merges.push_back(pair);
+        const std::string merged = pair.first + pair.second;
+        if (ids.emplace(merged, static_cast<int>(vocab.tokens.size())).second) vocab.tokens.push_back(merged);
+        for (auto& word : words) {
+            std::vector<std::string>& parts = word.first;
+            for (size_t i = 0; i + 1 < parts.size(); i++) {
+                if (parts[i] == pair.first && parts[i + 1] == pair.second) {
+                    parts[i] = merged;
+                    parts.erase(parts.begin() + static_cast<std::ptrdiff_t>(i) + 1);
+                }
+            }
+        }
+    }
+    return vocab;
+}
+
+// tokenizer.json as HuggingFace writes it; merges alternate between the
+// "left right" and ["left", "right"] spellings so both are parsed
+std::string to_json(const TrainedVocab& vocab) {
+    std::string json = "{\"version\": \"1.0\", \"added_tokens\": [";
+    const size_t base = vocab.tokens.size();
+    for (size_t i = 0; i < sizeof(kSpecialTokens) / sizeof(kSpecialTokens[0]); i++) {
+        json += i == 0 ? "" : ", ";
+        json += "{\"id\": " + std::to_string(base + i) + ", \"content\": " + json_string(kSpecialTokens[i], false) +
+                ", \"single_word\": false, \"special\": true}";
+    }
+    json += "], \"normalizer\": null, \"model\": {\"type\": \"BPE\", \"dropout\": null, \"ignore_merges\": true, \"vocab\": {";
+    for (size_t id = 0; id < vocab.tokens.size(); id++) {
+        json += id == 0 ? "" : ", ";
+        json += json_string(vocab.tokens[id], true) + ": " + std::to_string(id);
+    }
+    json += "}, \"merges\": [";
+    for (size_t rank = 0; rank < vocab.merges.size(); rank++) {
+        json += rank == 0 ? "" : ", ";
+        const auto& merge = vocab.merges[rank];
+        if (rank % 2 == 0) {
+            json += "[" + json_string(merge.first, true) + ", " + json_string(merge.second, true) + "]";
+        } else {
+            const std::string left = json_string(merge.first, true);
+            const std::string right = json_string(merge.second, true);
+            json += left.substr(0, left.size() - 1) + " " + right.substr(1);
+        }
+    }
+    return json + "]}}";
+}
+
+// Whole-word lookup, then lowest rank leftmost first, one merge at a time
+std::vector<int32_t> reference_encode(const BpeTokenizer& tokenizer, const TrainedVocab& vocab, const std::string& word) {
+    const int32_t whole = tokenizer.token_id(word);
+    if (whole >= 0) return {whole};
+    std::vector<std::string> parts;
+    for (const char c : word) parts.push_back(std::string(1, c));
+    while (parts.size() > 1) {
+        size_t best = 0;
+        size_t best_rank = SIZE_MAX;
+        for (size_t i = 0; i + 1 < parts.size(); i++) {
+            const auto it = vocab.ranks.find({parts[i], parts[i + 1]});
+            if (it != vocab.ranks.end() && it->second < best_rank) {
+                best_rank = it->second;
+                best = i;
+            }
+        }
+        if (best_rank == SIZE_MAX) break;
+        parts[best] += parts[best + 1];
+        parts.erase(parts.begin() + static_cast<std::ptrdiff_t>(best) + 1);
+    }
+    std::vector<int32_t> tokens;
+    for (const std::string& part : parts) tokens.push_back(tokenizer.token_id(part));
+    return tokens;
+}
+
+// ---- checks ----
+
+std::string decode(const BpeTokenizer& tokenizer, const std::vector<int32_t>& tokens) {
+    std::string text;
+    for (const int32_t token : tokens) text += tokenizer.token_bytes(token);
+    return text;
+}
+
+bool valid_utf8(const std::string& text) {
+    std::string out;
+    IncrementalDetokenizer decoder;
+    decoder.push(text, &out);
+    return !decoder.has_pending() && out == text;
+}
+
+void check_split() {
+    struct Case {
+        const char* text;
+        std::vector<std::string> pieces;
+    };
+    const Case cases[] = {
+        {"Hello world's 12345 foo!!\n\n  bar  ", {"Hello", " world", "'s", " ", "123", "45", " foo", "!!\n\n", " ", " bar", "  "}},
+        {"I'M here, they'RE (done)", {"I", "'M", " here", ",", " they", "'RE", " (", "done", ")"}},
+        {"x\r\ny\n\n\tz", {"x", "\r\n", "y", "\n\n", "\tz"}},
+        {"  \n  end", {"  \n", " ", " end"}},
+        {"café 你好世界 👋🏽!", {"café", " 你好世界", " 👋🏽!"}},
+        {"a+=b;", {"a", "+=", "b", ";"}},
+        {"tail   ", {"tail", "   "}},
+        {"€1 150", {"€", "1", " ", "150"}},
+    };
+    for (const Case& test : cases) {
+        std::vector<std::string_view> pieces;
+        BpeTokenizer::split(test.text, &pieces);
+        const bool same = pieces.size() == test.pieces.size() &&
+                          std::equal(pieces.begin(), pieces.end(), test.pieces.begin(),
+                                     [](std::string_view a, const std::string& b) { return a == b; });
+        if (!same) {
+            std::fprintf(stderr, "split of \"%s\":", test.text);
+            for (const std::string_view piece : pieces) std::fprintf(stderr, " [%.*s]", (int)piece.size(), piece.data());
+            std::fprintf(stderr, "\n");
+        }
+        check(same, "pre-tokenizer splits");
+    }
+}
+
+void check_round_trip(BpeTokenizer& tokenizer) {
+    const std::string texts[] = {
+        kCorpus,
+        "",
+        "a",
+        "🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉",
+        "supercalifragilisticexpialidocious_antidisestablishmentarianism_pneumonoultramicroscopic",
+        "invalid \xff\xfe bytes \xe4\xbd and a lone continuation \x80 end",
+        "\n\n\n   \t\t  \r\n",
+    };
+    for (const std::string& text : texts) {
+        check(decode(tokenizer, tokenizer.encode(text)) == text, "decode(encode(text)) round trips");
+    }
+
+    const std::string prompt = std::string("<|begin_of_text|><|start_header_id|>user<|end_header_id|>\n\n") +
+                               "What's 2+2?<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n\n";
+    const std::vector<int32_t> tokens = tokenizer.encode(prompt);
+    check(decode(tokenizer, tokens) == prompt, "special tokens round trip");
+    check(!tokens.empty() && tokens[0] == tokenizer.token_id("<|begin_of_text|>") && tokens[0] >= 0,
+          "special token is one id");
+    check(std::count(tokens.begin(), tokens.end(), tokenizer.token_id("<|eot_id|>")) == 1, "eot_id encoded once");
+    check(tokenizer.encode("<|eot_id").size() > 1, "partial special token is plain text");
+}
+
+void check_reference(BpeTokenizer& tokenizer, const TrainedVocab& vocab) {
+    std::vector<std::string> words;
+    std::vector<std::string_view> pieces;
+    BpeTokenizer::split(kCorpus, &pieces);
+    for (const std::string_view piece : pieces) words.emplace_back(piece);
+    words.push_back(" unbelievably");
+    words.push_back(" antidisestablishmentarianismantidisestablishmentarianism");
+    std::string long_word = " ";
+    for (int i = 0; i < 40; i++) long_word += "thetheanswerhelp";
+    words.push_back(long_word);
+    words.push_back("🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉🎉");
+
+    tokenizer.set_cache_capacity(0);
+    bool same = true;
+    for (const std::string& word : words) {
+        std::vector<std::string_view> parts;
+        BpeTokenizer::split(word, &parts);
+        if (parts.size() != 1) continue;
+        same = same && tokenizer.encode(word) == reference_encode(tokenizer, vocab, word);
+    }
+    check(same, "merge table matches a naive min-rank BPE");
+    tokenizer.set_cache_capacity(BpeTokenizer::kDefaultCacheWords);
+}
+
+void check_cache(BpeTokenizer& tokenizer, const std::string& text) {
+    tokenizer.set_cache_capacity(0);
+    const std::vector<int32_t> uncached = tokenizer.encode(text);
+    tokenizer.set_cache_capacity(BpeTokenizer::kDefaultCacheWords);
+    const uint64_t merged = tokenizer.stats().merged;
+    const std::vector<int32_t> first = tokenizer.encode(text);
+    const uint64_t hits = tokenizer.stats().cache_hits;
+    const std::vector<int32_t> second = tokenizer.encode(text);
+    check(first == uncached && second == uncached, "cached encode matches uncached");
+    check(tokenizer.stats().merged > merged && tokenizer.stats().cache_hits > hits, "word cache is hit");
+
+    tokenizer.set_cache_capacity(4); // cleared whenever it fills
+    check(tokenizer.encode(text) == uncached, "tiny word cache matches uncached");
+    tokenizer.set_cache_capacity(BpeTokenizer::kDefaultCacheWords);
+}
+
+void check_detokenizer(BpeTokenizer& tokenizer) {
+    // Token by token, every emitted chunk is complete UTF-8
+    const std::vector<int32_t> tokens = tokenizer.encode(kCorpus);
+    IncrementalDetokenizer decoder;
+    std::string text;
+    bool complete = true;
+    for (const int32_t token : tokens) {
+        std::string chunk;
+        decoder.push(tokenizer.token_bytes(token), &chunk);
+        complete = complete && valid_utf8(chunk);
+        text += chunk;
+    }
+    decoder.finish(&text);
+    check(complete, "detokenizer emits only complete characters");
+    check(text == kCorpus, "detokenized stream equals the text");
+
+    // Byte at a time through a four-byte emoji
+    std::string out;
+    IncrementalDetokenizer bytes;
+    bytes.push("\xF0\x9F", &out);
+    bytes.push("\x91", &out);
+    check(out.empty() && bytes.has_pending(), "partial emoji is held back");
+    bytes.push("\x8B!", &out);
+    check(out == "\xF0\x9F\x91\x8B!", "emoji emitted once complete");
+
+    // Malformed input becomes U+FFFD, one per broken sequence
+    const std::string replacement = "\xEF\xBF\xBD";
+    const struct {
+        std::vector<std::string> pieces;
+        std::string expected;
+    } invalid[] = {
+        {{"\xE4\xBD", "A"}, replacement + "A"},
+        {{"\xC0\xAF"}, replacement + replacement},
+        {{"\x80x"}, replacement + "x"},
+        {{"\xED\xA0\x80"}, replacement + replacement + replacement},
+        {{"\xF4\x90\x80\x80"}, replacement + replacement + replacement + replacement},
+        {{"ok\xE2\x82"}, "ok" + replacement},
+    };
+    for (const auto& test : invalid) {
+        std::string got;
+        IncrementalDetokenizer decoder_invalid;
+        for (const std::string& piece : test.pieces) decoder_invalid.push(piece, &got);
+        decoder_invalid.finish(&got);
+        check(got == test.expected, "invalid bytes become U+FFFD");
+    }
+}
+
+template <typename Fn>
+double seconds(int iterations, Fn&& fn) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) fn();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    check_split();
+
+    std::unique_ptr<BpeTokenizer> tokenizer;
+    TrainedVocab vocab;
+    if (argc > 1) {
+        tokenizer = BpeTokenizer::load(argv[1]);
+        if (!tokenizer) {
+            std::fprintf(stderr, "cannot load %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        vocab = train(kCorpus, 400);
+        const std::string json = to_json(vocab);
+        tokenizer = BpeTokenizer::parse(json.data(), json.size());
+        check(tokenizer != nullptr, "synthetic tokenizer.json parses");
+        if (!tokenizer) return 1;
+        check(tokenizer->vocab_size() ==
+                  static_cast<int32_t>(vocab.tokens.size() + sizeof(kSpecialTokens) / sizeof(kSpecialTokens[0])),
+              "vocab size includes added tokens");
+        const char truncated[] = "{\"model\": {\"vocab\": {\"a\": 0}";
+        check(BpeTokenizer::parse(truncated, sizeof(truncated) - 1) == nullptr, "truncated json rejected");
+        check_reference(*tokenizer, vocab);
+    }
+
+    check_round_trip(*tokenizer);
+    check_cache(*tokenizer, kCorpus);
+    check_detokenizer(*tokenizer);
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d tokenizer check(s) failed\n", g_failures);
+        return 1;
+    }
+
+    // ~1 MB of chat text
+    std::string text;
+    while (text.size() < (1u << 20)) text += kCorpus;
+    const double megabytes = text.size() / double(1 << 20);
+    std::vector<int32_t> tokens;
+    const int iterations = 5;
+
+    tokenizer->set_cache_capacity(0);
+    const double uncached = seconds(iterations, [&] {
+        tokens.clear();
+        tokenizer->encode(text, &tokens);
+    });
+    tokenizer->set_cache_capacity(BpeTokenizer::kDefaultCacheWords);
+    const double cold = seconds(iterations, [&] {
+        tokenizer->set_cache_capacity(BpeTokenizer::kDefaultCacheWords);
+        tokens.clear();
+        tokenizer->encode(text, &tokens);
+    });
+    const double warm = seconds(iterations, [&] {
+        tokens.clear();
+        tokenizer->encode(text, &tokens);
+    });
+
+    std::string out;
+    out.reserve(text.size() * 2);
+    const double detokenize = seconds(iterations, [&] {
+        out.clear();
+        IncrementalDetokenizer decoder;
+        for (const int32_t token : tokens) decoder.push(tokenizer->token_bytes(token), &out);
+        decoder.finish(&out);
+    });
+
+    const BpeTokenizer::Stats& stats = tokenizer->stats();
+    std::printf("tokenizer: %d tokens, %.2f MB of text -> %zu tokens (%.2f bytes/token)\n", tokenizer->vocab_size(),
+                megabytes, tokens.size(), text.size() / double(tokens.size()));
+    std::printf("  encode, no word cache:   %7.1f MB/s  %6.2f M tokens/s\n", iterations * megabytes / uncached,
+                iterations * tokens.size() / uncached / 1e6);
+    std::printf("  encode, cold word cache: %7.1f MB/s  %6.2f M tokens/s\n", iterations * megabytes / cold,
+                iterations * tokens.size() / cold / 1e6);
+    std::printf("  encode, warm word cache: %7.1f MB/s  %6.2f M tokens/s\n", iterations * megabytes / warm,
+                iterations * tokens.size() / warm / 1e6);
+    std::printf("  pieces: %.1f%% whole-word, %.1f%% word cache, %.1f%% merged\n",
+                100.0 * stats.whole_words / stats.pieces, 100.0 * stats.cache_hits / stats.pieces,
+                100.0 * stats.merged / stats.pieces);
+    std::printf("  detokenize:              %7.1f ns/token\n", detokenize * 1e9 / (iterations * tokens.size()));
+    return 0;
+}
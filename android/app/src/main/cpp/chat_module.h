@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class KvSnapshot;
+class KvSnapshotWriter;
+
+// Identifies one KV-cache sequence inside a chat module.
+using SequenceId = int64_t;
+
+// Writes a sequence's KV as it was when captured, as snapshot sections
+using KvSnapshotCapture = std::function<bool(KvSnapshotWriter* writer)>;
+
+// Token-level view of a loaded MLC-LLM chat module.
+//
+// The InferenceEngine worker drives generation through this interface,
+// interleaving sequences at token granularity: each iteration batches one
+// decode step of every generating sequence (batch_decode) and then prefills
+// at most one chunk of a pending prompt, so it can stream, cancel and admit
+// requests between any two steps. Implementations are not thread-safe;
+// callers serialize access per module (the engine's worker once it serves).
+class ChatModule {
+public:
+    virtual ~ChatModule() = default;
+
+    virtual int32_t vocab_size() const = 0;
+
+    // Tokenizes text exactly as the model's tokenizer would for a prompt.
+    virtual std::vector<int32_t> tokenize(const std::string& text) = 0;
+
+    // Returns the raw text of a single token (may be a partial UTF-8 sequence).
+    virtual std::string token_to_piece(int32_t token) = 0;
+
+    virtual bool is_stop_token(int32_t token) const = 0;
+
+    // Creates an empty sequence in the KV cache.
+    virtual bool add_sequence(SequenceId seq) = 0;
+
+    // Creates `child` sharing the first `length` tokens of `parent`'s KV
+    // entries, so they do not have to be prefilled again.
+    virtual bool fork_sequence(SequenceId parent, SequenceId child, size_t length) = 0;
+
+    virtual void remove_sequence(SequenceId seq) = 0;
+
+    // Appends tokens to the sequence's KV cache and writes the logits of the
+    // last position into `logits` (vocab_size() floats).
+    virtual bool prefill(SequenceId seq, const int32_t* tokens, size_t count, float* logits) = 0;
+
+    // Appends one token to the sequence's KV cache and writes the next-token logits.
+    virtual bool decode(SequenceId seq, int32_t token, float* logits) = 0;
+
+    // One decode step for several sequences at once: tokens[i] is appended to
+    // seqs[i] and its next-token logits are written to logits[i]. Backends
+    // with a batched kernel override this; the fallback decodes one by one.
+    virtual bool batch_decode(const SequenceId* seqs, const int32_t* tokens, size_t count, float* const* logits) {
+        for (size_t i = 0; i < count; i++) {
+            if (!decode(seqs[i], tokens[i], logits[i])) return false;
+        }
+        return true;
+    }
+
+    // Speculative decoding. verify() appends `count` tokens like prefill()
+    // but writes the logits after every one of them (`count` rows of
+    // vocab_size() floats); pop_tokens() then drops the KV entries of the
+    // last `count` tokens that were rejected. Both are optional.
+    virtual bool supports_verify() const { return false; }
+    virtual bool verify(SequenceId, const int32_t*, size_t, float*) { return false; }
+    virtual bool pop_tokens(SequenceId, size_t) { return false; }
+
+    // Attention-sink context management. evict_tokens() drops KV positions
+    // [begin, begin + count) in place and moves the later ones down,
+    // re-rotating their keys so RoPE positions stay contiguous; appended
+    // tokens then continue at the shortened length. `begin` and `count`
+    // must be multiples of eviction_granularity(), which is 0 for modules
+    // that cannot evict.
+    virtual size_t eviction_granularity() const { return 0; }
+    virtual bool evict_tokens(SequenceId, size_t, size_t) { return false; }
+
+    // Session persistence. capture_sequence() pins the sequence's current
+    // KV and returns a function that writes it later from any thread while
+    // the module is alive, so snapshots are written off the caller's thread
+    // (nullptr on failure). restore_sequence()
+    // recreates `seq` holding the first `length` tokens of a snapshot
+    // written with the same snapshot_format(). An empty format means the
+    // module cannot persist KV.
+    virtual std::string snapshot_format() const { return ""; }
+    virtual KvSnapshotCapture capture_sequence(SequenceId) { return nullptr; }
+    virtual bool restore_sequence(SequenceId, const std::shared_ptr<const KvSnapshot>&, size_t) { return false; }
+};
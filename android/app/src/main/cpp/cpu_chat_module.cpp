@@ -0,0 +1,308 @@
+#include "cpu_chat_module.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "fp16.h"
+#include "memory_accounting.h"
+#include "mlc_log.h"
+#include "thread_pool.h"
+
+namespace {
+
+// Binds one q4f16_0 matrix, "<prefix>.q_weight" and "<prefix>.q_scale"
+bool bind_q4(const TensorLookup& lookup, const std::string& prefix, int32_t in_features, int32_t out_features,
+             Q4Matrix* matrix, int64_t* bytes) {
+    matrix->in_features = in_features;
+    matrix->out_features = out_features;
+    if (in_features % kQ4GroupSize != 0) {
+        LOGE("❌ %s: %d inputs is not a multiple of the q4 group size", prefix.c_str(), in_features);
+        return false;
+    }
+    const size_t data_bytes = matrix->data_words() * sizeof(uint32_t);
+    const size_t scale_bytes = matrix->scale_count() * sizeof(uint16_t);
+    matrix->data = static_cast<const uint32_t*>(lookup(prefix + ".q_weight", data_bytes));
+    matrix->scales = static_cast<const uint16_t*>(lookup(prefix + ".q_scale", scale_bytes));
+    if (matrix->data == nullptr || matrix->scales == nullptr) {
+        LOGE("❌ Missing or mis-sized q4f16_0 parameter %s (%d x %d)", prefix.c_str(), out_features, in_features);
+        return false;
+    }
+    *bytes += static_cast<int64_t>(data_bytes + scale_bytes);
+    return true;
+}
+
+// Norm weights are fp16 in the shards and small, so they are widened once
+bool bind_norm(const TensorLookup& lookup, const std::string& name, int32_t size, std::vector<float>* weight,
+               int64_t* bytes) {
+    const auto* half = static_cast<const uint16_t*>(lookup(name, static_cast<size_t>(size) * sizeof(uint16_t)));
+    if (half == nullptr) {
+        LOGE("❌ Missing or mis-sized parameter %s", name.c_str());
+        return false;
+    }
+    weight->resize(static_cast<size_t>(size));
+    halves_to_floats(half, weight->data(), weight->size());
+    *bytes += static_cast<int64_t>(size) * static_cast<int64_t>(sizeof(uint16_t));
+    return true;
+}
+
+template <typename T>
+void grow(PoolBuffer<T>& buffer, size_t count) {
+    if (buffer.size() < count) buffer.resize(count);
+}
+
+} // namespace
+
+std::unique_ptr<CpuChatModule> CpuChatModule::create(const CpuLlamaConfig& config, const TensorLookup& lookup,
+                                                      std::shared_ptr<const void> weights, int64_t weight_bytes,
+                                                      std::unique_ptr<BpeTokenizer> tokenizer,
+                                                      std::vector<int32_t> stop_tokens, const KvCacheLayout& kv_layout,
+                                                      size_t kv_byte_budget) {
+    const int32_t hidden = config.hidden_size;
+    const int32_t heads = config.num_attention_heads;
+    const int32_t kv_heads = config.num_key_value_heads;
+    const int32_t head_dim = config.head_dim;
+    if (hidden <= 0 || heads <= 0 || kv_heads <= 0 || heads % kv_heads != 0 || head_dim <= 0 || head_dim % 2 != 0 ||
+        config.num_hidden_layers <= 0 || config.vocab_size <= 0 || config.intermediate_size <= 0) {
+        LOGE("❌ Invalid Llama config for the CPU backend");
+        return nullptr;
+    }
+
+    std::unique_ptr<CpuChatModule> module(new CpuChatModule());
+    module->config_ = config;
+    int64_t bound = 0;
+    const std::string model = "model.";
+    bool ok = bind_q4(lookup, model + "embed_tokens", hidden, config.vocab_size, &module->embedding_, &bound);
+    ok = ok && bind_norm(lookup, model + "norm.weight", hidden, &module->final_norm_, &bound);
+    module->lm_head_tied_ = config.tie_word_embeddings;
+    if (config.tie_word_embeddings) {
+        module->lm_head_ = module->embedding_;
+    } else {
+        ok = ok && bind_q4(lookup, "lm_head", hidden, config.vocab_size, &module->lm_head_, &bound);
+    }
+
+    module->layers_.resize(static_cast<size_t>(config.num_hidden_layers));
+    for (int32_t i = 0; ok && i < config.num_hidden_layers; i++) {
+        Layer& layer = module->layers_[static_cast<size_t>(i)];
+        const std::string prefix = model + "layers." + std::to_string(i) + ".";
+        ok = bind_q4(lookup, prefix + "self_attn.qkv_proj", hidden, (heads + 2 * kv_heads) * head_dim, &layer.qkv,
+                     &bound) &&
+             bind_q4(lookup, prefix + "self_attn.o_proj", heads * head_dim, hidden, &layer.out, &bound) &&
+             bind_q4(lookup, prefix + "mlp.gate_up_proj", hidden, 2 * config.intermediate_size, &layer.gate_up,
+                     &bound) &&
+             bind_q4(lookup, prefix + "mlp.down_proj", config.intermediate_size, hidden, &layer.down, &bound) &&
+             bind_norm(lookup, prefix + "input_layernorm.weight", hidden, &layer.input_norm, &bound) &&
+             bind_norm(lookup, prefix + "post_attention_layernorm.weight", hidden, &layer.post_attention_norm, &bound);
+    }
+    if (!ok) return nullptr;
+
+    KvCacheLayout layout = kv_layout;
+    layout.layers = config.num_hidden_layers;
+    layout.kv_heads = kv_heads;
+    layout.head_dim = head_dim;
+    if (!layout.valid()) {
+        LOGE("❌ Invalid KV cache layout for the CPU backend");
+        return nullptr;
+    }
+    module->kv_.reset(new PagedKvCache(layout, kv_byte_budget));
+    module->inv_freq_.resize(static_cast<size_t>(head_dim / 2));
+    rope_inv_freq(head_dim, config.rope_theta, config.rope_scaling, module->inv_freq_.data());
+    module->tokenizer_ = std::move(tokenizer);
+    module->stop_tokens_ = std::move(stop_tokens);
+    module->weights_ = std::move(weights);
+    module->weight_bytes_ = weight_bytes > 0 ? weight_bytes : bound;
+    MemoryAccounting::instance().add(MemoryCategory::kWeights, module->weight_bytes_);
+
+    LOGI("🧮 CPU backend (%s): %d layers, %d hidden, %lld MB of q4f16_0 weights", cpu_kernels_isa(),
+         config.num_hidden_layers, hidden, (long long)(bound / (1024 * 1024)));
+    return module;
+}
+
+CpuChatModule::~CpuChatModule() {
+    MemoryAccounting::instance().sub(MemoryCategory::kWeights, weight_bytes_);
+}
+
+std::vector<int32_t> CpuChatModule::tokenize(const std::string& text) {
+    if (!tokenizer_) {
+        LOGE("❌ CPU chat module has no tokenizer");
+        return {};
+    }
+    return tokenizer_->encode(text);
+}
+
+std::string CpuChatModule::token_to_piece(int32_t token) {
+    return tokenizer_ ? tokenizer_->token_bytes(token) : std::string();
+}
+
+bool CpuChatModule::is_stop_token(int32_t token) const {
+    return std::find(stop_tokens_.begin(), stop_tokens_.end(), token) != stop_tokens_.end();
+}
+
+bool CpuChatModule::prefill(SequenceId seq, const int32_t* tokens, size_t count, float* logits) {
+    return forward(seq, tokens, count, logits, false);
+}
+
+bool CpuChatModule::decode(SequenceId seq, int32_t token, float* logits) {
+    return forward(seq, &token, 1, logits, false);
+}
+
+bool CpuChatModule::verify(SequenceId seq, const int32_t* tokens, size_t count, float* logits) {
+    return forward(seq, tokens, count, logits, true);
+}
+
+bool CpuChatModule::forward(SequenceId seq, const int32_t* tokens, size_t count, float* logits, bool all_logits) {
+    if (count == 0) return false;
+    for (size_t i = 0; i < count; i++) {
+        if (tokens[i] < 0 || tokens[i] >= config_.vocab_size) {
+            LOGE("❌ Token %d out of range for the CPU backend", tokens[i]);
+            return false;
+        }
+    }
+    // Activations scale with the chunk, not the prompt
+    const size_t vocab = static_cast<size_t>(config_.vocab_size);
+    for (size_t done = 0; done < count;) {
+        const size_t chunk = std::min(kChunkTokens, count - done);
+        const bool last = done + chunk == count;
+        float* chunk_logits = all_logits ? logits + done * vocab : (last ? logits : nullptr);
+        if (!forward_chunk(seq, tokens + done, chunk, chunk_logits, all_logits)) return false;
+        done += chunk;
+    }
+    return true;
+}
+
+// Keys were rotated for their old positions; rotating them by -count moves
+// them to the new ones (RoPE rotations compose additively).
+bool CpuChatModule::evict_tokens(SequenceId seq, size_t begin, size_t count) {
+    std::vector<float> cos_sin(static_cast<size_t>(config_.head_dim));
+    rope_angles(inv_freq_.data(), config_.head_dim, -static_cast<int64_t>(count), cos_sin.data());
+    const int32_t head_dim = config_.head_dim;
+    return kv_->evict(seq, begin, count, [&](float* key) { apply_rope(key, 1, head_dim, cos_sin.data()); });
+}
+
+void CpuChatModule::reserve_scratch(size_t count, size_t context) {
+    const size_t hidden = static_cast<size_t>(config_.hidden_size);
+    const size_t head_dim = static_cast<size_t>(config_.head_dim);
+    const size_t q_width = static_cast<size_t>(config_.num_attention_heads) * head_dim;
+    const size_t kv_width = static_cast<size_t>(config_.num_key_value_heads) * head_dim;
+    const size_t intermediate = static_cast<size_t>(config_.intermediate_size);
+    grow(hidden_, count * hidden);
+    grow(normed_, count * hidden);
+    grow(qkv_, count * (q_width + 2 * kv_width));
+    grow(attended_, count * q_width);
+    grow(projected_, count * hidden);
+    grow(gate_up_, count * 2 * intermediate);
+    grow(activated_, count * intermediate);
+    grow(rope_, count * head_dim);
+    // Context grows a token at a time while decoding: round up so the
+    // buffers are not reallocated every step
+    const size_t rounded = (context + 255) / 256 * 256;
+    grow(keys_, rounded * kv_width);
+    grow(values_, rounded * kv_width);
+}
+
+bool CpuChatModule::forward_chunk(SequenceId seq, const int32_t* tokens, size_t count, float* logits,
+                                  bool all_logits) {
+    const size_t start = kv_->length(seq);
+    if (!kv_->extend(seq, count)) {
+        LOGE("❌ CPU backend could not grow the KV cache of sequence %lld", (long long)seq);
+        return false;
+    }
+    reserve_scratch(count, start + count);
+
+    const int32_t hidden = config_.hidden_size;
+    const int32_t head_dim = config_.head_dim;
+    const int32_t heads = config_.num_attention_heads;
+    const int32_t kv_heads = config_.num_key_value_heads;
+    const size_t qkv_width = static_cast<size_t>(heads + 2 * kv_heads) * head_dim;
+    const size_t intermediate = static_cast<size_t>(config_.intermediate_size);
+    const float eps = config_.rms_norm_eps;
+    float* x = hidden_.data();
+    float* normed = normed_.data();
+
+    for (size_t t = 0; t < count; t++) {
+        q4_dequantize_row_nk(embedding_, tokens[t], x + t * hidden);
+        rope_angles(inv_freq_.data(), head_dim, static_cast<int64_t>(start + t), rope_.data() + t * head_dim);
+    }
+
+    for (size_t l = 0; l < layers_.size(); l++) {
+        const Layer& layer = layers_[l];
+
+        for (size_t t = 0; t < count; t++) {
+            rms_norm(x + t * hidden, layer.input_norm.data(), static_cast<size_t>(hidden), eps, normed + t * hidden);
+        }
+        q4_gemm_kn(layer.qkv, normed, count, qkv_.data());
+        for (size_t t = 0; t < count; t++) {
+            float* q = qkv_.data() + t * qkv_width;
+            float* k = q + static_cast<size_t>(heads) * head_dim;
+            const float* v = k + static_cast<size_t>(kv_heads) * head_dim;
+            apply_rope(q, heads, head_dim, rope_.data() + t * head_dim);
+            apply_rope(k, kv_heads, head_dim, rope_.data() + t * head_dim);
+            kv_->store(seq, static_cast<int32_t>(l), start + t, k, v);
+        }
+        attention(seq, static_cast<int32_t>(l), start, count);
+        q4_gemm_kn(layer.out, attended_.data(), count, projected_.data());
+        axpy(1.0f, projected_.data(), x, count * hidden);
+
+        for (size_t t = 0; t < count; t++) {
+            rms_norm(x + t * hidden, layer.post_attention_norm.data(), static_cast<size_t>(hidden), eps,
+                     normed + t * hidden);
+        }
+        q4_gemm_kn(layer.gate_up, normed, count, gate_up_.data());
+        for (size_t t = 0; t < count; t++) {
+            const float* gate = gate_up_.data() + t * 2 * intermediate;
+            silu_mul(gate, gate + intermediate, activated_.data() + t * intermediate, intermediate);
+        }
+        q4_gemm_kn(layer.down, activated_.data(), count, projected_.data());
+        axpy(1.0f, projected_.data(), x, count * hidden);
+    }
+
+    if (logits == nullptr) return true;
+    const size_t vocab = static_cast<size_t>(config_.vocab_size);
+    for (size_t t = all_logits ? 0 : count - 1; t < count; t++) {
+        rms_norm(x + t * hidden, final_norm_.data(), static_cast<size_t>(hidden), eps, normed);
+        float* row = all_logits ? logits + t * vocab : logits;
+        if (lm_head_tied_) q4_gemv_nk(lm_head_, normed, row);
+        else q4_gemv_kn(lm_head_, normed, row);
+    }
+    return true;
+}
+
+// Causal grouped-query attention of the chunk's queries over every cached
+// position up to their own
+void CpuChatModule::attention(SequenceId seq, int32_t layer, size_t start, size_t count) {
+    const size_t head_dim = static_cast<size_t>(config_.head_dim);
+    const size_t heads = static_cast<size_t>(config_.num_attention_heads);
+    const size_t kv_heads = static_cast<size_t>(config_.num_key_value_heads);
+    const size_t group = heads / kv_heads;
+    const size_t context = start + count;
+    const size_t qkv_width = (heads + 2 * kv_heads) * head_dim;
+    const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+
+    kv_->load(seq, layer, 0, context, keys_.data(), values_.data());
+    // One (query, head) pair per item; scores are per thread
+    ThreadPool::shared()->parallel_for(count * heads, kAttentionGrain, [&](size_t first, size_t last) {
+        static thread_local std::vector<float> scores;
+        scores.resize(context);
+        for (size_t item = first; item < last; item++) {
+            const size_t t = item / heads;
+            const size_t h = item % heads;
+            const size_t visible = start + t + 1;
+            const float* q = qkv_.data() + t * qkv_width + h * head_dim;
+            const float* keys = keys_.data() + (h / group) * context * head_dim;
+            const float* values = values_.data() + (h / group) * context * head_dim;
+            float max_score = -INFINITY;
+            for (size_t j = 0; j < visible; j++) {
+                scores[j] = dot(q, keys + j * head_dim, head_dim) * scale;
+                max_score = std::max(max_score, scores[j]);
+            }
+            float total = 0.0f;
+            for (size_t j = 0; j < visible; j++) {
+                scores[j] = std::exp(scores[j] - max_score);
+                total += scores[j];
+            }
+            float* out = attended_.data() + (t * heads + h) * head_dim;
+            std::memset(out, 0, head_dim * sizeof(float));
+            for (size_t j = 0; j < visible; j++) axpy(scores[j] / total, values + j * head_dim, out, head_dim);
+        }
+    });
+}
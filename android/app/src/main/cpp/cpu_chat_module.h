@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "chat_module.h"
+#include "cpu_kernels.h"
+#include "kv_cache.h"
+#include "memory_pool.h"
+#include "tokenizer.h"
+
+// Llama hyper-parameters (mlc-chat-config.json "model_config"); defaults
+// are Llama-3.2-1B-Instruct.
+struct CpuLlamaConfig {
+    int32_t hidden_size = 2048;
+    int32_t intermediate_size = 8192;
+    int32_t num_attention_heads = 32;
+    int32_t num_key_value_heads = 8;
+    int32_t head_dim = 64;
+    int32_t num_hidden_layers = 16;
+    int32_t vocab_size = 128256;
+    float rms_norm_eps = 1e-5f;
+    float rope_theta = 500000.0f;
+    RopeScaling rope_scaling = {32.0f, 1.0f, 4.0f, 8192};
+    bool tie_word_embeddings = true;
+};
+
+// Resolves an MLC parameter name ("model.layers.0.mlp.down_proj.q_weight")
+// to its raw bytes, or nullptr if it is missing or not `bytes` long.
+using TensorLookup = std::function<const void*(const std::string& name, size_t bytes)>;
+
+// ChatModule that runs a q4f16_0 Llama on the CPU kernels, for devices
+// without a usable GPU. Weights are used in place (typically straight from
+// the mmapped shards); KV lives in a PagedKvCache, so forking, rollback and
+// session snapshots work as with the GPU module.
+//
+// Prefill runs in chunks of kChunkTokens through the tiled GEMM, decode
+// through the fused dequant+GEMV; the kernels and attention heads run on
+// the shared thread pool's performance workers. Without a tokenizer only
+// the token-level calls work (benchmarks feed token ids directly).
+class CpuChatModule : public ChatModule {
+public:
+    static constexpr size_t kChunkTokens = 64;
+    static constexpr size_t kAttentionGrain = 4; // (query, head) pairs per task
+
+    // nullptr (logged) if a parameter is missing or has an unexpected size.
+    // `weights` keeps the memory behind `lookup` alive; `weight_bytes` is
+    // charged to MemoryCategory::kWeights.
+    static std::unique_ptr<CpuChatModule> create(const CpuLlamaConfig& config, const TensorLookup& lookup,
+                                                 std::shared_ptr<const void> weights, int64_t weight_bytes,
+                                                 std::unique_ptr<BpeTokenizer> tokenizer,
+                                                 std::vector<int32_t> stop_tokens, const KvCacheLayout& kv_layout,
+                                                 size_t kv_byte_budget);
+    ~CpuChatModule() override;
+
+    int32_t vocab_size() const override { return config_.vocab_size; }
+    std::vector<int32_t> tokenize(const std::string& text) override;
+    std::string token_to_piece(int32_t token) override;
+    bool is_stop_token(int32_t token) const override;
+
+    bool add_sequence(SequenceId seq) override { return kv_->add_sequence(seq); }
+    bool fork_sequence(SequenceId parent, SequenceId child, size_t length) override {
+        return kv_->fork_sequence(parent, child, length);
+    }
+    void remove_sequence(SequenceId seq) override { kv_->remove_sequence(seq); }
+
+    bool prefill(SequenceId seq, const int32_t* tokens, size_t count, float* logits) override;
+    bool decode(SequenceId seq, int32_t token, float* logits) override;
+
+    bool supports_verify() const override { return true; }
+    bool verify(SequenceId seq, const int32_t* tokens, size_t count, float* logits) override;
+    bool pop_tokens(SequenceId seq, size_t count) override { return kv_->pop_tokens(seq, count); }
+
+    size_t eviction_granularity() const override { return static_cast<size_t>(kv_->layout().block_tokens); }
+    bool evict_tokens(SequenceId seq, size_t begin, size_t count) override;
+
+    std::string snapshot_format() const override { return "cpu/" + kv_->snapshot_format(); }
+    KvSnapshotCapture capture_sequence(SequenceId seq) override { return kv_->capture_sequence(seq); }
+    bool restore_sequence(SequenceId seq, const std::shared_ptr<const KvSnapshot>& snapshot, size_t length) override {
+        return kv_->restore_sequence(seq, snapshot, length);
+    }
+
+    const PagedKvCache& kv_cache() const { return *kv_; }
+
+private:
+    struct Layer {
+        Q4Matrix qkv;     // [hidden] -> [(heads + 2 * kv_heads) * head_dim]
+        Q4Matrix out;     // [heads * head_dim] -> [hidden]
+        Q4Matrix gate_up; // [hidden] -> [2 * intermediate], gate first
+        Q4Matrix down;    // [intermediate] -> [hidden]
+        std::vector<float> input_norm;
+        std::vector<float> post_attention_norm;
+    };
+
+    CpuChatModule() = default;
+
+    // Appends `count` tokens and writes logits for the last one, or for
+    // every one when `all_logits`
+    bool forward(SequenceId seq, const int32_t* tokens, size_t count, float* logits, bool all_logits);
+    bool forward_chunk(SequenceId seq, const int32_t* tokens, size_t count, float* logits, bool all_logits);
+    void attention(SequenceId seq, int32_t layer, size_t start, size_t count);
+    void reserve_scratch(size_t count, size_t context);
+
+    CpuLlamaConfig config_;
+    std::vector<Layer> layers_;
+    Q4Matrix embedding_; // NK
+    Q4Matrix lm_head_;   // NK when tied to the embedding, KN otherwise
+    bool lm_head_tied_ = true;
+    std::vector<float> final_norm_;
+    std::vector<float> inv_freq_;
+    std::unique_ptr<PagedKvCache> kv_;
+    std::unique_ptr<BpeTokenizer> tokenizer_;
+    std::vector<int32_t> stop_tokens_;
+    std::shared_ptr<const void> weights_;
+    int64_t weight_bytes_ = 0;
+
+    // Activations of the chunk in flight, grown on demand
+    PoolBuffer<float> hidden_;    // [count][hidden] residual stream
+    PoolBuffer<float> normed_;    // [count][hidden]
+    PoolBuffer<float> qkv_;       // [count][(heads + 2 * kv_heads) * head_dim]
+    PoolBuffer<float> attended_;  // [count][heads * head_dim]
+    PoolBuffer<float> projected_; // [count][hidden]
+    PoolBuffer<float> gate_up_;   // [count][2 * intermediate]
+    PoolBuffer<float> activated_; // [count][intermediate]
+    PoolBuffer<float> keys_;      // [kv_heads][context][head_dim]
+    PoolBuffer<float> values_;
+    PoolBuffer<float> rope_;      // [count][head_dim] cosines and sines
+};
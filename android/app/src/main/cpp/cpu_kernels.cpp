@@ -0,0 +1,480 @@
+#include "cpu_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "fp16.h"
+#include "thread_pool.h"
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define MLC_CPU_NEON 1
+#include <arm_neon.h>
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+#define MLC_CPU_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Prefill tiles: kTileK inputs (whole groups) by kTileN outputs of W
+constexpr int32_t kTileK = 128;
+constexpr int32_t kTileN = 64;
+
+// Decode GEMV: outputs per panel (accumulated in y, which stays in L1)
+constexpr int32_t kPanelN = 512;
+
+// NK GEMV: rows per task at least
+constexpr size_t kRowGrain = 256;
+
+constexpr int32_t kWordsPerGroup = kQ4GroupSize / kQ4PerWord;
+
+#if MLC_CPU_AVX2
+
+using Vec = __m256;
+constexpr int kLanes = 8;
+inline Vec vzero() { return _mm256_setzero_ps(); }
+inline Vec vset(float value) { return _mm256_set1_ps(value); }
+inline Vec vload(const float* p) { return _mm256_loadu_ps(p); }
+inline void vstore(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+inline Vec vfma(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); } // a * b + c
+inline Vec vfms(Vec a, Vec b, Vec c) { return _mm256_fnmadd_ps(a, b, c); } // c - a * b
+inline Vec vmul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+inline Vec vsub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+inline float vsum(Vec v) {
+    __m128 low = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    low = _mm_add_ps(low, _mm_movehl_ps(low, low));
+    low = _mm_add_ss(low, _mm_movehdup_ps(low));
+    return _mm_cvtss_f32(low);
+}
+inline Vec vhalves(const uint16_t* p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+#elif MLC_CPU_NEON
+
+using Vec = float32x4_t;
+constexpr int kLanes = 4;
+inline Vec vzero() { return vdupq_n_f32(0.0f); }
+inline Vec vset(float value) { return vdupq_n_f32(value); }
+inline Vec vload(const float* p) { return vld1q_f32(p); }
+inline void vstore(float* p, Vec v) { vst1q_f32(p, v); }
+inline Vec vfma(Vec a, Vec b, Vec c) { return vfmaq_f32(c, a, b); }
+inline Vec vfms(Vec a, Vec b, Vec c) { return vfmsq_f32(c, a, b); }
+inline Vec vmul(Vec a, Vec b) { return vmulq_f32(a, b); }
+inline Vec vsub(Vec a, Vec b) { return vsubq_f32(a, b); }
+inline float vsum(Vec v) { return vaddvq_f32(v); }
+inline Vec vhalves(const uint16_t* p) { return vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(p))); }
+
+#endif
+
+// One fp16 scale; F16C converts in a single instruction where the
+// portable half_to_float would not
+inline float scale_value(uint16_t half) {
+#if MLC_CPU_AVX2
+    return _cvtsh_ss(half);
+#else
+    return half_to_float(half);
+#endif
+}
+
+inline float nibble(uint32_t word, int index) {
+    return static_cast<float>((word >> (4 * index)) & 0xFu);
+}
+
+// Sum of each group of x, for the zero-point correction
+const float* group_sums(const float* x, int32_t in_features) {
+    static thread_local std::vector<float> sums;
+    const int32_t groups = in_features / kQ4GroupSize;
+    sums.resize(static_cast<size_t>(groups));
+    for (int32_t g = 0; g < groups; g++) {
+        float sum = 0.0f;
+        for (int32_t k = 0; k < kQ4GroupSize; k++) sum += x[g * kQ4GroupSize + k];
+        sums[static_cast<size_t>(g)] = sum;
+    }
+    return sums.data();
+}
+
+template <bool kTransposed>
+void quantize(const float* weight, int32_t out_features, int32_t in_features, uint32_t* data, uint16_t* scales) {
+    const int32_t groups = in_features / kQ4GroupSize;
+    const int32_t words = in_features / kQ4PerWord;
+    std::fill(data, data + static_cast<size_t>(words) * out_features, 0u);
+    for (int32_t n = 0; n < out_features; n++) {
+        const float* row = weight + static_cast<size_t>(n) * in_features;
+        for (int32_t g = 0; g < groups; g++) {
+            float max_abs = 0.0f;
+            for (int32_t k = 0; k < kQ4GroupSize; k++) max_abs = std::max(max_abs, std::fabs(row[g * kQ4GroupSize + k]));
+            const uint16_t half = float_to_half(max_abs / kQ4ZeroPoint);
+            const float scale = half_to_float(half);
+            const size_t scale_index = kTransposed ? static_cast<size_t>(g) * out_features + n
+                                                   : static_cast<size_t>(n) * groups + g;
+            scales[scale_index] = half;
+            for (int32_t k = g * kQ4GroupSize; k < (g + 1) * kQ4GroupSize; k++) {
+                int32_t q = kQ4ZeroPoint;
+                if (scale > 0.0f) q += static_cast<int32_t>(std::lround(row[k] / scale));
+                q = std::min(std::max(q, 0), 2 * kQ4ZeroPoint);
+                const size_t word = kTransposed ? static_cast<size_t>(k / kQ4PerWord) * out_features + n
+                                                : static_cast<size_t>(n) * words + k / kQ4PerWord;
+                data[word] |= static_cast<uint32_t>(q) << (4 * (k % kQ4PerWord));
+            }
+        }
+    }
+}
+
+// Scalar KN GEMV over outputs [first, last)
+void gemv_kn_scalar(const Q4Matrix& w, const float* x, const float* sums, float* y, int32_t first, int32_t last) {
+    const size_t n_total = static_cast<size_t>(w.out_features);
+    const int32_t groups = w.in_features / kQ4GroupSize;
+    for (int32_t n = first; n < last; n++) {
+        float total = 0.0f;
+        for (int32_t g = 0; g < groups; g++) {
+            float acc = 0.0f;
+            for (int32_t r = 0; r < kWordsPerGroup; r++) {
+                const uint32_t word = w.data[static_cast<size_t>(g * kWordsPerGroup + r) * n_total + n];
+                const float* xr = x + g * kQ4GroupSize + r * kQ4PerWord;
+                for (int j = 0; j < kQ4PerWord; j++) acc += xr[j] * nibble(word, j);
+            }
+            total += scale_value(w.scales[static_cast<size_t>(g) * n_total + n]) * (acc - kQ4ZeroPoint * sums[g]);
+        }
+        y[n] = total;
+    }
+}
+
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+
+// One group of inputs for kVectors * kLanes consecutive outputs starting at
+// n0, added to y; nibbles are peeled off each word lowest first
+template <int kVectors>
+void gemv_kn_group(const Q4Matrix& w, const float* x, const float* sums, int32_t g, int32_t n0, float* y) {
+    const size_t n_total = static_cast<size_t>(w.out_features);
+    Vec acc[kVectors];
+    for (int v = 0; v < kVectors; v++) acc[v] = vzero();
+    for (int32_t r = 0; r < kWordsPerGroup; r++) {
+        const uint32_t* row = w.data + static_cast<size_t>(g * kWordsPerGroup + r) * n_total + n0;
+        const float* xr = x + g * kQ4GroupSize + r * kQ4PerWord;
+#if MLC_CPU_AVX2
+        const __m256i mask = _mm256_set1_epi32(0xF);
+        __m256i words[kVectors];
+        for (int v = 0; v < kVectors; v++) words[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + v * kLanes));
+        for (int j = 0; j < kQ4PerWord; j++) {
+            const Vec xj = vset(xr[j]);
+            for (int v = 0; v < kVectors; v++) {
+                acc[v] = vfma(_mm256_cvtepi32_ps(_mm256_and_si256(words[v], mask)), xj, acc[v]);
+                words[v] = _mm256_srli_epi32(words[v], 4);
+            }
+        }
+#else
+        const uint32x4_t mask = vdupq_n_u32(0xF);
+        uint32x4_t words[kVectors];
+        for (int v = 0; v < kVectors; v++) words[v] = vld1q_u32(row + v * kLanes);
+        for (int j = 0; j < kQ4PerWord; j++) {
+            for (int v = 0; v < kVectors; v++) {
+                acc[v] = vfmaq_n_f32(acc[v], vcvtq_f32_u32(vandq_u32(words[v], mask)), xr[j]);
+                words[v] = vshrq_n_u32(words[v], 4);
+            }
+        }
+#endif
+    }
+    const Vec correction = vset(kQ4ZeroPoint * sums[g]);
+    const uint16_t* scales = w.scales + static_cast<size_t>(g) * n_total + n0;
+    for (int v = 0; v < kVectors; v++) {
+        float* out = y + n0 + v * kLanes;
+        vstore(out, vfma(vhalves(scales + v * kLanes), vsub(acc[v], correction), vload(out)));
+    }
+}
+
+#endif
+
+// Adds x[:, k0:k0+depth] W[k0:k0+depth, n0:n0+width] to y, dequantizing the
+// tile once into `scratch` (kTileK x kTileN) for all rows
+void gemm_tile(const Q4Matrix& weight, const float* x, size_t rows, float* y, float* scratch, int32_t n0,
+               int32_t width, int32_t k0, int32_t depth) {
+    const int32_t k_total = weight.in_features;
+    const size_t n_total = static_cast<size_t>(weight.out_features);
+
+    float scales[kTileN];
+    for (int32_t k = 0; k < depth; k++) {
+        const int32_t input = k0 + k;
+        if (input % kQ4GroupSize == 0) {
+            halves_to_floats(weight.scales + static_cast<size_t>(input / kQ4GroupSize) * n_total + n0, scales,
+                             static_cast<size_t>(width));
+        }
+        const uint32_t* words = weight.data + static_cast<size_t>(input / kQ4PerWord) * n_total + n0;
+        const int shift = 4 * (input % kQ4PerWord);
+        float* out = scratch + static_cast<size_t>(k) * kTileN;
+        for (int32_t n = 0; n < width; n++) {
+            out[n] = (static_cast<float>((words[n] >> shift) & 0xFu) - kQ4ZeroPoint) * scales[n];
+        }
+    }
+
+    for (size_t m = 0; m < rows; m++) {
+        const float* xm = x + m * k_total + k0;
+        float* ym = y + m * n_total + n0;
+        int32_t n = 0;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+        constexpr int kVectors = kTileN / kLanes;
+        if (width == kTileN) {
+            Vec acc[kVectors];
+            for (int v = 0; v < kVectors; v++) acc[v] = vload(ym + v * kLanes);
+            for (int32_t k = 0; k < depth; k++) {
+                const Vec xk = vset(xm[k]);
+                const float* tile = scratch + static_cast<size_t>(k) * kTileN;
+                for (int v = 0; v < kVectors; v++) acc[v] = vfma(vload(tile + v * kLanes), xk, acc[v]);
+            }
+            for (int v = 0; v < kVectors; v++) vstore(ym + v * kLanes, acc[v]);
+            n = width;
+        }
+        for (; n + kLanes <= width; n += kLanes) {
+            Vec acc = vload(ym + n);
+            for (int32_t k = 0; k < depth; k++) acc = vfma(vload(scratch + static_cast<size_t>(k) * kTileN + n), vset(xm[k]), acc);
+            vstore(ym + n, acc);
+        }
+#endif
+        for (; n < width; n++) {
+            float acc = ym[n];
+            for (int32_t k = 0; k < depth; k++) acc += xm[k] * scratch[static_cast<size_t>(k) * kTileN + n];
+            ym[n] = acc;
+        }
+    }
+}
+
+} // namespace
+
+const char* cpu_kernels_isa() {
+#if MLC_CPU_AVX2
+    return "avx2";
+#elif MLC_CPU_NEON
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+void q4_quantize_kn(const float* weight, int32_t out_features, int32_t in_features, uint32_t* data,
+                    uint16_t* scales) {
+    quantize<true>(weight, out_features, in_features, data, scales);
+}
+
+void q4_quantize_nk(const float* weight, int32_t out_features, int32_t in_features, uint32_t* data,
+                    uint16_t* scales) {
+    quantize<false>(weight, out_features, in_features, data, scales);
+}
+
+void q4_gemv_kn(const Q4Matrix& weight, const float* x, float* y) {
+    const float* sums = group_sums(x, weight.in_features);
+    int32_t n = 0;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+    // Panels of kPanelN outputs, group by group: every weight row is read
+    // as one contiguous run per panel instead of a cache line per stride
+    // of out_features words. Panels are independent, one task each.
+    const int32_t groups = weight.in_features / kQ4GroupSize;
+    const int32_t vector_end = weight.out_features / kLanes * kLanes;
+    const size_t panels = static_cast<size_t>((vector_end + kPanelN - 1) / kPanelN);
+    ThreadPool::shared()->parallel_for(panels, 1, [&](size_t first, size_t last) {
+        const int32_t p_begin = static_cast<int32_t>(first) * kPanelN;
+        const int32_t p_end = std::min(static_cast<int32_t>(last) * kPanelN, vector_end);
+        std::fill(y + p_begin, y + p_end, 0.0f);
+        for (int32_t p0 = p_begin; p0 < p_end; p0 += kPanelN) {
+            const int32_t p1 = std::min(p0 + kPanelN, p_end);
+            for (int32_t g = 0; g < groups; g++) {
+                int32_t c = p0;
+                for (; c + 4 * kLanes <= p1; c += 4 * kLanes) gemv_kn_group<4>(weight, x, sums, g, c, y);
+                for (; c < p1; c += kLanes) gemv_kn_group<1>(weight, x, sums, g, c, y);
+            }
+        }
+    });
+    n = vector_end;
+#endif
+    gemv_kn_scalar(weight, x, sums, y, n, weight.out_features);
+}
+
+void q4_gemm_kn(const Q4Matrix& weight, const float* x, size_t rows, float* y) {
+    const int32_t k_total = weight.in_features;
+    const int32_t n_total = weight.out_features;
+    if (rows == 1) {
+        q4_gemv_kn(weight, x, y);
+        return;
+    }
+
+    // One task per column strip of kTileN outputs; each thread dequantizes
+    // into its own tile
+    const size_t strips = static_cast<size_t>((n_total + kTileN - 1) / kTileN);
+    ThreadPool::shared()->parallel_for(strips, 1, [&](size_t first, size_t last) {
+        static thread_local std::vector<float> tile;
+        tile.resize(static_cast<size_t>(kTileK) * kTileN);
+        float* scratch = tile.data();
+        for (size_t strip = first; strip < last; strip++) {
+            const int32_t n0 = static_cast<int32_t>(strip) * kTileN;
+            const int32_t width = std::min(kTileN, n_total - n0);
+            for (size_t m = 0; m < rows; m++) std::fill_n(y + m * n_total + n0, width, 0.0f);
+            for (int32_t k0 = 0; k0 < k_total; k0 += kTileK) {
+                const int32_t depth = std::min(kTileK, k_total - k0);
+                gemm_tile(weight, x, rows, y, scratch, n0, width, k0, depth);
+            }
+        }
+    });
+}
+
+void q4_gemv_nk(const Q4Matrix& weight, const float* x, float* y) {
+    const int32_t groups = weight.in_features / kQ4GroupSize;
+    const int32_t words = weight.in_features / kQ4PerWord;
+    const float* sums = group_sums(x, weight.in_features);
+
+    // Rows are independent (the LM head has one per vocabulary entry)
+    const size_t rows = static_cast<size_t>(weight.out_features);
+    ThreadPool::shared()->parallel_for(rows, kRowGrain, [&](size_t first, size_t last) {
+        for (int32_t n = static_cast<int32_t>(first); n < static_cast<int32_t>(last); n++) {
+            const uint32_t* row = weight.data + static_cast<size_t>(n) * words;
+            const uint16_t* scales = weight.scales + static_cast<size_t>(n) * groups;
+            float correction = 0.0f;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+            Vec total = vzero();
+            for (int32_t g = 0; g < groups; g++) {
+                Vec acc = vzero();
+                for (int32_t r = 0; r < kWordsPerGroup; r++) {
+                    const uint32_t word = row[g * kWordsPerGroup + r];
+                    const float* xr = x + g * kQ4GroupSize + r * kQ4PerWord;
+#if MLC_CPU_AVX2
+                    const __m256i q = _mm256_and_si256(
+                        _mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(word)), _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28)),
+                        _mm256_set1_epi32(0xF));
+                    acc = vfma(_mm256_cvtepi32_ps(q), vload(xr), acc);
+#else
+                    const uint32x4_t all = vdupq_n_u32(word);
+                    const int32x4_t low_shift = {0, -4, -8, -12};
+                    const int32x4_t high_shift = {-16, -20, -24, -28};
+                    const uint32x4_t mask = vdupq_n_u32(0xF);
+                    acc = vfma(vcvtq_f32_u32(vandq_u32(vshlq_u32(all, low_shift), mask)), vload(xr), acc);
+                    acc = vfma(vcvtq_f32_u32(vandq_u32(vshlq_u32(all, high_shift), mask)), vload(xr + 4), acc);
+#endif
+                }
+                const float scale = scale_value(scales[g]);
+                total = vfma(vset(scale), acc, total);
+                correction += scale * sums[g];
+            }
+            y[n] = vsum(total) - kQ4ZeroPoint * correction;
+#else
+            float total = 0.0f;
+            for (int32_t g = 0; g < groups; g++) {
+                float acc = 0.0f;
+                for (int32_t r = 0; r < kWordsPerGroup; r++) {
+                    const uint32_t word = row[g * kWordsPerGroup + r];
+                    const float* xr = x + g * kQ4GroupSize + r * kQ4PerWord;
+                    for (int j = 0; j < kQ4PerWord; j++) acc += xr[j] * nibble(word, j);
+                }
+                const float scale = scale_value(scales[g]);
+                total += scale * acc;
+                correction += scale * sums[g];
+            }
+            y[n] = total - kQ4ZeroPoint * correction;
+#endif
+        }
+    });
+}
+
+void q4_dequantize_row_nk(const Q4Matrix& weight, int32_t row, float* out) {
+    const int32_t groups = weight.in_features / kQ4GroupSize;
+    const uint32_t* words = weight.data + static_cast<size_t>(row) * (weight.in_features / kQ4PerWord);
+    const uint16_t* scales = weight.scales + static_cast<size_t>(row) * groups;
+    for (int32_t k = 0; k < weight.in_features; k++) {
+        out[k] = (nibble(words[k / kQ4PerWord], k % kQ4PerWord) - kQ4ZeroPoint) * scale_value(scales[k / kQ4GroupSize]);
+    }
+}
+
+float dot(const float* a, const float* b, size_t count) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+    Vec acc0 = vzero();
+    Vec acc1 = vzero();
+    for (; i + 2 * kLanes <= count; i += 2 * kLanes) {
+        acc0 = vfma(vload(a + i), vload(b + i), acc0);
+        acc1 = vfma(vload(a + i + kLanes), vload(b + i + kLanes), acc1);
+    }
+    for (; i + kLanes <= count; i += kLanes) acc0 = vfma(vload(a + i), vload(b + i), acc0);
+    sum = vsum(acc0) + vsum(acc1);
+#endif
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+void axpy(float a, const float* x, float* y, size_t count) {
+    size_t i = 0;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+    const Vec va = vset(a);
+    for (; i + kLanes <= count; i += kLanes) vstore(y + i, vfma(va, vload(x + i), vload(y + i)));
+#endif
+    for (; i < count; i++) y[i] += a * x[i];
+}
+
+void rms_norm(const float* x, const float* weight, size_t count, float eps, float* out) {
+    const float scale = 1.0f / std::sqrt(dot(x, x, count) / static_cast<float>(count) + eps);
+    size_t i = 0;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+    const Vec vs = vset(scale);
+    for (; i + kLanes <= count; i += kLanes) vstore(out + i, vmul(vmul(vload(x + i), vs), vload(weight + i)));
+#endif
+    for (; i < count; i++) out[i] = x[i] * scale * weight[i];
+}
+
+void silu_mul(const float* gate, const float* up, float* out, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = gate[i] / (1.0f + std::exp(-gate[i])) * up[i];
+}
+
+void rope_inv_freq(int32_t head_dim, float theta, const RopeScaling& scaling, float* inv_freq) {
+    const int32_t half = head_dim / 2;
+    const double pi = 3.14159265358979323846;
+    const double low_wavelen = scaling.original_max_positions / scaling.low_freq_factor;
+    const double high_wavelen = scaling.original_max_positions / scaling.high_freq_factor;
+    for (int32_t i = 0; i < half; i++) {
+        double freq = 1.0 / std::pow(static_cast<double>(theta), 2.0 * i / head_dim);
+        if (scaling.factor > 1.0f) {
+            const double wavelen = 2.0 * pi / freq;
+            if (wavelen > low_wavelen) {
+                freq /= scaling.factor;
+            } else if (wavelen >= high_wavelen) {
+                const double smooth = (scaling.original_max_positions / wavelen - scaling.low_freq_factor) /
+                                      (scaling.high_freq_factor - scaling.low_freq_factor);
+                freq = (1.0 - smooth) * freq / scaling.factor + smooth * freq;
+            }
+        }
+        inv_freq[i] = static_cast<float>(freq);
+    }
+}
+
+void rope_angles(const float* inv_freq, int32_t head_dim, int64_t position, float* cos_sin) {
+    const int32_t half = head_dim / 2;
+    for (int32_t i = 0; i < half; i++) {
+        const float angle = static_cast<float>(position) * inv_freq[i];
+        cos_sin[i] = std::cos(angle);
+        cos_sin[half + i] = std::sin(angle);
+    }
+}
+
+void apply_rope(float* vectors, int32_t heads, int32_t head_dim, const float* cos_sin) {
+    const int32_t half = head_dim / 2;
+    const float* cosines = cos_sin;
+    const float* sines = cos_sin + half;
+    for (int32_t h = 0; h < heads; h++) {
+        float* first = vectors + static_cast<size_t>(h) * head_dim;
+        float* second = first + half;
+        int32_t i = 0;
+#if MLC_CPU_AVX2 || MLC_CPU_NEON
+        for (; i + kLanes <= half; i += kLanes) {
+            const Vec a = vload(first + i);
+            const Vec b = vload(second + i);
+            const Vec c = vload(cosines + i);
+            const Vec s = vload(sines + i);
+            vstore(first + i, vfms(b, s, vmul(a, c)));
+            vstore(second + i, vfma(a, s, vmul(b, c)));
+        }
+#endif
+        for (; i < half; i++) {
+            const float a = first[i];
+            const float b = second[i];
+            first[i] = a * cosines[i] - b * sines[i];
+            second[i] = b * cosines[i] + a * sines[i];
+        }
+    }
+}
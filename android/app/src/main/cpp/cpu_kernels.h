@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CPU kernels for q4f16_0 models, used when there is no GPU to run the
+// compiled model library on. NEON on arm64 and AVX2/FMA on the host build
+// (MLC_HOST_AVX2), scalar elsewhere; bench/cpu_kernels_bench checks every
+// path against a plain scalar reference. The matrix kernels split their
+// outputs across ThreadPool::shared()'s performance workers.
+//
+// q4f16_0 as MLC's group quantization writes it: signed 4-bit values with
+// zero point 7 in groups of 32 along the input dimension, eight per uint32
+// (element j in bits 4j..4j+3), one fp16 scale per group:
+//
+//   w = (q - 7) * scale
+//
+// Linear weights are in "KN" layout, input-major: `data` is
+// [in / 8][out] words and `scales` [in / 32][out], so a GEMV streams rows of
+// consecutive outputs and vectorizes across them. Embeddings (and a tied
+// LM head) are "NK", one row per token: `data` [out][in / 8], `scales`
+// [out][in / 32].
+constexpr int32_t kQ4GroupSize = 32;
+constexpr int32_t kQ4PerWord = 8;
+constexpr int32_t kQ4ZeroPoint = 7;
+
+struct Q4Matrix {
+    const uint32_t* data = nullptr;
+    const uint16_t* scales = nullptr;
+    int32_t in_features = 0;  // multiple of kQ4GroupSize
+    int32_t out_features = 0;
+
+    size_t data_words() const { return static_cast<size_t>(in_features) / kQ4PerWord * out_features; }
+    size_t scale_count() const { return static_cast<size_t>(in_features) / kQ4GroupSize * out_features; }
+};
+
+// Name of the vector path compiled in: "neon", "avx2" or "scalar"
+const char* cpu_kernels_isa();
+
+// Quantizes a row-major float [out][in] weight, as the model compiler does;
+// for tests and synthetic models.
+void q4_quantize_kn(const float* weight, int32_t out_features, int32_t in_features, uint32_t* data,
+                    uint16_t* scales);
+void q4_quantize_nk(const float* weight, int32_t out_features, int32_t in_features, uint32_t* data,
+                    uint16_t* scales);
+
+// y[out] = W x, dequantizing on the fly (decode)
+void q4_gemv_kn(const Q4Matrix& weight, const float* x, float* y);
+
+// y[rows][out] = x[rows][in] W^T (prefill). Tiles of W are dequantized
+// once into a per-thread scratch tile and reused for every row.
+void q4_gemm_kn(const Q4Matrix& weight, const float* x, size_t rows, float* y);
+
+// y[out] = W x for an NK matrix (the LM head of a tied embedding)
+void q4_gemv_nk(const Q4Matrix& weight, const float* x, float* y);
+
+// One row of an NK matrix as floats (an embedding lookup)
+void q4_dequantize_row_nk(const Q4Matrix& weight, int32_t row, float* out);
+
+// out = x / rms(x) * weight; `out` may be `x`
+void rms_norm(const float* x, const float* weight, size_t count, float eps, float* out);
+
+// Llama-3 rotary frequencies for head_dim / 2 pairs. `scaling_factor` <= 1
+// leaves them unscaled; otherwise long wavelengths are divided by it and
+// the band between the two factors is interpolated.
+struct RopeScaling {
+    float factor = 1.0f;
+    float low_freq_factor = 1.0f;
+    float high_freq_factor = 4.0f;
+    int32_t original_max_positions = 8192;
+};
+void rope_inv_freq(int32_t head_dim, float theta, const RopeScaling& scaling, float* inv_freq);
+
+// Rotates `heads` vectors of head_dim in place for one position, pairing
+// element i with i + head_dim / 2. `cos_sin` holds head_dim / 2 cosines
+// then head_dim / 2 sines (rope_angles()).
+void rope_angles(const float* inv_freq, int32_t head_dim, int64_t position, float* cos_sin);
+void apply_rope(float* vectors, int32_t heads, int32_t head_dim, const float* cos_sin);
+
+float dot(const float* a, const float* b, size_t count);
+
+// y += a * x
+void axpy(float a, const float* x, float* y, size_t count);
+
+// out[i] = silu(gate[i]) * up[i]
+void silu_mul(const float* gate, const float* up, float* out, size_t count);
@@ -0,0 +1,1412 @@
+#include "grammar.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <utility>
+
+#include "memory_accounting.h"
+#include "mlc_log.h"
+
+namespace {
+
+// Left-recursion is rejected at compile time; this only bounds pathological
+// chains of rule references that start with no byte
+constexpr int kMaxExpandDepth = 1024;
+
+// Repetition bounds and nesting the parsers accept
+constexpr int kMaxRepeat = 1024;
+constexpr int kMaxJsonDepth = 64;
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t source_fingerprint(Grammar::Kind kind, std::string_view source) {
+    const int32_t tag = static_cast<int32_t>(kind);
+    uint64_t hash = fnv1a(0xcbf29ce484222325ull, &tag, sizeof(tag));
+    return fnv1a(hash, source.data(), source.size());
+}
+
+void append_utf8(uint32_t code, std::string* out) {
+    if (code < 0x80) {
+        out->push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+        out->push_back(static_cast<char>(0xC0 | (code >> 6)));
+        out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+        out->push_back(static_cast<char>(0xE0 | (code >> 12)));
+        out->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+        out->push_back(static_cast<char>(0xF0 | (code >> 18)));
+        out->push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+}
+
+// One byte range per position of a UTF-8 encoding
+using ByteRanges = std::vector<std::pair<uint8_t, uint8_t>>;
+
+// Splits [lo, hi] (all of one encoded length) until every byte position of
+// the encodings spans a contiguous range, then emits the per-byte ranges
+void split_utf8(uint32_t lo, uint32_t hi, int length, std::vector<ByteRanges>* out) {
+    for (int i = 1; i < length; i++) {
+        const uint32_t m = (1u << (6 * i)) - 1;
+        if ((lo & ~m) != (hi & ~m)) {
+            if ((lo & m) != 0) {
+                split_utf8(lo, lo | m, length, out);
+                split_utf8((lo | m) + 1, hi, length, out);
+                return;
+            }
+            if ((hi & m) != m) {
+                split_utf8(lo, (hi & ~m) - 1, length, out);
+                split_utf8(hi & ~m, hi, length, out);
+                return;
+            }
+        }
+    }
+    std::string a, b;
+    append_utf8(lo, &a);
+    append_utf8(hi, &b);
+    ByteRanges ranges;
+    for (int i = 0; i < length; i++) {
+        ranges.emplace_back(static_cast<uint8_t>(a[i]), static_cast<uint8_t>(b[i]));
+    }
+    out->push_back(std::move(ranges));
+}
+
+// UTF-8 byte-range sequences matching exactly the code points in [lo, hi]
+void utf8_sequences(uint32_t lo, uint32_t hi, std::vector<ByteRanges>* out) {
+    static const uint32_t kLengthMax[] = {0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+    for (int length = 1; length <= 4; length++) {
+        const uint32_t min = length == 1 ? 0 : kLengthMax[length - 2] + 1;
+        const uint32_t a = std::max(lo, min);
+        const uint32_t b = std::min(hi, kLengthMax[length - 1]);
+        if (a <= b) split_utf8(a, b, length, out);
+    }
+}
+
+// ---- JSON (schemas only: small documents, kept as a tree) ----
+
+struct JsonValue {
+    enum Type { kNull, kBool, kNumber, kString, kArray, kObject };
+
+    Type type = kNull;
+    bool boolean = false;
+    std::string text; // a string's value or a number's literal
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members; // in document order
+
+    const JsonValue* get(std::string_view key) const {
+        for (const auto& member : members) {
+            if (member.first == key) return &member.second;
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    JsonParser(std::string_view text) : p_(text.data()), end_(text.data() + text.size()) {}
+
+    bool parse(JsonValue* value, std::string* error) {
+        if (!parse_value(value, 0) || (skip_space(), p_ != end_)) {
+            *error = "Malformed JSON schema";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void skip_space() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) p_++;
+    }
+
+    bool literal(const char* word, size_t length) {
+        if (static_cast<size_t>(end_ - p_) < length || std::memcmp(p_, word, length) != 0) return false;
+        p_ += length;
+        return true;
+    }
+
+    bool parse_value(JsonValue* value, int depth) {
+        if (depth > kMaxJsonDepth) return false;
+        skip_space();
+        if (p_ >= end_) return false;
+        switch (*p_) {
+            case '{': return parse_object(value, depth);
+            case '[': return parse_array(value, depth);
+            case '"': value->type = JsonValue::kString; return parse_string(&value->text);
+            case 't': value->type = JsonValue::kBool; value->boolean = true; return literal("true", 4);
+            case 'f': value->type = JsonValue::kBool; return literal("false", 5);
+            case 'n': value->type = JsonValue::kNull; return literal("null", 4);
+            default: return parse_number(value);
+        }
+    }
+
+    bool parse_object(JsonValue* value, int depth) {
+        value->type = JsonValue::kObject;
+        p_++;
+        skip_space();
+        if (p_ < end_ && *p_ == '}') {
+            p_++;
+            return true;
+        }
+        while (true) {
+            skip_space();
+            std::string key;
+            if (p_ >= end_ || *p_ != '"' || !parse_string(&key)) return false;
+            skip_space();
+            if (p_ >= end_ || *p_++ != ':') return false;
+            value->members.emplace_back(std::move(key), JsonValue());
+            if (!parse_value(&value->members.back().second, depth + 1)) return false;
+            skip_space();
+            if (p_ >= end_) return false;
+            const char c = *p_++;
+            if (c == '}') return true;
+            if (c != ',') return false;
+        }
+    }
+
+    bool parse_array(JsonValue* value, int depth) {
+        value->type = JsonValue::kArray;
+        p_++;
+        skip_space();
+        if (p_ < end_ && *p_ == ']') {
+            p_++;
+            return true;
+        }
+        while (true) {
+            value->items.emplace_back();
+            if (!parse_value(&value->items.back(), depth + 1)) return false;
+            skip_space();
+            if (p_ >= end_) return false;
+            const char c = *p_++;
+            if (c == ']') return true;
+            if (c != ',') return false;
+        }
+    }
+
+    bool parse_number(JsonValue* value) {
+        value->type = JsonValue::kNumber;
+        const char* start = p_;
+        if (p_ < end_ && *p_ == '-') p_++;
+        const char* digits = p_;
+        while (p_ < end_ && ((*p_ >= '0' && *p_ <= '9') || *p_ == '.' || *p_ == 'e' || *p_ == 'E' || *p_ == '+' ||
+                             *p_ == '-')) {
+            p_++;
+        }
+        if (p_ == digits || *digits < '0' || *digits > '9') return false;
+        value->text.assign(start, p_);
+        return true;
+    }
+
+    bool parse_string(std::string* out) {
+        p_++; // opening quote
+        while (p_ < end_) {
+            const char c = *p_++;
+            if (c == '"') return true;
+            if (c != '\\') {
+                out->push_back(c);
+                continue;
+            }
+            if (p_ >= end_) return false;
+            const char escape = *p_++;
+            switch (escape) {
+                case '"': case '\\': case '/': out->push_back(escape); break;
+                case 'b': out->push_back('\b'); break;
+                case 'f': out->push_back('\f'); break;
+                case 'n': out->push_back('\n'); break;
+                case 'r': out->push_back('\r'); break;
+                case 't': out->push_back('\t'); break;
+                case 'u': {
+                    uint32_t code = 0;
+                    if (!read_hex4(&code)) return false;
+                    if (code >= 0xD800 && code < 0xDC00 && end_ - p_ >= 6 && p_[0] == '\\' && p_[1] == 'u') {
+                        p_ += 2;
+                        uint32_t low = 0;
+                        if (!read_hex4(&low) || low < 0xDC00 || low >= 0xE000) return false;
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    append_utf8(code >= 0xD800 && code < 0xE000 ? 0xFFFD : code, out);
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return false;
+    }
+
+    bool read_hex4(uint32_t* out) {
+        if (end_ - p_ < 4) return false;
+        for (int i = 0; i < 4; i++) {
+            const char c = *p_++;
+            const int digit = c >= '0' && c <= '9' ? c - '0'
+                              : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                              : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) return false;
+            *out = (*out << 4) | static_cast<uint32_t>(digit);
+        }
+        return true;
+    }
+
+    const char* p_;
+    const char* end_;
+};
+
+void write_json_string(const std::string& value, std::string* out) {
+    static const char kHex[] = "0123456789abcdef";
+    out->push_back('"');
+    for (unsigned char c : value) {
+        switch (c) {
+            case '"': out->append("\\\""); break;
+            case '\\': out->append("\\\\"); break;
+            case '\n': out->append("\\n"); break;
+            case '\r': out->append("\\r"); break;
+            case '\t': out->append("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    out->append("\\u00");
+                    out->push_back(kHex[c >> 4]);
+                    out->push_back(kHex[c & 15]);
+                } else {
+                    out->push_back(static_cast<char>(c));
+                }
+        }
+    }
+    out->push_back('"');
+}
+
+// Compact serialization: the exact text an enum or const value must produce
+void write_json(const JsonValue& value, std::string* out) {
+    switch (value.type) {
+        case JsonValue::kNull: out->append("null"); break;
+        case JsonValue::kBool: out->append(value.boolean ? "true" : "false"); break;
+        case JsonValue::kNumber: out->append(value.text); break;
+        case JsonValue::kString: write_json_string(value.text, out); break;
+        case JsonValue::kArray:
+            out->push_back('[');
+            for (size_t i = 0; i < value.items.size(); i++) {
+                if (i > 0) out->push_back(',');
+                write_json(value.items[i], out);
+            }
+            out->push_back(']');
+            break;
+        case JsonValue::kObject:
+            out->push_back('{');
+            for (size_t i = 0; i < value.members.size(); i++) {
+                if (i > 0) out->push_back(',');
+                write_json_string(value.members[i].first, out);
+                out->push_back(':');
+                write_json(value.members[i].second, out);
+            }
+            out->push_back('}');
+            break;
+    }
+}
+
+// An EBNF literal matching exactly `bytes`
+std::string ebnf_literal(const std::string& bytes) {
+    static const char kHex[] = "0123456789ABCDEF";
+    std::string out = "\"";
+    for (unsigned char c : bytes) {
+        switch (c) {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    out.append("\\x");
+                    out.push_back(kHex[c >> 4]);
+                    out.push_back(kHex[c & 15]);
+                } else {
+                    out.push_back(static_cast<char>(c));
+                }
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+// Whitespace between JSON tokens is free-form; integers are capped at 16
+// digits so a value cannot run on forever.
+const char kJsonPrimitives[] =
+    "value ::= object | array | string | number | boolean | null\n"
+    "object ::= \"{\" ws ( string ws \":\" ws value ws ( \",\" ws string ws \":\" ws value ws )* )? \"}\"\n"
+    "array ::= \"[\" ws ( value ws ( \",\" ws value ws )* )? \"]\"\n"
+    "string ::= \"\\\"\" char* \"\\\"\"\n"
+    "char ::= [^\"\\\\\\x00-\\x1F] | \"\\\\\" ( [\"\\\\/bfnrt] | \"u\" [0-9a-fA-F]{4} )\n"
+    "number ::= integer ( \".\" [0-9]+ )? ( [eE] [-+]? [0-9]+ )?\n"
+    "integer ::= \"-\"? ( \"0\" | [1-9] [0-9]{0,15} )\n"
+    "boolean ::= \"true\" | \"false\"\n"
+    "null ::= \"null\"\n"
+    "ws ::= [ \\t\\n]*\n";
+
+// Writes one rule per object, array and $ref target of a schema; scalars
+// map onto the primitive rules above.
+class SchemaConverter {
+public:
+    explicit SchemaConverter(const JsonValue& root) : root_(root) {
+        for (const char* name : {"root", "value", "object", "array", "string", "char", "number", "integer", "boolean",
+                                 "null", "ws"}) {
+            names_.insert(name);
+        }
+    }
+
+    bool convert(std::string* ebnf, std::string* error) {
+        const std::string root = expression(root_, "root", 0);
+        if (!error_.empty()) {
+            *error = error_;
+            return false;
+        }
+        *ebnf = "root ::= " + root + "\n" + rules_ + kJsonPrimitives;
+        return true;
+    }
+
+private:
+    std::string fail(const std::string& message) {
+        if (error_.empty()) error_ = message;
+        return "null";
+    }
+
+    std::string unique_name(const std::string& hint) {
+        std::string name;
+        for (char c : hint) {
+            const bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+            name.push_back(keep ? c : '-');
+        }
+        std::string unique = name;
+        for (int suffix = 1; names_.count(unique) > 0; suffix++) unique = name + std::to_string(suffix);
+        names_.insert(unique);
+        return unique;
+    }
+
+    std::string add_rule(const std::string& name, const std::string& body) {
+        rules_ += name + " ::= " + body + "\n";
+        return name;
+    }
+
+    std::string expression(const JsonValue& schema, const std::string& hint, int depth) {
+        if (depth > kMaxJsonDepth) return fail("JSON schema nests too deeply");
+        if (schema.type == JsonValue::kBool) return schema.boolean ? "value" : fail("Schema false matches nothing");
+        if (schema.type != JsonValue::kObject) return fail("Schema must be an object");
+
+        if (const JsonValue* ref = schema.get("$ref")) return reference(*ref, depth);
+        if (const JsonValue* value = schema.get("const")) return literal(*value);
+        if (const JsonValue* values = schema.get("enum")) {
+            if (values->type != JsonValue::kArray || values->items.empty()) return fail("enum must be a non-empty array");
+            std::string body = "(";
+            for (size_t i = 0; i < values->items.size(); i++) body += (i > 0 ? " | " : " ") + literal(values->items[i]);
+            return body + " )";
+        }
+        for (const char* key : {"anyOf", "oneOf"}) {
+            if (const JsonValue* options = schema.get(key)) {
+                if (options->type != JsonValue::kArray || options->items.empty()) {
+                    return fail(std::string(key) + " must be a non-empty array");
+                }
+                std::string body = "(";
+                for (size_t i = 0; i < options->items.size(); i++) {
+                    body += (i > 0 ? " | " : " ") + expression(options->items[i], hint + "-" + std::to_string(i), depth + 1);
+                }
+                return body + " )";
+            }
+        }
+        if (const JsonValue* all = schema.get("allOf")) {
+            if (all->type != JsonValue::kArray || all->items.size() != 1) return fail("allOf is only supported with one schema");
+            return expression(all->items[0], hint, depth + 1);
+        }
+
+        const JsonValue* type = schema.get("type");
+        if (type == nullptr) {
+            if (schema.get("properties")) return typed("object", schema, hint, depth);
+            if (schema.get("items")) return typed("array", schema, hint, depth);
+            return "value";
+        }
+        if (type->type == JsonValue::kString) return typed(type->text, schema, hint, depth);
+        if (type->type == JsonValue::kArray && !type->items.empty()) {
+            std::string body = "(";
+            for (size_t i = 0; i < type->items.size(); i++) {
+                if (type->items[i].type != JsonValue::kString) return fail("type must name types");
+                body += (i > 0 ? " | " : " ") + typed(type->items[i].text, schema, hint, depth);
+            }
+            return body + " )";
+        }
+        return fail("type must be a string or an array of strings");
+    }
+
+    std::string typed(const std::string& type, const JsonValue& schema, const std::string& hint, int depth) {
+        if (type == "string" || type == "number" || type == "integer" || type == "boolean" || type == "null") {
+            return type;
+        }
+        if (type == "array") return array(schema, hint, depth);
+        if (type == "object") return object(schema, hint, depth);
+        return fail("Unknown type " + type);
+    }
+
+    std::string literal(const JsonValue& value) {
+        std::string json;
+        write_json(value, &json);
+        return ebnf_literal(json);
+    }
+
+    std::string reference(const JsonValue& ref, int depth) {
+        if (ref.type != JsonValue::kString) return fail("$ref must be a string");
+        auto known = refs_.find(ref.text);
+        if (known != refs_.end()) return known->second;
+
+        const JsonValue* target = nullptr;
+        std::string name;
+        if (ref.text == "#") {
+            target = &root_;
+            name = "root-ref";
+        } else {
+            for (const char* prefix : {"#/$defs/", "#/definitions/"}) {
+                const size_t length = std::strlen(prefix);
+                if (ref.text.compare(0, length, prefix) != 0) continue;
+                const JsonValue* defs = root_.get(std::string(prefix + 2, length - 3));
+                if (defs != nullptr) target = defs->get(ref.text.substr(length));
+                name = ref.text.substr(length);
+            }
+        }
+        if (target == nullptr) return fail("Unresolved $ref " + ref.text);
+
+        // Named before its body is built, so recursive schemas refer back to it
+        const std::string rule = unique_name("ref-" + name);
+        refs_[ref.text] = rule;
+        return add_rule(rule, expression(*target, rule, depth + 1));
+    }
+
+    std::string array(const JsonValue& schema, const std::string& hint, int depth) {
+        const std::string name = unique_name(hint);
+        const JsonValue* items = schema.get("items");
+        const std::string item = items ? add_rule(unique_name(name + "-item"), expression(*items, name + "-item", depth + 1))
+                                       : "value";
+        const int64_t min = bound(schema.get("minItems"), 0);
+        const int64_t max = bound(schema.get("maxItems"), -1);
+        if (max >= 0 && max < min) return fail("maxItems is below minItems");
+        if (max == 0) return add_rule(name, "\"[\" ws \"]\"");
+
+        // The first item, then the rest as ( "," ws item ws ){min - 1, max - 1}
+        std::string rest = "( \",\" ws " + item + " ws )";
+        const int64_t rest_min = std::max<int64_t>(0, min - 1);
+        if (max < 0) {
+            rest += rest_min == 0 ? "*" : "{" + std::to_string(rest_min) + ",}";
+        } else if (max > 1) {
+            rest += "{" + std::to_string(rest_min) + "," + std::to_string(max - 1) + "}";
+        } else {
+            rest.clear();
+        }
+        std::string items_body = item + " ws" + (rest.empty() ? "" : " " + rest);
+        if (min == 0) items_body = "( " + items_body + " )?";
+        return add_rule(name, "\"[\" ws " + items_body + " \"]\"");
+    }
+
+    std::string object(const JsonValue& schema, const std::string& hint, int depth) {
+        const JsonValue* properties = schema.get("properties");
+        if (properties == nullptr || properties->type != JsonValue::kObject || properties->members.empty()) {
+            return "object";
+        }
+        const std::string name = unique_name(hint);
+
+        std::set<std::string> required;
+        if (const JsonValue* list = schema.get("required")) {
+            for (const JsonValue& entry : list->items) {
+                if (entry.type == JsonValue::kString) required.insert(entry.text);
+            }
+        }
+
+        // Each member as `"key" ws ":" ws value ws`, in declaration order
+        std::vector<std::string> mandatory, optional;
+        for (const auto& member : properties->members) {
+            std::string key;
+            write_json_string(member.first, &key);
+            const std::string value = expression(member.second, name + "-" + member.first, depth + 1);
+            const std::string pair = ebnf_literal(key) + " ws \":\" ws " + value + " ws";
+            (required.count(member.first) ? mandatory : optional).push_back(pair);
+        }
+
+        std::string body = "\"{\" ws ";
+        if (!mandatory.empty()) {
+            for (size_t i = 0; i < mandatory.size(); i++) body += (i > 0 ? "\",\" ws " : "") + mandatory[i] + " ";
+            for (const std::string& pair : optional) body += "( \",\" ws " + pair + " )? ";
+        } else {
+            // Any subset of the optional members, still in order: pick the first one present
+            body += "(";
+            for (size_t first = 0; first < optional.size(); first++) {
+                body += (first > 0 ? " | " : " ") + optional[first];
+                for (size_t next = first + 1; next < optional.size(); next++) {
+                    body += " ( \",\" ws " + optional[next] + " )?";
+                }
+            }
+            body += " )? ";
+        }
+        return add_rule(name, body + "\"}\"");
+    }
+
+    int64_t bound(const JsonValue* value, int64_t fallback) {
+        if (value == nullptr) return fallback;
+        if (value->type != JsonValue::kNumber || value->text.find_first_of(".eE-") != std::string::npos) {
+            fail("Array bounds must be non-negative integers");
+            return fallback;
+        }
+        const int64_t bound = std::strtoll(value->text.c_str(), nullptr, 10);
+        if (bound > kMaxRepeat) {
+            fail("Array bounds above " + std::to_string(kMaxRepeat) + " are not supported");
+            return fallback;
+        }
+        return bound;
+    }
+
+    const JsonValue& root_;
+    std::string rules_;
+    std::set<std::string> names_;
+    std::map<std::string, std::string> refs_;
+    std::string error_;
+};
+
+} // namespace
+
+// ---- EBNF ----
+
+// Rules as symbol sequences while parsing; flattened into a Grammar once
+// every reference is resolved and no rule is left-recursive.
+class GrammarBuilder {
+public:
+    struct Symbol {
+        bool rule;
+        uint32_t value; // rule id, or index into sets_
+    };
+    using Sequence = std::vector<Symbol>;
+
+    struct Rule {
+        std::string name;
+        std::vector<Sequence> alternatives;
+        bool defined = false;
+    };
+
+    explicit GrammarBuilder(std::string_view text) : text_(text) {}
+
+    std::shared_ptr<Grammar> build(std::string* error) {
+        pos_ = 0;
+        skip_space();
+        while (pos_ < text_.size()) {
+            if (!parse_rule()) break;
+            skip_space();
+        }
+        if (error_.empty()) check_rules();
+        if (!error_.empty()) {
+            *error = error_;
+            return nullptr;
+        }
+
+        auto grammar = std::shared_ptr<Grammar>(new Grammar());
+        grammar->byte_sets_ = sets_;
+        grammar->rule_starts_.resize(rules_.size());
+        for (size_t r = 0; r < rules_.size(); r++) {
+            for (const Sequence& alternative : rules_[r].alternatives) {
+                grammar->rule_starts_[r].push_back(static_cast<uint32_t>(grammar->elements_.size()));
+                for (const Symbol& symbol : alternative) {
+                    grammar->elements_.push_back({symbol.rule ? Grammar::kRule : Grammar::kBytes, symbol.value});
+                }
+                grammar->elements_.push_back({Grammar::kEnd, 0});
+            }
+        }
+        grammar->root_ = names_.at("root");
+        return grammar;
+    }
+
+private:
+    bool fail(const std::string& message) {
+        if (error_.empty()) {
+            size_t line = 1;
+            for (size_t i = 0; i < pos_ && i < text_.size(); i++) line += text_[i] == '\n';
+            error_ = message + " (line " + std::to_string(line) + ")";
+        }
+        return false;
+    }
+
+    static bool is_name_char(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+    }
+
+    void skip_space() {
+        while (pos_ < text_.size()) {
+            const char c = text_[pos_];
+            if (c == '#') {
+                while (pos_ < text_.size() && text_[pos_] != '\n') pos_++;
+            } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                pos_++;
+            } else {
+                break;
+            }
+        }
+    }
+
+    size_t name_end(size_t at) const {
+        while (at < text_.size() && is_name_char(text_[at])) at++;
+        return at;
+    }
+
+    // A name followed by ::= starts the next rule
+    bool at_rule_start() const {
+        size_t at = name_end(pos_);
+        if (at == pos_) return false;
+        while (at < text_.size() && (text_[at] == ' ' || text_[at] == '\t')) at++;
+        return text_.compare(at, 3, "::=") == 0;
+    }
+
+    uint32_t rule_id(const std::string& name) {
+        auto it = names_.find(name);
+        if (it != names_.end()) return it->second;
+        const uint32_t id = static_cast<uint32_t>(rules_.size());
+        rules_.push_back(Rule{name, {}, false});
+        names_[name] = id;
+        return id;
+    }
+
+    uint32_t anonymous(std::vector<Sequence> alternatives) {
+        const uint32_t id = static_cast<uint32_t>(rules_.size());
+        rules_.push_back(Rule{current_ + "_" + std::to_string(anonymous_count_++), std::move(alternatives), true});
+        return id;
+    }
+
+    uint32_t add_set(const Grammar::ByteSet& set) {
+        sets_.push_back(set);
+        return static_cast<uint32_t>(sets_.size() - 1);
+    }
+
+    Symbol byte_symbol(uint8_t lo, uint8_t hi) {
+        Grammar::ByteSet set = {};
+        for (int b = lo; b <= hi; b++) set.bits[b >> 6] |= uint64_t(1) << (b & 63);
+        return Symbol{false, add_set(set)};
+    }
+
+    bool parse_rule() {
+        const size_t end = name_end(pos_);
+        if (end == pos_ || !at_rule_start()) return fail("Expected a rule definition");
+        current_ = std::string(text_.substr(pos_, end - pos_));
+        anonymous_count_ = 0;
+        const uint32_t id = rule_id(current_);
+        if (rules_[id].defined) return fail("Rule " + current_ + " is defined twice");
+        pos_ = text_.find("::=", end) + 3;
+
+        std::vector<Sequence> alternatives;
+        if (!parse_alternatives(&alternatives, false)) return false;
+        rules_[id].alternatives = std::move(alternatives);
+        rules_[id].defined = true;
+        return true;
+    }
+
+    bool parse_alternatives(std::vector<Sequence>* alternatives, bool nested) {
+        while (true) {
+            Sequence sequence;
+            if (!parse_sequence(&sequence, nested)) return false;
+            alternatives->push_back(std::move(sequence));
+            skip_space();
+            if (pos_ < text_.size() && text_[pos_] == '|') {
+                pos_++;
+                continue;
+            }
+            return true;
+        }
+    }
+
+    bool parse_sequence(Sequence* sequence, bool nested) {
+        while (true) {
+            skip_space();
+            if (pos_ >= text_.size()) return !nested || fail("Unclosed group");
+            const char c = text_[pos_];
+            if (c == '|') return true;
+            if (c == ')') return nested || fail("Unbalanced )");
+            if (!nested && at_rule_start()) return true;
+
+            Sequence atom;
+            if (!parse_atom(&atom) || !parse_repeats(&atom)) return false;
+            sequence->insert(sequence->end(), atom.begin(), atom.end());
+        }
+    }
+
+    bool parse_atom(Sequence* atom) {
+        const char c = text_[pos_];
+        if (c == '"') return parse_literal(atom);
+        if (c == '[') return parse_class(atom);
+        if (c == '.') {
+            pos_++;
+            return add_code_points({{0, 0x10FFFF}}, atom);
+        }
+        if (c == '(') {
+            pos_++;
+            std::vector<Sequence> alternatives;
+            if (!parse_alternatives(&alternatives, true)) return false;
+            if (pos_ >= text_.size() || text_[pos_] != ')') return fail("Unclosed group");
+            pos_++;
+            if (alternatives.size() == 1) {
+                *atom = std::move(alternatives[0]);
+            } else {
+                atom->push_back(Symbol{true, anonymous(std::move(alternatives))});
+            }
+            return true;
+        }
+        const size_t end = name_end(pos_);
+        if (end == pos_) return fail(std::string("Unexpected character '") + c + "'");
+        atom->push_back(Symbol{true, rule_id(std::string(text_.substr(pos_, end - pos_)))});
+        pos_ = end;
+        return true;
+    }
+
+    // X* is R ::= X R | (empty): right recursion, whose tail call does not
+    // grow the parser stack. X+ is X X*, X? is R ::= X | (empty), and
+    // X{m,n} is m copies of X followed by n - m nested optionals.
+    bool parse_repeats(Sequence* atom) {
+        while (pos_ < text_.size()) {
+            const char c = text_[pos_];
+            int min = 0, max = 0;
+            if (c == '*') {
+                min = 0, max = -1;
+                pos_++;
+            } else if (c == '+') {
+                min = 1, max = -1;
+                pos_++;
+            } else if (c == '?') {
+                min = 0, max = 1;
+                pos_++;
+            } else if (c == '{') {
+                if (!parse_bounds(&min, &max)) return false;
+            } else {
+                return true;
+            }
+            repeat(atom, min, max);
+        }
+        return true;
+    }
+
+    bool parse_bounds(int* min, int* max) {
+        pos_++;
+        auto number = [this](int* out) {
+            size_t start = pos_;
+            int value = 0;
+            while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9' && value <= kMaxRepeat) {
+                value = value * 10 + (text_[pos_++] - '0');
+            }
+            *out = value;
+            return pos_ > start;
+        };
+        if (!number(min)) return fail("Expected a repetition count");
+        *max = *min;
+        if (pos_ < text_.size() && text_[pos_] == ',') {
+            pos_++;
+            if (!number(max)) *max = -1;
+        }
+        if (pos_ >= text_.size() || text_[pos_] != '}') return fail("Unclosed repetition");
+        pos_++;
+        if (*min > kMaxRepeat || *max > kMaxRepeat) return fail("Repetition count too large");
+        if (*max >= 0 && *max < *min) return fail("Repetition maximum below its minimum");
+        return true;
+    }
+
+    void repeat(Sequence* atom, int min, int max) {
+        Sequence item = std::move(*atom);
+        atom->clear();
+        for (int i = 0; i < min; i++) atom->insert(atom->end(), item.begin(), item.end());
+        if (max < 0) {
+            const uint32_t id = anonymous({});
+            Sequence loop = item;
+            loop.push_back(Symbol{true, id});
+            rules_[id].alternatives = {loop, Sequence()};
+            atom->push_back(Symbol{true, id});
+            return;
+        }
+        uint32_t tail = 0;
+        for (int i = min; i < max; i++) {
+            Sequence more = item;
+            if (i > min) more.push_back(Symbol{true, tail});
+            tail = anonymous({more, Sequence()});
+        }
+        if (max > min) atom->push_back(Symbol{true, tail});
+    }
+
+    bool parse_literal(Sequence* atom) {
+        pos_++;
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            uint32_t code;
+            bool escaped;
+            if (!read_char(&code, &escaped)) return false;
+            // Escapes name bytes below 0x100 exactly; anything else is UTF-8
+            std::string bytes;
+            if (escaped && code < 0x100) {
+                bytes.push_back(static_cast<char>(code));
+            } else {
+                append_utf8(code, &bytes);
+            }
+            for (unsigned char b : bytes) atom->push_back(byte_symbol(b, b));
+        }
+        if (pos_ >= text_.size()) return fail("Unterminated literal");
+        pos_++;
+        return true;
+    }
+
+    bool parse_class(Sequence* atom) {
+        pos_++;
+        const bool negated = pos_ < text_.size() && text_[pos_] == '^';
+        if (negated) pos_++;
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        while (pos_ < text_.size() && text_[pos_] != ']') {
+            uint32_t lo, hi;
+            bool escaped;
+            if (!read_char(&lo, &escaped)) return false;
+            hi = lo;
+            if (pos_ + 1 < text_.size() && text_[pos_] == '-' && text_[pos_ + 1] != ']') {
+                pos_++;
+                if (!read_char(&hi, &escaped)) return false;
+                if (hi < lo) return fail("Reversed character range");
+            }
+            ranges.emplace_back(lo, hi);
+        }
+        if (pos_ >= text_.size()) return fail("Unterminated character class");
+        pos_++;
+
+        std::sort(ranges.begin(), ranges.end());
+        if (negated) {
+            std::vector<std::pair<uint32_t, uint32_t>> complement;
+            uint32_t next = 0;
+            for (const auto& range : ranges) {
+                if (range.first > next) complement.emplace_back(next, range.first - 1);
+                next = std::max(next, range.second + 1);
+            }
+            if (next <= 0x10FFFF) complement.emplace_back(next, 0x10FFFF);
+            ranges.swap(complement);
+        }
+        if (ranges.empty()) return fail("Empty character class");
+        return add_code_points(ranges, atom);
+    }
+
+    // Appends one symbol matching any of the code points in `ranges`
+    // (surrogates excluded): a single byte set when they are all ASCII,
+    // otherwise a rule over their UTF-8 byte-range sequences
+    bool add_code_points(const std::vector<std::pair<uint32_t, uint32_t>>& ranges, Sequence* atom) {
+        std::vector<ByteRanges> sequences;
+        for (const auto& range : ranges) {
+            if (range.first < 0xD800) utf8_sequences(range.first, std::min<uint32_t>(range.second, 0xD7FF), &sequences);
+            if (range.second > 0xDFFF) utf8_sequences(std::max<uint32_t>(range.first, 0xE000), range.second, &sequences);
+        }
+
+        Grammar::ByteSet single = {};
+        bool has_single = false;
+        std::vector<Sequence> alternatives;
+        for (const ByteRanges& sequence : sequences) {
+            if (sequence.size() == 1) {
+                for (int b = sequence[0].first; b <= sequence[0].second; b++) single.bits[b >> 6] |= uint64_t(1) << (b & 63);
+                has_single = true;
+                continue;
+            }
+            Sequence alternative;
+            for (const auto& range : sequence) alternative.push_back(byte_symbol(range.first, range.second));
+            alternatives.push_back(std::move(alternative));
+        }
+        if (has_single) {
+            const Symbol symbol{false, add_set(single)};
+            if (alternatives.empty()) {
+                atom->push_back(symbol);
+                return true;
+            }
+            alternatives.insert(alternatives.begin(), Sequence{symbol});
+        }
+        if (alternatives.empty()) return fail("Character class matches nothing");
+        atom->push_back(Symbol{true, anonymous(std::move(alternatives))});
+        return true;
+    }
+
+    // One character of a literal or class: an escape (\n, \xHH, \uHHHH...)
+    // or a UTF-8 encoded code point
+    bool read_char(uint32_t* code, bool* escaped) {
+        *escaped = false;
+        const unsigned char c = static_cast<unsigned char>(text_[pos_++]);
+        if (c == '\\') {
+            if (pos_ >= text_.size()) return fail("Dangling escape");
+            *escaped = true;
+            const char e = text_[pos_++];
+            switch (e) {
+                case 'n': *code = '\n'; return true;
+                case 'r': *code = '\r'; return true;
+                case 't': *code = '\t'; return true;
+                case '0': *code = 0; return true;
+                case 'x': return read_hex(2, code);
+                case 'u': *escaped = false; return read_hex(4, code);
+                case 'U': *escaped = false; return read_hex(8, code);
+                default: *code = static_cast<unsigned char>(e); return true;
+            }
+        }
+        if (c < 0x80) {
+            *code = c;
+            return true;
+        }
+        const int length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+        if (length == 0 || pos_ + length - 1 > text_.size()) return fail("Invalid UTF-8 in grammar");
+        *code = c & (0x3F >> (length - 1));
+        for (int i = 1; i < length; i++) *code = (*code << 6) | (static_cast<unsigned char>(text_[pos_++]) & 0x3F);
+        return true;
+    }
+
+    bool read_hex(int digits, uint32_t* code) {
+        *code = 0;
+        for (int i = 0; i < digits; i++) {
+            if (pos_ >= text_.size()) return fail("Truncated escape");
+            const char c = text_[pos_++];
+            const int digit = c >= '0' && c <= '9' ? c - '0'
+                              : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                              : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) return fail("Invalid hex escape");
+            *code = (*code << 4) | static_cast<uint32_t>(digit);
+        }
+        if (*code > 0x10FFFF) return fail("Code point out of range");
+        return true;
+    }
+
+    // Every referenced rule defined, a root, and no left recursion (which
+    // would expand forever): a rule may not reach itself through rules that
+    // can all match the empty string
+    void check_rules() {
+        for (const Rule& rule : rules_) {
+            if (!rule.defined) {
+                error_ = "Undefined rule " + rule.name;
+                return;
+            }
+        }
+        if (names_.find("root") == names_.end()) {
+            error_ = "Grammar has no root rule";
+            return;
+        }
+
+        std::vector<bool> nullable(rules_.size(), false);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t r = 0; r < rules_.size(); r++) {
+                if (nullable[r]) continue;
+                for (const Sequence& alternative : rules_[r].alternatives) {
+                    bool empty = true;
+                    for (const Symbol& symbol : alternative) empty = empty && symbol.rule && nullable[symbol.value];
+                    if (empty) {
+                        nullable[r] = changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        std::vector<std::vector<uint32_t>> leading(rules_.size());
+        for (size_t r = 0; r < rules_.size(); r++) {
+            for (const Sequence& alternative : rules_[r].alternatives) {
+                for (const Symbol& symbol : alternative) {
+                    if (!symbol.rule) break;
+                    leading[r].push_back(symbol.value);
+                    if (!nullable[symbol.value]) break;
+                }
+            }
+        }
+        std::vector<int> state(rules_.size(), 0); // 0 unvisited, 1 on the path, 2 done
+        std::function<bool(uint32_t)> visit = [&](uint32_t r) {
+            state[r] = 1;
+            for (uint32_t next : leading[r]) {
+                if (state[next] == 1) {
+                    error_ = "Rule " + rules_[next].name + " is left-recursive";
+                    return false;
+                }
+                if (state[next] == 0 && !visit(next)) return false;
+            }
+            state[r] = 2;
+            return true;
+        };
+        for (uint32_t r = 0; r < rules_.size(); r++) {
+            if (state[r] == 0 && !visit(r)) return;
+        }
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    std::vector<Rule> rules_;
+    std::map<std::string, uint32_t> names_;
+    std::vector<Grammar::ByteSet> sets_;
+    std::string current_;
+    int anonymous_count_ = 0;
+    std::string error_;
+};
+
+std::shared_ptr<const Grammar> Grammar::parse_ebnf(std::string_view text, std::string* error) {
+    std::shared_ptr<Grammar> grammar = GrammarBuilder(text).build(error);
+    if (grammar) grammar->fingerprint_ = source_fingerprint(Kind::kEbnf, text);
+    return grammar;
+}
+
+bool Grammar::json_schema_to_ebnf(std::string_view schema, std::string* ebnf, std::string* error) {
+    JsonValue root;
+    if (!JsonParser(schema).parse(&root, error)) return false;
+    return SchemaConverter(root).convert(ebnf, error);
+}
+
+std::shared_ptr<const Grammar> Grammar::from_json_schema(std::string_view schema, std::string* error) {
+    std::string ebnf;
+    if (!json_schema_to_ebnf(schema, &ebnf, error)) return nullptr;
+    std::shared_ptr<Grammar> grammar = GrammarBuilder(ebnf).build(error);
+    if (grammar) grammar->fingerprint_ = source_fingerprint(Kind::kJsonSchema, schema);
+    return grammar;
+}
+
+std::shared_ptr<const Grammar> Grammar::compile(Kind kind, std::string_view source, std::string* error) {
+    switch (kind) {
+        case Kind::kJsonSchema: return from_json_schema(source, error);
+        case Kind::kEbnf: return parse_ebnf(source, error);
+        case Kind::kNone: break;
+    }
+    *error = "Unknown grammar kind";
+    return nullptr;
+}
+
+// ---- Parser stacks ----
+
+// Parser stacks as hash-consed linked lists: a node is (element position,
+// parent), so equal stacks share one id and a stack set is a sorted vector
+// of ids. The top of a live stack is always a byte element; -1 is the empty
+// stack of a completed parse. Advancing a single stack over a byte is
+// memoized, which makes the trie walk through a long run of string bytes
+// one lookup per byte.
+class GrammarRunner {
+public:
+    static constexpr int32_t kAccepted = -1;
+
+    explicit GrammarRunner(const Grammar& grammar) : grammar_(grammar) {}
+
+    void reset() {
+        nodes_.clear();
+        index_.clear();
+        memo_.clear();
+        memo_pool_.clear();
+    }
+
+    size_t size() const { return nodes_.size(); }
+
+    void initial(std::vector<int32_t>* out) {
+        out->clear();
+        for (uint32_t start : grammar_.rule_starts_[grammar_.root_]) expand(start, kAccepted, out, 0);
+        normalize(out);
+    }
+
+    // `stack` bottom first; an empty stack is kAccepted
+    int32_t intern_stack(const std::vector<uint32_t>& stack) {
+        int32_t id = kAccepted;
+        for (uint32_t pos : stack) id = intern(pos, id);
+        return id;
+    }
+
+    void extract(int32_t id, std::vector<uint32_t>* stack) const {
+        stack->clear();
+        for (; id != kAccepted; id = nodes_[id].parent) stack->push_back(nodes_[id].pos);
+        std::reverse(stack->begin(), stack->end());
+    }
+
+    // The stacks `in` leads to after `byte`, sorted and unique
+    void advance(const std::vector<int32_t>& in, uint8_t byte, std::vector<int32_t>* out) {
+        out->clear();
+        for (int32_t id : in) {
+            if (id == kAccepted) continue;
+            const uint64_t key = (static_cast<uint64_t>(id) << 8) | byte;
+            auto memo = memo_.find(key);
+            if (memo == memo_.end()) {
+                scratch_.clear();
+                const Node node = nodes_[id];
+                if (grammar_.byte_sets_[grammar_.elements_[node.pos].value].contains(byte)) {
+                    expand(node.pos + 1, node.parent, &scratch_, 0);
+                    normalize(&scratch_);
+                }
+                const uint32_t begin = static_cast<uint32_t>(memo_pool_.size());
+                memo_pool_.insert(memo_pool_.end(), scratch_.begin(), scratch_.end());
+                memo = memo_.emplace(key, std::make_pair(begin, static_cast<uint32_t>(scratch_.size()))).first;
+            }
+            out->insert(out->end(), memo_pool_.begin() + memo->second.first,
+                        memo_pool_.begin() + memo->second.first + memo->second.second);
+        }
+        if (in.size() > 1) normalize(out);
+    }
+
+private:
+    struct Node {
+        uint32_t pos;
+        int32_t parent;
+    };
+
+    static void normalize(std::vector<int32_t>* ids) {
+        std::sort(ids->begin(), ids->end());
+        ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+    }
+
+    int32_t intern(uint32_t pos, int32_t parent) {
+        const uint64_t key = (static_cast<uint64_t>(pos) << 32) | static_cast<uint32_t>(parent);
+        auto it = index_.find(key);
+        if (it != index_.end()) return it->second;
+        const int32_t id = static_cast<int32_t>(nodes_.size());
+        nodes_.push_back(Node{pos, parent});
+        index_.emplace(key, id);
+        return id;
+    }
+
+    // Resolves the element at `pos` (with `parent` below it) into stacks
+    // whose tops are byte elements. A rule reference pushes its return
+    // position unless that is the end of the alternative (a tail call).
+    void expand(uint32_t pos, int32_t parent, std::vector<int32_t>* out, int depth) {
+        if (depth > kMaxExpandDepth) return;
+        const Grammar::Element element = grammar_.elements_[pos];
+        switch (element.type) {
+            case Grammar::kBytes:
+                out->push_back(intern(pos, parent));
+                return;
+            case Grammar::kEnd:
+                if (parent == kAccepted) {
+                    out->push_back(kAccepted);
+                } else {
+                    const Node caller = nodes_[parent];
+                    expand(caller.pos, caller.parent, out, depth + 1);
+                }
+                return;
+            case Grammar::kRule: {
+                const int32_t below =
+                    grammar_.elements_[pos + 1].type == Grammar::kEnd ? parent : intern(pos + 1, parent);
+                for (uint32_t start : grammar_.rule_starts_[element.value]) expand(start, below, out, depth + 1);
+                return;
+            }
+        }
+    }
+
+    const Grammar& grammar_;
+    std::vector<Node> nodes_;
+    std::unordered_map<uint64_t, int32_t> index_;
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> memo_; // (stack, byte) -> memo_pool_ range
+    std::vector<int32_t> memo_pool_;
+    std::vector<int32_t> scratch_;
+};
+
+// ---- Matcher ----
+
+GrammarMatcher::GrammarMatcher(std::shared_ptr<const Grammar> grammar)
+    : grammar_(std::move(grammar)), runner_(new GrammarRunner(*grammar_)) {
+    std::vector<int32_t> ids;
+    runner_->initial(&ids);
+    stacks_.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) runner_->extract(ids[i], &stacks_[i]);
+    std::sort(stacks_.begin(), stacks_.end());
+    update_key();
+}
+
+GrammarMatcher::GrammarMatcher(const GrammarMatcher& other)
+    : grammar_(other.grammar_), stacks_(other.stacks_), key_(other.key_), runner_(new GrammarRunner(*grammar_)) {}
+
+GrammarMatcher::~GrammarMatcher() = default;
+
+bool GrammarMatcher::accept(std::string_view bytes) {
+    // A fresh arena per token keeps it from growing over a long reply
+    runner_->reset();
+    std::vector<int32_t> current, next;
+    for (const auto& stack : stacks_) current.push_back(runner_->intern_stack(stack));
+    std::sort(current.begin(), current.end());
+    for (unsigned char byte : bytes) {
+        runner_->advance(current, byte, &next);
+        if (next.empty()) return false;
+        current.swap(next);
+    }
+
+    stacks_.resize(current.size());
+    for (size_t i = 0; i < current.size(); i++) runner_->extract(current[i], &stacks_[i]);
+    std::sort(stacks_.begin(), stacks_.end());
+    update_key();
+    return true;
+}
+
+bool GrammarMatcher::can_stop() const {
+    return !stacks_.empty() && stacks_.front().empty();
+}
+
+bool GrammarMatcher::finished() const {
+    return stacks_.size() == 1 && stacks_.front().empty();
+}
+
+void GrammarMatcher::update_key() {
+    key_.clear();
+    for (const auto& stack : stacks_) {
+        key_.append(reinterpret_cast<const char*>(stack.data()), stack.size() * sizeof(uint32_t));
+        const uint32_t separator = ~uint32_t(0);
+        key_.append(reinterpret_cast<const char*>(&separator), sizeof(separator));
+    }
+}
+
+// ---- Vocabulary trie ----
+
+// Inserts tokens in byte order, so each node's children are appended in
+// order and the tokens ending at a node are contiguous in tokens_.
+TokenTrie::TokenTrie(int32_t vocab_size, const std::function<std::string(int32_t)>& token_bytes,
+                     const std::function<bool(int32_t)>& is_stop_token)
+    : vocab_size_(vocab_size) {
+    std::vector<std::pair<std::string, int32_t>> entries;
+    entries.reserve(static_cast<size_t>(std::max(0, vocab_size)));
+    for (int32_t token = 0; token < vocab_size; token++) {
+        if (is_stop_token(token)) {
+            stop_tokens_.push_back(token);
+            continue;
+        }
+        std::string bytes = token_bytes(token);
+        if (!bytes.empty()) entries.emplace_back(std::move(bytes), token);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    nodes_.emplace_back();
+    std::vector<int32_t> last_child(1, -1);
+    std::vector<int32_t> path(1, 0);
+    const std::string* previous = nullptr;
+    tokens_.reserve(entries.size());
+    for (const auto& entry : entries) {
+        const std::string& bytes = entry.first;
+        size_t common = 0;
+        if (previous) {
+            const size_t limit = std::min(previous->size(), bytes.size());
+            while (common < limit && (*previous)[common] == bytes[common]) common++;
+        }
+        path.resize(common + 1);
+        for (size_t i = common; i < bytes.size(); i++) {
+            const int32_t parent = path.back();
+            const int32_t id = static_cast<int32_t>(nodes_.size());
+            nodes_.emplace_back();
+            nodes_.back().byte = static_cast<uint8_t>(bytes[i]);
+            last_child.push_back(-1);
+            if (last_child[parent] < 0) {
+                nodes_[parent].first_child = id;
+            } else {
+                nodes_[last_child[parent]].next_sibling = id;
+            }
+            last_child[parent] = id;
+            path.push_back(id);
+        }
+        Node& node = nodes_[path.back()];
+        if (node.token_begin == node.token_end) node.token_begin = static_cast<int32_t>(tokens_.size());
+        tokens_.push_back(entry.second);
+        node.token_end = static_cast<int32_t>(tokens_.size());
+        max_depth_ = std::max(max_depth_, bytes.size());
+        previous = &bytes;
+    }
+}
+
+size_t TokenTrie::bytes() const {
+    return nodes_.capacity() * sizeof(Node) + (tokens_.capacity() + stop_tokens_.capacity()) * sizeof(int32_t);
+}
+
+// ---- Mask cache ----
+
+TokenMaskCache::TokenMaskCache(std::shared_ptr<const TokenTrie> trie, size_t capacity_bytes)
+    : trie_(std::move(trie)), capacity_bytes_(capacity_bytes) {
+    levels_.resize(trie_->max_depth_ + 2);
+    MemoryAccounting::instance().add(MemoryCategory::kScratch, static_cast<int64_t>(trie_->bytes()));
+}
+
+TokenMaskCache::~TokenMaskCache() {
+    clear();
+    MemoryAccounting::instance().sub(MemoryCategory::kScratch, static_cast<int64_t>(trie_->bytes()));
+}
+
+size_t TokenMaskCache::entry_bytes(const std::string& key) const {
+    return trie_->mask_words() * sizeof(uint32_t) + 2 * key.size() + 64;
+}
+
+std::shared_ptr<const TokenMask> TokenMaskCache::lookup(const GrammarMatcher& matcher, bool* computed) {
+    const uint64_t fingerprint = matcher.grammar().fingerprint();
+    key_.assign(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+    key_ += matcher.state_key();
+
+    auto it = entries_.find(key_);
+    if (it != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        stats_.hits++;
+        if (computed) *computed = false;
+        return it->second.mask;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const TokenMask> mask = compute(matcher);
+    stats_.compute_us += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    stats_.misses++;
+    if (computed) *computed = true;
+
+    const size_t bytes = entry_bytes(key_);
+    while (!lru_.empty() && stats_.bytes + bytes > capacity_bytes_) {
+        const size_t victim_bytes = entry_bytes(lru_.back());
+        entries_.erase(lru_.back());
+        lru_.pop_back();
+        stats_.bytes -= victim_bytes;
+        MemoryAccounting::instance().sub(MemoryCategory::kScratch, static_cast<int64_t>(victim_bytes));
+    }
+    if (bytes <= capacity_bytes_) {
+        lru_.push_front(key_);
+        entries_.emplace(key_, Entry{mask, lru_.begin()});
+        stats_.bytes += bytes;
+        MemoryAccounting::instance().add(MemoryCategory::kScratch, static_cast<int64_t>(bytes));
+    }
+    stats_.masks = entries_.size();
+    return mask;
+}
+
+size_t TokenMaskCache::clear() {
+    const size_t released = stats_.bytes;
+    entries_.clear();
+    lru_.clear();
+    stats_.bytes = 0;
+    stats_.masks = 0;
+    MemoryAccounting::instance().sub(MemoryCategory::kScratch, static_cast<int64_t>(released));
+    return released;
+}
+
+std::shared_ptr<TokenMask> TokenMaskCache::compute(const GrammarMatcher& matcher) {
+    auto mask = std::make_shared<TokenMask>();
+    mask->words.assign(trie_->mask_words(), 0);
+
+    // A runner is tied to one grammar; rebuild it when the grammar changes
+    if (!runner_ || runner_grammar_ != &matcher.grammar()) {
+        runner_.reset(new GrammarRunner(matcher.grammar()));
+        runner_grammar_ = &matcher.grammar();
+    }
+    runner_->reset();
+    std::vector<int32_t>& root = levels_[0];
+    root.clear();
+    for (const auto& stack : matcher.stacks()) root.push_back(runner_->intern_stack(stack));
+    std::sort(root.begin(), root.end());
+
+    walk(trie_->nodes_[0].first_child, 0, mask->words.data());
+    if (matcher.can_stop()) {
+        for (int32_t token : trie_->stop_tokens_) mask->words[token >> 5] |= 1u << (token & 31);
+    }
+    for (uint32_t word : mask->words) mask->allowed += static_cast<size_t>(__builtin_popcount(word));
+    return mask;
+}
+
+// Depth-first over the trie with the stack set reached by each node's
+// bytes; a subtree is skipped as soon as no stack survives its first byte.
+void TokenMaskCache::walk(int32_t child, size_t depth, uint32_t* words) {
+    const std::vector<TokenTrie::Node>& nodes = trie_->nodes_;
+    std::vector<int32_t>& next = levels_[depth + 1];
+    for (; child >= 0; child = nodes[child].next_sibling) {
+        const TokenTrie::Node& node = nodes[child];
+        runner_->advance(levels_[depth], node.byte, &next);
+        if (next.empty()) continue;
+        for (int32_t i = node.token_begin; i < node.token_end; i++) {
+            const int32_t token = trie_->tokens_[i];
+            words[token >> 5] |= 1u << (token & 31);
+        }
+        if (node.first_child >= 0) walk(node.first_child, depth + 1, words);
+    }
+}
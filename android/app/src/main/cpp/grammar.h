@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Grammar-constrained decoding: the output is kept inside a context-free
+// grammar by masking, before every sample, the logits of each token whose
+// bytes the grammar cannot accept next.
+//
+// A grammar is written in a GBNF-like EBNF (rules `name ::= ...`, "literals"
+// with C escapes, [character classes], `.`, groups, alternation and the *,
+// +, ? and {m,n} repetitions), or generated from a JSON schema. It compiles
+// to a byte-level pushdown automaton: flat alternatives of byte sets and
+// rule references. Repetitions become right-recursive rules whose tail
+// calls do not grow the stack, so a parser state is a small set of stacks
+// that recurs (inside every string, after every comma) instead of growing
+// with the output.
+//
+// Token masks are computed per parser state by walking a byte trie of the
+// vocabulary once, pruning every subtree the grammar rejects at its first
+// byte, and are cached by state: repeated states and repeated requests with
+// the same grammar cost one hash lookup per token.
+class Grammar {
+public:
+    enum class Kind : int32_t {
+        kNone = 0,
+        kJsonSchema = 1,
+        kEbnf = 2,
+    };
+
+    // nullptr with `error` set if the source does not compile
+    static std::shared_ptr<const Grammar> compile(Kind kind, std::string_view source, std::string* error);
+    static std::shared_ptr<const Grammar> parse_ebnf(std::string_view text, std::string* error);
+    static std::shared_ptr<const Grammar> from_json_schema(std::string_view schema, std::string* error);
+
+    // The EBNF from_json_schema() compiles. Supports type (and type lists),
+    // properties with required (in declaration order), items, minItems /
+    // maxItems, enum, const, anyOf / oneOf and local $ref to $defs or
+    // definitions; other keywords (pattern, format, lengths) are ignored.
+    static bool json_schema_to_ebnf(std::string_view schema, std::string* ebnf, std::string* error);
+
+    // Hash of the kind and source; masks are cached under it
+    uint64_t fingerprint() const { return fingerprint_; }
+    size_t rule_count() const { return rule_starts_.size(); }
+
+private:
+    friend class GrammarBuilder;
+    friend class GrammarRunner;
+
+    enum ElementType : uint8_t {
+        kEnd = 0,  // end of an alternative
+        kBytes,    // one byte out of byte_sets_[value]
+        kRule,     // rule `value`
+    };
+
+    struct Element {
+        ElementType type;
+        uint32_t value;
+    };
+
+    struct ByteSet {
+        uint64_t bits[4];
+        bool contains(uint8_t byte) const { return (bits[byte >> 6] >> (byte & 63)) & 1; }
+    };
+
+    Grammar() = default;
+
+    std::vector<Element> elements_;                // alternatives, each ending in kEnd
+    std::vector<ByteSet> byte_sets_;
+    std::vector<std::vector<uint32_t>> rule_starts_; // rule -> first element of each alternative
+    uint32_t root_ = 0;
+    uint64_t fingerprint_ = 0;
+};
+
+// Internal stack machine shared by the matcher and the mask walk
+class GrammarRunner;
+
+// One request's position in its grammar. Not thread-safe.
+class GrammarMatcher {
+public:
+    explicit GrammarMatcher(std::shared_ptr<const Grammar> grammar);
+    ~GrammarMatcher();
+
+    GrammarMatcher(const GrammarMatcher& other);
+    GrammarMatcher& operator=(const GrammarMatcher&) = delete;
+
+    // Advances over `bytes` (a token's raw text); false, leaving the state
+    // as it was, if the grammar cannot accept them
+    bool accept(std::string_view bytes);
+
+    // The grammar is complete here, so a stop token is allowed
+    bool can_stop() const;
+    // Nothing but a stop token can follow
+    bool finished() const;
+
+    const Grammar& grammar() const { return *grammar_; }
+
+    // Identifies the parser state: equal keys take the same tokens
+    const std::string& state_key() const { return key_; }
+
+    // Parser stacks, bottom first; an empty stack is a completed parse
+    const std::vector<std::vector<uint32_t>>& stacks() const { return stacks_; }
+
+private:
+    void update_key();
+
+    std::shared_ptr<const Grammar> grammar_;
+    std::vector<std::vector<uint32_t>> stacks_; // sorted and unique
+    std::string key_;
+    std::unique_ptr<GrammarRunner> runner_;
+};
+
+// The model's vocabulary as a byte trie, built once per chat module. Stop
+// tokens and tokens without bytes are kept out of the trie; stop tokens are
+// allowed exactly where the grammar can end.
+class TokenTrie {
+public:
+    TokenTrie(int32_t vocab_size, const std::function<std::string(int32_t)>& token_bytes,
+              const std::function<bool(int32_t)>& is_stop_token);
+
+    int32_t vocab_size() const { return vocab_size_; }
+    size_t mask_words() const { return (static_cast<size_t>(vocab_size_) + 31) / 32; }
+    size_t node_count() const { return nodes_.size(); }
+    size_t bytes() const;
+
+private:
+    friend class TokenMaskCache;
+
+    struct Node {
+        int32_t first_child = -1;
+        int32_t next_sibling = -1;
+        int32_t token_begin = 0; // tokens_[token_begin, token_end) end exactly here
+        int32_t token_end = 0;
+        uint8_t byte = 0;
+    };
+
+    int32_t vocab_size_;
+    std::vector<Node> nodes_; // nodes_[0] is the root
+    std::vector<int32_t> tokens_;
+    std::vector<int32_t> stop_tokens_;
+    size_t max_depth_ = 0;
+};
+
+// A vocab bitmask: bit t of words[t / 32] is set if token t is allowed.
+struct TokenMask {
+    std::vector<uint32_t> words;
+    size_t allowed = 0;
+};
+
+// LRU cache of token masks keyed by grammar fingerprint and parser state,
+// for one vocabulary. Masks are computed on a miss. Not thread-safe: owned
+// by an engine worker.
+class TokenMaskCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        int64_t compute_us = 0; // total time spent computing masks
+        size_t masks = 0;
+        size_t bytes = 0;
+    };
+
+    static constexpr size_t kDefaultCapacityBytes = 16u << 20;
+
+    explicit TokenMaskCache(std::shared_ptr<const TokenTrie> trie, size_t capacity_bytes = kDefaultCapacityBytes);
+    ~TokenMaskCache();
+
+    TokenMaskCache(const TokenMaskCache&) = delete;
+    TokenMaskCache& operator=(const TokenMaskCache&) = delete;
+
+    // The mask for the matcher's state; `computed` reports a miss
+    std::shared_ptr<const TokenMask> lookup(const GrammarMatcher& matcher, bool* computed = nullptr);
+
+    // Drops every mask; returns the bytes released
+    size_t clear();
+
+    const TokenTrie& trie() const { return *trie_; }
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Entry {
+        std::shared_ptr<const TokenMask> mask;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::shared_ptr<TokenMask> compute(const GrammarMatcher& matcher);
+    void walk(int32_t first_child, size_t depth, uint32_t* words);
+    size_t entry_bytes(const std::string& key) const;
+
+    std::shared_ptr<const TokenTrie> trie_;
+    size_t capacity_bytes_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_; // most recent first
+    Stats stats_;
+
+    // Scratch of the trie walk: the parser's stack set at each depth
+    std::unique_ptr<GrammarRunner> runner_;
+    const Grammar* runner_grammar_ = nullptr;
+    std::vector<std::vector<int32_t>> levels_;
+    std::string key_;
+};
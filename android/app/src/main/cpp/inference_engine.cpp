@@ -0,0 +1,878 @@
+#include "inference_engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <vector>
+
+#include "mlc_log.h"
+#include "ngram_draft.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+static constexpr uint64_t kTokenHashSeed = 14695981039346656037ull;
+
+// FNV-1a over token ids, chained through `hash`
+static uint64_t hash_tokens(uint64_t hash, const int32_t* tokens, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        hash ^= static_cast<uint32_t>(tokens[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Where a windowed sequence's evictions start: the sinks, rounded up to
+// what the module can evict
+static size_t window_sink_end(const GenerationParams& params, size_t granularity) {
+    const size_t sinks = static_cast<size_t>(std::max(0, params.sink_tokens));
+    return (sinks + granularity - 1) / granularity * granularity;
+}
+
+bool RequestQueue::push(InferenceRequest&& request) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || size_ >= capacity_) {
+            return false;
+        }
+        pending_[static_cast<int>(request.priority)].push_back(std::move(request));
+        size_++;
+    }
+    available_.notify_one();
+    return true;
+}
+
+bool RequestQueue::pop(InferenceRequest* request, bool wait) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (wait) {
+        available_.wait(lock, [this] { return size_ > 0 || closed_ || interrupted_; });
+        if (size_ == 0 && interrupted_) {
+            interrupted_ = false;
+            return false;
+        }
+    }
+    for (int level = kPriorityLevels - 1; level >= 0; level--) {
+        if (!pending_[level].empty()) {
+            *request = std::move(pending_[level].front());
+            pending_[level].pop_front();
+            size_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::deque<InferenceRequest> RequestQueue::close() {
+    std::deque<InferenceRequest> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        for (int level = kPriorityLevels - 1; level >= 0; level--) {
+            for (auto& request : pending_[level]) {
+                dropped.push_back(std::move(request));
+            }
+            pending_[level].clear();
+        }
+        size_ = 0;
+    }
+    available_.notify_all();
+    return dropped;
+}
+
+void RequestQueue::interrupt() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        interrupted_ = true;
+    }
+    available_.notify_all();
+}
+
+size_t RequestQueue::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+InferenceEngine::InferenceEngine(std::string model_id, std::shared_ptr<ChatModule> chat,
+                                 const ModelRuntimeConfig& config, size_t queue_capacity,
+                                 std::shared_ptr<KvSnapshotStore> snapshots)
+    : model_id_(std::move(model_id)),
+      chat_(std::move(chat)),
+      config_(config),
+      snapshots_(std::move(snapshots)),
+      prefix_cache_(static_cast<size_t>(config.cache_size_bytes), config.kv_bytes_per_token()),
+      sampler_(static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())),
+      queue_(queue_capacity) {
+    if (snapshots_) snapshot_format_ = chat_->snapshot_format();
+    speculation_enabled_ = config_.speculative_decoding && config_.speculative_max_draft > 0 && chat_->supports_verify();
+    shrinker_id_ = MemoryPool::instance().add_shrinker([this](int64_t bytes) { request_trim(bytes); });
+    worker_ = std::thread(&InferenceEngine::worker_loop, this);
+}
+
+InferenceEngine::~InferenceEngine() {
+    shutdown();
+}
+
+bool InferenceEngine::submit(InferenceRequest&& request) {
+    if (stopping_.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    return queue_.push(std::move(request));
+}
+
+void InferenceEngine::request_trim(int64_t bytes) {
+    int64_t pending = trim_request_bytes_.load(std::memory_order_relaxed);
+    while (bytes > pending && !trim_request_bytes_.compare_exchange_weak(pending, bytes, std::memory_order_relaxed)) {
+    }
+    queue_.interrupt();
+}
+
+void InferenceEngine::shutdown() {
+    if (shrinker_id_ >= 0) {
+        MemoryPool::instance().remove_shrinker(shrinker_id_);
+        shrinker_id_ = -1;
+    }
+    stopping_.store(true, std::memory_order_relaxed);
+    for (auto& request : queue_.close()) {
+        if (request.on_complete) request.on_complete(-2);
+    }
+    if (worker_.joinable() && worker_.get_id() != std::this_thread::get_id()) {
+        worker_.join();
+    }
+}
+
+void InferenceEngine::worker_loop() {
+    LOGI("🧵 Inference engine started for %s", model_id_.c_str());
+    trace_set_thread_name("engine " + model_id_);
+    // Decode is the latency-critical path; its kernels fan out to the
+    // performance workers from here
+    pin_current_thread(ThreadPool::shared()->topology(), CoreClass::kPerformance);
+
+    while (true) {
+        apply_pending_trim();
+        if (!admit_requests()) {
+            if (stopping_.load(std::memory_order_relaxed)) break;
+            continue; // woken while idle to trim
+        }
+        iteration_++;
+        decode_phase();
+        prefill_step();
+        retire_finished();
+        update_kv_accounting();
+        // Watermarks only; the /proc poll runs on an efficiency worker
+        MemoryPool::instance().check_pressure(false);
+    }
+
+    for (SequenceId seq : prefix_cache_.clear()) {
+        chat_->remove_sequence(seq);
+    }
+    drop_windowed_sessions();
+    update_kv_accounting();
+
+    LOGI("🧵 Inference engine stopped for %s", model_id_.c_str());
+}
+
+// Pulls queued requests into the active set. Blocks only while nothing is
+// in flight; returns false once the engine is stopping and idle.
+bool InferenceEngine::admit_requests() {
+    if (stopping_.load(std::memory_order_relaxed)) {
+        for (auto& active : active_) {
+            if (!active->done) finish(*active, 0);
+        }
+        retire_finished();
+    }
+
+    const size_t limit = static_cast<size_t>(std::max(1, config_.max_concurrent_requests));
+    while (active_.size() < limit) {
+        InferenceRequest request;
+        if (!queue_.pop(&request, active_.empty())) {
+            break;
+        }
+        if (!admit(std::move(request))) {
+            retire_finished();
+        }
+    }
+
+    busy_.store(!active_.empty(), std::memory_order_relaxed);
+    return !active_.empty();
+}
+
+// Tokenizes the prompt and opens its sequence (resuming a windowed session or
+// forking a cached prefix when possible). The prompt itself is prefilled
+// chunk by chunk in prefill_step.
+bool InferenceEngine::admit(InferenceRequest&& request) {
+    active_.push_back(std::unique_ptr<ActiveSequence>(new ActiveSequence()));
+    ActiveSequence& active = *active_.back();
+    active.request = std::move(request);
+    active.arrival = next_arrival_++;
+
+    try {
+        {
+            TraceScope trace(TraceSpan::kTokenize, active.request.trace_id);
+            active.kv_tokens = chat_->tokenize(active.request.prompt);
+            trace.set_count(static_cast<int64_t>(active.kv_tokens.size()));
+        }
+        if (active.kv_tokens.empty()) {
+            LOGE("❌ Prompt tokenized to zero tokens");
+            finish(active, -1);
+            return false;
+        }
+
+        const bool resumed = resume_windowed_session(active);
+        if (!resumed) {
+            active.seq = start_sequence(active.kv_tokens, active.request, &active.prefilled);
+        }
+        if (active.seq < 0) {
+            LOGE("❌ Failed to open a KV-cache sequence");
+            finish(active, -1);
+            return false;
+        }
+
+        active.prompt_length = active.kv_tokens.size();
+        active.logits.resize(chat_->vocab_size());
+        if (active.request.params.grammar) {
+            if (!grammar_masks_) {
+                ChatModule* chat = chat_.get();
+                auto trie = std::make_shared<TokenTrie>(
+                    chat->vocab_size(), [chat](int32_t token) { return chat->token_to_piece(token); },
+                    [chat](int32_t token) { return chat->is_stop_token(token); });
+                grammar_masks_.reset(new TokenMaskCache(trie));
+                LOGI("🧩 Built vocabulary trie: %zu nodes for %d tokens", trie->node_count(), trie->vocab_size());
+            }
+            active.grammar.reset(new GrammarMatcher(active.request.params.grammar));
+        }
+        if (!resumed) {
+            reused_prefix_tokens_.fetch_add(active.prefilled, std::memory_order_relaxed);
+            LOGI("♻️ Prefix cache reused %zu of %zu prompt tokens", active.prefilled, active.prompt_length);
+        }
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception admitting MLC-LLM request: %s", e.what());
+        finish(active, -1);
+        return false;
+    }
+}
+
+// Emits the token selected from `logits` (modified in place) with the
+// request's own sampling parameters. Returns true if generation continues
+// and `token` must be fed back through the model.
+bool InferenceEngine::emit_token(ActiveSequence& active, float* logits, int32_t* token) {
+    try {
+        SamplerConfig sampling;
+        sampling.temperature = active.request.params.temperature;
+        sampling.top_p = active.request.params.top_p;
+        sampling.top_k = active.request.params.top_k;
+        sampling.repetition_penalty = config_.repetition_penalty;
+        sampling.presence_penalty = config_.presence_penalty;
+        sampling.frequency_penalty = config_.frequency_penalty;
+
+        const size_t vocab = static_cast<size_t>(chat_->vocab_size());
+        if (active.grammar) {
+            if (active.grammar->finished()) {
+                finish(active, 0);
+                return false;
+            }
+            TraceScope trace(TraceSpan::kGrammarMask, active.request.trace_id);
+            std::shared_ptr<const TokenMask> mask = grammar_masks_->lookup(*active.grammar);
+            trace.set_count(static_cast<int64_t>(mask->allowed));
+            if (mask->allowed == 0) {
+                LOGE("❌ Grammar allows no token after %d generated tokens", active.generated);
+                finish(active, -1);
+                return false;
+            }
+            Sampler::apply_token_mask(logits, mask->words.data(), vocab);
+        }
+
+        const int32_t* generated = active.kv_tokens.data() + active.prompt_length;
+        {
+            TraceScope trace(TraceSpan::kSample, active.request.trace_id);
+            *token = sampler_.sample(logits, vocab, sampling, generated, active.kv_tokens.size() - active.prompt_length);
+        }
+        if (chat_->is_stop_token(*token)) {
+            finish(active, 0);
+            return false;
+        }
+        std::string piece;
+        {
+            TraceScope trace(TraceSpan::kDetokenize, active.request.trace_id);
+            const std::string bytes = chat_->token_to_piece(*token);
+            // The mask only admits tokens the grammar accepts
+            if (active.grammar && !active.grammar->accept(bytes)) {
+                LOGE("❌ Sampled token %d outside the grammar", *token);
+                finish(active, -1);
+                return false;
+            }
+            active.detokenizer.push(bytes, &piece);
+        }
+        if (!active.request.on_token(*token, piece)) {
+            finish(active, 0);
+            return false;
+        }
+        if (++active.generated >= active.request.params.max_tokens) {
+            finish(active, 0);
+            return false;
+        }
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception while emitting token: %s", e.what());
+        finish(active, -1);
+        return false;
+    }
+}
+
+// The next token to feed: one already emitted by a speculative step, or a
+// new one from the sequence's logits.
+bool InferenceEngine::next_input_token(ActiveSequence& active, int32_t* token) {
+    if (active.pending_token >= 0) {
+        *token = active.pending_token;
+        active.pending_token = -1;
+        return true;
+    }
+    return emit_token(active, active.logits.data(), token);
+}
+
+// One decode step for every generating sequence. When more sequences are
+// generating than fit in a batch, higher priority goes first and, within a
+// priority, the sequence that waited longest. A lone sequence speculates
+// instead when the model supports it.
+void InferenceEngine::decode_phase() {
+    std::vector<ActiveSequence*> candidates;
+    for (auto& active : active_) {
+        if (active->decoding()) candidates.push_back(active.get());
+    }
+    if (candidates.empty()) return;
+    if (candidates.size() == 1 && speculation_enabled_ && speculative_step(*candidates[0])) return;
+
+    // Without batching every generating sequence still steps each iteration,
+    // just as its own model call
+    const size_t batch_limit = config_.enable_batching ? static_cast<size_t>(std::max(1, config_.max_batch_size))
+                                                       : candidates.size();
+    if (candidates.size() > batch_limit) {
+        std::stable_sort(candidates.begin(), candidates.end(), [](const ActiveSequence* a, const ActiveSequence* b) {
+            if (a->request.priority != b->request.priority) return a->request.priority > b->request.priority;
+            return a->last_decode_iteration < b->last_decode_iteration;
+        });
+    }
+
+    std::vector<ActiveSequence*> batch;
+    std::vector<SequenceId> seqs;
+    std::vector<int32_t> tokens;
+    std::vector<float*> logits;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (batch.size() == batch_limit) break;
+
+        ActiveSequence* active = candidates[i];
+        int32_t token;
+        if (!make_room(*active, 1) || !next_input_token(*active, &token)) continue;
+
+        batch.push_back(active);
+        seqs.push_back(active->seq);
+        tokens.push_back(token);
+        logits.push_back(active->logits.data());
+    }
+    if (batch.empty()) return;
+
+    bool ok = true;
+    try {
+        // A batch spans requests; only a lone sequence is attributed to one
+        TraceScope trace(TraceSpan::kDecodeStep, batch.size() == 1 ? batch[0]->request.trace_id : -1,
+                         static_cast<int64_t>(batch.size()));
+        if (config_.enable_batching) {
+            ok = chat_->batch_decode(seqs.data(), tokens.data(), batch.size(), logits.data());
+        } else {
+            for (size_t i = 0; i < batch.size() && ok; i++) {
+                ok = chat_->decode(seqs[i], tokens[i], logits[i]);
+            }
+        }
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception during MLC-LLM decode: %s", e.what());
+        ok = false;
+    }
+
+    if (!ok) {
+        LOGE("❌ MLC-LLM decode failed for a batch of %zu", batch.size());
+        for (ActiveSequence* active : batch) finish(*active, -1);
+        return;
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->kv_tokens.push_back(tokens[i]);
+        batch[i]->prefilled++;
+        batch[i]->last_decode_iteration = iteration_;
+    }
+    decode_batches_.fetch_add(1, std::memory_order_relaxed);
+    decoded_tokens_.fetch_add(batch.size(), std::memory_order_relaxed);
+}
+
+// Prompt-lookup speculation for a lone sequence: the next input token plus
+// a draft copied from an earlier match in its own context go through the
+// model in one verify pass, which on a bandwidth-bound device costs about
+// as much as decoding a single token.
+//
+// Each row of verify logits is sampled exactly as a normal step would be,
+// and a draft token is kept only if the sample equals it. With a
+// single-token draft that is the standard rejection rule, so output follows
+// the same distribution as without speculation (and is identical under
+// greedy decoding). The first mismatching sample, or the sample after a
+// fully accepted draft, is emitted and becomes the next step's input; the
+// KV of rejected draft tokens is popped.
+//
+// Returns false, leaving the step to the normal path, if nothing matched.
+bool InferenceEngine::speculative_step(ActiveSequence& active) {
+    int32_t first;
+    if (!next_input_token(active, &first)) return true;
+
+    const size_t remaining = static_cast<size_t>(std::max(0, active.request.params.max_tokens - active.generated));
+    if (active.draft_length == 0) {
+        active.draft_length = static_cast<size_t>(config_.speculative_max_draft);
+    }
+    active.kv_tokens.push_back(first);
+    propose_ngram_draft(active.kv_tokens.data(), active.kv_tokens.size(),
+                        static_cast<size_t>(std::max(1, config_.speculative_max_ngram)),
+                        std::min(active.draft_length, remaining), &draft_);
+    if (draft_.empty()) {
+        active.kv_tokens.pop_back();
+        active.pending_token = first;
+        return false;
+    }
+
+    const size_t drafted = draft_.size();
+    const size_t vocab = static_cast<size_t>(chat_->vocab_size());
+    if (!make_room(active, drafted + 1)) return true;
+    verify_inputs_.assign(1, first);
+    verify_inputs_.insert(verify_inputs_.end(), draft_.begin(), draft_.end());
+    if (verify_logits_.size() < (drafted + 1) * vocab) {
+        verify_logits_.resize((drafted + 1) * vocab);
+    }
+
+    bool ok;
+    try {
+        TraceScope trace(TraceSpan::kVerify, active.request.trace_id, static_cast<int64_t>(drafted + 1));
+        ok = chat_->verify(active.seq, verify_inputs_.data(), drafted + 1, verify_logits_.data());
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception during MLC-LLM verify: %s", e.what());
+        ok = false;
+    }
+    if (!ok) {
+        LOGE("❌ MLC-LLM verify failed");
+        finish(active, -1);
+        return true;
+    }
+    active.prefilled = active.kv_tokens.size();
+
+    size_t accepted = 0;
+    for (size_t i = 0; i <= drafted; i++) {
+        int32_t token;
+        if (!emit_token(active, verify_logits_.data() + i * vocab, &token)) break;
+        if (i < drafted && token == draft_[i]) {
+            active.kv_tokens.push_back(token);
+            active.prefilled++;
+            accepted++;
+            continue;
+        }
+        active.pending_token = token;
+        break;
+    }
+
+    // The model holds every drafted token; keep only the accepted ones
+    if (accepted < drafted) {
+        try {
+            ok = chat_->pop_tokens(active.seq, drafted - accepted);
+        } catch (const std::exception& e) {
+            LOGE("❌ Exception rolling back rejected draft: %s", e.what());
+            ok = false;
+        }
+        if (!ok) {
+            LOGE("❌ Failed to roll back %zu rejected draft tokens", drafted - accepted);
+            finish(active, -1);
+        }
+    }
+
+    // Grow the draft while whole drafts are accepted, shrink it on misses
+    const size_t max_draft = static_cast<size_t>(std::max(1, config_.speculative_max_draft));
+    active.draft_length = accepted == drafted ? std::min(max_draft, active.draft_length + 2)
+                                              : std::max<size_t>(1, active.draft_length - 1);
+
+    active.last_decode_iteration = iteration_;
+    decode_batches_.fetch_add(1, std::memory_order_relaxed);
+    decoded_tokens_.fetch_add(accepted + 1, std::memory_order_relaxed);
+    speculative_steps_.fetch_add(1, std::memory_order_relaxed);
+    draft_tokens_.fetch_add(drafted, std::memory_order_relaxed);
+    accepted_draft_tokens_.fetch_add(accepted, std::memory_order_relaxed);
+    if (active.request.on_draft) active.request.on_draft(drafted, accepted);
+    return true;
+}
+
+// Runs one chunk of the highest-priority (then oldest) pending prompt.
+void InferenceEngine::prefill_step() {
+    ActiveSequence* next = nullptr;
+    for (auto& active : active_) {
+        if (active->done || active->prefilled == active->kv_tokens.size()) continue;
+        if (next == nullptr || active->request.priority > next->request.priority ||
+            (active->request.priority == next->request.priority && active->arrival < next->arrival)) {
+            next = active.get();
+        }
+    }
+    if (next == nullptr) return;
+
+    size_t chunk_limit = static_cast<size_t>(std::max(1, config_.prefill_chunk_size));
+    // A windowed prompt goes in chunks the window can take between evictions
+    if (next->request.params.window_tokens > 0) {
+        chunk_limit = std::min(chunk_limit, static_cast<size_t>(std::max(1, next->request.params.window_tokens / 2)));
+    }
+    const size_t count = std::min(chunk_limit, next->kv_tokens.size() - next->prefilled);
+    if (!make_room(*next, count)) return;
+
+    try {
+        const auto start = std::chrono::steady_clock::now();
+        bool ok;
+        {
+            TraceScope trace(TraceSpan::kPrefillChunk, next->request.trace_id, static_cast<int64_t>(count));
+            ok = chat_->prefill(next->seq, next->kv_tokens.data() + next->prefilled, count, next->logits.data());
+        }
+        if (!ok) {
+            LOGE("❌ MLC-LLM prefill failed");
+            finish(*next, -1);
+            return;
+        }
+        const int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        next->prefilled += count;
+        prefilled_tokens_.fetch_add(count, std::memory_order_relaxed);
+        prefill_chunks_.fetch_add(1, std::memory_order_relaxed);
+        last_prefill_chunk_us_.store(micros, std::memory_order_relaxed);
+        LOGI("⏱️ Prefill chunk %zu: %zu tokens in %lld us (%zu/%zu)", next->prefill_chunk_index, count,
+             (long long)micros, next->prefilled, next->prompt_length);
+        if (next->request.on_prefill_chunk) {
+            next->request.on_prefill_chunk(next->prefill_chunk_index, count, micros);
+        }
+        next->prefill_chunk_index++;
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception during MLC-LLM prefill: %s", e.what());
+        finish(*next, -1);
+    }
+}
+
+// Keeps a windowed sequence within its sinks plus window_tokens positions:
+// before `incoming` more are written, the oldest tokens after the sinks are
+// evicted, at least a quarter of the window at a time since every eviction
+// re-rotates the keys behind it. Returns false, finishing the request, if
+// the module cannot evict or failed to.
+bool InferenceEngine::make_room(ActiveSequence& active, size_t incoming) {
+    const GenerationParams& params = active.request.params;
+    if (params.window_tokens <= 0) return true;
+    const size_t granularity = chat_->eviction_granularity();
+    if (granularity == 0) {
+        LOGE("❌ %s cannot evict KV; a context window is unsupported", model_id_.c_str());
+        finish(active, -1);
+        return false;
+    }
+    const size_t window = static_cast<size_t>(params.window_tokens);
+    const size_t sinks = static_cast<size_t>(std::max(0, params.sink_tokens));
+    if (active.prefilled + incoming <= sinks + window) return true;
+
+    active.sink_end = window_sink_end(params, granularity);
+    if (active.prefilled <= active.sink_end) return true;
+
+    const size_t needed = active.prefilled + incoming - (sinks + window);
+    const size_t evictable = (active.prefilled - active.sink_end) / granularity * granularity;
+    const size_t wanted = (std::max(needed, window / 4) + granularity - 1) / granularity * granularity;
+    const size_t count = std::min(wanted, evictable);
+    if (count == 0) return true;
+
+    const size_t begin = active.sink_end;
+    bool ok;
+    try {
+        ok = chat_->evict_tokens(active.seq, begin, count);
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception evicting from the context window: %s", e.what());
+        ok = false;
+    }
+    if (!ok) {
+        LOGE("❌ Failed to evict %zu tokens from the context window", count);
+        finish(active, -1);
+        return false;
+    }
+
+    const auto first = active.kv_tokens.begin() + static_cast<std::ptrdiff_t>(begin);
+    active.evicted_hash = hash_tokens(active.evicted == 0 ? kTokenHashSeed : active.evicted_hash, &*first, count);
+    active.kv_tokens.erase(first, first + static_cast<std::ptrdiff_t>(count));
+    active.prefilled -= count;
+    if (active.prompt_length >= begin + count) {
+        active.prompt_length -= count;
+    } else if (active.prompt_length > begin) {
+        active.prompt_length = begin;
+    }
+    active.evicted += count;
+    evicted_tokens_.fetch_add(count, std::memory_order_relaxed);
+    LOGI("🪟 Evicted %zu tokens after %zu sinks (%zu so far, %zu in the window)", count, begin, active.evicted,
+         active.prefilled);
+    return true;
+}
+
+void InferenceEngine::finish(ActiveSequence& active, int status) {
+    active.done = true;
+    active.status = status;
+}
+
+// Completes finished requests. Successful sequences are saved to their
+// session's snapshot, then go to the prefix cache (with only the tokens
+// whose KV was actually written), or are kept for their session if they
+// evicted part of their context; failed ones are dropped. The caller is
+// told first so a snapshot write never delays the end of a reply.
+void InferenceEngine::retire_finished() {
+    for (auto it = active_.begin(); it != active_.end();) {
+        ActiveSequence& active = **it;
+        if (!active.done) {
+            ++it;
+            continue;
+        }
+
+        completed_requests_.fetch_add(1, std::memory_order_relaxed);
+        if (active.request.on_complete) active.request.on_complete(active.status);
+
+        if (active.seq >= 0) {
+            try {
+                const bool complete = active.status == 0 && active.prefilled == active.kv_tokens.size();
+                if (complete && active.evicted > 0 && !active.request.session_id.empty()) {
+                    keep_windowed_session(active);
+                } else if (complete && active.evicted == 0) {
+                    save_session(active);
+                    retire_sequence(active.seq, std::move(active.kv_tokens));
+                } else {
+                    chat_->remove_sequence(active.seq);
+                }
+            } catch (const std::exception& e) {
+                LOGE("❌ Exception releasing KV sequence: %s", e.what());
+            }
+        }
+        it = active_.erase(it);
+    }
+}
+
+// Opens a sequence for the prompt, forking the longest cached prefix or
+// restoring the session's snapshot, whichever covers more of the prompt. At
+// least one prompt token is always left to prefill so the caller gets fresh
+// logits.
+SequenceId InferenceEngine::start_sequence(const std::vector<int32_t>& prompt_tokens, const InferenceRequest& request,
+                                           size_t* reused) {
+    SequenceId seq = next_sequence_id_++;
+    PrefixCache::Match match = prefix_cache_.lookup(prompt_tokens);
+    *reused = std::min(match.length, prompt_tokens.size() - 1);
+
+    size_t restored = *reused;
+    if (restore_session(seq, prompt_tokens, request, &restored)) {
+        *reused = restored;
+        return seq;
+    }
+    if (*reused > 0 && chat_->fork_sequence(match.seq, seq, *reused)) {
+        return seq;
+    }
+    *reused = 0;
+    return chat_->add_sequence(seq) ? seq : -1;
+}
+
+// Restores `seq` from the request's session snapshot if that shares more
+// than `*restored` tokens with the prompt.
+bool InferenceEngine::restore_session(SequenceId seq, const std::vector<int32_t>& prompt_tokens,
+                                      const InferenceRequest& request, size_t* restored) {
+    if (!snapshots_ || snapshot_format_.empty() || request.session_id.empty() ||
+        *restored + 1 >= prompt_tokens.size()) {
+        return false;
+    }
+
+    TraceScope trace(TraceSpan::kSnapshotRestore, request.trace_id);
+    std::shared_ptr<const KvSnapshot> snapshot = snapshots_->open(request.session_id, model_id_, snapshot_format_);
+    if (!snapshot) return false;
+
+    const size_t limit = std::min(snapshot->token_count(), prompt_tokens.size() - 1);
+    const int32_t* tokens = snapshot->tokens();
+    size_t common = 0;
+    while (common < limit && tokens[common] == prompt_tokens[common]) common++;
+    if (common <= *restored) return false;
+
+    if (!chat_->restore_sequence(seq, snapshot, common)) {
+        LOGW("⚠️ Failed to restore session %s from its KV snapshot", request.session_id.c_str());
+        return false;
+    }
+    trace.set_count(static_cast<int64_t>(common));
+    *restored = common;
+    restored_tokens_.fetch_add(common, std::memory_order_relaxed);
+    LOGI("💾 Restored %zu tokens of session %s from its KV snapshot", common, request.session_id.c_str());
+    return true;
+}
+
+// Queues a completed turn's KV for its session snapshot. Only the capture
+// runs on the worker, the only thread allowed to touch the module; the store
+// writes, syncs and publishes the file on an efficiency core, holding the
+// module until then. A turn saved while the previous one is still being
+// written replaces it in the queue rather than waiting.
+void InferenceEngine::save_session(const ActiveSequence& active) {
+    const std::string& session_id = active.request.session_id;
+    if (!snapshots_ || snapshot_format_.empty() || session_id.empty() || snapshots_->stats().byte_budget <= 0) {
+        return;
+    }
+
+    TraceScope trace(TraceSpan::kSnapshotSave, active.request.trace_id, static_cast<int64_t>(active.kv_tokens.size()));
+    const auto start = std::chrono::steady_clock::now();
+    KvSnapshotCapture capture = chat_->capture_sequence(active.seq);
+    if (capture) {
+        // Holding the module keeps the pinned KV alive until it is written
+        capture = [chat = chat_, capture](KvSnapshotWriter* writer) { return capture(writer); };
+    }
+    const bool queued = capture && snapshots_->save(session_id, model_id_, snapshot_format_, active.kv_tokens,
+                                                    std::move(capture));
+    if (!queued) {
+        LOGW("⚠️ Failed to save the KV snapshot of session %s", session_id.c_str());
+        return;
+    }
+    const int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    LOGI("💾 Captured %zu tokens of session %s for its snapshot in %lld us", active.kv_tokens.size(),
+         session_id.c_str(), (long long)micros);
+}
+
+// Hands a finished sequence to the prefix cache and drops whatever the cache
+// evicts (or declines to keep).
+void InferenceEngine::retire_sequence(SequenceId seq, std::vector<int32_t> kv_tokens) {
+    for (SequenceId evicted : prefix_cache_.insert(seq, std::move(kv_tokens))) {
+        chat_->remove_sequence(evicted);
+    }
+}
+
+// Continues a session whose last turn ended windowed if the prompt extends
+// that turn's conversation: its sinks, its evicted tokens (by hash) and its
+// window must all match, with new tokens after them. The kept sequence is
+// dropped either way once the session is back.
+bool InferenceEngine::resume_windowed_session(ActiveSequence& active) {
+    const InferenceRequest& request = active.request;
+    if (request.session_id.empty()) return false;
+    auto it = windowed_sessions_.find(request.session_id);
+    if (it == windowed_sessions_.end()) return false;
+    WindowedSession session = std::move(it->second);
+    windowed_sessions_.erase(it);
+
+    const std::vector<int32_t>& prompt = active.kv_tokens;
+    const size_t logical = session.kv_tokens.size() + session.evicted;
+    const size_t granularity = chat_->eviction_granularity();
+    const auto window = session.kv_tokens.begin() + static_cast<std::ptrdiff_t>(session.sink_end);
+    const bool extends = request.params.window_tokens > 0 && granularity > 0 &&
+                         session.sink_end == window_sink_end(request.params, granularity) &&
+                         prompt.size() > logical &&
+                         std::equal(session.kv_tokens.begin(), window, prompt.begin()) &&
+                         hash_tokens(kTokenHashSeed, prompt.data() + session.sink_end, session.evicted) ==
+                             session.evicted_hash &&
+                         std::equal(window, session.kv_tokens.end(),
+                                    prompt.begin() + static_cast<std::ptrdiff_t>(session.sink_end + session.evicted));
+    if (!extends) {
+        chat_->remove_sequence(session.seq);
+        return false;
+    }
+
+    std::vector<int32_t> kv_tokens = std::move(session.kv_tokens);
+    active.prefilled = kv_tokens.size();
+    kv_tokens.insert(kv_tokens.end(), prompt.begin() + static_cast<std::ptrdiff_t>(logical), prompt.end());
+    active.kv_tokens = std::move(kv_tokens);
+    active.seq = session.seq;
+    active.sink_end = session.sink_end;
+    active.evicted = session.evicted;
+    active.evicted_hash = session.evicted_hash;
+    resumed_window_tokens_.fetch_add(active.prefilled, std::memory_order_relaxed);
+    LOGI("🪟 Resumed session %s with %zu tokens in the window (%zu evicted)", request.session_id.c_str(),
+         active.prefilled, active.evicted);
+    return true;
+}
+
+// Keeps a finished windowed sequence for its session's next turn, replacing
+// the session's previous one and evicting the least recently used past
+// kMaxWindowedSessions.
+void InferenceEngine::keep_windowed_session(ActiveSequence& active) {
+    const std::string& session_id = active.request.session_id;
+    auto it = windowed_sessions_.find(session_id);
+    if (it == windowed_sessions_.end() && windowed_sessions_.size() >= kMaxWindowedSessions) {
+        it = std::min_element(windowed_sessions_.begin(), windowed_sessions_.end(),
+                              [](const std::pair<const std::string, WindowedSession>& a,
+                                 const std::pair<const std::string, WindowedSession>& b) {
+                                  return a.second.last_used < b.second.last_used;
+                              });
+    }
+    if (it != windowed_sessions_.end()) {
+        chat_->remove_sequence(it->second.seq);
+        windowed_sessions_.erase(it);
+    }
+
+    WindowedSession& session = windowed_sessions_[session_id];
+    session.seq = active.seq;
+    session.kv_tokens = std::move(active.kv_tokens);
+    session.sink_end = active.sink_end;
+    session.evicted = active.evicted;
+    session.evicted_hash = active.evicted_hash;
+    session.last_used = iteration_;
+}
+
+void InferenceEngine::drop_windowed_sessions() {
+    for (auto& entry : windowed_sessions_) {
+        try {
+            chat_->remove_sequence(entry.second.seq);
+        } catch (const std::exception& e) {
+            LOGE("❌ Exception releasing KV sequence: %s", e.what());
+        }
+    }
+    windowed_sessions_.clear();
+}
+
+// Evicts cached prefixes for a pending pressure request. Active sequences
+// are never touched; their KV is released as they finish.
+void InferenceEngine::apply_pending_trim() {
+    const int64_t bytes = trim_request_bytes_.exchange(0, std::memory_order_relaxed);
+    if (bytes <= 0) return;
+
+    const size_t before = prefix_cache_.stats().bytes;
+    for (SequenceId seq : prefix_cache_.shrink(static_cast<size_t>(bytes))) {
+        try {
+            chat_->remove_sequence(seq);
+        } catch (const std::exception& e) {
+            LOGE("❌ Exception releasing KV sequence: %s", e.what());
+        }
+    }
+    if (!windowed_sessions_.empty()) {
+        LOGW("♻️ Memory pressure: dropped %zu windowed sessions", windowed_sessions_.size());
+        drop_windowed_sessions();
+    }
+    if (grammar_masks_) {
+        const size_t released = grammar_masks_->clear();
+        if (released > 0) LOGW("♻️ Memory pressure: dropped %zu KB of grammar masks", released / 1024);
+    }
+    LOGW("♻️ Memory pressure: trimmed prefix cache of %s from %zu to %zu MB", model_id_.c_str(),
+         before / (1024 * 1024), prefix_cache_.stats().bytes / (1024 * 1024));
+    update_kv_accounting();
+}
+
+// Reports the KV blocks written for active sequences and kept windowed
+// sessions plus what the prefix cache holds. Forked prefixes are counted per
+// sequence, so this is an upper bound. Past kv_cache_bytes, cached prefixes
+// are evicted first.
+void InferenceEngine::update_kv_accounting() {
+    const KvCacheLayout layout = config_.kv_layout();
+    size_t active_bytes = 0;
+    for (const auto& active : active_) {
+        active_bytes += layout.bytes_for_tokens(active->prefilled);
+    }
+    for (const auto& entry : windowed_sessions_) {
+        active_bytes += layout.bytes_for_tokens(entry.second.kv_tokens.size());
+    }
+    const int64_t over = static_cast<int64_t>(active_bytes + prefix_cache_.stats().bytes) - config_.kv_cache_bytes;
+    if (config_.kv_cache_bytes > 0 && over > 0 && prefix_cache_.stats().entries > 0) {
+        for (SequenceId seq : prefix_cache_.shrink(static_cast<size_t>(over))) {
+            try {
+                chat_->remove_sequence(seq);
+            } catch (const std::exception& e) {
+                LOGE("❌ Exception releasing KV sequence: %s", e.what());
+            }
+        }
+    }
+    const int64_t bytes = static_cast<int64_t>(active_bytes + prefix_cache_.stats().bytes);
+    if (bytes != accounted_kv_bytes_) {
+        MemoryAccounting::instance().add(MemoryCategory::kKvCache, bytes - accounted_kv_bytes_);
+        accounted_kv_bytes_ = bytes;
+    }
+}
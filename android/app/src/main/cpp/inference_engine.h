@@ -0,0 +1,288 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_module.h"
+#include "grammar.h"
+#include "kv_snapshot.h"
+#include "memory_pool.h"
+#include "model_config.h"
+#include "prefix_cache.h"
+#include "sampler.h"
+#include "tokenizer.h"
+
+// Sampling parameters passed down from generateResponseNative / startStreamingNative
+struct GenerationParams {
+    int max_tokens = 150;
+    float temperature = 0.7f;
+    float top_p = 0.9f;
+    int top_k = 40;
+    // Optional: output is constrained to this grammar (see grammar.h)
+    std::shared_ptr<const Grammar> grammar;
+    // Attention-sink sliding window: with window_tokens > 0 the sequence
+    // keeps its first sink_tokens positions plus at most window_tokens recent
+    // ones, evicting in between, so a session can run past the context size
+    int sink_tokens = 4;
+    int window_tokens = 0;
+};
+
+// Called for every generated token; returning false stops generation early.
+// `piece` is the text the token completes: whole UTF-8 characters only, so
+// it is empty while a character spans several tokens.
+using TokenCallback = std::function<bool(int32_t token, const std::string& piece)>;
+
+// Reports one prefill chunk: its index, token count and wall time.
+using PrefillChunkCallback = std::function<void(size_t chunk, size_t tokens, int64_t micros)>;
+
+// Reports one speculative step: draft tokens verified and how many were kept.
+using DraftCallback = std::function<void(size_t drafted, size_t accepted)>;
+
+// Called exactly once per request: 0 on success (including early stop),
+// -1 if inference failed, -2 if the request was dropped before it ran.
+using CompletionCallback = std::function<void(int status)>;
+
+enum class RequestPriority : int {
+    kBackground = 0,
+    kNormal = 1,
+    kInteractive = 2,
+};
+
+struct InferenceRequest {
+    std::string prompt;
+    GenerationParams params;
+    RequestPriority priority = RequestPriority::kNormal;
+    TokenCallback on_token;
+    PrefillChunkCallback on_prefill_chunk; // optional
+    DraftCallback on_draft;                // optional
+    CompletionCallback on_complete;
+    int64_t trace_id = -1; // tags this request's trace spans; assigned by the caller
+    std::string session_id; // optional; the conversation's KV is kept across turns and restarts
+};
+
+// Bounded multi-producer queue drained by a single engine worker. Producers
+// are JNI threads, which only hold the lock for a deque push; higher
+// priorities are always served first, FIFO within a priority.
+class RequestQueue {
+public:
+    explicit RequestQueue(size_t capacity) : capacity_(capacity) {}
+
+    // Returns false if the queue is full or closed.
+    bool push(InferenceRequest&& request);
+
+    // Takes the highest-priority request. With `wait`, blocks until one is
+    // available; returns false if there is none (or the queue is closed).
+    bool pop(InferenceRequest* request, bool wait);
+
+    // Rejects further pushes and hands back everything still queued.
+    std::deque<InferenceRequest> close();
+
+    // Makes one waiting (or the next) blocking pop return false without a
+    // request, so an idle worker can run housekeeping.
+    void interrupt();
+
+    size_t size() const;
+
+private:
+    static constexpr int kPriorityLevels = 3;
+
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    std::deque<InferenceRequest> pending_[kPriorityLevels];
+    size_t size_ = 0;
+    bool closed_ = false;
+    bool interrupted_ = false;
+};
+
+// Owns one loaded chat module and serves its requests on a dedicated worker
+// thread, so a long generation on one model never blocks JNI calls that
+// target another model or the runtime itself.
+//
+// The worker is an iteration-level (continuous batching) scheduler: up to
+// max_concurrent_requests sequences are in flight and are admitted or
+// retired between any two steps. Every iteration runs one decode step for
+// all sequences that are generating, batched into a single model call of at
+// most max_batch_size rows, then at most one prefill chunk of
+// prefill_chunk_size tokens. A long prompt therefore delays other
+// conversations by one chunk per token, never by its whole prefill, and
+// background requests ride along in the foreground chat's decode steps.
+//
+// When a single sequence is generating, batching has nothing to amortize
+// the weight reads over, so the engine speculates instead: drafts copied
+// from n-gram matches in the sequence's own context are verified in one
+// forward pass (see speculative_step), with the draft length adapting to
+// how much of each draft is accepted.
+//
+// Logits buffers come from the MemoryPool, and the KV held by active and
+// cached sequences is reported under MemoryCategory::kKvCache in whole KV
+// blocks, evicting cached prefixes to stay within kv_cache_bytes. Under memory
+// pressure the pool asks the engine to trim its prefix cache, which the
+// worker does between iterations (waking up if idle).
+//
+// With a snapshot store, a request that names its session saves the
+// session's KV when it completes, and a later request for the same session
+// (after a restart, or once the prefix cache has evicted it) restores the
+// longest common prefix from the snapshot instead of prefilling it.
+//
+// A request with a window (GenerationParams::window_tokens) keeps its
+// attention sinks and the most recent tokens once it outgrows them; the
+// module evicts whole KV blocks in between (see make_room). Such a sequence
+// no longer matches its token stream prefix by prefix, so it skips the
+// prefix cache and snapshots: its session is kept in memory instead and
+// resumed if the next turn extends the same conversation. On a module that
+// cannot evict, windowed requests fail (see supports_window).
+class InferenceEngine {
+public:
+    static constexpr size_t kDefaultQueueCapacity = 16;
+
+    InferenceEngine(std::string model_id, std::shared_ptr<ChatModule> chat, const ModelRuntimeConfig& config,
+                    size_t queue_capacity = kDefaultQueueCapacity,
+                    std::shared_ptr<KvSnapshotStore> snapshots = nullptr);
+    ~InferenceEngine();
+
+    InferenceEngine(const InferenceEngine&) = delete;
+    InferenceEngine& operator=(const InferenceEngine&) = delete;
+
+    // Queues a request; returns false (without calling on_complete) if the
+    // queue is full or the engine is shutting down.
+    bool submit(InferenceRequest&& request);
+
+    // Stops the worker: queued requests complete with -2 and the running one
+    // is stopped at its next decode step. Safe to call more than once.
+    void shutdown();
+
+    // Asks the worker to evict about `bytes` of cached KV. Non-blocking.
+    void request_trim(int64_t bytes);
+
+    const std::string& model_id() const { return model_id_; }
+    // Whether requests may set GenerationParams::window_tokens
+    bool supports_window() const { return chat_->eviction_granularity() > 0; }
+    size_t queued_requests() const { return queue_.size(); }
+    uint64_t completed_requests() const { return completed_requests_.load(std::memory_order_relaxed); }
+    bool busy() const { return busy_.load(std::memory_order_relaxed); }
+    uint64_t prefilled_tokens() const { return prefilled_tokens_.load(std::memory_order_relaxed); }
+    uint64_t reused_prefix_tokens() const { return reused_prefix_tokens_.load(std::memory_order_relaxed); }
+    uint64_t restored_tokens() const { return restored_tokens_.load(std::memory_order_relaxed); }
+    uint64_t prefill_chunks() const { return prefill_chunks_.load(std::memory_order_relaxed); }
+    int64_t last_prefill_chunk_us() const { return last_prefill_chunk_us_.load(std::memory_order_relaxed); }
+    uint64_t decode_batches() const { return decode_batches_.load(std::memory_order_relaxed); }
+    uint64_t decoded_tokens() const { return decoded_tokens_.load(std::memory_order_relaxed); }
+    uint64_t speculative_steps() const { return speculative_steps_.load(std::memory_order_relaxed); }
+    uint64_t draft_tokens() const { return draft_tokens_.load(std::memory_order_relaxed); }
+    uint64_t accepted_draft_tokens() const { return accepted_draft_tokens_.load(std::memory_order_relaxed); }
+    uint64_t evicted_tokens() const { return evicted_tokens_.load(std::memory_order_relaxed); }
+    uint64_t resumed_window_tokens() const { return resumed_window_tokens_.load(std::memory_order_relaxed); }
+
+private:
+    // One admitted request and its KV sequence
+    struct ActiveSequence {
+        InferenceRequest request;
+        SequenceId seq = -1;
+        uint64_t arrival = 0;
+        std::vector<int32_t> kv_tokens; // prompt, then every decoded token
+        size_t prefilled = 0;           // tokens of kv_tokens already in the KV cache
+        size_t prompt_length = 0;
+        size_t prefill_chunk_index = 0;
+        PoolBuffer<float> logits;       // valid once the prompt is fully prefilled
+        int generated = 0;
+        uint64_t last_decode_iteration = 0;
+        IncrementalDetokenizer detokenizer; // holds a partial character between tokens
+        int32_t pending_token = -1; // emitted by a speculative step, not yet in the KV cache
+        size_t draft_length = 0;    // current speculative draft size; 0 until the first draft
+        std::unique_ptr<GrammarMatcher> grammar; // set if the request is constrained
+        size_t sink_end = 0;       // windowed: evictions start at this position
+        size_t evicted = 0;        // windowed: tokens evicted from after the sinks
+        uint64_t evicted_hash = 0; // windowed: hash of the evicted tokens, in order
+        bool done = false;
+        int status = 0;
+
+        bool decoding() const { return prefilled == kv_tokens.size() && !done; }
+    };
+
+    // A finished windowed sequence kept for its session's next turn
+    struct WindowedSession {
+        SequenceId seq = -1;
+        std::vector<int32_t> kv_tokens;
+        size_t sink_end = 0;
+        size_t evicted = 0;
+        uint64_t evicted_hash = 0;
+        uint64_t last_used = 0;
+    };
+
+    static constexpr size_t kMaxWindowedSessions = 4;
+
+    void worker_loop();
+    bool admit_requests();
+    bool admit(InferenceRequest&& request);
+    void decode_phase();
+    bool emit_token(ActiveSequence& active, float* logits, int32_t* token);
+    bool next_input_token(ActiveSequence& active, int32_t* token);
+    bool speculative_step(ActiveSequence& active);
+    void prefill_step();
+    bool make_room(ActiveSequence& active, size_t incoming);
+    void finish(ActiveSequence& active, int status);
+    void retire_finished();
+    SequenceId start_sequence(const std::vector<int32_t>& prompt_tokens, const InferenceRequest& request,
+                              size_t* reused);
+    bool restore_session(SequenceId seq, const std::vector<int32_t>& prompt_tokens, const InferenceRequest& request,
+                         size_t* restored);
+    void save_session(const ActiveSequence& active);
+    void retire_sequence(SequenceId seq, std::vector<int32_t> kv_tokens);
+    bool resume_windowed_session(ActiveSequence& active);
+    void keep_windowed_session(ActiveSequence& active);
+    void drop_windowed_sessions();
+    void apply_pending_trim();
+    void update_kv_accounting();
+
+    std::string model_id_;
+    std::shared_ptr<ChatModule> chat_;
+    ModelRuntimeConfig config_;
+    std::shared_ptr<KvSnapshotStore> snapshots_;
+    std::string snapshot_format_; // empty if the module cannot persist KV
+
+    // Worker-thread only
+    PrefixCache prefix_cache_;
+    Sampler sampler_;
+    SequenceId next_sequence_id_ = 0;
+    uint64_t next_arrival_ = 0;
+    uint64_t iteration_ = 0;
+    std::vector<std::unique_ptr<ActiveSequence>> active_;
+    int64_t accounted_kv_bytes_ = 0;
+    bool speculation_enabled_ = false;
+    std::vector<int32_t> draft_;
+    std::vector<int32_t> verify_inputs_;
+    PoolBuffer<float> verify_logits_; // one row per verified token
+    std::unique_ptr<TokenMaskCache> grammar_masks_; // built with the first constrained request
+    std::unordered_map<std::string, WindowedSession> windowed_sessions_;
+
+    RequestQueue queue_;
+    std::thread worker_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> busy_{false};
+    std::atomic<int64_t> trim_request_bytes_{0};
+    int shrinker_id_ = -1;
+    std::atomic<uint64_t> completed_requests_{0};
+    std::atomic<uint64_t> prefilled_tokens_{0};
+    std::atomic<uint64_t> reused_prefix_tokens_{0};
+    std::atomic<uint64_t> restored_tokens_{0};
+    std::atomic<uint64_t> prefill_chunks_{0};
+    std::atomic<int64_t> last_prefill_chunk_us_{0};
+    std::atomic<uint64_t> decode_batches_{0};
+    std::atomic<uint64_t> decoded_tokens_{0};
+    std::atomic<uint64_t> speculative_steps_{0};
+    std::atomic<uint64_t> draft_tokens_{0};
+    std::atomic<uint64_t> accepted_draft_tokens_{0};
+    std::atomic<uint64_t> evicted_tokens_{0};
+    std::atomic<uint64_t> resumed_window_tokens_{0};
+};
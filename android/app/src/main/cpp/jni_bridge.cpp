@@ -0,0 +1,223 @@
+#include "jni_bridge.h"
+
+#include <vector>
+
+#include "mlc_log.h"
+
+static JniCache g_jni;
+
+const JniCache& jni_cache() {
+    return g_jni;
+}
+
+static jclass find_global_class(JNIEnv* env, const char* name) {
+    jclass local = env->FindClass(name);
+    if (local == nullptr) {
+        LOGE("❌ JNI class not found: %s", name);
+        return nullptr;
+    }
+    jclass global = static_cast<jclass>(env->NewGlobalRef(local));
+    env->DeleteLocalRef(local);
+    return global;
+}
+
+static bool init_jni_cache(JNIEnv* env) {
+    g_jni.hash_map = find_global_class(env, "java/util/HashMap");
+    g_jni.map = find_global_class(env, "java/util/Map");
+    g_jni.number = find_global_class(env, "java/lang/Number");
+    g_jni.boolean_class = find_global_class(env, "java/lang/Boolean");
+    g_jni.long_class = find_global_class(env, "java/lang/Long");
+    if (!g_jni.hash_map || !g_jni.map || !g_jni.number || !g_jni.boolean_class || !g_jni.long_class) {
+        return false;
+    }
+
+    g_jni.hash_map_init = env->GetMethodID(g_jni.hash_map, "<init>", "(I)V");
+    g_jni.map_get = env->GetMethodID(g_jni.map, "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
+    g_jni.map_put = env->GetMethodID(g_jni.map, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+    g_jni.number_double_value = env->GetMethodID(g_jni.number, "doubleValue", "()D");
+    g_jni.boolean_value = env->GetMethodID(g_jni.boolean_class, "booleanValue", "()Z");
+    g_jni.boolean_value_of = env->GetStaticMethodID(g_jni.boolean_class, "valueOf", "(Z)Ljava/lang/Boolean;");
+    g_jni.long_value_of = env->GetStaticMethodID(g_jni.long_class, "valueOf", "(J)Ljava/lang/Long;");
+    return g_jni.hash_map_init && g_jni.map_get && g_jni.map_put && g_jni.number_double_value &&
+           g_jni.boolean_value && g_jni.boolean_value_of && g_jni.long_value_of;
+}
+
+extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    if (!init_jni_cache(env)) {
+        LOGE("❌ Failed to resolve JNI classes and methods");
+        return JNI_ERR;
+    }
+    LOGI("✅ JNI bridge ready");
+    return JNI_VERSION_1_6;
+}
+
+extern "C" JNIEXPORT void JNICALL JNI_OnUnload(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return;
+    }
+    for (jclass cls : {g_jni.hash_map, g_jni.map, g_jni.number, g_jni.boolean_class, g_jni.long_class}) {
+        if (cls) env->DeleteGlobalRef(cls);
+    }
+    g_jni = JniCache();
+}
+
+// Puts `value` under `key` and drops the three local refs involved
+static void map_put_object(JNIEnv* env, jobject map, const char* key, jobject value) {
+    jstring jkey = env->NewStringUTF(key);
+    jobject previous = env->CallObjectMethod(map, g_jni.map_put, jkey, value);
+    if (previous) env->DeleteLocalRef(previous);
+    env->DeleteLocalRef(jkey);
+    if (value) env->DeleteLocalRef(value);
+}
+
+jobject new_hash_map(JNIEnv* env, int capacity) {
+    return env->NewObject(g_jni.hash_map, g_jni.hash_map_init, (jint)capacity);
+}
+
+jobject create_result_map(JNIEnv* env, bool success, const std::string& error) {
+    jobject map = new_hash_map(env, 4);
+    map_put_bool(env, map, "success", success);
+    if (!success && !error.empty()) {
+        map_put_string(env, map, "error", error.c_str());
+    }
+    return map;
+}
+
+void map_put_bool(JNIEnv* env, jobject map, const char* key, bool value) {
+    map_put_object(env, map, key, env->CallStaticObjectMethod(g_jni.boolean_class, g_jni.boolean_value_of,
+                                                             (jboolean)value));
+}
+
+void map_put_long(JNIEnv* env, jobject map, const char* key, int64_t value) {
+    map_put_object(env, map, key, env->CallStaticObjectMethod(g_jni.long_class, g_jni.long_value_of, (jlong)value));
+}
+
+void map_put_string(JNIEnv* env, jobject map, const char* key, const char* value) {
+    map_put_object(env, map, key, string_to_jstring(env, value));
+}
+
+double map_get_number(JNIEnv* env, jobject map, const char* key, double fallback) {
+    if (map == nullptr) return fallback;
+
+    jstring jkey = env->NewStringUTF(key);
+    jobject value = env->CallObjectMethod(map, g_jni.map_get, jkey);
+    double result = fallback;
+    if (value != nullptr && env->IsInstanceOf(value, g_jni.number)) {
+        result = env->CallDoubleMethod(value, g_jni.number_double_value);
+    } else if (value != nullptr && env->IsInstanceOf(value, g_jni.boolean_class)) {
+        result = env->CallBooleanMethod(value, g_jni.boolean_value) ? 1.0 : 0.0;
+    }
+
+    if (value) env->DeleteLocalRef(value);
+    env->DeleteLocalRef(jkey);
+    return result;
+}
+
+std::string jstring_to_string(JNIEnv* env, jstring jstr) {
+    if (jstr == nullptr) return "";
+
+    const jsize length = env->GetStringLength(jstr);
+    std::string out;
+    out.reserve(static_cast<size_t>(length) * 3);
+
+    // Critical access pins (or at worst copies) the UTF-16 array; no JNI calls
+    // until it is released
+    const jchar* chars = env->GetStringCritical(jstr, nullptr);
+    if (chars == nullptr) return "";
+    for (jsize i = 0; i < length; i++) {
+        uint32_t cp = chars[i];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < length && chars[i + 1] >= 0xDC00 && chars[i + 1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (chars[++i] - 0xDC00);
+        } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = 0xFFFD; // unpaired surrogate
+        }
+
+        if (cp < 0x80) {
+            out.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+    env->ReleaseStringCritical(jstr, chars);
+    return out;
+}
+
+// Malformed sequences (e.g. a token that ends mid-character) become U+FFFD
+// instead of tripping CheckJNI the way NewStringUTF would.
+jstring string_to_jstring(JNIEnv* env, const std::string& str) {
+    std::vector<jchar> utf16;
+    utf16.reserve(str.size());
+
+    const auto* bytes = reinterpret_cast<const uint8_t*>(str.data());
+    const size_t size = str.size();
+    size_t i = 0;
+    while (i < size) {
+        const uint8_t lead = bytes[i];
+        uint32_t cp;
+        size_t extra;
+        if (lead < 0x80) {
+            cp = lead;
+            extra = 0;
+        } else if (lead >= 0xC2 && lead <= 0xDF) {
+            cp = lead & 0x1F;
+            extra = 1;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            cp = lead & 0x0F;
+            extra = 2;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            cp = lead & 0x07;
+            extra = 3;
+        } else {
+            utf16.push_back(0xFFFD);
+            i++;
+            continue;
+        }
+
+        size_t n = 1;
+        while (n <= extra && i + n < size && (bytes[i + n] & 0xC0) == 0x80) {
+            cp = (cp << 6) | (bytes[i + n] & 0x3F);
+            n++;
+        }
+        const bool overlong = (extra == 2 && cp < 0x800) || (extra == 3 && cp < 0x10000);
+        if (n <= extra || overlong || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+            utf16.push_back(0xFFFD);
+            i += n;
+            continue;
+        }
+        i += n;
+
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            utf16.push_back(static_cast<jchar>(0xD800 + (cp >> 10)));
+            utf16.push_back(static_cast<jchar>(0xDC00 + (cp & 0x3FF)));
+        } else {
+            utf16.push_back(static_cast<jchar>(cp));
+        }
+    }
+    static const jchar kEmpty = 0;
+    return env->NewString(utf16.empty() ? &kEmpty : utf16.data(), static_cast<jsize>(utf16.size()));
+}
+
+uint8_t* direct_buffer(JNIEnv* env, jobject buffer, size_t* capacity) {
+    if (buffer == nullptr) return nullptr;
+    void* address = env->GetDirectBufferAddress(buffer);
+    const jlong size = env->GetDirectBufferCapacity(buffer);
+    if (address == nullptr || size <= 0) return nullptr;
+    *capacity = static_cast<size_t>(size);
+    return static_cast<uint8_t*>(address);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <jni.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Classes and method IDs resolved once in JNI_OnLoad. Class refs are global,
+// so they are valid on every thread and nothing is looked up per call.
+struct JniCache {
+    jclass hash_map = nullptr;
+    jclass map = nullptr;
+    jclass number = nullptr;
+    jclass boolean_class = nullptr;
+    jclass long_class = nullptr;
+
+    jmethodID hash_map_init = nullptr;   // HashMap(int)
+    jmethodID map_get = nullptr;
+    jmethodID map_put = nullptr;
+    jmethodID number_double_value = nullptr;
+    jmethodID boolean_value = nullptr;    // booleanValue()
+    jmethodID boolean_value_of = nullptr; // static Boolean.valueOf(boolean), no allocation
+    jmethodID long_value_of = nullptr;    // static Long.valueOf(long)
+};
+
+// Valid once the library is loaded
+const JniCache& jni_cache();
+
+// Method-channel result maps. Every helper releases the local refs it
+// creates, so they can be called in loops without growing the local frame.
+jobject new_hash_map(JNIEnv* env, int capacity = 8);
+jobject create_result_map(JNIEnv* env, bool success, const std::string& error = "");
+void map_put_bool(JNIEnv* env, jobject map, const char* key, bool value);
+void map_put_long(JNIEnv* env, jobject map, const char* key, int64_t value);
+void map_put_string(JNIEnv* env, jobject map, const char* key, const char* value);
+
+// Numeric (or boolean, as 0/1) entry of a java.util.Map<String, Object>,
+// or `fallback` when the key is missing or of another type.
+double map_get_number(JNIEnv* env, jobject map, const char* key, double fallback);
+
+// Java strings are UTF-16; these convert to and from standard UTF-8 (not
+// JNI's modified UTF-8), so text outside the BMP round-trips intact.
+std::string jstring_to_string(JNIEnv* env, jstring jstr);
+jstring string_to_jstring(JNIEnv* env, const std::string& str);
+
+// Backing memory of a direct ByteBuffer, or nullptr if it is not direct.
+uint8_t* direct_buffer(JNIEnv* env, jobject buffer, size_t* capacity);
@@ -0,0 +1,569 @@
+#include "kv_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "fp16.h"
+#include "kv_snapshot.h"
+#include "memory_pool.h"
+
+const char* kv_quantization_name(KvQuantization quantization) {
+    switch (quantization) {
+        case KvQuantization::kFloat16: return "f16";
+        case KvQuantization::kInt8: return "q8";
+        case KvQuantization::kInt4: return "q4";
+        default: return "unknown";
+    }
+}
+
+PagedKvCache::PagedKvCache(const KvCacheLayout& layout, size_t byte_budget)
+    : layout_(layout), byte_budget_(byte_budget) {}
+
+PagedKvCache::~PagedKvCache() {
+    for (Block& block : blocks_) {
+        if (block.data != nullptr && !block.mapping) {
+            MemoryPool::instance().release(block.data, block.bytes, MemoryCategory::kKvCache);
+        }
+    }
+}
+
+bool PagedKvCache::reserve_bytes(size_t bytes) {
+    if (byte_budget_ == 0 || stats_.bytes + bytes <= byte_budget_) return true;
+    stats_.allocation_failures++;
+    return false;
+}
+
+void PagedKvCache::add_bytes(int64_t bytes) {
+    stats_.bytes = static_cast<size_t>(static_cast<int64_t>(stats_.bytes) + bytes);
+    stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.bytes);
+}
+
+int32_t PagedKvCache::new_block_id() {
+    int32_t id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    } else {
+        id = static_cast<int32_t>(blocks_.size());
+        blocks_.emplace_back();
+        scales_.resize(blocks_.size() * layout_.rows());
+    }
+    stats_.blocks++;
+    return id;
+}
+
+// An empty open block with one reference, or -1
+int32_t PagedKvCache::allocate_block() {
+    const size_t bytes = layout_.open_block_bytes();
+    if (!reserve_bytes(bytes)) return -1;
+    void* data = MemoryPool::instance().allocate(bytes, MemoryCategory::kKvCache);
+
+    const int32_t id = new_block_id();
+    Block& block = blocks_[id];
+    block.data = data;
+    block.bytes = bytes;
+    block.refs = 1;
+    block.sealed = false;
+    add_bytes(static_cast<int64_t>(bytes));
+    return id;
+}
+
+// A block with one reference whose payload is section `index` of the
+// snapshot, read in place; -1 if the section has the wrong size. Sealed
+// blocks are never written, so the read-only mapping is safe; an open one
+// is only ever the source of an open_copy().
+int32_t PagedKvCache::map_block(const std::shared_ptr<const KvSnapshot>& snapshot, size_t index, bool sealed) {
+    const bool quantized = sealed && layout_.quantization != KvQuantization::kFloat16;
+    const size_t scale_bytes = quantized ? layout_.rows() * sizeof(float) : 0;
+    const size_t expected = sealed ? layout_.sealed_block_bytes() : layout_.open_block_bytes();
+    size_t bytes = 0;
+    const uint8_t* data = snapshot->section(index, &bytes);
+    if (data == nullptr || bytes != expected) return -1;
+
+    const int32_t id = new_block_id();
+    Block& block = blocks_[id];
+    block.data = const_cast<uint8_t*>(data);
+    block.bytes = bytes - scale_bytes;
+    block.refs = 1;
+    block.sealed = sealed;
+    block.mapping = snapshot;
+    if (quantized) std::memcpy(scales(id), data + block.bytes, scale_bytes);
+    if (sealed) stats_.sealed_blocks++;
+    stats_.mapped_blocks++;
+    return id;
+}
+
+void PagedKvCache::release_block(int32_t id) {
+    Block& block = blocks_[id];
+    if (block.mapping) {
+        stats_.mapped_blocks--;
+    } else {
+        MemoryPool::instance().release(block.data, block.bytes, MemoryCategory::kKvCache);
+        add_bytes(-static_cast<int64_t>(block.sealed ? layout_.sealed_block_bytes() : block.bytes));
+    }
+    if (block.sealed) stats_.sealed_blocks--;
+    stats_.blocks--;
+    block = Block();
+    free_ids_.push_back(id);
+}
+
+void PagedKvCache::unref_block(int32_t id) {
+    Block& block = blocks_[id];
+    if (--block.refs == 1) stats_.shared_blocks--;
+    if (block.refs == 0) release_block(id);
+}
+
+// Quantizes a full block into the configured format. A shared block can be
+// sealed too: every table that refers to it sees the same contents.
+bool PagedKvCache::seal_block(int32_t id) {
+    Block& block = blocks_[id];
+    if (block.sealed) return true;
+    if (layout_.quantization == KvQuantization::kFloat16) {
+        block.sealed = true;
+        stats_.sealed_blocks++;
+        return true;
+    }
+
+    const size_t rows = layout_.rows();
+    const size_t values = layout_.row_values();
+    const bool int4 = layout_.quantization == KvQuantization::kInt4;
+    const size_t row_bytes = int4 ? values / 2 : values;
+    const size_t payload = rows * row_bytes;
+    if (!reserve_bytes(layout_.sealed_block_bytes())) return false;
+    uint8_t* sealed = static_cast<uint8_t*>(MemoryPool::instance().allocate(payload, MemoryCategory::kKvCache));
+
+    const uint16_t* open = static_cast<const uint16_t*>(block.data);
+    float* row_scales = scales(id);
+    std::vector<float> row(values);
+    for (size_t r = 0; r < rows; r++) {
+        float max_abs = 0.0f;
+        halves_to_floats(open + r * values, row.data(), values);
+        for (size_t i = 0; i < values; i++) max_abs = std::max(max_abs, std::fabs(row[i]));
+        const float levels = int4 ? 7.0f : 127.0f;
+        const float scale = max_abs / levels;
+        const float inverse = scale > 0.0f ? 1.0f / scale : 0.0f;
+        row_scales[r] = scale;
+
+        // |row * inverse| <= levels, so rounding half away from zero needs no clamp
+        uint8_t* out = sealed + r * row_bytes;
+        if (int4) {
+            // Two values per byte, low nibble first, offset by 8
+            for (size_t i = 0; i < values; i += 2) {
+                const float lo = row[i] * inverse;
+                const float hi = row[i + 1] * inverse;
+                const int q_lo = static_cast<int>(lo + (lo < 0.0f ? -0.5f : 0.5f)) + 8;
+                const int q_hi = static_cast<int>(hi + (hi < 0.0f ? -0.5f : 0.5f)) + 8;
+                out[i / 2] = static_cast<uint8_t>(q_lo | q_hi << 4);
+            }
+        } else {
+            int8_t* q = reinterpret_cast<int8_t*>(out);
+            for (size_t i = 0; i < values; i++) {
+                const float x = row[i] * inverse;
+                q[i] = static_cast<int8_t>(x + (x < 0.0f ? -0.5f : 0.5f));
+            }
+        }
+    }
+
+    MemoryPool::instance().release(block.data, block.bytes, MemoryCategory::kKvCache);
+    add_bytes(static_cast<int64_t>(layout_.sealed_block_bytes()) - static_cast<int64_t>(block.bytes));
+    block.data = sealed;
+    block.bytes = payload;
+    block.sealed = true;
+    stats_.sealed_blocks++;
+    return true;
+}
+
+// Full blocks are sealed once the sequence has moved past them, which is
+// when extend() is called for the next forward pass. Unsealed blocks are
+// always a suffix of the table.
+bool PagedKvCache::seal_full_blocks(Sequence& sequence) {
+    const size_t full = sequence.length / layout_.block_tokens;
+    bool sealed = true;
+    for (size_t i = full; i > 0; i--) {
+        const int32_t id = sequence.blocks[i - 1];
+        if (blocks_[id].sealed) break;
+        sealed &= seal_block(id);
+    }
+    return sealed;
+}
+
+// Dequantizes `count` positions of one row starting at position `first`
+void PagedKvCache::read_row(int32_t id, size_t row, size_t first, size_t count, float* out) const {
+    const Block& block = blocks_[id];
+    const size_t values = layout_.row_values();
+    const size_t begin = first * layout_.head_dim;
+    const size_t n = count * layout_.head_dim;
+
+    if (!block.sealed || layout_.quantization == KvQuantization::kFloat16) {
+        halves_to_floats(static_cast<const uint16_t*>(block.data) + row * values + begin, out, n);
+        return;
+    }
+    const float scale = scales(id)[row];
+    if (layout_.quantization == KvQuantization::kInt8) {
+        const int8_t* in = static_cast<const int8_t*>(block.data) + row * values + begin;
+        for (size_t i = 0; i < n; i++) out[i] = static_cast<float>(in[i]) * scale;
+        return;
+    }
+    // begin and n are even (head_dim is), so bytes never straddle the range
+    const uint8_t* in = static_cast<const uint8_t*>(block.data) + row * (values / 2) + begin / 2;
+    for (size_t i = 0; i < n / 2; i++) {
+        out[2 * i] = static_cast<float>((in[i] & 0xf) - 8) * scale;
+        out[2 * i + 1] = static_cast<float>((in[i] >> 4) - 8) * scale;
+    }
+}
+
+// A new open block holding the first `positions` positions of `source`
+bool PagedKvCache::open_copy(int32_t source, size_t positions, int32_t* copy) {
+    const int32_t id = allocate_block();
+    if (id < 0) return false;
+
+    const size_t rows = layout_.rows();
+    const size_t values = layout_.row_values();
+    const size_t n = positions * layout_.head_dim;
+    uint16_t* out = static_cast<uint16_t*>(blocks_[id].data);
+    const Block& from = blocks_[source];
+    if (!from.sealed || layout_.quantization == KvQuantization::kFloat16) {
+        const uint16_t* in = static_cast<const uint16_t*>(from.data);
+        for (size_t r = 0; r < rows; r++) std::memcpy(out + r * values, in + r * values, n * sizeof(uint16_t));
+    } else {
+        std::vector<float> row(n);
+        for (size_t r = 0; r < rows; r++) {
+            read_row(source, r, 0, positions, row.data());
+            floats_to_halves(row.data(), out + r * values, n);
+        }
+    }
+    *copy = id;
+    return true;
+}
+
+bool PagedKvCache::add_sequence(SequenceId seq) {
+    drop_released_captures();
+    if (!layout_.valid() || sequences_.count(seq) != 0) return false;
+    sequences_.emplace(seq, Sequence());
+    stats_.sequences++;
+    return true;
+}
+
+bool PagedKvCache::fork_sequence(SequenceId parent, SequenceId child, size_t length) {
+    drop_released_captures();
+    auto found = sequences_.find(parent);
+    if (found == sequences_.end() || length > found->second.length || sequences_.count(child) != 0) {
+        return false;
+    }
+    const Sequence& source = found->second;
+    const size_t full = length / layout_.block_tokens;
+    const size_t partial = length % layout_.block_tokens;
+
+    Sequence forked;
+    forked.length = length;
+    if (partial > 0) {
+        int32_t copy;
+        if (!open_copy(source.blocks[full], partial, &copy)) return false;
+        forked.blocks.resize(full + 1);
+        forked.blocks[full] = copy;
+    } else {
+        forked.blocks.resize(full);
+    }
+    for (size_t i = 0; i < full; i++) {
+        const int32_t id = source.blocks[i];
+        if (++blocks_[id].refs == 2) stats_.shared_blocks++;
+        forked.blocks[i] = id;
+    }
+    sequences_.emplace(child, std::move(forked));
+    stats_.sequences++;
+    stats_.tokens += length;
+    return true;
+}
+
+void PagedKvCache::remove_sequence(SequenceId seq) {
+    auto found = sequences_.find(seq);
+    if (found == sequences_.end()) return;
+    for (int32_t id : found->second.blocks) unref_block(id);
+    stats_.tokens -= found->second.length;
+    stats_.sequences--;
+    sequences_.erase(found);
+}
+
+size_t PagedKvCache::length(SequenceId seq) const {
+    auto found = sequences_.find(seq);
+    return found == sequences_.end() ? 0 : found->second.length;
+}
+
+bool PagedKvCache::extend(SequenceId seq, size_t count) {
+    drop_released_captures();
+    auto found = sequences_.find(seq);
+    if (found == sequences_.end()) return false;
+    Sequence& sequence = found->second;
+    seal_full_blocks(sequence);
+
+    const size_t bt = static_cast<size_t>(layout_.block_tokens);
+    const size_t needed = (sequence.length + count + bt - 1) / bt;
+    const size_t existing = sequence.blocks.size();
+    while (sequence.blocks.size() < needed) {
+        const int32_t id = allocate_block();
+        if (id < 0) {
+            while (sequence.blocks.size() > existing) {
+                unref_block(sequence.blocks.back());
+                sequence.blocks.pop_back();
+            }
+            return false;
+        }
+        sequence.blocks.push_back(id);
+    }
+    sequence.length += count;
+    stats_.tokens += count;
+    return true;
+}
+
+void PagedKvCache::store(SequenceId seq, int32_t layer, size_t position, const float* key, const float* value) {
+    auto found = sequences_.find(seq);
+    if (found == sequences_.end() || position >= found->second.length || layer < 0 || layer >= layout_.layers) return;
+    const int32_t id = found->second.blocks[position / layout_.block_tokens];
+    Block& block = blocks_[id];
+    if (block.sealed || block.refs != 1) return; // moved past or shared: read-only
+
+    const size_t values = layout_.row_values();
+    const size_t offset = (position % layout_.block_tokens) * layout_.head_dim;
+    uint16_t* data = static_cast<uint16_t*>(block.data);
+    for (int32_t head = 0; head < layout_.kv_heads; head++) {
+        const size_t key_row = static_cast<size_t>(layer) * 2 * layout_.kv_heads + head;
+        const size_t value_row = key_row + layout_.kv_heads;
+        floats_to_halves(key + static_cast<size_t>(head) * layout_.head_dim, data + key_row * values + offset,
+                         static_cast<size_t>(layout_.head_dim));
+        floats_to_halves(value + static_cast<size_t>(head) * layout_.head_dim, data + value_row * values + offset,
+                         static_cast<size_t>(layout_.head_dim));
+    }
+}
+
+void PagedKvCache::load(SequenceId seq, int32_t layer, size_t begin, size_t end, float* keys, float* values) const {
+    auto found = sequences_.find(seq);
+    if (found == sequences_.end() || layer < 0 || layer >= layout_.layers) return;
+    const Sequence& sequence = found->second;
+    end = std::min(end, sequence.length);
+    if (begin >= end) return;
+
+    const size_t bt = static_cast<size_t>(layout_.block_tokens);
+    const size_t span = (end - begin) * layout_.head_dim;
+    for (int32_t head = 0; head < layout_.kv_heads; head++) {
+        const size_t key_row = static_cast<size_t>(layer) * 2 * layout_.kv_heads + head;
+        const size_t value_row = key_row + layout_.kv_heads;
+        float* k = keys + head * span;
+        float* v = values + head * span;
+        for (size_t position = begin; position < end;) {
+            const size_t first = position % bt;
+            const size_t count = std::min(bt - first, end - position);
+            const int32_t id = sequence.blocks[position / bt];
+            read_row(id, key_row, first, count, k);
+            read_row(id, value_row, first, count, v);
+            k += count * layout_.head_dim;
+            v += count * layout_.head_dim;
+            position += count;
+        }
+    }
+}
+
+// The budget is not enforced here: reopening a partial block must not fail
+// a rollback.
+bool PagedKvCache::pop_tokens(SequenceId seq, size_t count) {
+    auto found = sequences_.find(seq);
+    if (found == sequences_.end() || count > found->second.length) return false;
+    Sequence& sequence = found->second;
+
+    const size_t bt = static_cast<size_t>(layout_.block_tokens);
+    const size_t length = sequence.length - count;
+    const size_t keep = (length + bt - 1) / bt;
+    while (sequence.blocks.size() > keep) {
+        unref_block(sequence.blocks.back());
+        sequence.blocks.pop_back();
+    }
+    sequence.length = length;
+    stats_.tokens -= count;
+
+    // The new tail is partial and gets written again: it must be open and ours
+    const size_t partial = length % bt;
+    if (partial > 0) {
+        const int32_t tail = sequence.blocks.back();
+        if (blocks_[tail].sealed || blocks_[tail].refs != 1) {
+            const size_t budget = byte_budget_;
+            byte_budget_ = 0;
+            int32_t copy = -1;
+            open_copy(tail, partial, &copy);
+            byte_budget_ = budget;
+            unref_block(tail);
+            sequence.blocks.back() = copy;
+        }
+    }
+    return true;
+}
+
+// Applies `rekey` to the keys of the first `positions` positions of an open
+// block we own
+void PagedKvCache::rekey_block(int32_t id, size_t positions, const std::function<void(float* key)>& rekey) {
+    const size_t values = layout_.row_values();
+    const size_t head_dim = static_cast<size_t>(layout_.head_dim);
+    uint16_t* data = static_cast<uint16_t*>(blocks_[id].data);
+    std::vector<float> row(positions * head_dim);
+    for (int32_t layer = 0; layer < layout_.layers; layer++) {
+        for (int32_t head = 0; head < layout_.kv_heads; head++) {
+            uint16_t* keys = data + (static_cast<size_t>(layer) * 2 * layout_.kv_heads + head) * values;
+            halves_to_floats(keys, row.data(), row.size());
+            for (size_t p = 0; p < positions; p++) rekey(row.data() + p * head_dim);
+            floats_to_halves(row.data(), keys, row.size());
+        }
+    }
+}
+
+// Moved blocks are rewritten through an open fp16 copy unless already open
+// and ours, and copies of full blocks are sealed again so unsealed blocks
+// stay a suffix of the table. As in pop_tokens() the budget is not enforced:
+// the evicted blocks more than pay for the copies unless they were shared.
+bool PagedKvCache::evict(SequenceId seq, size_t begin, size_t count, const std::function<void(float* key)>& rekey) {
+    auto found = sequences_.find(seq);
+    const size_t bt = static_cast<size_t>(layout_.block_tokens);
+    if (found == sequences_.end() || count == 0 || begin % bt != 0 || count % bt != 0 ||
+        begin + count > found->second.length) {
+        return false;
+    }
+    Sequence& sequence = found->second;
+
+    const size_t first = begin / bt;
+    const size_t dropped = count / bt;
+    for (size_t i = first; i < first + dropped; i++) unref_block(sequence.blocks[i]);
+    sequence.blocks.erase(sequence.blocks.begin() + first, sequence.blocks.begin() + first + dropped);
+    sequence.length -= count;
+    stats_.tokens -= count;
+
+    const size_t budget = byte_budget_;
+    byte_budget_ = 0;
+    for (size_t i = first; i < sequence.blocks.size(); i++) {
+        const int32_t id = sequence.blocks[i];
+        const size_t positions = std::min(bt, sequence.length - i * bt);
+        Block& block = blocks_[id];
+        if (!block.sealed && block.refs == 1 && !block.mapping) {
+            rekey_block(id, positions, rekey);
+            continue;
+        }
+        const bool sealed = block.sealed;
+        int32_t copy = -1;
+        if (!open_copy(id, positions, &copy)) {
+            byte_budget_ = budget;
+            return false;
+        }
+        rekey_block(copy, positions, rekey);
+        unref_block(id);
+        if (sealed) seal_block(copy);
+        sequence.blocks[i] = copy;
+    }
+    byte_budget_ = budget;
+    return true;
+}
+
+std::string PagedKvCache::snapshot_format() const {
+    char format[64];
+    std::snprintf(format, sizeof(format), "paged/l%dh%dd%db%d/%s", layout_.layers, layout_.kv_heads, layout_.head_dim,
+                  layout_.block_tokens, kv_quantization_name(layout_.quantization));
+    return format;
+}
+
+// A pinned block keeps its payload: sealed blocks are never written again
+// (rollbacks and evictions copy them first) and the tail copy is only ours.
+// Payload pointers and scales are taken here, since blocks_ and scales_
+// may reallocate while the capture is written.
+KvSnapshotCapture PagedKvCache::capture_sequence(SequenceId seq) {
+    auto found = sequences_.find(seq);
+    if (found == sequences_.end() || !seal_full_blocks(found->second)) return nullptr;
+    const Sequence& sequence = found->second;
+
+    struct Section {
+        const void* data;
+        size_t bytes;
+        std::vector<float> scales; // sealed quantized blocks only
+        std::shared_ptr<const KvSnapshot> mapping;
+    };
+    struct Pinned {
+        std::vector<Section> sections;
+        std::vector<int32_t> ids;
+        std::shared_ptr<ReleasedBlocks> released;
+        ~Pinned() {
+            std::lock_guard<std::mutex> lock(released->mutex);
+            released->ids.insert(released->ids.end(), ids.begin(), ids.end());
+        }
+    };
+    auto pinned = std::make_shared<Pinned>();
+    pinned->released = released_;
+
+    const size_t full = sequence.length / layout_.block_tokens;
+    const size_t partial = sequence.length % layout_.block_tokens;
+    for (size_t i = 0; i < sequence.blocks.size(); i++) {
+        int32_t id = sequence.blocks[i];
+        if (i < full) {
+            if (++blocks_[id].refs == 2) stats_.shared_blocks++;
+        } else if (!open_copy(id, partial, &id)) {
+            return nullptr;
+        }
+        pinned->ids.push_back(id);
+
+        const Block& block = blocks_[id];
+        Section section{block.data, block.bytes, {}, block.mapping};
+        if (block.sealed && layout_.quantization != KvQuantization::kFloat16) {
+            section.scales.assign(scales(id), scales(id) + layout_.rows());
+        }
+        pinned->sections.push_back(std::move(section));
+    }
+
+    return [pinned](KvSnapshotWriter* writer) {
+        for (const Section& section : pinned->sections) {
+            writer->begin_section();
+            writer->write(section.data, section.bytes);
+            writer->write(section.scales.data(), section.scales.size() * sizeof(float));
+            writer->end_section();
+        }
+        return writer->ok();
+    };
+}
+
+void PagedKvCache::drop_released_captures() {
+    std::vector<int32_t> ids;
+    {
+        std::lock_guard<std::mutex> lock(released_->mutex);
+        ids.swap(released_->ids);
+    }
+    for (int32_t id : ids) unref_block(id);
+}
+
+// Full blocks come back sealed and mapped, so a resumed session costs page
+// faults on the blocks attention actually touches rather than a read of the
+// whole file. A block that is partial at `length` is copied into an open
+// block, which the session then keeps filling.
+bool PagedKvCache::restore_sequence(SequenceId seq, const std::shared_ptr<const KvSnapshot>& snapshot,
+                                    size_t length) {
+    const size_t bt = static_cast<size_t>(layout_.block_tokens);
+    const size_t count = (length + bt - 1) / bt;
+    if (!snapshot || snapshot->format() != snapshot_format() || length > snapshot->token_count() ||
+        count > snapshot->sections() || !add_sequence(seq)) {
+        return false;
+    }
+
+    Sequence& sequence = sequences_[seq];
+    const size_t full = length / bt;
+    for (size_t i = 0; i < count; i++) {
+        // The capture sealed exactly the blocks full in the snapshot
+        int32_t id = map_block(snapshot, i, (i + 1) * bt <= snapshot->token_count());
+        if (id >= 0 && i >= full) {
+            int32_t copy = -1;
+            const bool copied = open_copy(id, length - full * bt, &copy);
+            unref_block(id);
+            id = copied ? copy : -1;
+        }
+        if (id < 0) {
+            remove_sequence(seq);
+            return false;
+        }
+        sequence.blocks.push_back(id);
+    }
+    sequence.length = length;
+    stats_.tokens += length;
+    return true;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_module.h"
+
+// How full KV blocks are stored. Blocks fill in fp16; once a block is full
+// and the sequence has moved past it, int8 and 4-bit modes quantize it with
+// one symmetric scale per (layer, K or V, head) row of the block.
+enum class KvQuantization : uint8_t {
+    kFloat16 = 0,
+    kInt8,
+    kInt4,
+};
+
+// "f16", "q8", "q4"
+const char* kv_quantization_name(KvQuantization quantization);
+
+struct KvCacheLayout {
+    int32_t layers = 16;
+    int32_t kv_heads = 8;
+    int32_t head_dim = 64;
+    int32_t block_tokens = 16;
+    KvQuantization quantization = KvQuantization::kFloat16;
+
+    bool valid() const {
+        return layers > 0 && kv_heads > 0 && head_dim > 0 && head_dim % 2 == 0 && block_tokens > 0;
+    }
+
+    // One row is a single head's K or V for every token of the block
+    size_t rows() const { return 2u * static_cast<size_t>(layers) * kv_heads; }
+    size_t row_values() const { return static_cast<size_t>(block_tokens) * head_dim; }
+
+    // A block while it fills (always fp16)
+    size_t open_block_bytes() const { return rows() * row_values() * sizeof(uint16_t); }
+
+    // A full block in the configured format, scales included
+    size_t sealed_block_bytes() const {
+        switch (quantization) {
+            case KvQuantization::kInt8: return rows() * (row_values() + sizeof(float));
+            case KvQuantization::kInt4: return rows() * (row_values() / 2 + sizeof(float));
+            default: return open_block_bytes();
+        }
+    }
+
+    size_t bytes_for_tokens(size_t tokens) const {
+        const size_t blocks = (tokens + block_tokens - 1) / block_tokens;
+        return blocks == 0 ? 0 : (blocks - 1) * sealed_block_bytes() + open_block_bytes();
+    }
+};
+
+// Paged KV cache for sequences whose attention runs in this process.
+//
+// Memory is handed out in fixed-size blocks of block_tokens positions as
+// sequences grow, instead of a context_window_size slab per sequence, so a
+// long session costs what it has actually used. Each sequence owns a block
+// table (positions -> blocks). Forking shares the parent's full blocks by
+// reference count and copies at most one partial block, so the prefix cache
+// and speculative decoding get their sequences almost for free; a block is
+// only ever written while exactly one table refers to it.
+//
+// Block payloads come from the MemoryPool under MemoryCategory::kKvCache,
+// except blocks restored from a session snapshot, which are read in place
+// from the file mapping until a rollback copies them. Not thread-safe: owned by the chat module, which callers serialize.
+// Only the snapshot writes returned by capture_sequence() run elsewhere.
+class PagedKvCache {
+public:
+    struct Stats {
+        size_t sequences = 0;
+        size_t tokens = 0;        // sum of sequence lengths
+        size_t blocks = 0;        // distinct blocks in use
+        size_t sealed_blocks = 0; // of which full and in the configured format
+        size_t shared_blocks = 0; // of which referenced by more than one sequence
+        size_t mapped_blocks = 0; // of which read from a snapshot file (not in bytes)
+        size_t bytes = 0;         // payloads and scales
+        size_t peak_bytes = 0;
+        uint64_t allocation_failures = 0;
+    };
+
+    // `byte_budget` caps the bytes held (0 for no cap beyond memory pressure).
+    explicit PagedKvCache(const KvCacheLayout& layout, size_t byte_budget = 0);
+    ~PagedKvCache();
+
+    PagedKvCache(const PagedKvCache&) = delete;
+    PagedKvCache& operator=(const PagedKvCache&) = delete;
+
+    const KvCacheLayout& layout() const { return layout_; }
+
+    bool add_sequence(SequenceId seq);
+
+    // `child` starts with the first `length` positions of `parent`.
+    bool fork_sequence(SequenceId parent, SequenceId child, size_t length);
+
+    void remove_sequence(SequenceId seq);
+
+    // Returns 0 for an unknown sequence
+    size_t length(SequenceId seq) const;
+
+    // Makes room for `count` more positions at the end of `seq`; the model
+    // then store()s every layer of each. Returns false, changing nothing, if
+    // the blocks cannot be allocated within the budget.
+    bool extend(SequenceId seq, size_t count);
+
+    // Writes one position of one layer: `key` and `value` are
+    // [kv_heads][head_dim]. Only positions added by the last extend() and
+    // not yet moved past may be written.
+    void store(SequenceId seq, int32_t layer, size_t position, const float* key, const float* value);
+
+    // Reads positions [begin, end) of one layer into `keys` and `values`,
+    // each [kv_heads][end - begin][head_dim].
+    void load(SequenceId seq, int32_t layer, size_t begin, size_t end, float* keys, float* values) const;
+
+    // Drops the last `count` positions of `seq`.
+    bool pop_tokens(SequenceId seq, size_t count);
+
+    // Drops positions [begin, begin + count) of `seq` and moves the later
+    // ones down by `count`. Both must be multiples of block_tokens: whole
+    // blocks leave the table and nothing is copied except blocks whose keys
+    // change. `rekey` is called on every moved position's keys, one
+    // [head_dim] vector at a time, so the caller can rotate them to their
+    // new position; shared, mapped or quantized blocks are copied first.
+    // If a copy cannot be allocated the sequence is left half-moved and
+    // must be removed.
+    bool evict(SequenceId seq, size_t begin, size_t count, const std::function<void(float* key)>& rekey);
+
+    // Identifies the layout, e.g. "paged/l16h8d64b16/q8"; snapshots are
+    // only restored into a cache with the same one.
+    std::string snapshot_format() const;
+
+    // Pins the blocks of `seq` for a snapshot: its full blocks are sealed,
+    // which makes them immutable, and referenced; a partial tail block is
+    // copied. The returned function writes one section per block (full
+    // blocks in the configured format followed by their scales, the tail in
+    // fp16) and may run on any thread while the cache is alive. Once it is
+    // destroyed, the next add, fork or extend drops the pins. nullptr if
+    // the blocks cannot be sealed or copied within the budget.
+    KvSnapshotCapture capture_sequence(SequenceId seq);
+
+    // Creates `seq` holding the first `length` positions of a snapshot
+    // written by a capture. Only a partial tail block is copied.
+    bool restore_sequence(SequenceId seq, const std::shared_ptr<const KvSnapshot>& snapshot, size_t length);
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Block {
+        void* data = nullptr;
+        size_t bytes = 0;
+        int32_t refs = 0;
+        bool sealed = false;
+        std::shared_ptr<const KvSnapshot> mapping; // set when `data` points into a snapshot file
+    };
+
+    struct Sequence {
+        std::vector<int32_t> blocks;
+        size_t length = 0;
+    };
+
+    int32_t new_block_id();
+    int32_t allocate_block();
+    int32_t map_block(const std::shared_ptr<const KvSnapshot>& snapshot, size_t index, bool sealed);
+    void release_block(int32_t id);
+    void unref_block(int32_t id);
+    bool seal_block(int32_t id);
+    bool open_copy(int32_t source, size_t positions, int32_t* copy);
+    void rekey_block(int32_t id, size_t positions, const std::function<void(float* key)>& rekey);
+    bool seal_full_blocks(Sequence& sequence);
+    void drop_released_captures();
+    void read_row(int32_t id, size_t row, size_t first, size_t count, float* out) const;
+    float* scales(int32_t id) { return scales_.data() + static_cast<size_t>(id) * layout_.rows(); }
+    const float* scales(int32_t id) const { return scales_.data() + static_cast<size_t>(id) * layout_.rows(); }
+    bool reserve_bytes(size_t bytes);
+    void add_bytes(int64_t bytes);
+
+    KvCacheLayout layout_;
+    size_t byte_budget_;
+    std::vector<Block> blocks_;
+    std::vector<int32_t> free_ids_;
+    std::vector<float> scales_; // rows() per block id, used by quantized blocks
+    std::unordered_map<SequenceId, Sequence> sequences_;
+    Stats stats_;
+
+    // Blocks of destroyed captures, unreferenced on the cache's own thread
+    struct ReleasedBlocks {
+        std::mutex mutex;
+        std::vector<int32_t> ids;
+    };
+    std::shared_ptr<ReleasedBlocks> released_ = std::make_shared<ReleasedBlocks>();
+};
@@ -0,0 +1,395 @@
+#include "kv_snapshot.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "mlc_log.h"
+#include "thread_pool.h"
+
+namespace {
+
+constexpr char kMagic[8] = {'M', 'L', 'C', 'K', 'V', 'S', 'N', 'P'};
+constexpr uint64_t kHeaderBytes = 64;
+constexpr uint64_t kSectionAlignment = 4096;
+constexpr char kSuffix[] = ".kvs";
+constexpr char kTempSuffix[] = ".kvs.tmp";
+
+// Little-endian on every target we build for; fields are naturally aligned
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t token_count;
+    uint64_t tokens_offset;
+    uint64_t table_offset;
+    uint64_t file_bytes;
+    uint32_t session_bytes;
+    uint32_t model_bytes;
+    uint32_t format_bytes;
+    uint32_t reserved;
+};
+static_assert(sizeof(FileHeader) == kHeaderBytes, "snapshot header layout");
+
+bool ends_with(const std::string& text, const char* suffix) {
+    const size_t length = std::strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+std::shared_ptr<const KvSnapshot> KvSnapshot::open(const std::string& path) {
+    std::shared_ptr<KvSnapshot> snapshot(new KvSnapshot());
+    if (!snapshot->file_.open(path)) return nullptr;
+
+    const uint8_t* data = snapshot->file_.data();
+    const uint64_t size = snapshot->file_.size();
+    FileHeader header;
+    if (size < kHeaderBytes) return nullptr;
+    std::memcpy(&header, data, sizeof(header));
+    const uint64_t strings = static_cast<uint64_t>(header.session_bytes) + header.model_bytes + header.format_bytes;
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kKvSnapshotVersion ||
+        header.file_bytes != size || kHeaderBytes + strings > size || header.tokens_offset % alignof(int32_t) != 0 ||
+        header.tokens_offset > size || header.token_count > (size - header.tokens_offset) / sizeof(int32_t) ||
+        header.table_offset > size || header.section_count > (size - header.table_offset) / sizeof(Section)) {
+        LOGW("⚠️ Ignoring invalid KV snapshot %s", path.c_str());
+        return nullptr;
+    }
+
+    const char* text = reinterpret_cast<const char*>(data + kHeaderBytes);
+    snapshot->session_id_.assign(text, header.session_bytes);
+    snapshot->model_id_.assign(text + header.session_bytes, header.model_bytes);
+    snapshot->format_.assign(text + header.session_bytes + header.model_bytes, header.format_bytes);
+    snapshot->tokens_ = reinterpret_cast<const int32_t*>(data + header.tokens_offset);
+    snapshot->token_count_ = static_cast<size_t>(header.token_count);
+
+    snapshot->sections_.resize(header.section_count);
+    std::memcpy(snapshot->sections_.data(), data + header.table_offset, header.section_count * sizeof(Section));
+    for (const Section& section : snapshot->sections_) {
+        if (section.offset > size || section.bytes > size - section.offset) {
+            LOGW("⚠️ Ignoring truncated KV snapshot %s", path.c_str());
+            return nullptr;
+        }
+    }
+    return snapshot;
+}
+
+const uint8_t* KvSnapshot::section(size_t index, size_t* bytes) const {
+    if (index >= sections_.size()) {
+        *bytes = 0;
+        return nullptr;
+    }
+    *bytes = static_cast<size_t>(sections_[index].bytes);
+    return file_.data() + sections_[index].offset;
+}
+
+KvSnapshotWriter::KvSnapshotWriter(const std::string& path, const std::string& session_id,
+                                   const std::string& model_id, const std::string& format, const int32_t* tokens,
+                                   size_t token_count)
+    : path_(path), temp_path_(path + ".tmp"), token_count_(token_count) {
+    file_ = std::fopen(temp_path_.c_str(), "wb");
+    if (file_ == nullptr) {
+        LOGE("❌ Failed to create %s: %s", temp_path_.c_str(), std::strerror(errno));
+        return;
+    }
+
+    // Placeholder; finish() writes the real header once the counts are known
+    const FileHeader header = {};
+    write(&header, sizeof(header));
+    write(session_id.data(), session_id.size());
+    write(model_id.data(), model_id.size());
+    write(format.data(), format.size());
+    pad_to(alignof(int32_t));
+    tokens_offset_ = offset_;
+    write(tokens, token_count * sizeof(int32_t));
+    string_bytes_[0] = static_cast<uint32_t>(session_id.size());
+    string_bytes_[1] = static_cast<uint32_t>(model_id.size());
+    string_bytes_[2] = static_cast<uint32_t>(format.size());
+}
+
+KvSnapshotWriter::~KvSnapshotWriter() {
+    if (file_ != nullptr) std::fclose(file_);
+    if (!finished_) ::unlink(temp_path_.c_str());
+}
+
+void KvSnapshotWriter::write(const void* data, size_t bytes) {
+    if (!ok() || bytes == 0) return;
+    if (std::fwrite(data, 1, bytes, file_) != bytes) {
+        LOGE("❌ Failed to write %s: %s", temp_path_.c_str(), std::strerror(errno));
+        failed_ = true;
+        return;
+    }
+    offset_ += bytes;
+}
+
+void KvSnapshotWriter::pad_to(uint64_t alignment) {
+    static const uint8_t zeros[kSectionAlignment] = {};
+    const uint64_t padding = (alignment - offset_ % alignment) % alignment;
+    write(zeros, static_cast<size_t>(padding));
+}
+
+void KvSnapshotWriter::begin_section() {
+    pad_to(kSectionAlignment);
+    sections_.push_back(Section{offset_, 0});
+}
+
+void KvSnapshotWriter::end_section() {
+    if (!sections_.empty()) sections_.back().bytes = offset_ - sections_.back().offset;
+}
+
+bool KvSnapshotWriter::finish() {
+    pad_to(alignof(uint64_t));
+    const uint64_t table_offset = offset_;
+    write(sections_.data(), sections_.size() * sizeof(Section));
+    if (!ok()) return false;
+
+    FileHeader header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kKvSnapshotVersion;
+    header.section_count = static_cast<uint32_t>(sections_.size());
+    header.token_count = token_count_;
+    header.tokens_offset = tokens_offset_;
+    header.table_offset = table_offset;
+    header.file_bytes = offset_;
+    header.session_bytes = string_bytes_[0];
+    header.model_bytes = string_bytes_[1];
+    header.format_bytes = string_bytes_[2];
+    std::fseek(file_, 0, SEEK_SET);
+    const bool written = std::fwrite(&header, sizeof(header), 1, file_) == 1 && std::fflush(file_) == 0 &&
+                         fsync(fileno(file_)) == 0;
+    std::fclose(file_);
+    file_ = nullptr;
+    if (!written || std::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        LOGE("❌ Failed to publish KV snapshot %s: %s", path_.c_str(), std::strerror(errno));
+        return false;
+    }
+    finished_ = true;
+    return true;
+}
+
+KvSnapshotStore::KvSnapshotStore(std::string directory, int64_t byte_budget) : directory_(std::move(directory)) {
+    stats_.byte_budget = byte_budget;
+}
+
+KvSnapshotStore::~KvSnapshotStore() {
+    flush();
+}
+
+void KvSnapshotStore::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    published_.wait(lock, [this] { return pending_.empty(); });
+}
+
+void KvSnapshotStore::set_byte_budget(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.byte_budget = bytes;
+    if (scanned_) evict_locked("");
+}
+
+// FNV-1a; names only need to be stable, the header holds the real ids
+uint64_t KvSnapshotStore::hash(const std::string& text) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+std::string KvSnapshotStore::file_name(const std::string& session_id, const std::string& model_id) const {
+    char name[48];
+    std::snprintf(name, sizeof(name), "%016llx-%016llx", static_cast<unsigned long long>(hash(session_id)),
+                  static_cast<unsigned long long>(hash(model_id)));
+    return std::string(name) + kSuffix;
+}
+
+// Indexes the directory on first use and clears out interrupted writes
+void KvSnapshotStore::scan_locked() {
+    if (scanned_) return;
+    scanned_ = true;
+    if (mkdir(directory_.c_str(), 0700) != 0 && errno != EEXIST) {
+        LOGE("❌ Failed to create snapshot directory %s: %s", directory_.c_str(), std::strerror(errno));
+        return;
+    }
+    DIR* dir = opendir(directory_.c_str());
+    if (dir == nullptr) return;
+    while (dirent* item = readdir(dir)) {
+        const std::string name = item->d_name;
+        const std::string path = directory_ + "/" + name;
+        if (ends_with(name, kTempSuffix)) {
+            ::unlink(path.c_str());
+            continue;
+        }
+        struct stat info;
+        if (!ends_with(name, kSuffix) || stat(path.c_str(), &info) != 0) continue;
+        Entry entry;
+        entry.bytes = static_cast<int64_t>(info.st_size);
+        entry.last_used_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        entries_[name] = entry;
+        stats_.bytes += entry.bytes;
+    }
+    closedir(dir);
+    stats_.files = entries_.size();
+    evict_locked("");
+}
+
+void KvSnapshotStore::erase_locked(const std::string& name) {
+    auto found = entries_.find(name);
+    if (found == entries_.end()) return;
+    ::unlink((directory_ + "/" + name).c_str());
+    stats_.bytes -= found->second.bytes;
+    entries_.erase(found);
+    stats_.files = entries_.size();
+}
+
+// Oldest first until within budget; `keep` (the file just written) goes last
+void KvSnapshotStore::evict_locked(const std::string& keep) {
+    while (!entries_.empty() && stats_.bytes > stats_.byte_budget) {
+        auto oldest = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->first == keep && entries_.size() > 1) continue;
+            if (oldest == entries_.end() || it->second.last_used_ns < oldest->second.last_used_ns) oldest = it;
+        }
+        LOGI("🗑️ Evicting KV snapshot %s (%lld KB)", oldest->first.c_str(), (long long)(oldest->second.bytes / 1024));
+        erase_locked(oldest->first);
+        stats_.evictions++;
+    }
+}
+
+std::shared_ptr<const KvSnapshot> KvSnapshotStore::open(const std::string& session_id, const std::string& model_id,
+                                                        const std::string& format) {
+    const std::string name = file_name(session_id, model_id);
+    const std::string path = directory_ + "/" + name;
+    {
+        // A pending save leaves the previous file in place until its rename
+        std::lock_guard<std::mutex> lock(mutex_);
+        scan_locked();
+        if (entries_.count(name) == 0) return nullptr;
+    }
+
+    std::shared_ptr<const KvSnapshot> snapshot = KvSnapshot::open(path);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!snapshot || snapshot->session_id() != session_id || snapshot->model_id() != model_id ||
+        snapshot->format() != format) {
+        // Stale: another model build or KV format. Its mapping (if any) stays valid.
+        stats_.rejected++;
+        erase_locked(name);
+        return nullptr;
+    }
+
+    // Restoring counts as use, on disk too so the order survives restarts
+    auto found = entries_.find(name);
+    if (found != entries_.end()) found->second.last_used_ns = now_ns();
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    stats_.restores++;
+    return snapshot;
+}
+
+bool KvSnapshotStore::save(const std::string& session_id, const std::string& model_id, const std::string& format,
+                           std::vector<int32_t> tokens, WriteFn write) {
+    const std::string name = file_name(session_id, model_id);
+    Save next{session_id, model_id, format, std::move(tokens), std::move(write)};
+    std::lock_guard<std::mutex> lock(mutex_);
+    scan_locked();
+    if (stats_.byte_budget <= 0) return false;
+    if (pending_.count(name) != 0) {
+        // The earlier save still owns the temporary file; only the newest
+        // one waiting behind it is worth writing
+        auto queued = queued_.find(name);
+        if (queued != queued_.end()) {
+            queued->second = std::move(next);
+            stats_.coalesced++;
+        } else {
+            queued_.emplace(name, std::move(next));
+        }
+        return true;
+    }
+    pending_.insert(name);
+    ThreadPool::shared()->submit(CoreClass::kEfficiency,
+                                 [this, name, next = std::move(next)]() mutable { publish(name, std::move(next)); });
+    return true;
+}
+
+// Writing the KV and the fsync (tens of ms on phone flash) are the slow part
+// of a save, and nothing on the decode path needs to wait for them. Saves
+// queued behind this one meanwhile are written here too, in turn.
+void KvSnapshotStore::publish(const std::string& name, Save save) {
+    const std::string path = directory_ + "/" + name;
+    while (true) {
+        bool finished = false;
+        uint64_t bytes = 0;
+        {
+            KvSnapshotWriter writer(path, save.session_id, save.model_id, save.format, save.tokens.data(),
+                                    save.tokens.size());
+            finished = writer.ok() && save.write(&writer) && writer.finish();
+            bytes = writer.bytes_written();
+        }
+        save = Save(); // drops the capture and whatever KV it pinned
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finished) {
+            Entry& entry = entries_[name];
+            stats_.bytes += static_cast<int64_t>(bytes) - entry.bytes;
+            entry.bytes = static_cast<int64_t>(bytes);
+            entry.last_used_ns = now_ns();
+            stats_.files = entries_.size();
+            stats_.saves++;
+            evict_locked(name);
+        } else {
+            LOGW("⚠️ Failed to write KV snapshot %s", name.c_str());
+        }
+
+        auto queued = queued_.find(name);
+        if (queued == queued_.end() || stats_.byte_budget <= 0) {
+            if (queued != queued_.end()) queued_.erase(queued);
+            pending_.erase(name);
+            // Under the lock: the destructor may run as soon as pending_ is empty
+            published_.notify_all();
+            return;
+        }
+        save = std::move(queued->second);
+        queued_.erase(queued);
+    }
+}
+
+// Names are hex hashes, so a session's prefix matches only its own files
+void KvSnapshotStore::wait_published_locked(std::unique_lock<std::mutex>& lock, const std::string& prefix) {
+    published_.wait(lock, [&] {
+        auto next = pending_.lower_bound(prefix);
+        return next == pending_.end() || next->compare(0, prefix.size(), prefix) != 0;
+    });
+}
+
+void KvSnapshotStore::remove_session(const std::string& session_id) {
+    char prefix[24];
+    std::snprintf(prefix, sizeof(prefix), "%016llx-", static_cast<unsigned long long>(hash(session_id)));
+    std::unique_lock<std::mutex> lock(mutex_);
+    scan_locked();
+    // Nothing queued for the session is worth writing any more
+    auto queued = queued_.lower_bound(prefix);
+    while (queued != queued_.end() && queued->first.compare(0, std::strlen(prefix), prefix) == 0) {
+        queued = queued_.erase(queued);
+    }
+    wait_published_locked(lock, prefix);
+    std::vector<std::string> names;
+    for (const auto& entry : entries_) {
+        if (entry.first.compare(0, std::strlen(prefix), prefix) == 0) names.push_back(entry.first);
+    }
+    for (const std::string& name : names) erase_locked(name);
+}
+
+KvSnapshotStore::Stats KvSnapshotStore::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
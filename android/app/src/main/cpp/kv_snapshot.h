@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Persisted KV state of one chat session, so reopening a conversation after
+// a restart pages its KV back in instead of prefilling every earlier turn.
+//
+// A snapshot file holds the sequence's token ids and its KV as opaque
+// sections written by the chat module (one per KV block for the paged
+// cache), each page aligned so it can be used straight from the mapping:
+//
+//   header (64 bytes)  magic, version, counts and offsets
+//   session id, model id, KV format    checked on open
+//   token ids          int32
+//   sections           4 KB aligned
+//   section table      {offset, bytes} per section
+//
+// Files are written to a temporary name, synced and renamed, so a crash
+// leaves either the previous snapshot or none.
+constexpr uint32_t kKvSnapshotVersion = 1;
+
+class KvSnapshot {
+public:
+    // Maps and validates a snapshot file; nullptr if it is missing, of
+    // another version or truncated.
+    static std::shared_ptr<const KvSnapshot> open(const std::string& path);
+
+    const std::string& session_id() const { return session_id_; }
+    const std::string& model_id() const { return model_id_; }
+    const std::string& format() const { return format_; }
+
+    const int32_t* tokens() const { return tokens_; }
+    size_t token_count() const { return token_count_; }
+
+    size_t sections() const { return sections_.size(); }
+    // Read-only, valid while the snapshot is alive; pages fault in on first touch
+    const uint8_t* section(size_t index, size_t* bytes) const;
+
+    size_t file_bytes() const { return file_.size(); }
+
+private:
+    struct Section {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    KvSnapshot() = default;
+
+    MappedFile file_;
+    std::string session_id_;
+    std::string model_id_;
+    std::string format_;
+    const int32_t* tokens_ = nullptr;
+    size_t token_count_ = 0;
+    std::vector<Section> sections_;
+};
+
+// Streams one snapshot to disk. Sections are appended in order; finish()
+// publishes the file, and a writer destroyed without finish() leaves nothing.
+class KvSnapshotWriter {
+public:
+    KvSnapshotWriter(const std::string& path, const std::string& session_id, const std::string& model_id,
+                     const std::string& format, const int32_t* tokens, size_t token_count);
+    ~KvSnapshotWriter();
+
+    KvSnapshotWriter(const KvSnapshotWriter&) = delete;
+    KvSnapshotWriter& operator=(const KvSnapshotWriter&) = delete;
+
+    bool ok() const { return file_ != nullptr && !failed_; }
+
+    void begin_section();
+    void write(const void* data, size_t bytes);
+    void end_section();
+
+    bool finish();
+
+    uint64_t bytes_written() const { return offset_; }
+
+private:
+    struct Section {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    void pad_to(uint64_t alignment);
+
+    std::string path_;
+    std::string temp_path_;
+    std::FILE* file_ = nullptr;
+    bool failed_ = false;
+    bool finished_ = false;
+    uint64_t offset_ = 0;
+    uint64_t tokens_offset_ = 0;
+    uint64_t token_count_ = 0;
+    uint32_t string_bytes_[3] = {}; // session, model, format
+    std::vector<Section> sections_;
+};
+
+// Directory of session snapshots with an on-disk byte budget. One file per
+// (session, model); the least recently saved or restored files are deleted
+// once the directory exceeds the budget. Recency is the file's mtime, so it
+// survives restarts. Thread-safe: every engine and JNI thread shares one.
+//
+// save() only queues: an efficiency-core worker of ThreadPool::shared()
+// writes the KV through the caller's capture, then syncs, renames and
+// evicts. Until then the snapshot is pending. open() keeps returning the
+// previous file, a further save() of it waits behind it (replacing any
+// other waiting save), and remove_session() and flush() wait for it.
+class KvSnapshotStore {
+public:
+    struct Stats {
+        size_t files = 0;
+        int64_t bytes = 0;
+        int64_t byte_budget = 0;
+        uint64_t saves = 0;
+        uint64_t restores = 0;
+        uint64_t rejected = 0; // written for another model id or KV format
+        uint64_t evictions = 0;
+        uint64_t coalesced = 0; // replaced by a newer save before being written
+    };
+
+    // Writes the sequence's KV sections, on a pool worker; false abandons
+    // the snapshot
+    using WriteFn = std::function<bool(KvSnapshotWriter* writer)>;
+
+    KvSnapshotStore(std::string directory, int64_t byte_budget);
+    ~KvSnapshotStore(); // waits for pending snapshots
+
+    KvSnapshotStore(const KvSnapshotStore&) = delete;
+    KvSnapshotStore& operator=(const KvSnapshotStore&) = delete;
+
+    // 0 disables saving; lowering it evicts right away
+    void set_byte_budget(int64_t bytes);
+
+    // The session's snapshot for this model, if one exists and was written
+    // with `format`. Only the header is read; KV pages are mapped lazily.
+    std::shared_ptr<const KvSnapshot> open(const std::string& session_id, const std::string& model_id,
+                                           const std::string& format);
+
+    // Replaces the session's snapshot for this model in the background. A
+    // failure there is logged and leaves the previous snapshot. False if
+    // saving is disabled.
+    bool save(const std::string& session_id, const std::string& model_id, const std::string& format,
+              std::vector<int32_t> tokens, WriteFn write);
+
+    // Deletes the session's snapshots for every model.
+    void remove_session(const std::string& session_id);
+
+    // Waits until every save so far is published or has failed.
+    void flush();
+
+    Stats stats() const;
+
+private:
+    struct Entry {
+        int64_t bytes = 0;
+        int64_t last_used_ns = 0;
+    };
+
+    struct Save {
+        std::string session_id;
+        std::string model_id;
+        std::string format;
+        std::vector<int32_t> tokens;
+        WriteFn write;
+    };
+
+    static uint64_t hash(const std::string& text);
+    std::string file_name(const std::string& session_id, const std::string& model_id) const;
+    void scan_locked();
+    void evict_locked(const std::string& keep);
+    void erase_locked(const std::string& name);
+    void publish(const std::string& name, Save save);
+    void wait_published_locked(std::unique_lock<std::mutex>& lock, const std::string& prefix);
+
+    std::string directory_;
+    mutable std::mutex mutex_;
+    bool scanned_ = false;
+    std::map<std::string, Entry> entries_; // by file name
+    std::set<std::string> pending_;        // being written, not yet renamed into place
+    std::map<std::string, Save> queued_;   // to write once the pending one is published
+    std::condition_variable published_;
+    Stats stats_;
+};
@@ -0,0 +1,102 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mlc_log.h"
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+    path_ = path;
+
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        LOGE("❌ Failed to open %s: %s", path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd_, &info) != 0) {
+        LOGE("❌ Failed to stat %s: %s", path.c_str(), std::strerror(errno));
+        close();
+        return false;
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_ == 0) {
+        return true;
+    }
+
+    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        LOGE("❌ Failed to mmap %s (%zu bytes): %s", path.c_str(), size_, std::strerror(errno));
+        close();
+        return false;
+    }
+    data_ = static_cast<uint8_t*>(mapping);
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+        data_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    size_ = 0;
+}
+
+void MappedFile::advise(Access access, size_t offset, size_t length) {
+#ifndef NO_POSIX_MADVISE
+    if (data_ == nullptr || offset >= size_) return;
+    length = std::min(length, size_ - offset);
+
+    // madvise needs a page-aligned start; widen the range down to it
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t start = offset / page * page;
+
+    int advice = MADV_NORMAL;
+    switch (access) {
+        case Access::kNormal: advice = MADV_NORMAL; break;
+        case Access::kSequential: advice = MADV_SEQUENTIAL; break;
+        case Access::kRandom: advice = MADV_RANDOM; break;
+        case Access::kWillNeed: advice = MADV_WILLNEED; break;
+    }
+    if (madvise(data_ + start, offset + length - start, advice) != 0) {
+        LOGW("⚠️ madvise(%d) failed on %s: %s", advice, path_.c_str(), std::strerror(errno));
+    }
+#else
+    (void)access;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+void MappedFile::release(size_t offset, size_t length) {
+#ifndef NO_POSIX_MADVISE
+    if (data_ == nullptr || offset >= size_) return;
+    length = std::min(length, size_ - offset);
+
+    // Only whole pages inside the range, so neighbouring tensors stay resident
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t start = (offset + page - 1) / page * page;
+    const size_t end = offset + length == size_ ? size_ : (offset + length) / page * page;
+    if (end > start) {
+        madvise(data_ + start, end - start, MADV_DONTNEED);
+    }
+#else
+    (void)offset;
+    (void)length;
+#endif
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only mmap of a file, backed by the page cache.
+//
+// Weight shards are read through the mapping instead of into heap buffers,
+// so the bytes live in the page cache once and only the pages currently
+// being uploaded count against the process RSS. madvise hints are skipped
+// when NO_POSIX_MADVISE is defined.
+class MappedFile {
+public:
+    enum class Access {
+        kNormal,
+        kSequential, // aggressive readahead, pages may be dropped behind
+        kRandom,
+        kWillNeed,   // start reading the range in now
+    };
+
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps the whole file; returns false (and logs) on failure.
+    bool open(const std::string& path);
+    void close();
+
+    bool is_open() const { return fd_ >= 0; }
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string& path() const { return path_; }
+
+    void advise(Access access, size_t offset = 0, size_t length = SIZE_MAX);
+
+    // Drops this process's resident pages wholly inside the range; they stay
+    // in the page cache and fault back in if touched again.
+    void release(size_t offset, size_t length);
+
+private:
+    std::string path_;
+    int fd_ = -1;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
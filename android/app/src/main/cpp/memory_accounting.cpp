@@ -0,0 +1,82 @@
+#include "memory_accounting.h"
+
+#include <cstdio>
+#include <cstring>
+
+const char* memory_category_name(MemoryCategory category) {
+    switch (category) {
+        case MemoryCategory::kWeights: return "weights";
+        case MemoryCategory::kKvCache: return "kv";
+        case MemoryCategory::kScratch: return "scratch";
+        case MemoryCategory::kJni: return "jni";
+        default: return "unknown";
+    }
+}
+
+MemoryAccounting& MemoryAccounting::instance() {
+    static MemoryAccounting accounting;
+    return accounting;
+}
+
+void MemoryAccounting::add(MemoryCategory category, int64_t bytes) {
+    const int index = static_cast<int>(category);
+    const int64_t now = current_[index].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int64_t peak = peak_[index].load(std::memory_order_relaxed);
+    while (now > peak && !peak_[index].compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+    }
+}
+
+int64_t MemoryAccounting::current(MemoryCategory category) const {
+    return current_[static_cast<int>(category)].load(std::memory_order_relaxed);
+}
+
+int64_t MemoryAccounting::peak(MemoryCategory category) const {
+    return peak_[static_cast<int>(category)].load(std::memory_order_relaxed);
+}
+
+int64_t MemoryAccounting::total() const {
+    int64_t total = 0;
+    for (int i = 0; i < kCategories; i++) {
+        total += current_[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// Both files are "Key:   <value> kB" lines; stdio keeps this allocation-free
+// so it is safe to call while memory is tight.
+static bool read_kb_fields(const char* path, const char* const* keys, int64_t* const* values, int count) {
+    FILE* file = std::fopen(path, "r");
+    if (file == nullptr) {
+        return false;
+    }
+    char line[256];
+    int found = 0;
+    while (found < count && std::fgets(line, sizeof(line), file) != nullptr) {
+        for (int i = 0; i < count; i++) {
+            const size_t length = std::strlen(keys[i]);
+            long long kb = 0;
+            if (std::strncmp(line, keys[i], length) == 0 && line[length] == ':' &&
+                std::sscanf(line + length + 1, "%lld", &kb) == 1) {
+                *values[i] = static_cast<int64_t>(kb) * 1024;
+                found++;
+                break;
+            }
+        }
+    }
+    std::fclose(file);
+    return found > 0;
+}
+
+bool read_system_memory(SystemMemory* memory) {
+    *memory = SystemMemory();
+    const char* const keys[] = {"MemTotal", "MemAvailable", "MemFree"};
+    int64_t* const values[] = {&memory->total_bytes, &memory->available_bytes, &memory->free_bytes};
+    return read_kb_fields("/proc/meminfo", keys, values, 3);
+}
+
+bool read_process_memory(ProcessMemory* memory) {
+    *memory = ProcessMemory();
+    const char* const keys[] = {"VmRSS", "VmHWM", "VmSwap"};
+    int64_t* const values[] = {&memory->rss_bytes, &memory->peak_rss_bytes, &memory->swap_bytes};
+    return read_kb_fields("/proc/self/status", keys, values, 3);
+}
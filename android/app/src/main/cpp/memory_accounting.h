@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// What the native layer holds host memory for. On mobile SoCs GPU buffers
+// are carved out of the same RAM, so device-side weights and KV count too.
+enum class MemoryCategory : int {
+    kWeights = 0,
+    kKvCache,
+    kScratch, // logits, batch staging and other per-step buffers
+    kJni,     // text queued for or marshalled to Java
+    kCount,
+};
+
+const char* memory_category_name(MemoryCategory category);
+
+// Process-wide byte counters per category. Lock-free; updated by whoever
+// allocates or frees and read by getMemoryStatsNative and the pool's
+// pressure check.
+class MemoryAccounting {
+public:
+    static MemoryAccounting& instance();
+
+    void add(MemoryCategory category, int64_t bytes);
+    void sub(MemoryCategory category, int64_t bytes) { add(category, -bytes); }
+
+    int64_t current(MemoryCategory category) const;
+    int64_t peak(MemoryCategory category) const;
+    int64_t total() const;
+
+private:
+    static constexpr int kCategories = static_cast<int>(MemoryCategory::kCount);
+
+    std::atomic<int64_t> current_[kCategories] = {};
+    std::atomic<int64_t> peak_[kCategories] = {};
+};
+
+// /proc/meminfo
+struct SystemMemory {
+    int64_t total_bytes = 0;
+    int64_t available_bytes = 0;
+    int64_t free_bytes = 0;
+};
+
+// /proc/self/status
+struct ProcessMemory {
+    int64_t rss_bytes = 0;
+    int64_t peak_rss_bytes = 0;
+    int64_t swap_bytes = 0;
+};
+
+// Return false if the file cannot be read (fields are then left at 0).
+bool read_system_memory(SystemMemory* memory);
+bool read_process_memory(ProcessMemory* memory);
@@ -0,0 +1,209 @@
+#include "memory_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#include "mlc_log.h"
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+MemoryPool& MemoryPool::instance() {
+    static MemoryPool pool;
+    return pool;
+}
+
+// Smallest class that fits, or -1 if the request is too large to pool
+int MemoryPool::size_class(size_t bytes) {
+    int index = 0;
+    size_t size = kMinBlockBytes;
+    while (size < bytes) {
+        size <<= 1;
+        if (++index == kSizeClasses) return -1;
+    }
+    return index;
+}
+
+void* MemoryPool::allocate(size_t bytes, MemoryCategory category) {
+    const int index = size_class(bytes);
+    const size_t block_bytes = index >= 0 ? class_bytes(index) : bytes;
+
+    if (index >= 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<void*>& free_list = free_lists_[index];
+        if (!free_list.empty()) {
+            void* block = free_list.back();
+            free_list.pop_back();
+            cached_bytes_ -= static_cast<int64_t>(block_bytes);
+            hits_++;
+            MemoryAccounting::instance().add(category, static_cast<int64_t>(block_bytes));
+            return block;
+        }
+        misses_++;
+    }
+
+    void* block = nullptr;
+    if (posix_memalign(&block, 64, block_bytes) != 0) {
+        // Cached blocks of other classes may be what is missing
+        trim(0);
+        if (posix_memalign(&block, 64, block_bytes) != 0) {
+            LOGE("❌ Pool allocation of %zu bytes (%s) failed", block_bytes, memory_category_name(category));
+            throw std::bad_alloc();
+        }
+    }
+    MemoryAccounting::instance().add(category, static_cast<int64_t>(block_bytes));
+
+    // Only fresh allocations grow the footprint, so only they check it
+    check_pressure(false);
+    return block;
+}
+
+void MemoryPool::release(void* block, size_t bytes, MemoryCategory category) {
+    if (block == nullptr) return;
+    const int index = size_class(bytes);
+    const int64_t block_bytes = static_cast<int64_t>(index >= 0 ? class_bytes(index) : bytes);
+    MemoryAccounting::instance().sub(category, block_bytes);
+
+    if (index >= 0) {
+        // Keep the block unless that would hold the footprint above the low watermark
+        const int64_t low = low_watermark_.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (low <= 0 || MemoryAccounting::instance().total() + cached_bytes_ + block_bytes <= low) {
+            free_lists_[index].push_back(block);
+            cached_bytes_ += block_bytes;
+            return;
+        }
+        trimmed_bytes_ += block_bytes;
+    }
+    std::free(block);
+}
+
+void MemoryPool::set_watermarks(int64_t low_bytes, int64_t high_bytes, int64_t min_available_bytes) {
+    if (high_bytes > 0 && (low_bytes <= 0 || low_bytes > high_bytes)) {
+        low_bytes = high_bytes;
+    }
+    low_watermark_.store(low_bytes > 0 ? low_bytes : 0, std::memory_order_relaxed);
+    high_watermark_.store(high_bytes > 0 ? high_bytes : 0, std::memory_order_relaxed);
+    min_available_.store(min_available_bytes > 0 ? min_available_bytes : 0, std::memory_order_relaxed);
+    under_pressure_.store(false, std::memory_order_relaxed);
+    LOGI("🧮 Memory watermarks: low %lld MB, high %lld MB, min available %lld MB",
+         (long long)(low_bytes / (1024 * 1024)), (long long)(high_bytes / (1024 * 1024)),
+         (long long)(min_available_bytes / (1024 * 1024)));
+}
+
+int MemoryPool::add_shrinker(Shrinker shrinker) {
+    std::lock_guard<std::mutex> lock(shrinker_mutex_);
+    const int id = next_shrinker_id_++;
+    shrinkers_[id] = std::move(shrinker);
+    return id;
+}
+
+void MemoryPool::remove_shrinker(int id) {
+    std::lock_guard<std::mutex> lock(shrinker_mutex_);
+    shrinkers_.erase(id);
+}
+
+int64_t MemoryPool::trim(int64_t keep_bytes) {
+    std::vector<void*> blocks;
+    int64_t freed = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Largest classes first: fewest frees for the most memory
+        for (int index = kSizeClasses - 1; index >= 0 && cached_bytes_ > keep_bytes; index--) {
+            std::vector<void*>& free_list = free_lists_[index];
+            while (!free_list.empty() && cached_bytes_ > keep_bytes) {
+                blocks.push_back(free_list.back());
+                free_list.pop_back();
+                cached_bytes_ -= static_cast<int64_t>(class_bytes(index));
+                freed += static_cast<int64_t>(class_bytes(index));
+            }
+        }
+        trimmed_bytes_ += freed;
+    }
+    for (void* block : blocks) {
+        std::free(block);
+    }
+    return freed;
+}
+
+int64_t MemoryPool::held_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return MemoryAccounting::instance().total() + cached_bytes_;
+}
+
+bool MemoryPool::check_pressure(bool read_system) {
+    const int64_t high = high_watermark_.load(std::memory_order_relaxed);
+    const int64_t low = low_watermark_.load(std::memory_order_relaxed);
+    const int64_t min_available = min_available_.load(std::memory_order_relaxed);
+    if (high <= 0 && min_available <= 0) {
+        return false;
+    }
+
+    const int64_t held = held_bytes();
+    int64_t excess = high > 0 && held > high ? held - low : 0;
+
+    if (read_system && min_available > 0) {
+        const int64_t now = now_ms();
+        int64_t last = last_system_poll_ms_.load(std::memory_order_relaxed);
+        if (now - last >= kSystemPollMs &&
+            last_system_poll_ms_.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            SystemMemory system;
+            if (read_system_memory(&system) && system.available_bytes > 0 && system.available_bytes < min_available) {
+                excess = std::max(excess, min_available - system.available_bytes);
+            }
+        }
+    }
+
+    if (excess <= 0) {
+        if (low <= 0 || held <= low) {
+            under_pressure_.store(false, std::memory_order_relaxed);
+        }
+        return false;
+    }
+
+    // Once per crossing; while it stays high, at most once per cooldown
+    const int64_t now = now_ms();
+    if (under_pressure_.exchange(true, std::memory_order_relaxed) &&
+        now - last_pressure_ms_.load(std::memory_order_relaxed) < kPressureCooldownMs) {
+        return false;
+    }
+    last_pressure_ms_.store(now, std::memory_order_relaxed);
+    on_pressure(excess);
+    return true;
+}
+
+void MemoryPool::on_pressure(int64_t excess_bytes) {
+    pressure_events_.fetch_add(1, std::memory_order_relaxed);
+    const int64_t freed = trim(0);
+    LOGW("⚠️ Memory pressure: %lld MB over target, %lld MB of pooled blocks released",
+         (long long)(excess_bytes / (1024 * 1024)), (long long)(freed / (1024 * 1024)));
+
+    const int64_t remaining = excess_bytes - freed;
+    if (remaining <= 0) return;
+
+    std::lock_guard<std::mutex> lock(shrinker_mutex_);
+    for (auto& entry : shrinkers_) {
+        entry.second(remaining);
+    }
+}
+
+MemoryPool::Stats MemoryPool::stats() const {
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.cached_bytes = cached_bytes_;
+        stats.held_bytes = MemoryAccounting::instance().total() + cached_bytes_;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        stats.trimmed_bytes = trimmed_bytes_;
+    }
+    stats.low_watermark_bytes = low_watermark_.load(std::memory_order_relaxed);
+    stats.high_watermark_bytes = high_watermark_.load(std::memory_order_relaxed);
+    stats.min_available_bytes = min_available_.load(std::memory_order_relaxed);
+    stats.pressure_events = pressure_events_.load(std::memory_order_relaxed);
+    return stats;
+}
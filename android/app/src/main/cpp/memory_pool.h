@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "memory_accounting.h"
+
+// Pooled allocator for scratch buffers and KV blocks.
+//
+// Requests are rounded up to power-of-two size classes (4 KB to 64 MB) and
+// released blocks go back on their class's free list, so the per-request
+// logits and per-step staging buffers stop churning the system allocator.
+// Larger requests bypass the pool. Every block is charged to its
+// MemoryCategory at class size.
+//
+// Memory pressure uses two watermarks over everything accounted plus the
+// pool's cached blocks. Crossing the high watermark (or MemAvailable
+// dropping below the configured floor) first returns cached blocks to the
+// system, then asks the registered shrinkers (the engines' prefix caches)
+// to free the rest of the way down to the low watermark. Pressure fires
+// once per crossing and re-arms below the low watermark, with a cooldown
+// while it stays high.
+class MemoryPool {
+public:
+    static constexpr size_t kMinBlockBytes = 4096;
+    static constexpr int kSizeClasses = 15; // 4 KB << 14 = 64 MB
+
+    // Asked to free about `bytes`; must not block or allocate from the pool
+    using Shrinker = std::function<void(int64_t bytes)>;
+
+    struct Stats {
+        int64_t cached_bytes = 0;
+        int64_t held_bytes = 0; // accounted + cached
+        int64_t low_watermark_bytes = 0;
+        int64_t high_watermark_bytes = 0;
+        int64_t min_available_bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t pressure_events = 0;
+        int64_t trimmed_bytes = 0;
+    };
+
+    static MemoryPool& instance();
+
+    // Throws std::bad_alloc if the system allocation fails even after the
+    // cache has been trimmed.
+    void* allocate(size_t bytes, MemoryCategory category);
+    void release(void* block, size_t bytes, MemoryCategory category);
+
+    // 0 disables the corresponding check
+    void set_watermarks(int64_t low_bytes, int64_t high_bytes, int64_t min_available_bytes);
+
+    int add_shrinker(Shrinker shrinker);
+    // Once this returns the shrinker is not running and will not be called again.
+    void remove_shrinker(int id);
+
+    // Frees cached blocks until at most `keep_bytes` remain; returns bytes freed.
+    int64_t trim(int64_t keep_bytes);
+
+    // Runs the pressure response if a watermark is crossed. With
+    // `read_system`, MemAvailable is checked too (at most every
+    // kSystemPollMs; it costs a /proc read). Returns true if it fired.
+    bool check_pressure(bool read_system);
+
+    Stats stats() const;
+
+private:
+    static constexpr int64_t kSystemPollMs = 500;
+    static constexpr int64_t kPressureCooldownMs = 1000;
+
+    MemoryPool() = default;
+
+    static int size_class(size_t bytes);
+    static size_t class_bytes(int size_class) { return kMinBlockBytes << size_class; }
+
+    int64_t held_bytes() const;
+    void on_pressure(int64_t excess_bytes);
+
+    mutable std::mutex mutex_;
+    std::vector<void*> free_lists_[kSizeClasses];
+    int64_t cached_bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    int64_t trimmed_bytes_ = 0;
+
+    std::atomic<int64_t> low_watermark_{0};
+    std::atomic<int64_t> high_watermark_{0};
+    std::atomic<int64_t> min_available_{0};
+    std::atomic<int64_t> last_system_poll_ms_{0};
+    std::atomic<int64_t> last_pressure_ms_{0};
+    std::atomic<bool> under_pressure_{false};
+    std::atomic<uint64_t> pressure_events_{0};
+
+    // Held while shrinkers run, so remove_shrinker can wait them out
+    std::mutex shrinker_mutex_;
+    std::map<int, Shrinker> shrinkers_;
+    int next_shrinker_id_ = 0;
+};
+
+// Move-only array of trivially copyable T allocated from the pool. Resizing
+// does not preserve contents.
+template <typename T>
+class PoolBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "PoolBuffer holds raw memory");
+
+public:
+    explicit PoolBuffer(MemoryCategory category = MemoryCategory::kScratch) : category_(category) {}
+    ~PoolBuffer() { reset(); }
+
+    PoolBuffer(PoolBuffer&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)), category_(other.category_) {}
+    PoolBuffer& operator=(PoolBuffer&& other) noexcept {
+        if (this != &other) {
+            reset();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+            category_ = other.category_;
+        }
+        return *this;
+    }
+    PoolBuffer(const PoolBuffer&) = delete;
+    PoolBuffer& operator=(const PoolBuffer&) = delete;
+
+    void resize(size_t count) {
+        if (count == size_) return;
+        reset();
+        if (count > 0) {
+            data_ = static_cast<T*>(MemoryPool::instance().allocate(count * sizeof(T), category_));
+            size_ = count;
+        }
+    }
+
+    void reset() {
+        if (data_ != nullptr) {
+            MemoryPool::instance().release(data_, size_ * sizeof(T), category_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+    MemoryCategory category_;
+};
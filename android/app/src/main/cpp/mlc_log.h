@@ -0,0 +1,53 @@
+#pragma once
+
+// Logging shared by the native MLC-LLM layer. Routes to logcat on device and
+// to stderr when the inference core is built for the host.
+//
+// MLC_LOG_LEVEL picks what is compiled in: 0 nothing, 1 errors, 2 warnings,
+// 3 info. Release builds (NDEBUG) default to 2, so per-request LOGI calls
+// cost nothing there: their arguments are type-checked but never evaluated.
+#ifndef MLC_LOG_LEVEL
+#ifdef NDEBUG
+#define MLC_LOG_LEVEL 2
+#else
+#define MLC_LOG_LEVEL 3
+#endif
+#endif
+
+#ifdef __ANDROID__
+#include <android/log.h>
+
+#define LOG_TAG "MLCTVMWrapper"
+#define MLC_LOG_ERROR(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define MLC_LOG_WARN(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+#define MLC_LOG_INFO(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#else
+#include <cstdio>
+
+#define MLC_HOST_LOG(level, ...) \
+    do { std::fprintf(stderr, "[" level "] " __VA_ARGS__); std::fputc('\n', stderr); } while (0)
+#define MLC_LOG_ERROR(...) MLC_HOST_LOG("E", __VA_ARGS__)
+#define MLC_LOG_WARN(...) MLC_HOST_LOG("W", __VA_ARGS__)
+#define MLC_LOG_INFO(...) MLC_HOST_LOG("I", __VA_ARGS__)
+#endif
+
+#define MLC_LOG_DISABLED(log, ...) \
+    do { if (false) log(__VA_ARGS__); } while (0)
+
+#if MLC_LOG_LEVEL >= 1
+#define LOGE(...) MLC_LOG_ERROR(__VA_ARGS__)
+#else
+#define LOGE(...) MLC_LOG_DISABLED(MLC_LOG_ERROR, __VA_ARGS__)
+#endif
+
+#if MLC_LOG_LEVEL >= 2
+#define LOGW(...) MLC_LOG_WARN(__VA_ARGS__)
+#else
+#define LOGW(...) MLC_LOG_DISABLED(MLC_LOG_WARN, __VA_ARGS__)
+#endif
+
+#if MLC_LOG_LEVEL >= 3
+#define LOGI(...) MLC_LOG_INFO(__VA_ARGS__)
+#else
+#define LOGI(...) MLC_LOG_DISABLED(MLC_LOG_INFO, __VA_ARGS__)
+#endif
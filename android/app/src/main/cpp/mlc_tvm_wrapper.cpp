@@ -1,12 +1,19 @@
 #include <jni.h>
 #include <string>
 #include <memory>
-#include <android/log.h>
 #include <fstream>
 #include <vector>
 #include <map>
 #include <mutex>
 #include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <atomic>
+#include <future>
 
 // MLC-LLM Runtime includes
 #include <tvm/runtime/c_runtime_api.h>
@@ -16,38 +23,449 @@
 #include <tvm/runtime/ndarray.h>
 #include <dlfcn.h>
 
-#define LOG_TAG "MLCTVMWrapper"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#include "chat_module.h"
+#include "cpu_chat_module.h"
+#include "grammar.h"
+#include "inference_engine.h"
+#include "jni_bridge.h"
+#include "kv_snapshot.h"
+#include "memory_accounting.h"
+#include "memory_pool.h"
+#include "mlc_log.h"
+#include "model_config.h"
+#include "model_load.h"
+#include "model_residency.h"
+#include "published_snapshot.h"
+#include "result_protocol.h"
+#include "thread_pool.h"
+#include "token_stream.h"
+#include "tokenizer.h"
+#include "trace.h"
+#include "weight_loader.h"
 
-// Global state management
-static std::mutex g_mutex;
-static bool g_tvm_initialized = false;
-static std::map<std::string, tvm::runtime::Module> g_loaded_models;
-static std::string g_current_model_id;
+// Global state management. g_registry_mutex only guards the config registry
+// below and is never held across model loading or inference; each model's
+// work is serialized by its own InferenceEngine, and loaded models are owned
+// by g_residency (declared after the loader it calls).
+static std::mutex g_registry_mutex;
+static std::atomic<bool> g_tvm_initialized{false};
+static std::atomic<bool> g_use_gpu{true};
+static std::map<std::string, ModelRuntimeConfig> g_model_configs;
+
+// Per-session KV snapshots, shared by every model's engine. Disabled until a
+// model config sets kv_snapshot_mb.
+static const char* const kSnapshotDirectory = "/data/data/com.example.offline_ai_companion/files/kv_snapshots";
+static const std::shared_ptr<KvSnapshotStore> g_snapshot_store =
+    std::make_shared<KvSnapshotStore>(kSnapshotDirectory, 0);
 
 // TVM Runtime Handle
 static tvm::runtime::Module g_tvm_runtime;
 
+// Snapshots read lock-free by queryDeviceCapabilities / getMemoryStatsNative
+struct DeviceSnapshot {
+    int32_t has_gpu;
+    int64_t vram_bytes;
+    char device_info[128];
+};
+
+// Fields in the order of the binary stats message (MemoryStatsField)
+struct MemorySnapshot {
+    int64_t fields[kMemoryStatsFieldCount];
+};
+
+static PublishedSnapshot<DeviceSnapshot> g_device_snapshot;
+static PublishedSnapshot<MemorySnapshot> g_memory_snapshot;
+static std::mutex g_publish_mutex; // serializes snapshot writers only
+
+// Tags each generation's spans in exported traces
+static std::atomic<int64_t> g_next_trace_id{1};
+
 // MLC-LLM specific includes and functions
 extern "C" {
     // MLC-LLM C API functions
-    int mlc_llm_create_chat_module(const char* model_path, tvm::runtime::Module* chat_module);
-    int mlc_llm_generate_response(tvm::runtime::Module chat_module, const char* prompt, char** response);
     int mlc_llm_get_device_info(int* has_gpu, long* vram_bytes, char** device_info);
     int mlc_llm_get_memory_stats(long* vram_used, long* vram_total, long* system_ram);
 }
 
+// ChatModule backed by the packed functions exported from the compiled model library.
+// Its uploaded weights are charged to MemoryCategory::kWeights for its lifetime.
+class TvmChatModule : public ChatModule {
+public:
+    TvmChatModule(tvm::runtime::Module module, int64_t weight_bytes)
+        : module_(module), weight_bytes_(weight_bytes) {
+        MemoryAccounting::instance().add(MemoryCategory::kWeights, weight_bytes_);
+    }
+    
+    ~TvmChatModule() override {
+        MemoryAccounting::instance().sub(MemoryCategory::kWeights, weight_bytes_);
+    }
+
+    // Prefers the native tokenizer from <model_path>/tokenizer.json; the
+    // library's tokenize/token_to_piece are only needed without one.
+    bool init(const std::string& model_path) {
+        tokenize_ = module_.GetFunction("tokenize");
+        token_to_piece_ = module_.GetFunction("token_to_piece");
+        add_sequence_ = module_.GetFunction("add_sequence");
+        fork_sequence_ = module_.GetFunction("fork_sequence");
+        remove_sequence_ = module_.GetFunction("remove_sequence");
+        prefill_ = module_.GetFunction("prefill_tokens");
+        decode_ = module_.GetFunction("decode_token");
+        batch_decode_ = module_.GetFunction("batch_decode_tokens"); // optional
+        verify_ = module_.GetFunction("verify_tokens");             // optional, with pop_tokens
+        pop_tokens_ = module_.GetFunction("pop_tokens");
+        evict_ = module_.GetFunction("evict_tokens");               // optional, needs the paged KV cache
+        export_kv_ = module_.GetFunction("export_sequence_kv");     // optional, with import_sequence_kv
+        import_kv_ = module_.GetFunction("import_sequence_kv");
+        tvm::runtime::PackedFunc get_vocab_size = module_.GetFunction("get_vocab_size");
+        tvm::runtime::PackedFunc get_stop_tokens = module_.GetFunction("get_stop_token_ids");
+        if (add_sequence_ == nullptr || fork_sequence_ == nullptr || remove_sequence_ == nullptr ||
+            prefill_ == nullptr || decode_ == nullptr || get_vocab_size == nullptr) {
+            LOGE("❌ Chat module is missing token-level functions");
+            return false;
+        }
+
+        vocab_size_ = static_cast<int32_t>(static_cast<int64_t>(get_vocab_size()));
+        tokenizer_ = BpeTokenizer::load(model_path + "/tokenizer.json");
+        if (tokenizer_ && tokenizer_->vocab_size() > vocab_size_) {
+            LOGW("⚠️ tokenizer.json has %d tokens, model has %d; using the library tokenizer",
+                 tokenizer_->vocab_size(), vocab_size_);
+            tokenizer_.reset();
+        }
+        if (!tokenizer_ && (tokenize_ == nullptr || token_to_piece_ == nullptr)) {
+            LOGE("❌ Chat module has no tokenizer");
+            return false;
+        }
+        if (get_stop_tokens != nullptr) {
+            tvm::runtime::NDArray ids = get_stop_tokens();
+            stop_tokens_ = ndarray_to_tokens(ids);
+        }
+        return vocab_size_ > 0;
+    }
+
+    int32_t vocab_size() const override { return vocab_size_; }
+
+    std::vector<int32_t> tokenize(const std::string& text) override {
+        if (tokenizer_) {
+            return tokenizer_->encode(text);
+        }
+        tvm::runtime::NDArray ids = tokenize_(text);
+        return ndarray_to_tokens(ids);
+    }
+
+    std::string token_to_piece(int32_t token) override {
+        if (tokenizer_) {
+            return tokenizer_->token_bytes(token);
+        }
+        std::string piece = token_to_piece_(static_cast<int64_t>(token));
+        return piece;
+    }
+
+    bool is_stop_token(int32_t token) const override {
+        return std::find(stop_tokens_.begin(), stop_tokens_.end(), token) != stop_tokens_.end();
+    }
+
+    bool add_sequence(SequenceId seq) override {
+        add_sequence_(seq);
+        return true;
+    }
+
+    bool fork_sequence(SequenceId parent, SequenceId child, size_t length) override {
+        fork_sequence_(parent, child, static_cast<int64_t>(length));
+        return true;
+    }
+
+    void remove_sequence(SequenceId seq) override { remove_sequence_(seq); }
+
+    bool prefill(SequenceId seq, const int32_t* tokens, size_t count, float* logits) override {
+        tvm::runtime::NDArray input = tvm::runtime::NDArray::Empty(
+            {static_cast<int64_t>(count)}, DLDataType{kDLInt, 32, 1}, DLDevice{kDLCPU, 0});
+        input.CopyFromBytes(tokens, count * sizeof(int32_t));
+        tvm::runtime::NDArray output = prefill_(seq, input);
+        return copy_logits(output, logits);
+    }
+
+    bool decode(SequenceId seq, int32_t token, float* logits) override {
+        tvm::runtime::NDArray output = decode_(seq, static_cast<int64_t>(token));
+        return copy_logits(output, logits);
+    }
+
+    bool batch_decode(const SequenceId* seqs, const int32_t* tokens, size_t count, float* const* logits) override {
+        if (batch_decode_ == nullptr) {
+            return ChatModule::batch_decode(seqs, tokens, count, logits);
+        }
+        
+        const DLDevice cpu{kDLCPU, 0};
+        tvm::runtime::NDArray seq_ids = tvm::runtime::NDArray::Empty({static_cast<int64_t>(count)}, DLDataType{kDLInt, 64, 1}, cpu);
+        tvm::runtime::NDArray input = tvm::runtime::NDArray::Empty({static_cast<int64_t>(count)}, DLDataType{kDLInt, 32, 1}, cpu);
+        seq_ids.CopyFromBytes(seqs, count * sizeof(SequenceId));
+        input.CopyFromBytes(tokens, count * sizeof(int32_t));
+        
+        // [count, vocab] logits, one row per sequence
+        tvm::runtime::NDArray output = batch_decode_(seq_ids, input);
+        if (output.Shape().size() != 2 || output.Shape()[0] != static_cast<int64_t>(count) ||
+            output.Shape()[1] != vocab_size_) {
+            LOGE("❌ Unexpected batched logits shape from chat module");
+            return false;
+        }
+        // Staging buffer is reused across steps; it only grows with the batch
+        const size_t row_floats = count * static_cast<size_t>(vocab_size_);
+        if (batch_rows_.size() < row_floats) {
+            batch_rows_.resize(row_floats);
+        }
+        float* rows = batch_rows_.data();
+        output.CopyToBytes(rows, row_floats * sizeof(float));
+        for (size_t i = 0; i < count; i++) {
+            std::memcpy(logits[i], rows + i * vocab_size_, static_cast<size_t>(vocab_size_) * sizeof(float));
+        }
+        return true;
+    }
+
+    // Sizes the runtime's KV cache as pages of kv_block_tokens that are
+    // allocated on demand, instead of context_window_size per sequence up
+    // front. Libraries without create_paged_kv_cache keep their own layout.
+    bool configure_kv_cache(const ModelRuntimeConfig& config) {
+        tvm::runtime::PackedFunc create_kv = module_.GetFunction("create_paged_kv_cache");
+        if (create_kv == nullptr) {
+            LOGW("⚠️ Model library has no paged KV cache; using its built-in KV layout");
+            snapshot_format_ = "tvm/builtin";
+            return true;
+        }
+        
+        const KvCacheLayout layout = config.kv_layout();
+        if (!layout.valid()) {
+            LOGE("❌ Invalid KV cache layout in model config");
+            return false;
+        }
+        // 0 pages: grow with the tokens in use until memory pressure
+        const int64_t max_pages = config.kv_cache_bytes > 0
+            ? config.kv_cache_bytes / static_cast<int64_t>(layout.sealed_block_bytes()) : 0;
+        create_kv(static_cast<int64_t>(config.max_concurrent_requests), static_cast<int64_t>(config.context_window_size),
+                  static_cast<int64_t>(config.prefill_chunk_size), static_cast<int64_t>(layout.block_tokens), max_pages,
+                  std::string(kv_quantization_name(layout.quantization)));
+        LOGI("📄 Paged KV cache: %d-token %s pages, %lld pages max", layout.block_tokens,
+             kv_quantization_name(layout.quantization), (long long)max_pages);
+        snapshot_format_ = std::string("tvm/") + kv_quantization_name(layout.quantization) + "/" +
+                           std::to_string(layout.block_tokens);
+        page_tokens_ = static_cast<size_t>(layout.block_tokens);
+        return true;
+    }
+    
+    bool supports_verify() const override { return verify_ != nullptr && pop_tokens_ != nullptr; }
+
+    bool verify(SequenceId seq, const int32_t* tokens, size_t count, float* logits) override {
+        tvm::runtime::NDArray input = tvm::runtime::NDArray::Empty(
+            {static_cast<int64_t>(count)}, DLDataType{kDLInt, 32, 1}, DLDevice{kDLCPU, 0});
+        input.CopyFromBytes(tokens, count * sizeof(int32_t));
+        
+        // [count, vocab] logits, one row per input position
+        tvm::runtime::NDArray output = verify_(seq, input);
+        if (output.Shape().size() != 2 || output.Shape()[0] != static_cast<int64_t>(count) ||
+            output.Shape()[1] != vocab_size_) {
+            LOGE("❌ Unexpected verify logits shape from chat module");
+            return false;
+        }
+        output.CopyToBytes(logits, count * static_cast<size_t>(vocab_size_) * sizeof(float));
+        return true;
+    }
+
+    bool pop_tokens(SequenceId seq, size_t count) override {
+        pop_tokens_(seq, static_cast<int64_t>(count));
+        return true;
+    }
+    
+    // The runtime drops whole KV pages and re-rotates the keys after them;
+    // without its paged KV cache there are no pages to evict
+    size_t eviction_granularity() const override { return evict_ != nullptr ? page_tokens_ : 0; }
+
+    bool evict_tokens(SequenceId seq, size_t begin, size_t count) override {
+        evict_(seq, static_cast<int64_t>(begin), static_cast<int64_t>(count));
+        return true;
+    }
+    
+    // The runtime serializes a sequence's KV pages into one opaque byte
+    // array, stored as a single snapshot section
+    std::string snapshot_format() const override {
+        return export_kv_ != nullptr && import_kv_ != nullptr ? snapshot_format_ : std::string();
+    }
+    
+    // The export is the runtime's own copy, so only that stays on the
+    // module's thread; staging it to the file happens in the capture
+    KvSnapshotCapture capture_sequence(SequenceId seq) override {
+        tvm::runtime::NDArray kv = export_kv_(seq);
+        return [kv](KvSnapshotWriter* writer) {
+            const size_t bytes = static_cast<size_t>(kv.Shape().back());
+            PoolBuffer<uint8_t> staging;
+            staging.resize(bytes);
+            kv.CopyToBytes(staging.data(), bytes);
+            writer->begin_section();
+            writer->write(staging.data(), bytes);
+            writer->end_section();
+            return writer->ok();
+        };
+    }
+    
+    bool restore_sequence(SequenceId seq, const std::shared_ptr<const KvSnapshot>& snapshot, size_t length) override {
+        size_t bytes = 0;
+        const uint8_t* data = snapshot->section(0, &bytes);
+        if (data == nullptr || bytes == 0) {
+            return false;
+        }
+        tvm::runtime::NDArray input = tvm::runtime::NDArray::Empty(
+            {static_cast<int64_t>(bytes)}, DLDataType{kDLUInt, 8, 1}, DLDevice{kDLCPU, 0});
+        input.CopyFromBytes(data, bytes);
+        import_kv_(seq, input, static_cast<int64_t>(length));
+        return true;
+    }
+
+private:
+    static std::vector<int32_t> ndarray_to_tokens(const tvm::runtime::NDArray& array) {
+        std::vector<int32_t> tokens(array.Shape().back());
+        array.CopyToBytes(tokens.data(), tokens.size() * sizeof(int32_t));
+        return tokens;
+    }
+
+    bool copy_logits(const tvm::runtime::NDArray& output, float* logits) const {
+        if (output.Shape().back() != vocab_size_) {
+            LOGE("❌ Unexpected logits shape from chat module");
+            return false;
+        }
+        output.CopyToBytes(logits, static_cast<size_t>(vocab_size_) * sizeof(float));
+        return true;
+    }
+
+    tvm::runtime::Module module_;
+    tvm::runtime::PackedFunc tokenize_;
+    tvm::runtime::PackedFunc token_to_piece_;
+    tvm::runtime::PackedFunc add_sequence_;
+    tvm::runtime::PackedFunc fork_sequence_;
+    tvm::runtime::PackedFunc remove_sequence_;
+    tvm::runtime::PackedFunc prefill_;
+    tvm::runtime::PackedFunc decode_;
+    tvm::runtime::PackedFunc batch_decode_;
+    tvm::runtime::PackedFunc verify_;
+    tvm::runtime::PackedFunc pop_tokens_;
+    tvm::runtime::PackedFunc evict_;
+    tvm::runtime::PackedFunc export_kv_;
+    tvm::runtime::PackedFunc import_kv_;
+    std::unique_ptr<BpeTokenizer> tokenizer_;
+    std::string snapshot_format_;
+    size_t page_tokens_ = 0; // 0 with the built-in KV layout
+    int64_t weight_bytes_ = 0;
+    int32_t vocab_size_ = 0;
+    std::vector<int32_t> stop_tokens_;
+    PoolBuffer<float> batch_rows_;
+};
+
+// The native q4f16_0 backend over the mmapped shards, for devices without
+// a GPU. nullptr if the model is not a Llama it can run (or the load was
+// cancelled). Its "upload" is faulting the mapped weights in.
+static std::shared_ptr<ChatModule> create_cpu_chat_module(const std::string& model_path,
+                                                          const ModelRuntimeConfig& config, ModelLoadTask* task) {
+    task->begin_stage(LoadStage::kMapWeights);
+    std::shared_ptr<MappedWeights> weights = map_model_weights(model_path, task);
+    std::unique_ptr<BpeTokenizer> tokenizer = BpeTokenizer::load(model_path + "/tokenizer.json");
+    if (!weights || !tokenizer) {
+        return nullptr;
+    }
+    task->begin_stage(LoadStage::kUpload);
+    if (!prefault_model_weights(*weights, task)) {
+        return nullptr;
+    }
+    // Llama-3 end-of-turn tokens; the library reports its own, but there is
+    // no library on this path
+    std::vector<int32_t> stop_tokens;
+    for (const char* name : {"<|end_of_text|>", "<|eom_id|>", "<|eot_id|>"}) {
+        const int32_t id = tokenizer->token_id(name);
+        if (id >= 0) {
+            stop_tokens.push_back(id);
+        }
+    }
+
+    CpuLlamaConfig llama;
+    llama.hidden_size = config.hidden_size;
+    llama.intermediate_size = config.intermediate_size;
+    llama.num_attention_heads = config.num_attention_heads;
+    llama.num_key_value_heads = config.num_key_value_heads;
+    llama.head_dim = config.head_dim;
+    llama.num_hidden_layers = config.num_hidden_layers;
+    llama.vocab_size = config.vocab_size;
+    llama.rms_norm_eps = config.rms_norm_eps;
+    llama.rope_theta = config.position_embedding_base;
+    llama.rope_scaling.factor = config.rope_scaling_factor;
+    llama.rope_scaling.low_freq_factor = config.rope_scaling_low_freq_factor;
+    llama.rope_scaling.high_freq_factor = config.rope_scaling_high_freq_factor;
+    llama.rope_scaling.original_max_positions = config.rope_scaling_original_max_position_embeddings;
+    llama.tie_word_embeddings = config.tie_word_embeddings;
+
+    const MappedWeights* tensors = weights.get();
+    const int64_t weight_bytes = static_cast<int64_t>(weights->bytes);
+    std::shared_ptr<ChatModule> module = CpuChatModule::create(
+        llama, [tensors](const std::string& name, size_t bytes) { return tensors->find(name, bytes); },
+        std::move(weights), weight_bytes, std::move(tokenizer), std::move(stop_tokens), config.kv_layout(),
+        config.kv_cache_bytes > 0 ? static_cast<size_t>(config.kv_cache_bytes) : 0);
+    return module;
+}
+
 // MLC-LLM Runtime implementations
-int mlc_llm_create_chat_module(const char* model_path, tvm::runtime::Module* chat_module) {
+int mlc_llm_create_chat_module(const char* model_path, bool use_gpu, const ModelRuntimeConfig& config,
+                               ModelLoadTask* task, std::shared_ptr<ChatModule>* chat_module) {
     LOGI("🔄 Creating MLC-LLM chat module from: %s", model_path);
     
     try {
+        const auto start = std::chrono::steady_clock::now();
+        
+        task->begin_stage(LoadStage::kVerify);
+        if (!verify_model_files(model_path, task) || task->cancelled()) {
+            return -1;
+        }
+        
+        // Without a GPU the model library would fall back to TVM's generic
+        // CPU schedules; the native q4f16_0 kernels are used instead when
+        // they can run the model
+        if (use_gpu) {
+            int has_gpu = 0;
+            long vram_bytes = 0;
+            char* device_info = nullptr;
+            use_gpu = mlc_llm_get_device_info(&has_gpu, &vram_bytes, &device_info) == 0 && has_gpu != 0;
+            free(device_info);
+        }
+        if (!use_gpu) {
+            std::shared_ptr<ChatModule> cpu_module = create_cpu_chat_module(model_path, config, task);
+            if (task->cancelled()) {
+                return -1;
+            }
+            if (cpu_module) {
+                *chat_module = cpu_module;
+                LOGI("✅ CPU chat module created in %lld ms", (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+                return 0;
+            }
+            LOGW("⚠️ Native CPU backend cannot run %s; using the model library on the CPU", model_path);
+        }
+        
         // Load the MLC model using TVM runtime
         std::string model_lib_path = std::string(model_path) + "/model.so";
         std::string model_config_path = std::string(model_path) + "/mlc-chat-config.json";
         
+        // Map the parameter shards and upload them before the chat module
+        // is created, so it finds its weights in the runtime cache
+        const DLDevice device = use_gpu ? DLDevice{kDLOpenCL, 0} : DLDevice{kDLCPU, 0};
+        WeightLoadStats weights;
+        task->begin_stage(LoadStage::kMapWeights);
+        int weight_status = load_model_weights(model_path, device, &weights, task);
+        if (weight_status < 0) {
+            LOGE("❌ Failed to load model weights from: %s", model_path);
+            release_weight_cache();
+            return -1;
+        }
+        // Already there unless the library carries its own weights
+        task->begin_stage(LoadStage::kUpload);
+        if (weight_status == 0) {
+            LOGI("📦 Mapped %zu tensors from %zu shards (%zu MB, %zu MB zero-copy) in %lld ms",
+                 weights.tensors, weights.shards, weights.bytes / (1024 * 1024), weights.zero_copy_bytes / (1024 * 1024),
+                 (long long)(weights.micros / 1000));
+        }
+        
         // Create chat module using TVM runtime
         tvm::runtime::Module lib = tvm::runtime::Module::LoadFromFile(model_lib_path);
         
@@ -55,54 +473,78 @@ int mlc_llm_create_chat_module(const char* model_path, tvm::runtime::Module* cha
         tvm::runtime::PackedFunc chat_create = lib.GetFunction("mlc_chat_create");
         if (chat_create == nullptr) {
             LOGE("❌ Failed to get mlc_chat_create function");
+            task->set_error("Model library has no mlc_chat_create");
             return -1;
         }
         
         // Create the chat module
-        *chat_module = chat_create();
+        auto module = std::make_shared<TvmChatModule>(chat_create(), static_cast<int64_t>(weights.bytes));
+        release_weight_cache();
+        if (!module->init(model_path) || !module->configure_kv_cache(config)) {
+            task->set_error("Chat module initialization failed");
+            return -1;
+        }
+        task->set_fraction(1.0);
+        *chat_module = module;
         
-        LOGI("✅ MLC-LLM chat module created successfully");
+        const int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ProcessMemory process;
+        read_process_memory(&process);
+        LOGI("✅ MLC-LLM chat module created in %lld ms (RSS %lld MB, peak %lld MB)", (long long)elapsed_ms,
+             (long long)(process.rss_bytes / (1024 * 1024)), (long long)(process.peak_rss_bytes / (1024 * 1024)));
         return 0; // Success
     } catch (const std::exception& e) {
         LOGE("❌ Exception creating MLC-LLM chat module: %s", e.what());
+        task->set_error(e.what());
+        release_weight_cache();
         return -1;
     }
 }
 
-int mlc_llm_generate_response(tvm::runtime::Module chat_module, const char* prompt, char** response) {
-    LOGI("🔄 Generating MLC-LLM response for: %.50s...", prompt);
+// Queues a blocking generation on the model's engine and waits for it. Only
+// the calling JNI thread waits; other models and entry points keep running.
+int mlc_llm_generate_response(InferenceEngine& engine, const char* prompt, const GenerationParams& params,
+                              RequestPriority priority, const std::string& session_id, char** response) {
+    LOGI("🔄 Generating MLC-LLM response for a %zu-byte prompt", strlen(prompt));
     
-    try {
-        // Get the generate function from the chat module
-        tvm::runtime::PackedFunc generate = chat_module.GetFunction("generate");
-        if (generate == nullptr) {
-            LOGE("❌ Failed to get generate function");
-            return -1;
-        }
-        
-        // Prepare input
-        tvm::runtime::NDArray input = tvm::runtime::NDArray::Empty({1}, tvm::runtime::DataType::kDLInt, tvm::runtime::Device{kDLCPU, 0});
-        
-        // Call generate function
-        tvm::runtime::NDArray output = generate(input);
-        
-        // Convert output to string
-        std::string result = "Generated response from MLC-LLM: " + std::string(prompt);
-        
-        // Allocate memory for response
-        *response = (char*)malloc(result.length() + 1);
-        strcpy(*response, result.c_str());
-        
-        LOGI("✅ MLC-LLM response generated: %d characters", (int)result.length());
-        return 0; // Success
-    } catch (const std::exception& e) {
-        LOGE("❌ Exception generating MLC-LLM response: %s", e.what());
+    auto result_text = std::make_shared<std::string>();
+    auto done = std::make_shared<std::promise<int>>();
+    std::future<int> status_future = done->get_future();
+    
+    InferenceRequest request;
+    request.prompt = prompt;
+    request.params = params;
+    request.priority = priority;
+    request.session_id = session_id;
+    request.trace_id = g_next_trace_id.fetch_add(1, std::memory_order_relaxed);
+    request.on_token = [result_text](int32_t, const std::string& piece) {
+        *result_text += piece;
+        return true;
+    };
+    request.on_complete = [done](int status) { done->set_value(status); };
+    
+    if (!engine.submit(std::move(request))) {
+        LOGE("❌ MLC-LLM request queue is full or closed");
         return -1;
     }
+    
+    int status = status_future.get();
+    if (status != 0) {
+        return status;
+    }
+    const std::string& result = *result_text;
+    
+    // Allocate memory for response
+    *response = (char*)malloc(result.length() + 1);
+    strcpy(*response, result.c_str());
+    
+    LOGI("✅ MLC-LLM response generated: %d characters", (int)result.length());
+    return 0; // Success
 }
 
 int tvm_module_run_inference(void* module, const char* input, char** output) {
-    LOGI("🔄 Running MLC-LLM inference for: %s", input);
+    LOGI("🔄 Running MLC-LLM inference for a %zu-byte prompt", strlen(input));
     
     // Simple but realistic AI response generation
     std::string prompt = input;
@@ -151,7 +593,7 @@ int tvm_module_run_inference(void* module, const char* input, char** output) {
     *output = (char*)malloc(response.length() + 1);
     strcpy(*output, response.c_str());
     
-    LOGI("✅ Generated MLC-LLM response: %s", response.substr(0, 100).c_str());
+    LOGI("✅ Generated MLC-LLM response: %zu characters", response.length());
     return 0; // Success
 }
 
@@ -201,8 +643,9 @@ int mlc_llm_get_memory_stats(long* vram_used, long* vram_total, long* system_ram
             *vram_used = 0;
         }
         
-        // Get system RAM (simplified)
-        *system_ram = 12000000000; // 12GB system RAM
+        SystemMemory system;
+        read_system_memory(&system);
+        *system_ram = system.total_bytes;
         
         LOGI("✅ Memory stats: VRAM %ld/%ld MB, System RAM %ld MB", 
              *vram_used / (1024 * 1024), *vram_total / (1024 * 1024), *system_ram / (1024 * 1024));
@@ -216,59 +659,202 @@ int mlc_llm_get_memory_stats(long* vram_used, long* vram_total, long* system_ram
     }
 }
 
-// Helper functions
-std::string jstring_to_string(JNIEnv* env, jstring jstr) {
-    if (jstr == nullptr) return "";
-    const char* chars = env->GetStringUTFChars(jstr, nullptr);
-    std::string str(chars);
-    env->ReleaseStringUTFChars(jstr, chars);
-    return str;
+// Refreshes the snapshots behind the stats queries. Called from load/unload
+// and after each request, never from the readers.
+static void publish_device_snapshot() {
+    int has_gpu = 0;
+    long vram_bytes = 0;
+    char* device_info = nullptr;
+    if (mlc_llm_get_device_info(&has_gpu, &vram_bytes, &device_info) != 0) {
+        return;
+    }
+    
+    DeviceSnapshot snapshot = {};
+    snapshot.has_gpu = has_gpu;
+    snapshot.vram_bytes = vram_bytes;
+    if (device_info) {
+        strncpy(snapshot.device_info, device_info, sizeof(snapshot.device_info) - 1);
+        free(device_info);
+    }
+    
+    std::lock_guard<std::mutex> lock(g_publish_mutex);
+    g_device_snapshot.publish(snapshot);
+}
+
+static void publish_memory_snapshot() {
+    long vram_used = 0, vram_total = 0, system_ram = 0;
+    if (mlc_llm_get_memory_stats(&vram_used, &vram_total, &system_ram) != 0) {
+        return;
+    }
+    
+    MemorySnapshot snapshot = {};
+    int64_t* fields = snapshot.fields;
+    fields[kStatVramUsed] = vram_used;
+    fields[kStatVramTotal] = vram_total;
+    fields[kStatSystemRam] = system_ram;
+    
+    SystemMemory system;
+    ProcessMemory process;
+    read_system_memory(&system);
+    read_process_memory(&process);
+    fields[kStatSystemAvailable] = system.available_bytes;
+    fields[kStatProcessRss] = process.rss_bytes;
+    fields[kStatProcessPeakRss] = process.peak_rss_bytes;
+    
+    const MemoryAccounting& accounting = MemoryAccounting::instance();
+    fields[kStatWeightsBytes] = accounting.current(MemoryCategory::kWeights);
+    fields[kStatKvCacheBytes] = accounting.current(MemoryCategory::kKvCache);
+    fields[kStatScratchBytes] = accounting.current(MemoryCategory::kScratch);
+    fields[kStatJniBytes] = accounting.current(MemoryCategory::kJni);
+    const MemoryPool::Stats pool = MemoryPool::instance().stats();
+    fields[kStatPoolCachedBytes] = pool.cached_bytes;
+    fields[kStatMemoryPressureEvents] = static_cast<int64_t>(pool.pressure_events);
+    
+    std::lock_guard<std::mutex> lock(g_publish_mutex);
+    g_memory_snapshot.publish(snapshot);
 }
 
-jstring string_to_jstring(JNIEnv* env, const std::string& str) {
-    return env->NewStringUTF(str.c_str());
+// Refreshes the memory snapshot on an efficiency worker, so the /proc reads,
+// device query and pressure check stay off the engine's decode path. This
+// is the only place the system memory poll runs; engines check their
+// watermarks alone. Requests made while one is queued fold into it.
+static std::atomic<bool> g_memory_snapshot_queued{false};
+
+static void schedule_memory_snapshot() {
+    if (g_memory_snapshot_queued.exchange(true, std::memory_order_acq_rel)) return;
+    ThreadPool::shared()->submit(CoreClass::kEfficiency, [] {
+        g_memory_snapshot_queued.store(false, std::memory_order_release);
+        MemoryPool::instance().check_pressure(true);
+        publish_memory_snapshot();
+    });
 }
 
-jobject create_result_map(JNIEnv* env, bool success, const std::string& error = "") {
-    jclass mapClass = env->FindClass("java/util/HashMap");
-    jmethodID mapInit = env->GetMethodID(mapClass, "<init>", "()V");
-    jmethodID mapPut = env->GetMethodID(mapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-    
-    jobject resultMap = env->NewObject(mapClass, mapInit);
+// ModelResidency loader: creates the chat module, warms it up and wraps it
+// in an engine. Runs on whichever thread activated or preloaded the model.
+static std::shared_ptr<InferenceEngine> load_engine(const std::string& model_id, ModelLoadTask* task) {
+    std::string model_path = "/data/data/com.example.offline_ai_companion/files/mlc_models/" + model_id;
+    std::shared_ptr<ChatModule> chat_module;
     
-    jstring successKey = env->NewStringUTF("success");
-    jobject successValue = env->NewObject(env->FindClass("java/lang/Boolean"), 
-                                         env->GetMethodID(env->FindClass("java/lang/Boolean"), "<init>", "(Z)V"), 
-                                         success);
-    env->CallObjectMethod(resultMap, mapPut, successKey, successValue);
+    ModelRuntimeConfig model_config;
+    {
+        std::lock_guard<std::mutex> lock(g_registry_mutex);
+        auto config = g_model_configs.find(model_id);
+        if (config != g_model_configs.end()) {
+            model_config = config->second;
+        }
+    }
     
-    if (!success && !error.empty()) {
-        jstring errorKey = env->NewStringUTF("error");
-        jstring errorValue = env->NewStringUTF(error.c_str());
-        env->CallObjectMethod(resultMap, mapPut, errorKey, errorValue);
+    int result = mlc_llm_create_chat_module(model_path.c_str(), g_use_gpu.load(), model_config, task, &chat_module);
+    if (result != 0) {
+        if (!task->cancelled()) {
+            LOGE("❌ Failed to create MLC-LLM chat module from: %s", model_path.c_str());
+        }
+        return nullptr;
     }
     
-    return resultMap;
+    // Nothing else can reach the module before the engine owns it
+    task->begin_stage(LoadStage::kWarmup);
+    const auto warmup_start = std::chrono::steady_clock::now();
+    if (!warm_up_chat_module(*chat_module, task)) {
+        if (!task->cancelled()) {
+            LOGE("❌ Warm-up decode failed for %s", model_id.c_str());
+            task->set_error("Warm-up decode failed");
+        }
+        return nullptr;
+    }
+    LOGI("🔥 Warmed up %s in %lld ms", model_id.c_str(), (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - warmup_start).count());
+    return std::make_shared<InferenceEngine>(model_id, chat_module, model_config,
+                                             InferenceEngine::kDefaultQueueCapacity, g_snapshot_store);
+}
+
+static ModelResidency g_residency(load_engine);
+
+static std::shared_ptr<InferenceEngine> current_engine() {
+    return g_residency.current();
+}
+
+static RequestPriority priority_from_jint(jint priority) {
+    if (priority <= static_cast<jint>(RequestPriority::kBackground)) return RequestPriority::kBackground;
+    if (priority >= static_cast<jint>(RequestPriority::kInteractive)) return RequestPriority::kInteractive;
+    return RequestPriority::kNormal;
+}
+
+// Compiles the request's grammar (0 none, 1 JSON schema, 2 EBNF) into
+// `params`. Compiling is cheap next to a decode step; masks for a repeated
+// grammar are still cached by the engine.
+static bool grammar_from_jni(JNIEnv* env, jint grammarType, jstring grammar, GenerationParams* params,
+                             std::string* error) {
+    if (grammarType == static_cast<jint>(Grammar::Kind::kNone) || grammar == nullptr) return true;
+    if (grammarType != static_cast<jint>(Grammar::Kind::kJsonSchema) &&
+        grammarType != static_cast<jint>(Grammar::Kind::kEbnf)) {
+        *error = "Unknown grammar type " + std::to_string(grammarType);
+        return false;
+    }
+    params->grammar = Grammar::compile(static_cast<Grammar::Kind>(grammarType), jstring_to_string(env, grammar), error);
+    if (!params->grammar) return false;
+    LOGI("🧩 Compiled %s grammar: %zu rules", grammarType == static_cast<jint>(Grammar::Kind::kJsonSchema)
+         ? "JSON schema" : "EBNF", params->grammar->rule_count());
+    return true;
+}
+
+// Streaming handles passed to Java own a reference to the stream, so the
+// engine can keep producing into it after Java has released the handle.
+static std::shared_ptr<TokenStream>* stream_from_handle(jlong handle) {
+    return reinterpret_cast<std::shared_ptr<TokenStream>*>(handle);
+}
+
+// Load handles passed to Java share the task with the activation thread,
+// and remember what the single poller has already seen.
+struct LoadHandle {
+    std::shared_ptr<ModelLoadTask> task;
+    uint64_t seen_version = 0;
+    bool reported = false;
+};
+
+static LoadHandle* load_from_handle(jlong handle) {
+    return reinterpret_cast<LoadHandle*>(handle);
+}
+
+// Residency budget and device for the loads that follow
+static void configure_residency(jboolean useGPU, jlong maxVramBytes, jfloat gpuMemoryFraction) {
+    // Models stay resident while their estimated footprints fit this budget
+    const float fraction = gpuMemoryFraction > 0.0f && gpuMemoryFraction <= 1.0f ? gpuMemoryFraction : 1.0f;
+    g_residency.set_budget(static_cast<int64_t>(static_cast<double>(maxVramBytes) * fraction));
+    g_use_gpu = useGPU;
 }
 
 // JNI method implementations
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_example_offline_1ai_1companion_MLCWrapper_initializeTVMRuntime(JNIEnv* env, jobject thiz) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
     try {
         LOGI("🚀 Initializing MLC-LLM TVM runtime...");
         
-        if (g_tvm_initialized) {
-            LOGW("⚠️ MLC-LLM TVM runtime already initialized");
-            return JNI_TRUE;
+        {
+            std::lock_guard<std::mutex> lock(g_registry_mutex);
+            if (g_tvm_initialized) {
+                LOGW("⚠️ MLC-LLM TVM runtime already initialized");
+                return JNI_TRUE;
+            }
+            
+            // Initialize TVM runtime for MLC-LLM
+            // This will initialize the TVM runtime with MLC-LLM support
+            tvm::runtime::Registry::Get("device_api.gpu");
+            
+            g_tvm_initialized = true;
+        }
+        
+        // Default watermarks until a model config sets its own: shrink caches
+        // once the native footprint passes half of RAM or the system runs low
+        SystemMemory system;
+        if (read_system_memory(&system) && MemoryPool::instance().stats().high_watermark_bytes == 0) {
+            MemoryPool::instance().set_watermarks(system.total_bytes * 2 / 5, system.total_bytes / 2,
+                                                  system.total_bytes / 10);
         }
         
-        // Initialize TVM runtime for MLC-LLM
-        // This will initialize the TVM runtime with MLC-LLM support
-        tvm::runtime::Registry::Get("device_api.gpu");
+        publish_device_snapshot();
+        publish_memory_snapshot();
         
-        g_tvm_initialized = true;
         LOGI("✅ MLC-LLM TVM runtime initialized successfully");
         return JNI_TRUE;
         
@@ -283,42 +869,20 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_queryDeviceCapabilities(JNIEn
     try {
         LOGI("🔍 Querying MLC-LLM device capabilities...");
         
-        int has_gpu;
-        long vram_bytes;
-        char* device_info;
-        
-        int result = mlc_llm_get_device_info(&has_gpu, &vram_bytes, &device_info);
-        
-        // Create result map
-        jclass mapClass = env->FindClass("java/util/HashMap");
-        jmethodID mapInit = env->GetMethodID(mapClass, "<init>", "()V");
-        jmethodID mapPut = env->GetMethodID(mapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-        
-        jobject capMap = env->NewObject(mapClass, mapInit);
-        
-        // Add GPU support
-        jstring gpuKey = env->NewStringUTF("supportsGPU");
-        jobject gpuValue = env->NewObject(env->FindClass("java/lang/Boolean"), 
-                                         env->GetMethodID(env->FindClass("java/lang/Boolean"), "<init>", "(Z)V"), 
-                                         (jboolean)(has_gpu != 0));
-        env->CallObjectMethod(capMap, mapPut, gpuKey, gpuValue);
-        
-        // Add VRAM bytes
-        jstring vramKey = env->NewStringUTF("vramBytes");
-        jobject vramValue = env->NewObject(env->FindClass("java/lang/Long"), 
-                                          env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"), 
-                                          (jlong)vram_bytes);
-        env->CallObjectMethod(capMap, mapPut, vramKey, vramValue);
-        
-        // Add device info
-        jstring infoKey = env->NewStringUTF("deviceInfo");
-        jstring infoValue = env->NewStringUTF(device_info);
-        env->CallObjectMethod(capMap, mapPut, infoKey, infoValue);
+        DeviceSnapshot snapshot = {};
+        if (!g_device_snapshot.read(&snapshot)) {
+            // First query before initialize: populate once, then serve from the snapshot
+            publish_device_snapshot();
+            g_device_snapshot.read(&snapshot);
+        }
         
-        // Cleanup
-        if (device_info) free(device_info);
+        jobject capMap = new_hash_map(env, 4);
+        map_put_bool(env, capMap, "supportsGPU", snapshot.has_gpu != 0);
+        map_put_long(env, capMap, "vramBytes", snapshot.vram_bytes);
+        map_put_string(env, capMap, "deviceInfo", snapshot.device_info);
         
-        LOGI("✅ Device capabilities queried: GPU=%d, VRAM=%ldMB", has_gpu, vram_bytes / (1024 * 1024));
+        LOGI("✅ Device capabilities queried: GPU=%d, VRAM=%lldMB", snapshot.has_gpu,
+             (long long)(snapshot.vram_bytes / (1024 * 1024)));
         return capMap;
         
     } catch (const std::exception& e) {
@@ -330,18 +894,93 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_queryDeviceCapabilities(JNIEn
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_example_offline_1ai_1companion_MLCWrapper_loadModelConfigNative(JNIEnv* env, jobject thiz, 
                                                                           jstring modelId, jstring modelLib, jobject config) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
     try {
         std::string model_id = jstring_to_string(env, modelId);
         std::string model_lib = jstring_to_string(env, modelLib);
         
         LOGI("⚙️ Loading model config for: %s (lib: %s)", model_id.c_str(), model_lib.c_str());
         
-        // For now, just log the config loading
-        // In real implementation, this would configure TVM model parameters
+        ModelRuntimeConfig model_config;
+        model_config.num_hidden_layers = (int32_t)map_get_number(env, config, "num_hidden_layers", model_config.num_hidden_layers);
+        model_config.num_key_value_heads = (int32_t)map_get_number(env, config, "num_key_value_heads", model_config.num_key_value_heads);
+        model_config.head_dim = (int32_t)map_get_number(env, config, "head_dim", model_config.head_dim);
+        model_config.vocab_size = (int32_t)map_get_number(env, config, "vocab_size", model_config.vocab_size);
+        model_config.context_window_size = (int32_t)map_get_number(env, config, "context_window_size", model_config.context_window_size);
+        model_config.prefill_chunk_size = (int32_t)map_get_number(env, config, "prefill_chunk_size", model_config.prefill_chunk_size);
+        model_config.hidden_size = (int32_t)map_get_number(env, config, "hidden_size", model_config.hidden_size);
+        model_config.intermediate_size = (int32_t)map_get_number(env, config, "intermediate_size", model_config.intermediate_size);
+        model_config.num_attention_heads = (int32_t)map_get_number(env, config, "num_attention_heads",
+                                                                   model_config.num_attention_heads);
+        model_config.rms_norm_eps = (float)map_get_number(env, config, "rms_norm_eps", model_config.rms_norm_eps);
+        model_config.position_embedding_base = (float)map_get_number(env, config, "position_embedding_base",
+                                                                     model_config.position_embedding_base);
+        model_config.rope_scaling_factor = (float)map_get_number(env, config, "rope_scaling_factor",
+                                                                 model_config.rope_scaling_factor);
+        model_config.rope_scaling_low_freq_factor = (float)map_get_number(env, config, "rope_scaling_low_freq_factor",
+                                                                          model_config.rope_scaling_low_freq_factor);
+        model_config.rope_scaling_high_freq_factor = (float)map_get_number(env, config, "rope_scaling_high_freq_factor",
+                                                                           model_config.rope_scaling_high_freq_factor);
+        model_config.rope_scaling_original_max_position_embeddings = (int32_t)map_get_number(
+            env, config, "rope_scaling_original_max_position_embeddings",
+            model_config.rope_scaling_original_max_position_embeddings);
+        model_config.tie_word_embeddings = map_get_number(env, config, "tie_word_embeddings",
+                                                          model_config.tie_word_embeddings ? 1 : 0) != 0;
+        model_config.max_concurrent_requests = (int32_t)map_get_number(env, config, "max_concurrent_requests",
+                                                                       model_config.max_concurrent_requests);
+        model_config.max_batch_size = (int32_t)map_get_number(env, config, "max_batch_size", model_config.max_batch_size);
+        model_config.enable_batching = map_get_number(env, config, "enable_batching", model_config.enable_batching ? 1 : 0) != 0;
+        model_config.speculative_decoding = map_get_number(env, config, "speculative_decoding",
+                                                           model_config.speculative_decoding ? 1 : 0) != 0;
+        model_config.speculative_max_draft = (int32_t)map_get_number(env, config, "speculative_max_draft",
+                                                                     model_config.speculative_max_draft);
+        model_config.speculative_max_ngram = (int32_t)map_get_number(env, config, "speculative_max_ngram",
+                                                                     model_config.speculative_max_ngram);
+        model_config.repetition_penalty = (float)map_get_number(env, config, "repetition_penalty", model_config.repetition_penalty);
+        model_config.presence_penalty = (float)map_get_number(env, config, "presence_penalty", model_config.presence_penalty);
+        model_config.frequency_penalty = (float)map_get_number(env, config, "frequency_penalty", model_config.frequency_penalty);
+        model_config.cache_size_bytes = (int64_t)map_get_number(env, config, "cache_size_mb",
+                                                                model_config.cache_size_bytes / (1024 * 1024)) * 1024 * 1024;
+        model_config.kv_block_tokens = (int32_t)map_get_number(env, config, "kv_block_tokens", model_config.kv_block_tokens);
+        const int kv_bits = (int)map_get_number(env, config, "kv_cache_bits", 16);
+        model_config.kv_quantization = kv_bits == 8 ? KvQuantization::kInt8
+                                     : kv_bits == 4 ? KvQuantization::kInt4 : KvQuantization::kFloat16;
+        model_config.kv_cache_bytes = (int64_t)map_get_number(env, config, "kv_cache_mb",
+                                                              (double)(model_config.kv_cache_bytes / (1024 * 1024))) * 1024 * 1024;
+        model_config.estimated_vram_bytes = (int64_t)map_get_number(env, config, "estimated_vram_bytes",
+                                                                    (double)model_config.estimated_vram_bytes);
+        g_residency.set_estimated_bytes(model_id, model_config.estimated_vram_bytes);
+        
+        // Memory watermarks are process-wide; the last config that sets them wins
+        const MemoryPool::Stats pool = MemoryPool::instance().stats();
+        const double high_mb = map_get_number(env, config, "memory_high_watermark_mb", 0);
+        if (high_mb > 0) {
+            const double low_mb = map_get_number(env, config, "memory_low_watermark_mb", high_mb * 0.8);
+            const double min_available_mb = map_get_number(env, config, "memory_min_available_mb",
+                                                           (double)(pool.min_available_bytes / (1024 * 1024)));
+            MemoryPool::instance().set_watermarks((int64_t)(low_mb * 1024 * 1024), (int64_t)(high_mb * 1024 * 1024),
+                                                  (int64_t)(min_available_mb * 1024 * 1024));
+        }
+        
+        // Session snapshots share one directory; likewise the last budget wins
+        const double snapshot_mb = map_get_number(env, config, "kv_snapshot_mb", -1);
+        if (snapshot_mb >= 0) {
+            g_snapshot_store->set_byte_budget((int64_t)(snapshot_mb * 1024 * 1024));
+        }
+        
+        // One thread pool serves every model; -1 sizes it from the core topology
+        ThreadPoolOptions pool_options;
+        pool_options.performance_workers = (int)map_get_number(env, config, "cpu_performance_workers", -1);
+        pool_options.efficiency_workers = (int)map_get_number(env, config, "cpu_efficiency_workers", -1);
+        ThreadPool::configure_shared(pool_options);
         
-        LOGI("✅ Model config loaded successfully");
+        {
+            std::lock_guard<std::mutex> lock(g_registry_mutex);
+            g_model_configs[model_id] = model_config;
+        }
+        
+        LOGI("✅ Model config loaded successfully (prefix cache %lld MB, %zu KV bytes/token, %s KV blocks of %d)",
+             (long long)(model_config.cache_size_bytes / (1024 * 1024)), model_config.kv_bytes_per_token(),
+             kv_quantization_name(model_config.kv_quantization), model_config.kv_block_tokens);
         return JNI_TRUE;
         
     } catch (const std::exception& e) {
@@ -352,43 +991,38 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_loadModelConfigNative(JNIEnv*
 
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_example_offline_1ai_1companion_MLCWrapper_loadTVMModelNative(JNIEnv* env, jobject thiz, 
-                                                                       jstring modelId, jboolean useGPU, jint maxVramBytes) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
+                                                                       jstring modelId, jboolean useGPU, jlong maxVramBytes,
+                                                                       jfloat gpuMemoryFraction) {
     try {
         std::string model_id = jstring_to_string(env, modelId);
         
-        LOGI("🧠 Loading MLC-LLM model: %s, GPU: %s, Max VRAM: %dMB", 
-             model_id.c_str(), useGPU ? "true" : "false", maxVramBytes / (1024 * 1024));
+        LOGI("🧠 Loading MLC-LLM model: %s, GPU: %s, Max VRAM: %lldMB", 
+             model_id.c_str(), useGPU ? "true" : "false", (long long)(maxVramBytes / (1024 * 1024)));
         
         if (!g_tvm_initialized) {
             LOGE("❌ MLC-LLM TVM runtime not initialized");
             return JNI_FALSE;
         }
         
-        // Unload previous model if any
-        if (!g_current_model_id.empty()) {
-            auto it = g_loaded_models.find(g_current_model_id);
-            if (it != g_loaded_models.end()) {
-                g_loaded_models.erase(it);
-            }
-        }
+        configure_residency(useGPU, maxVramBytes, gpuMemoryFraction);
         
-        // Load new MLC-LLM model
-        std::string model_path = "/data/data/com.example.offline_ai_companion/files/mlc_models/" + model_id;
-        tvm::runtime::Module chat_module;
-        
-        int result = mlc_llm_create_chat_module(model_path.c_str(), &chat_module);
-        if (result != 0) {
-            LOGE("❌ Failed to create MLC-LLM chat module from: %s", model_path.c_str());
+        // Loading happens without any global lock held, so generation on
+        // other resident models keeps running meanwhile
+        const auto start = std::chrono::steady_clock::now();
+        bool was_resident = false;
+        std::shared_ptr<InferenceEngine> engine = g_residency.activate(model_id, &was_resident);
+        if (!engine) {
             return JNI_FALSE;
         }
         
-        // Store model
-        g_loaded_models[model_id] = chat_module;
-        g_current_model_id = model_id;
+        publish_memory_snapshot();
         
-        LOGI("✅ MLC-LLM model loaded successfully: %s", model_id.c_str());
+        const long long elapsed_ms = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ModelResidency::Stats stats = g_residency.stats();
+        LOGI("✅ MLC-LLM model %s: %s (%lld ms, %zu resident, %lld/%lld MB)", was_resident ? "switched" : "loaded",
+             model_id.c_str(), elapsed_ms, stats.resident_models, (long long)(stats.resident_bytes / (1024 * 1024)),
+             (long long)(stats.budget_bytes / (1024 * 1024)));
         return JNI_TRUE;
         
     } catch (const std::exception& e) {
@@ -397,31 +1031,142 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_loadTVMModelNative(JNIEnv* en
     }
 }
 
+// Starts switching to `modelId` on the native activation thread and returns
+// a handle for pollModelLoadNative (0 on failure). The current model keeps
+// serving until the new one is ready; a newer load supersedes this one.
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_startModelLoadNative(JNIEnv* env, jobject thiz, jstring modelId,
+                                                                        jboolean useGPU, jlong maxVramBytes,
+                                                                        jfloat gpuMemoryFraction) {
+    try {
+        std::string model_id = jstring_to_string(env, modelId);
+        
+        if (!g_tvm_initialized) {
+            LOGE("❌ MLC-LLM TVM runtime not initialized");
+            return 0;
+        }
+        
+        configure_residency(useGPU, maxVramBytes, gpuMemoryFraction);
+        LOGI("🧠 Loading MLC-LLM model in the background: %s", model_id.c_str());
+        return reinterpret_cast<jlong>(new LoadHandle{g_residency.activate_async(model_id)});
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception starting model load: %s", e.what());
+        return 0;
+    }
+}
+
+// Waits up to `timeoutMs` for the load to move on, then writes its state as
+// a kLoadProgress message into `buffer` and returns the size (-1 on a bad
+// handle or buffer).
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_pollModelLoadNative(JNIEnv* env, jobject thiz, jlong handle,
+                                                                       jobject buffer, jint timeoutMs) {
+    LoadHandle* load = load_from_handle(handle);
+    size_t capacity = 0;
+    uint8_t* out = direct_buffer(env, buffer, &capacity);
+    if (load == nullptr || out == nullptr) return -1;
+    
+    const ModelLoadTask::Progress progress = load->task->wait(load->seen_version, timeoutMs);
+    load->seen_version = progress.version;
+    if (progress.finished && !load->reported) {
+        load->reported = true;
+        const ModelLoadTask::Progress& p = progress;
+        LOGI("%s Load of %s %s (verify %lld ms, map %lld ms, upload %lld ms, warm-up %lld ms)",
+             p.stage == LoadStage::kReady ? "✅" : "⚠️", load->task->model_id().c_str(), load_stage_name(p.stage),
+             (long long)(p.stage_us[0] / 1000), (long long)(p.stage_us[1] / 1000), (long long)(p.stage_us[2] / 1000),
+             (long long)(p.stage_us[3] / 1000));
+        publish_memory_snapshot();
+    }
+    return static_cast<jint>(encode_load_progress(out, capacity, progress));
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_cancelModelLoadNative(JNIEnv* env, jobject thiz, jlong handle) {
+    LoadHandle* load = load_from_handle(handle);
+    if (load == nullptr) return;
+    
+    load->task->cancel();
+    LOGI("⏹️ Cancellation requested for the load of %s", load->task->model_id().c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_getModelLoadErrorNative(JNIEnv* env, jobject thiz, jlong handle) {
+    LoadHandle* load = load_from_handle(handle);
+    if (load == nullptr) return nullptr;
+    
+    const ModelLoadTask::Progress progress = load->task->progress();
+    if (!progress.finished || progress.stage != LoadStage::kFailed) {
+        return nullptr;
+    }
+    return string_to_jstring(env, load->task->error());
+}
+
+// Releasing does not cancel; a load nobody waits for still becomes resident
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_releaseModelLoadNative(JNIEnv* env, jobject thiz, jlong handle) {
+    delete load_from_handle(handle);
+}
+
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_preloadModelNative(JNIEnv* env, jobject thiz, jstring modelId) {
+    try {
+        std::string model_id = jstring_to_string(env, modelId);
+        
+        if (!g_tvm_initialized) {
+            LOGE("❌ MLC-LLM TVM runtime not initialized");
+            return JNI_FALSE;
+        }
+        
+        bool queued = g_residency.preload(model_id);
+        LOGI("📦 Preload %s: %s", model_id.c_str(), queued ? "queued" : "skipped");
+        return queued ? JNI_TRUE : JNI_FALSE;
+        
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception preloading model: %s", e.what());
+        return JNI_FALSE;
+    }
+}
+
 extern "C" JNIEXPORT jstring JNICALL
 Java_com_example_offline_1ai_1companion_MLCWrapper_generateResponseNative(JNIEnv* env, jobject thiz, 
                                                                            jstring prompt, jint maxTokens, 
-                                                                           jfloat temperature, jfloat topP, jint topK) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
+                                                                           jfloat temperature, jfloat topP, jint topK,
+                                                                           jint priority, jstring sessionId,
+                                                                           jint grammarType, jstring grammar,
+                                                                           jint sinkTokens, jint windowTokens) {
     try {
         std::string prompt_str = jstring_to_string(env, prompt);
         
-        LOGI("🔄 Generating MLC-LLM response for prompt: %.50s...", prompt_str.c_str());
+        LOGI("🔄 Generating MLC-LLM response for a %zu-byte prompt", prompt_str.size());
         
-        if (g_current_model_id.empty()) {
+        std::shared_ptr<InferenceEngine> engine = current_engine();
+        if (!engine) {
             LOGE("❌ No MLC-LLM model loaded");
             return string_to_jstring(env, "Error: No MLC-LLM model loaded");
         }
         
-        auto it = g_loaded_models.find(g_current_model_id);
-        if (it == g_loaded_models.end()) {
-            LOGE("❌ Current MLC-LLM model not found in loaded models");
-            return string_to_jstring(env, "Error: MLC-LLM model not found");
+        GenerationParams params;
+        params.max_tokens = maxTokens;
+        params.temperature = temperature;
+        params.top_p = topP;
+        params.top_k = topK;
+        params.sink_tokens = sinkTokens;
+        params.window_tokens = windowTokens;
+        if (windowTokens > 0 && !engine->supports_window()) {
+            LOGE("❌ %s cannot evict KV for a context window", engine->model_id().c_str());
+            return string_to_jstring(env, "Error: This model does not support a context window");
+        }
+        std::string grammar_error;
+        if (!grammar_from_jni(env, grammarType, grammar, &params, &grammar_error)) {
+            LOGE("❌ Invalid grammar: %s", grammar_error.c_str());
+            return string_to_jstring(env, "Error: Invalid grammar: " + grammar_error);
         }
         
         // Generate response using MLC-LLM
         char* output = nullptr;
-        int result = mlc_llm_generate_response(it->second, prompt_str.c_str(), &output);
+        int result = mlc_llm_generate_response(*engine, prompt_str.c_str(), params, priority_from_jint(priority),
+                                               jstring_to_string(env, sessionId), &output);
+        schedule_memory_snapshot();
         
         if (result != 0 || output == nullptr) {
             LOGE("❌ MLC-LLM inference failed");
@@ -432,6 +1177,7 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_generateResponseNative(JNIEnv
         free(output);
         
         LOGI("✅ Generated MLC-LLM response: %d characters", (int)response.length());
+        TraceScope trace(TraceSpan::kJniReturn, -1, static_cast<int64_t>(response.size()));
         return string_to_jstring(env, response);
         
     } catch (const std::exception& e) {
@@ -440,20 +1186,181 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_generateResponseNative(JNIEnv
     }
 }
 
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_startStreamingNative(JNIEnv* env, jobject thiz,
+                                                                         jstring prompt, jint maxTokens,
+                                                                         jfloat temperature, jfloat topP, jint topK,
+                                                                         jint priority, jstring sessionId,
+                                                                         jint grammarType, jstring grammar,
+                                                                         jint sinkTokens, jint windowTokens) {
+    try {
+        std::shared_ptr<InferenceEngine> engine = current_engine();
+        if (!engine) {
+            LOGE("❌ No MLC-LLM model loaded for streaming");
+            return 0;
+        }
+        
+        auto stream = std::make_shared<TokenStream>();
+        const auto start = std::chrono::steady_clock::now();
+        
+        InferenceRequest request;
+        request.prompt = jstring_to_string(env, prompt);
+        request.params.max_tokens = maxTokens;
+        request.params.temperature = temperature;
+        request.params.top_p = topP;
+        request.params.top_k = topK;
+        request.params.sink_tokens = sinkTokens;
+        request.params.window_tokens = windowTokens;
+        if (windowTokens > 0 && !engine->supports_window()) {
+            // Failed before it starts, so the reason reaches Dart as the stream's error
+            LOGE("❌ %s cannot evict KV for a context window", engine->model_id().c_str());
+            stream->finish(false, "This model does not support a context window");
+            return reinterpret_cast<jlong>(new std::shared_ptr<TokenStream>(stream));
+        }
+        std::string grammar_error;
+        if (!grammar_from_jni(env, grammarType, grammar, &request.params, &grammar_error)) {
+            LOGE("❌ Invalid grammar for streaming: %s", grammar_error.c_str());
+            return 0;
+        }
+        request.priority = priority_from_jint(priority);
+        request.session_id = jstring_to_string(env, sessionId);
+        request.trace_id = g_next_trace_id.fetch_add(1, std::memory_order_relaxed);
+        stream->trace_id = request.trace_id;
+        request.on_token = [stream, start](int32_t token, const std::string& piece) {
+            if (stream->cancel_requested.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            if (stream->generated_tokens++ == 0) {
+                stream->first_token_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            }
+            return stream->push(TokenEvent{token, piece});
+        };
+        request.on_prefill_chunk = [stream](size_t, size_t, int64_t micros) {
+            stream->prefill_chunk_us.push_back(micros);
+        };
+        request.on_draft = [stream](size_t drafted, size_t accepted) {
+            stream->draft_tokens += static_cast<int64_t>(drafted);
+            stream->accepted_draft_tokens += static_cast<int64_t>(accepted);
+        };
+        request.on_complete = [stream](int status) {
+            if (status == -1) {
+                stream->finish(false, "MLC-LLM inference failed");
+            } else if (status == -2) {
+                stream->finish(false, "MLC-LLM model was unloaded");
+            } else {
+                stream->finish(true);
+            }
+            schedule_memory_snapshot(); // on_complete runs on the engine worker
+            LOGI("✅ Streaming finished: %d tokens, %zu prefill chunks, first token after %lld us, "
+                 "%lld/%lld draft tokens accepted%s",
+                 stream->generated_tokens, stream->prefill_chunk_us.size(), (long long)stream->first_token_us,
+                 (long long)stream->accepted_draft_tokens, (long long)stream->draft_tokens,
+                 stream->cancel_requested.load() ? " (cancelled)" : "");
+        };
+        
+        if (!engine->submit(std::move(request))) {
+            LOGE("❌ MLC-LLM request queue is full or closed");
+            return 0;
+        }
+        
+        LOGI("🔄 Streaming generation queued");
+        return reinterpret_cast<jlong>(new std::shared_ptr<TokenStream>(stream));
+        
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception starting streaming generation: %s", e.what());
+        return 0;
+    }
+}
+
+// Writes up to `maxTokens` tokens into `buffer` as a kTokenBatch message and
+// returns its size (-1 for a bad handle or buffer). The batch carries
+// kTokenBatchFinished once the stream has nothing more to deliver.
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_pollStreamNative(JNIEnv* env, jobject thiz, jlong handle,
+                                                                     jobject buffer, jint maxTokens, jint timeoutMs) {
+    auto* holder = stream_from_handle(handle);
+    size_t capacity = 0;
+    uint8_t* out = direct_buffer(env, buffer, &capacity);
+    if (holder == nullptr || out == nullptr) return -1;
+    TokenStream& stream = **holder;
+    
+    // Tokens that did not fit last time go first
+    std::vector<TokenEvent>& events = stream.undelivered;
+    if (events.size() < static_cast<size_t>(maxTokens)) {
+        stream.drain(events, static_cast<size_t>(maxTokens) - events.size(), events.empty() ? timeoutMs : 0);
+    }
+    
+    TraceScope trace(TraceSpan::kJniReturn, stream.trace_id);
+    uint32_t flags = 0;
+    if (stream.is_drained()) {
+        flags = kTokenBatchFinished | (stream.failed ? kTokenBatchFailed : 0);
+    }
+    size_t encoded = 0;
+    const int64_t size = encode_token_batch(out, capacity, events.data(), events.size(), flags, &encoded);
+    events.erase(events.begin(), events.begin() + encoded);
+    trace.set_count(static_cast<int64_t>(encoded));
+    return static_cast<jint>(size);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_cancelStreamingNative(JNIEnv* env, jobject thiz, jlong handle) {
+    auto* holder = stream_from_handle(handle);
+    if (holder == nullptr) return;
+    
+    (*holder)->cancel_requested.store(true, std::memory_order_relaxed);
+    LOGI("⏹️ Streaming cancellation requested");
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_getStreamErrorNative(JNIEnv* env, jobject thiz, jlong handle) {
+    auto* holder = stream_from_handle(handle);
+    if (holder == nullptr) return nullptr;
+    TokenStream& stream = **holder;
+    
+    if (!stream.finished.load(std::memory_order_acquire) || !stream.failed) {
+        return nullptr;
+    }
+    return string_to_jstring(env, stream.error);
+}
+
+// Writes a kStreamTimings message into `buffer` once the stream has finished
+// and returns its size; 0 while it is still running, -1 on a bad handle or buffer.
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_getStreamTimingsNative(JNIEnv* env, jobject thiz, jlong handle,
+                                                                           jobject buffer) {
+    auto* holder = stream_from_handle(handle);
+    size_t capacity = 0;
+    uint8_t* out = direct_buffer(env, buffer, &capacity);
+    if (holder == nullptr || out == nullptr) return -1;
+    TokenStream& stream = **holder;
+    
+    if (!stream.finished.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    return static_cast<jint>(encode_stream_timings(out, capacity, stream.first_token_us, stream.prefill_chunk_us.data(),
+                                                   stream.prefill_chunk_us.size(), stream.draft_tokens,
+                                                   stream.accepted_draft_tokens));
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_releaseStreamNative(JNIEnv* env, jobject thiz, jlong handle) {
+    auto* holder = stream_from_handle(handle);
+    if (holder == nullptr) return;
+    
+    // The engine keeps its own reference until the request completes
+    (*holder)->cancel_requested.store(true, std::memory_order_relaxed);
+    delete holder;
+}
+
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_example_offline_1ai_1companion_MLCWrapper_unloadModelNative(JNIEnv* env, jobject thiz) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
     try {
-        if (!g_current_model_id.empty()) {
-            auto it = g_loaded_models.find(g_current_model_id);
-            if (it != g_loaded_models.end()) {
-                tvm_module_destroy(it->second);
-                g_loaded_models.erase(it);
-                LOGI("✅ Model unloaded: %s", g_current_model_id.c_str());
-            }
-            g_current_model_id.clear();
+        std::string model_id = g_residency.unload_current();
+        if (!model_id.empty()) {
+            LOGI("✅ Model unloaded: %s", model_id.c_str());
         }
+        publish_memory_snapshot();
         
         return JNI_TRUE;
         
@@ -463,68 +1370,111 @@ Java_com_example_offline_1ai_1companion_MLCWrapper_unloadModelNative(JNIEnv* env
     }
 }
 
-extern "C" JNIEXPORT jobject JNICALL
-Java_com_example_offline_1ai_1companion_MLCWrapper_getMemoryStatsNative(JNIEnv* env, jobject thiz) {
+// Deletes a conversation's saved KV, for every model, when the chat is deleted.
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_deleteSessionSnapshotNative(JNIEnv* env, jobject thiz,
+                                                                                jstring sessionId) {
     try {
-        long vram_used, vram_total, system_ram;
-        int result = mlc_llm_get_memory_stats(&vram_used, &vram_total, &system_ram);
-        
-        // Create result map
-        jclass mapClass = env->FindClass("java/util/HashMap");
-        jmethodID mapInit = env->GetMethodID(mapClass, "<init>", "()V");
-        jmethodID mapPut = env->GetMethodID(mapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-        
-        jobject statsMap = env->NewObject(mapClass, mapInit);
-        
-        // Add memory stats
-        jstring vramUsedKey = env->NewStringUTF("vramUsed");
-        jobject vramUsedValue = env->NewObject(env->FindClass("java/lang/Long"), 
-                                              env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"), 
-                                              (jlong)vram_used);
-        env->CallObjectMethod(statsMap, mapPut, vramUsedKey, vramUsedValue);
-        
-        jstring vramTotalKey = env->NewStringUTF("vramTotal");
-        jobject vramTotalValue = env->NewObject(env->FindClass("java/lang/Long"), 
-                                               env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"), 
-                                               (jlong)vram_total);
-        env->CallObjectMethod(statsMap, mapPut, vramTotalKey, vramTotalValue);
+        const std::string session_id = jstring_to_string(env, sessionId);
+        if (session_id.empty()) return;
         
-        jstring systemRamKey = env->NewStringUTF("systemRam");
-        jobject systemRamValue = env->NewObject(env->FindClass("java/lang/Long"), 
-                                                env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"), 
-                                                (jlong)system_ram);
-        env->CallObjectMethod(statsMap, mapPut, systemRamKey, systemRamValue);
-        
-        return statsMap;
+        g_snapshot_store->remove_session(session_id);
+        LOGI("🗑️ Deleted KV snapshots of session %s", session_id.c_str());
         
     } catch (const std::exception& e) {
-        LOGE("❌ Exception getting memory stats: %s", e.what());
-        return create_result_map(env, false, "Failed to get memory stats");
+        LOGE("❌ Exception deleting session snapshot: %s", e.what());
+    }
+}
+
+// Writes the latest memory snapshot into `buffer` as a kMemoryStats message
+// and returns its size (-1 if the buffer is not direct or too small).
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_getMemoryStatsNative(JNIEnv* env, jobject thiz, jobject buffer) {
+    size_t capacity = 0;
+    uint8_t* out = direct_buffer(env, buffer, &capacity);
+    if (out == nullptr) return -1;
+    
+    MemorySnapshot snapshot = {};
+    if (!g_memory_snapshot.read(&snapshot)) {
+        publish_memory_snapshot();
+        g_memory_snapshot.read(&snapshot);
+    }
+    // Polling keeps the snapshot, and the pressure poll behind it, fresh
+    // through long generations; this read returns the previous one
+    schedule_memory_snapshot();
+    return static_cast<jint>(encode_memory_stats(out, capacity, snapshot.fields, kMemoryStatsFieldCount));
+}
+
+// Writes per-worker counters of the shared thread pool into `buffer` as a
+// kThreadPoolStats message and returns its size (-1 if the buffer is not
+// direct or too small).
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_getThreadPoolStatsNative(JNIEnv* env, jobject thiz,
+                                                                             jobject buffer) {
+    size_t capacity = 0;
+    uint8_t* out = direct_buffer(env, buffer, &capacity);
+    if (out == nullptr) return -1;
+
+    const std::vector<ThreadPool::WorkerStats> workers = ThreadPool::shared()->stats();
+    std::vector<int64_t> fields(workers.size() * kThreadPoolStatsFieldCount);
+    for (size_t i = 0; i < workers.size(); i++) {
+        int64_t* row = fields.data() + i * kThreadPoolStatsFieldCount;
+        row[kPoolStatCpu] = workers[i].cpu;
+        row[kPoolStatCoreClass] = static_cast<int64_t>(workers[i].core_class);
+        row[kPoolStatTasks] = static_cast<int64_t>(workers[i].tasks);
+        row[kPoolStatSteals] = static_cast<int64_t>(workers[i].steals);
+        row[kPoolStatBusyUs] = workers[i].busy_us;
+        row[kPoolStatUptimeUs] = workers[i].uptime_us;
+    }
+    return static_cast<jint>(
+        encode_thread_pool_stats(out, capacity, fields.data(), workers.size(), kThreadPoolStatsFieldCount));
+}
+
+// Starts or stops recording trace spans. Spans already recorded are kept.
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_setTracingEnabledNative(JNIEnv* env, jobject thiz,
+                                                                            jboolean enabled) {
+    set_tracing_enabled(enabled == JNI_TRUE);
+    LOGI("🔍 Tracing %s", enabled == JNI_TRUE ? "enabled" : "disabled");
+}
+
+// Writes the spans recorded since the last dump to `path` as a Chrome JSON
+// trace (open in Perfetto or chrome://tracing). Returns the number of spans,
+// or -1 if the file could not be written.
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_offline_1ai_1companion_MLCWrapper_dumpTraceNative(JNIEnv* env, jobject thiz, jstring path) {
+    const std::string path_str = jstring_to_string(env, path);
+    std::FILE* out = std::fopen(path_str.c_str(), "w");
+    if (out == nullptr) {
+        LOGE("❌ Cannot open trace file: %s", path_str.c_str());
+        return -1;
+    }
+    int64_t spans = trace_write_chrome_json(out);
+    if (std::fclose(out) != 0) {
+        spans = -1;
     }
+    if (spans < 0) {
+        LOGE("❌ Failed to write trace file: %s", path_str.c_str());
+    } else {
+        LOGI("🔍 Wrote %lld trace spans to %s", (long long)spans, path_str.c_str());
+    }
+    return static_cast<jlong>(spans);
 }
+
 extern "C" JNIEXPORT void JNICALL
 Java_com_example_offline_1ai_1companion_MLCWrapper_disposeTVMRuntime(JNIEnv* env, jobject thiz) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
     try {
-        // Unload all models
-        for (auto& pair : g_loaded_models) {
-            tvm_module_destroy(pair.second);
-        }
-        g_loaded_models.clear();
-        g_current_model_id.clear();
+        g_tvm_initialized = false;
+        
+        // Unload all models, including any background preload
+        g_residency.clear();
         
         // Destroy runtime
-        if (g_tvm_runtime) {
-            tvm_runtime_destroy(g_tvm_runtime);
-            g_tvm_runtime = nullptr;
-        }
+        g_tvm_runtime = tvm::runtime::Module();
         
-        g_tvm_initialized = false;
         LOGI("✅ TVM runtime disposed");
         
     } catch (const std::exception& e) {
         LOGE("❌ Exception disposing TVM runtime: %s", e.what());
     }
 }
-
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "kv_cache.h"
+
+// Per-model settings handed over by loadModelConfigNative. Defaults match
+// Llama-3.2-1B-Instruct-q4f16_0 and the runtime_config in mlc-app-config.json.
+struct ModelRuntimeConfig {
+    int32_t num_hidden_layers = 16;
+    int32_t num_key_value_heads = 8;
+    int32_t head_dim = 64;
+    int32_t vocab_size = 128256;
+    int32_t context_window_size = 131072;
+    int32_t prefill_chunk_size = 8192;
+
+    // Llama shape for the CPU backend, used when there is no GPU
+    // (model_config; rope_scaling arrives flattened as rope_scaling_<key>)
+    int32_t hidden_size = 2048;
+    int32_t intermediate_size = 8192;
+    int32_t num_attention_heads = 32;
+    float rms_norm_eps = 1e-5f;
+    float position_embedding_base = 500000.0f;
+    float rope_scaling_factor = 32.0f;
+    float rope_scaling_low_freq_factor = 1.0f;
+    float rope_scaling_high_freq_factor = 4.0f;
+    int32_t rope_scaling_original_max_position_embeddings = 8192;
+    bool tie_word_embeddings = true;
+
+    // Requests the engine keeps in flight at once (runtime_config.max_concurrent_requests)
+    int32_t max_concurrent_requests = 4;
+
+    // Continuous batching of decode steps (runtime_config.enable_batching,
+    // model_config.max_batch_size)
+    bool enable_batching = true;
+    int32_t max_batch_size = 128;
+
+    // Prompt-lookup speculative decoding for a lone generating sequence
+    // (runtime_config.speculative_decoding, speculative_max_draft,
+    // speculative_max_ngram); needs ChatModule::supports_verify()
+    bool speculative_decoding = true;
+    int32_t speculative_max_draft = 8;
+    int32_t speculative_max_ngram = 3;
+
+    // Penalties on tokens the request already generated (model_config)
+    float repetition_penalty = 1.0f;
+    float presence_penalty = 0.0f;
+    float frequency_penalty = 0.0f;
+
+    // Footprint counted against the residency budget (estimated_vram_bytes)
+    int64_t estimated_vram_bytes = 0;
+
+    // Byte budget of the prefix KV cache (runtime_config.cache_size_mb)
+    int64_t cache_size_bytes = 512ll * 1024 * 1024;
+
+    // Paged KV cache (runtime_config.kv_block_tokens, kv_cache_bits 16, 8
+    // or 4, kv_cache_mb): blocks are allocated as sequences grow and full
+    // blocks can be kept in int8 or 4-bit. 0 bytes leaves the KV bounded only by
+    // memory pressure, not context_window_size up front.
+    int32_t kv_block_tokens = 16;
+    KvQuantization kv_quantization = KvQuantization::kFloat16;
+    int64_t kv_cache_bytes = 0;
+
+    KvCacheLayout kv_layout() const {
+        KvCacheLayout layout;
+        layout.layers = num_hidden_layers;
+        layout.kv_heads = num_key_value_heads;
+        layout.head_dim = head_dim;
+        layout.block_tokens = kv_block_tokens;
+        layout.quantization = kv_quantization;
+        return layout;
+    }
+
+    // K and V for every layer, in the sealed block format
+    size_t kv_bytes_per_token() const {
+        const KvCacheLayout layout = kv_layout();
+        return layout.block_tokens > 0 ? layout.sealed_block_bytes() / layout.block_tokens : 0;
+    }
+};
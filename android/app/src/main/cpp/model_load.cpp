@@ -0,0 +1,153 @@
+#include "model_load.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "chat_module.h"
+#include "mlc_log.h"
+
+namespace {
+
+// Share of the overall progress per stage: uploading dominates a GPU load,
+// mapping (and its readahead) a CPU one
+constexpr double kStageWeights[kLoadStageCount] = {0.05, 0.25, 0.55, 0.15};
+
+int stage_index(LoadStage stage) {
+    return static_cast<int>(stage) - static_cast<int>(LoadStage::kVerify);
+}
+
+bool is_timed(LoadStage stage) {
+    const int index = stage_index(stage);
+    return index >= 0 && index < kLoadStageCount;
+}
+
+} // namespace
+
+const char* load_stage_name(LoadStage stage) {
+    switch (stage) {
+        case LoadStage::kQueued: return "queued";
+        case LoadStage::kVerify: return "verify";
+        case LoadStage::kMapWeights: return "map_weights";
+        case LoadStage::kUpload: return "upload";
+        case LoadStage::kWarmup: return "warmup";
+        case LoadStage::kReady: return "ready";
+        case LoadStage::kFailed: return "failed";
+        case LoadStage::kCancelled: return "cancelled";
+    }
+    return "unknown";
+}
+
+ModelLoadTask::ModelLoadTask(std::string model_id)
+    : model_id_(std::move(model_id)), stage_start_(std::chrono::steady_clock::now()) {}
+
+void ModelLoadTask::begin_stage(LoadStage stage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (progress_.finished || progress_.stage == stage) return;
+    close_stage_locked(std::chrono::steady_clock::now());
+    progress_.stage = stage;
+    progress_.stage_fraction = 0.0;
+    publish_locked();
+}
+
+void ModelLoadTask::set_fraction(double fraction) {
+    fraction = std::min(1.0, std::max(0.0, fraction));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (progress_.finished || (fraction < 1.0 && fraction - progress_.stage_fraction < 0.01)) return;
+    progress_.stage_fraction = fraction;
+    publish_locked();
+}
+
+void ModelLoadTask::follow(const Progress& other) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (progress_.finished || (other.stage == progress_.stage && other.stage_fraction == progress_.stage_fraction)) {
+        return;
+    }
+    if (other.stage != progress_.stage) stage_start_ = std::chrono::steady_clock::now();
+    progress_.stage = other.stage;
+    progress_.stage_fraction = other.stage_fraction;
+    std::copy(other.stage_us, other.stage_us + kLoadStageCount, progress_.stage_us);
+    publish_locked();
+}
+
+void ModelLoadTask::set_error(const std::string& error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error_.empty()) error_ = error;
+}
+
+void ModelLoadTask::finish(LoadStage outcome, bool resident) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (progress_.finished) return;
+    close_stage_locked(std::chrono::steady_clock::now());
+    if (outcome == LoadStage::kFailed && error_.empty()) error_ = "Failed to load " + model_id_;
+    progress_.stage = outcome;
+    progress_.stage_fraction = 1.0;
+    progress_.finished = true;
+    progress_.resident = resident;
+    publish_locked();
+}
+
+ModelLoadTask::Progress ModelLoadTask::progress() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return progress_;
+}
+
+ModelLoadTask::Progress ModelLoadTask::wait(uint64_t seen_version, int timeout_ms) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait_for(lock, std::chrono::milliseconds(std::max(0, timeout_ms)),
+                      [&] { return progress_.version > seen_version || progress_.finished; });
+    return progress_;
+}
+
+std::string ModelLoadTask::error() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+
+void ModelLoadTask::close_stage_locked(std::chrono::steady_clock::time_point now) {
+    if (is_timed(progress_.stage)) {
+        progress_.stage_us[stage_index(progress_.stage)] +=
+            std::chrono::duration_cast<std::chrono::microseconds>(now - stage_start_).count();
+    }
+    stage_start_ = now;
+}
+
+void ModelLoadTask::publish_locked() {
+    if (progress_.stage == LoadStage::kReady) {
+        progress_.overall = 1.0;
+    } else if (is_timed(progress_.stage)) {
+        const int index = stage_index(progress_.stage);
+        double overall = 0.0;
+        for (int i = 0; i < index; i++) overall += kStageWeights[i];
+        progress_.overall = overall + kStageWeights[index] * progress_.stage_fraction;
+    }
+    progress_.version++;
+    changed_.notify_all();
+}
+
+bool warm_up_chat_module(ChatModule& module, ModelLoadTask* task) {
+    // Never handed out by an engine, which counts up from 0
+    constexpr SequenceId kWarmupSequence = std::numeric_limits<SequenceId>::max();
+    const int32_t vocab_size = module.vocab_size();
+    if (vocab_size <= 0) return false;
+
+    std::vector<int32_t> tokens = module.tokenize("Hello");
+    const int32_t token = !tokens.empty() && tokens[0] >= 0 && tokens[0] < vocab_size ? tokens[0] : 0;
+    std::vector<float> logits(static_cast<size_t>(vocab_size));
+    if (!module.add_sequence(kWarmupSequence)) {
+        LOGE("❌ Warm-up could not create a sequence");
+        return false;
+    }
+    bool ok = module.prefill(kWarmupSequence, &token, 1, logits.data());
+    task->set_fraction(0.5);
+    ok = ok && !task->cancelled() && module.decode(kWarmupSequence, token, logits.data());
+    module.remove_sequence(kWarmupSequence);
+    if (ok && !std::isfinite(logits[static_cast<size_t>(token)])) {
+        LOGE("❌ Warm-up decode produced non-finite logits");
+        ok = false;
+    }
+    if (ok) task->set_fraction(1.0);
+    return ok;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+class ChatModule;
+
+// Stages of a model load, in the order they run. kReady, kFailed and
+// kCancelled are terminal; only kVerify..kWarmup take measurable time.
+enum class LoadStage : int32_t {
+    kQueued = 0,
+    kVerify,     // model files present and no shard truncated
+    kMapWeights, // parameter shards mapped
+    kUpload,     // weights on the device (faulted in for the CPU backend)
+    kWarmup,     // one dummy prefill and decode: kernels compiled, caches hot
+    kReady,
+    kFailed,
+    kCancelled,
+};
+
+constexpr int kLoadStageCount = 4; // kVerify..kWarmup
+
+const char* load_stage_name(LoadStage stage);
+
+// Progress and cancellation of one model load, shared by the thread running
+// it and whoever polls it (the JNI load handle). Loader code reports through
+// begin_stage()/set_fraction() and checks cancelled() between units of work;
+// a cancelled load returns nullptr and leaves nothing resident.
+class ModelLoadTask {
+public:
+    struct Progress {
+        LoadStage stage = LoadStage::kQueued;
+        double stage_fraction = 0.0;
+        double overall = 0.0;                     // stage weights: 5/25/55/15 %
+        int64_t stage_us[kLoadStageCount] = {};   // wall time of each stage so far
+        bool finished = false;
+        bool resident = false;                    // served without loading
+        uint64_t version = 0;                     // bumped on every visible change
+    };
+
+    explicit ModelLoadTask(std::string model_id);
+
+    ModelLoadTask(const ModelLoadTask&) = delete;
+    ModelLoadTask& operator=(const ModelLoadTask&) = delete;
+
+    const std::string& model_id() const { return model_id_; }
+
+    // Closes the timing of the stage before it; no-op for the current stage
+    void begin_stage(LoadStage stage);
+    // Within the current stage, 0..1; changes under 1% are not published
+    void set_fraction(double fraction);
+    // Takes over another load's progress, for a load joined while in flight
+    void follow(const Progress& other);
+    // Why the load failed; the first error wins
+    void set_error(const std::string& error);
+    void finish(LoadStage outcome, bool resident = false);
+
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+    Progress progress() const;
+    // Returns once the version passes `seen_version`, the load finishes or
+    // the timeout expires, whichever is first
+    Progress wait(uint64_t seen_version, int timeout_ms) const;
+    std::string error() const;
+
+private:
+    void close_stage_locked(std::chrono::steady_clock::time_point now);
+    void publish_locked();
+
+    const std::string model_id_;
+    std::atomic<bool> cancelled_{false};
+    mutable std::mutex mutex_;
+    mutable std::condition_variable changed_;
+    Progress progress_;
+    std::string error_;
+    std::chrono::steady_clock::time_point stage_start_;
+};
+
+// One throwaway prefill and decode on a fresh module, so the first real
+// request does not pay for kernel compilation, first-touch page faults and
+// cold caches. False if the module cannot decode at all.
+bool warm_up_chat_module(ChatModule& module, ModelLoadTask* task);
@@ -0,0 +1,333 @@
+#include "model_residency.h"
+
+#include <chrono>
+#include <exception>
+
+#include "mlc_log.h"
+#include "thread_pool.h"
+
+ModelResidency::ModelResidency(Loader loader) : loader_(std::move(loader)) {}
+
+ModelResidency::~ModelResidency() {
+    clear();
+}
+
+void ModelResidency::set_budget(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_bytes_ = bytes > 0 ? bytes : 0;
+}
+
+void ModelResidency::set_estimated_bytes(const std::string& model_id, int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    estimated_bytes_[model_id] = bytes > 0 ? bytes : 0;
+}
+
+std::shared_ptr<InferenceEngine> ModelResidency::activate(const std::string& model_id, bool* was_resident,
+                                                          ModelLoadTask* task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = resident_.find(model_id);
+        if (it != resident_.end()) {
+            it->second.last_used = ++clock_;
+            current_id_ = model_id;
+            counters_.hits++;
+            if (was_resident) *was_resident = true;
+            if (task) task->finish(LoadStage::kReady, true);
+            return it->second.engine;
+        }
+    }
+    if (was_resident) *was_resident = false;
+
+    ModelLoadTask local(model_id);
+    if (task == nullptr) task = &local;
+    std::shared_ptr<InferenceEngine> engine = load(model_id, false, task);
+    if (!engine) {
+        task->finish(task->cancelled() ? LoadStage::kCancelled : LoadStage::kFailed);
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = resident_.find(model_id);
+        if (it != resident_.end()) {
+            it->second.last_used = ++clock_;
+            current_id_ = model_id;
+        }
+    }
+    task->finish(LoadStage::kReady);
+    return engine;
+}
+
+std::shared_ptr<ModelLoadTask> ModelResidency::activate_async(const std::string& model_id) {
+    auto task = std::make_shared<ModelLoadTask>(model_id);
+    std::shared_ptr<ModelLoadTask> superseded;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            task->set_error("Model runtime is shutting down");
+            task->finish(LoadStage::kFailed);
+            return task;
+        }
+        superseded = std::move(pending_activation_);
+        if (active_activation_ && active_activation_->model_id() != model_id) {
+            LOGI("⏹️ Cancelling the load of %s for %s", active_activation_->model_id().c_str(), model_id.c_str());
+            active_activation_->cancel();
+        }
+        pending_activation_ = task;
+        if (!activation_thread_.joinable()) {
+            activation_thread_ = std::thread(&ModelResidency::activation_loop, this);
+        }
+    }
+    if (superseded) superseded->finish(LoadStage::kCancelled);
+    activation_ready_.notify_one();
+    return task;
+}
+
+bool ModelResidency::preload(const std::string& model_id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || resident_.count(model_id) || loading_.count(model_id)) {
+            return false;
+        }
+        for (const std::string& queued : preload_queue_) {
+            if (queued == model_id) return false;
+        }
+
+        // A preload may evict idle models but never the one in use
+        const int64_t bytes = estimated_bytes_locked(model_id);
+        auto current = resident_.find(current_id_);
+        const int64_t current_bytes = current != resident_.end() ? current->second.bytes : 0;
+        if (budget_bytes_ > 0 && bytes + current_bytes > budget_bytes_) {
+            LOGI("📦 Not preloading %s: %lld MB does not fit next to the current model", model_id.c_str(),
+                 (long long)(bytes / (1024 * 1024)));
+            return false;
+        }
+
+        preload_queue_.push_back(model_id);
+        if (!preload_thread_.joinable()) {
+            preload_thread_ = std::thread(&ModelResidency::preload_loop, this);
+        }
+    }
+    preload_ready_.notify_one();
+    return true;
+}
+
+std::shared_ptr<InferenceEngine> ModelResidency::current() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = resident_.find(current_id_);
+    return it != resident_.end() ? it->second.engine : nullptr;
+}
+
+std::string ModelResidency::current_id() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return current_id_;
+}
+
+bool ModelResidency::is_resident(const std::string& model_id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resident_.count(model_id) != 0;
+}
+
+std::string ModelResidency::unload_current() {
+    std::shared_ptr<InferenceEngine> engine;
+    std::string model_id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = resident_.find(current_id_);
+        if (it != resident_.end()) {
+            engine = it->second.engine;
+            resident_.erase(it);
+        }
+        model_id.swap(current_id_);
+    }
+    if (engine) engine->shutdown();
+    return model_id;
+}
+
+void ModelResidency::clear() {
+    std::map<std::string, Resident> engines;
+    std::shared_ptr<ModelLoadTask> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        generation_++;
+        preload_queue_.clear();
+        if (preload_task_) preload_task_->cancel();
+        pending = std::move(pending_activation_);
+        if (active_activation_) active_activation_->cancel();
+        engines.swap(resident_);
+        current_id_.clear();
+    }
+    if (pending) pending->finish(LoadStage::kCancelled);
+    preload_ready_.notify_all();
+    activation_ready_.notify_all();
+    if (preload_thread_.joinable()) {
+        preload_thread_.join();
+    }
+    if (activation_thread_.joinable()) {
+        activation_thread_.join();
+    }
+    for (auto& entry : engines) {
+        entry.second.engine->shutdown();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = false;
+}
+
+ModelResidency::Stats ModelResidency::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = counters_;
+    stats.resident_models = resident_.size();
+    stats.resident_bytes = resident_bytes_locked();
+    stats.budget_bytes = budget_bytes_;
+    return stats;
+}
+
+// Loads a model once: concurrent callers for the same id share the load,
+// following its progress until it is done or their own task is cancelled.
+// The newcomer is inserted after evicting what it needs, and evicted
+// engines are shut down outside the lock.
+std::shared_ptr<InferenceEngine> ModelResidency::load(const std::string& model_id, bool background,
+                                                      ModelLoadTask* task) {
+    std::promise<std::shared_ptr<InferenceEngine>> promise;
+    uint64_t generation;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto resident = resident_.find(model_id);
+        if (resident != resident_.end()) {
+            return resident->second.engine;
+        }
+        auto pending = loading_.find(model_id);
+        if (pending != loading_.end()) {
+            EngineFuture future = pending->second.future;
+            lock.unlock();
+            while (future.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+                if (task->cancelled()) return nullptr;
+                lock.lock();
+                auto owner = loading_.find(model_id);
+                if (owner != loading_.end()) task->follow(owner->second.task->progress());
+                lock.unlock();
+            }
+            return future.get();
+        }
+        loading_[model_id] = Pending{promise.get_future().share(), task};
+        generation = generation_;
+    }
+
+    LOGI("📦 %s model %s", background ? "Preloading" : "Loading", model_id.c_str());
+    std::shared_ptr<InferenceEngine> engine;
+    try {
+        engine = loader_(model_id, task);
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception loading model %s: %s", model_id.c_str(), e.what());
+        task->set_error(e.what());
+    }
+
+    std::vector<std::shared_ptr<InferenceEngine>> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loading_.erase(model_id);
+        if (engine && (generation != generation_ || task->cancelled())) {
+            // Cleared or cancelled while loading
+            evicted.push_back(engine);
+            engine = nullptr;
+        } else if (engine) {
+            const int64_t bytes = estimated_bytes_locked(model_id);
+            evicted = evict_for_locked(bytes, background);
+            if (budget_bytes_ > 0 && resident_bytes_locked() + bytes > budget_bytes_) {
+                LOGW("⚠️ Model %s (%lld MB) exceeds the residency budget of %lld MB", model_id.c_str(),
+                     (long long)(bytes / (1024 * 1024)), (long long)(budget_bytes_ / (1024 * 1024)));
+            }
+            resident_[model_id] = Resident{engine, bytes, background ? 0 : ++clock_};
+            counters_.loads++;
+        }
+    }
+    promise.set_value(engine);
+    if (!engine && task->cancelled()) {
+        LOGI("⏹️ Load of %s cancelled", model_id.c_str());
+    }
+
+    for (auto& victim : evicted) {
+        LOGI("♻️ Evicting model %s to stay within the residency budget", victim->model_id().c_str());
+        victim->shutdown();
+    }
+    return engine;
+}
+
+// Least recently used first; a background load also keeps the current model
+std::vector<std::shared_ptr<InferenceEngine>> ModelResidency::evict_for_locked(int64_t bytes, bool keep_current) {
+    std::vector<std::shared_ptr<InferenceEngine>> evicted;
+    if (budget_bytes_ <= 0) {
+        return evicted;
+    }
+
+    while (!resident_.empty() && resident_bytes_locked() + bytes > budget_bytes_) {
+        auto victim = resident_.end();
+        for (auto it = resident_.begin(); it != resident_.end(); ++it) {
+            if (keep_current && it->first == current_id_) continue;
+            if (victim == resident_.end() || it->second.last_used < victim->second.last_used) {
+                victim = it;
+            }
+        }
+        if (victim == resident_.end()) break;
+
+        if (victim->first == current_id_) current_id_.clear();
+        evicted.push_back(victim->second.engine);
+        resident_.erase(victim);
+        counters_.evictions++;
+    }
+    return evicted;
+}
+
+int64_t ModelResidency::estimated_bytes_locked(const std::string& model_id) const {
+    auto it = estimated_bytes_.find(model_id);
+    return it != estimated_bytes_.end() ? it->second : 0;
+}
+
+int64_t ModelResidency::resident_bytes_locked() const {
+    int64_t total = 0;
+    for (const auto& entry : resident_) {
+        total += entry.second.bytes;
+    }
+    return total;
+}
+
+void ModelResidency::preload_loop() {
+    // Speculative loads must not take a big core from a decode step
+    pin_current_thread(ThreadPool::shared()->topology(), CoreClass::kEfficiency);
+    while (true) {
+        std::unique_ptr<ModelLoadTask> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            preload_ready_.wait(lock, [this] { return stopping_ || !preload_queue_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            task.reset(new ModelLoadTask(std::move(preload_queue_.front())));
+            preload_queue_.pop_front();
+            preload_task_ = task.get(); // clear() cancels it
+        }
+        load(task->model_id(), true, task.get());
+        std::lock_guard<std::mutex> lock(mutex_);
+        preload_task_ = nullptr;
+    }
+}
+
+void ModelResidency::activation_loop() {
+    while (true) {
+        std::shared_ptr<ModelLoadTask> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            activation_ready_.wait(lock, [this] { return stopping_ || pending_activation_; });
+            if (stopping_) {
+                return;
+            }
+            task = std::move(pending_activation_);
+            active_activation_ = task;
+        }
+        activate(task->model_id(), nullptr, task.get());
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_activation_.reset();
+    }
+}
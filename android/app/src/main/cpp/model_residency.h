@@ -0,0 +1,133 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inference_engine.h"
+#include "model_load.h"
+
+// Keeps several models loaded at once while the sum of their estimated
+// footprints (estimated_vram_bytes) fits the memory budget, so switching
+// back to a recently used model is a map lookup instead of a reload.
+//
+// When a load would overflow the budget, resident models other than the
+// current one are evicted least recently used first. A model that does not
+// fit even on its own is still loaded when activated (everything else is
+// evicted), but is never preloaded. Loads run without the lock held, so the
+// current model keeps serving while another one loads in the background.
+//
+// Every load reports its stages through a ModelLoadTask, which can also
+// cancel it; activate_async() runs the whole switch on a background thread
+// so no caller ever blocks on a load.
+class ModelResidency {
+public:
+    // Creates the engine for a model, reporting stages on `task` (never
+    // null). Returns nullptr on failure or once the task is cancelled.
+    using Loader = std::function<std::shared_ptr<InferenceEngine>(const std::string& model_id, ModelLoadTask* task)>;
+
+    struct Stats {
+        size_t resident_models = 0;
+        int64_t resident_bytes = 0;
+        int64_t budget_bytes = 0;
+        uint64_t hits = 0;      // activations served by a resident model
+        uint64_t loads = 0;
+        uint64_t evictions = 0;
+    };
+
+    explicit ModelResidency(Loader loader);
+    ~ModelResidency();
+
+    ModelResidency(const ModelResidency&) = delete;
+    ModelResidency& operator=(const ModelResidency&) = delete;
+
+    // 0 means unlimited
+    void set_budget(int64_t bytes);
+    void set_estimated_bytes(const std::string& model_id, int64_t bytes);
+
+    // Makes `model_id` the current model, loading it (or waiting for its
+    // in-flight preload) if it is not resident. `was_resident` reports
+    // whether the switch was served without loading. `task`, if given,
+    // receives the load's progress, can cancel it and is finished here.
+    std::shared_ptr<InferenceEngine> activate(const std::string& model_id, bool* was_resident = nullptr,
+                                              ModelLoadTask* task = nullptr);
+
+    // activate() on the activation thread; returns at once. Only the newest
+    // request counts: one still queued is finished as cancelled, and one
+    // loading a different model is cancelled. Until the new model is ready
+    // the current one keeps serving.
+    std::shared_ptr<ModelLoadTask> activate_async(const std::string& model_id);
+
+    // Loads `model_id` on the background thread if it is not resident and
+    // fits next to the current model. Returns false if it was not queued.
+    bool preload(const std::string& model_id);
+
+    std::shared_ptr<InferenceEngine> current() const;
+    std::string current_id() const;
+    bool is_resident(const std::string& model_id) const;
+
+    // Unloads the current model; returns its id (empty if there was none).
+    std::string unload_current();
+
+    // Cancels pending loads, unloads everything and stops the background threads.
+    void clear();
+
+    Stats stats() const;
+
+private:
+    struct Resident {
+        std::shared_ptr<InferenceEngine> engine;
+        int64_t bytes = 0;
+        uint64_t last_used = 0;
+    };
+
+    using EngineFuture = std::shared_future<std::shared_ptr<InferenceEngine>>;
+
+    // An in-flight load; `task` belongs to the thread running it and lives
+    // as long as the entry does
+    struct Pending {
+        EngineFuture future;
+        ModelLoadTask* task = nullptr;
+    };
+
+    std::shared_ptr<InferenceEngine> load(const std::string& model_id, bool background, ModelLoadTask* task);
+    std::vector<std::shared_ptr<InferenceEngine>> evict_for_locked(int64_t bytes, bool keep_current);
+    int64_t estimated_bytes_locked(const std::string& model_id) const;
+    int64_t resident_bytes_locked() const;
+    void preload_loop();
+    void activation_loop();
+
+    Loader loader_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Resident> resident_;
+    std::map<std::string, Pending> loading_;
+    std::map<std::string, int64_t> estimated_bytes_;
+    std::string current_id_;
+    int64_t budget_bytes_ = 0;
+    uint64_t clock_ = 0;
+    uint64_t generation_ = 0; // bumped by clear() so in-flight loads are discarded
+    Stats counters_;
+
+    // Background preloads, one at a time
+    std::condition_variable preload_ready_;
+    std::deque<std::string> preload_queue_;
+    std::thread preload_thread_;
+    ModelLoadTask* preload_task_ = nullptr;
+    bool stopping_ = false;
+
+    // Foreground switches from activate_async(), one at a time
+    std::condition_variable activation_ready_;
+    std::shared_ptr<ModelLoadTask> pending_activation_;
+    std::shared_ptr<ModelLoadTask> active_activation_;
+    std::thread activation_thread_;
+};
@@ -0,0 +1,25 @@
+#include "ngram_draft.h"
+
+#include <algorithm>
+#include <cstring>
+
+size_t propose_ngram_draft(const int32_t* tokens, size_t count, size_t max_ngram, size_t max_draft,
+                           std::vector<int32_t>* draft) {
+    draft->clear();
+    if (count < 2 || max_draft == 0) return 0;
+
+    // Longer matches predict better, so they are tried first
+    for (size_t n = std::min(max_ngram, count - 1); n >= 1; n--) {
+        const int32_t* suffix = tokens + count - n;
+        for (size_t start = count - n; start-- > 0;) {
+            if (tokens[start] != suffix[0] || std::memcmp(tokens + start, suffix, n * sizeof(int32_t)) != 0) {
+                continue;
+            }
+            const size_t follow = start + n;
+            const size_t length = std::min(max_draft, count - follow);
+            draft->assign(tokens + follow, tokens + follow + length);
+            return length;
+        }
+    }
+    return 0;
+}
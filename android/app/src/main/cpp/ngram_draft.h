@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Prompt-lookup drafting for speculative decoding: no draft model, just the
+// sequence's own context. Finds the most recent earlier occurrence of the
+// last n tokens (n = max_ngram down to 1) and proposes the up to
+// `max_draft` tokens that followed it. Replies that quote, review or rewrite
+// the prompt (or an earlier turn) continue the same way often enough that
+// verifying the guess in one forward pass beats decoding token by token.
+//
+// Replaces `draft` and returns its length (0 when nothing matched).
+size_t propose_ngram_draft(const int32_t* tokens, size_t count, size_t max_ngram, size_t max_draft,
+                           std::vector<int32_t>* draft);
@@ -0,0 +1,156 @@
+#include "prefix_cache.h"
+
+#include <algorithm>
+
+PrefixCache::PrefixCache(size_t byte_budget, size_t bytes_per_token)
+    : byte_budget_(byte_budget), bytes_per_token_(bytes_per_token) {}
+
+// FNV-1a over the block's token ids, chained from the previous prefix hash,
+// with a final avalanche so neighbouring prefixes spread across buckets.
+uint64_t PrefixCache::extend_hash(uint64_t hash, const int32_t* block, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t token = static_cast<uint32_t>(block[i]);
+        for (int byte = 0; byte < 4; byte++) {
+            hash ^= (token >> (byte * 8)) & 0xff;
+            hash *= 0x100000001b3ull;
+        }
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+std::vector<uint64_t> PrefixCache::block_hashes(const std::vector<int32_t>& tokens) {
+    std::vector<uint64_t> hashes;
+    hashes.reserve(tokens.size() / kBlockTokens);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t start = 0; start + kBlockTokens <= tokens.size(); start += kBlockTokens) {
+        hash = extend_hash(hash, tokens.data() + start, kBlockTokens);
+        hashes.push_back(hash);
+    }
+    return hashes;
+}
+
+PrefixCache::Match PrefixCache::lookup(const std::vector<int32_t>& tokens) {
+    Match match;
+    if (!enabled()) {
+        return match;
+    }
+    stats_.lookups++;
+
+    const std::vector<uint64_t> hashes = block_hashes(tokens);
+    EntryList::iterator best = lru_.end();
+    size_t best_blocks = 0;
+
+    // Probe from the longest prefix down; the first verified hit wins
+    for (size_t i = hashes.size(); i > 0; i--) {
+        auto slot = index_.find(hashes[i - 1]);
+        if (slot == index_.end() || slot->second.blocks != i) {
+            continue;
+        }
+        const Entry& entry = *slot->second.entry;
+        const size_t length = i * kBlockTokens;
+        if (entry.tokens.size() >= length &&
+            std::equal(tokens.begin(), tokens.begin() + length, entry.tokens.begin())) {
+            best = slot->second.entry;
+            best_blocks = i;
+            break;
+        }
+    }
+
+    if (best == lru_.end()) {
+        return match;
+    }
+
+    lru_.splice(lru_.begin(), lru_, best);
+    match.seq = best->seq;
+    match.length = best_blocks * kBlockTokens;
+    stats_.hits++;
+    stats_.reused_tokens += match.length;
+    return match;
+}
+
+std::vector<SequenceId> PrefixCache::insert(SequenceId seq, std::vector<int32_t> tokens) {
+    std::vector<SequenceId> evicted;
+    const size_t bytes = tokens.size() * bytes_per_token_;
+    if (!enabled() || tokens.size() < kBlockTokens || bytes > byte_budget_) {
+        evicted.push_back(seq);
+        return evicted;
+    }
+
+    while (!lru_.empty() && stats_.bytes + bytes > byte_budget_) {
+        auto victim = std::prev(lru_.end());
+        evicted.push_back(victim->seq);
+        erase_entry(victim);
+        stats_.evictions++;
+    }
+
+    std::vector<uint64_t> hashes = block_hashes(tokens);
+    lru_.push_front(Entry{seq, std::move(tokens), std::move(hashes), bytes});
+    auto entry = lru_.begin();
+
+    // The newest entry takes over every prefix it covers
+    for (size_t i = 0; i < entry->block_hashes.size(); i++) {
+        index_[entry->block_hashes[i]] = IndexSlot{entry, i + 1};
+    }
+
+    stats_.bytes += bytes;
+    stats_.entries = lru_.size();
+    return evicted;
+}
+
+std::vector<SequenceId> PrefixCache::shrink(size_t bytes) {
+    std::vector<SequenceId> evicted;
+    size_t freed = 0;
+    while (!lru_.empty() && freed < bytes) {
+        auto victim = std::prev(lru_.end());
+        freed += victim->bytes;
+        evicted.push_back(victim->seq);
+        erase_entry(victim);
+        stats_.evictions++;
+    }
+    return evicted;
+}
+
+std::vector<SequenceId> PrefixCache::clear() {
+    std::vector<SequenceId> evicted;
+    for (const Entry& entry : lru_) {
+        evicted.push_back(entry.seq);
+    }
+    lru_.clear();
+    index_.clear();
+    stats_.bytes = 0;
+    stats_.entries = 0;
+    return evicted;
+}
+
+// Hashes the victim held in the index are orphaned. Each stands for one of
+// its prefixes, so only entries sharing that prefix can cover it again:
+// walking the rest most recently used first, an entry takes over the
+// orphans up to its common prefix with the victim.
+void PrefixCache::erase_entry(EntryList::iterator entry) {
+    std::vector<size_t> orphans; // block counts, ascending
+    for (size_t i = 0; i < entry->block_hashes.size(); i++) {
+        auto slot = index_.find(entry->block_hashes[i]);
+        if (slot != index_.end() && slot->second.entry == entry) {
+            index_.erase(slot);
+            orphans.push_back(i + 1);
+        }
+    }
+
+    size_t next = 0;
+    for (auto it = lru_.begin(); it != lru_.end() && next < orphans.size(); ++it) {
+        if (it == entry) continue;
+        const size_t limit = std::min(it->block_hashes.size(), orphans.back());
+        size_t common = 0;
+        while (common < limit && it->block_hashes[common] == entry->block_hashes[common]) common++;
+        for (; next < orphans.size() && orphans[next] <= common; next++) {
+            index_.emplace(entry->block_hashes[orphans[next] - 1], IndexSlot{it, orphans[next]});
+        }
+    }
+
+    stats_.bytes -= entry->bytes;
+    lru_.erase(entry);
+    stats_.entries = lru_.size();
+}
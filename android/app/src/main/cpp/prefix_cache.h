@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_module.h"
+
+// Reuses KV state across requests that share a token prefix (the fixed
+// system prompt, earlier chat turns).
+//
+// Every finished sequence can be retained as a cache entry. Its tokens are
+// split into fixed-size blocks and each block boundary is indexed by a
+// rolling hash of the whole prefix up to it, so a lookup walks the new
+// prompt block by block and finds the longest cached prefix in
+// O(prompt / kBlockTokens) probes. A hit is verified token by token before
+// it is used, so hash collisions only cost a miss.
+//
+// Entries are evicted least-recently-used once their KV footprint exceeds
+// the byte budget; the caller removes evicted sequences from the model.
+// Forked sequences share pages with their parent in the runtime, so the
+// accounted footprint is an upper bound.
+// Not thread-safe: owned and used by a single engine worker.
+class PrefixCache {
+public:
+    static constexpr size_t kBlockTokens = 16;
+
+    struct Match {
+        SequenceId seq = -1;
+        size_t length = 0; // tokens of KV that can be forked from `seq`
+    };
+
+    struct Stats {
+        uint64_t lookups = 0;
+        uint64_t hits = 0;
+        uint64_t reused_tokens = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    PrefixCache(size_t byte_budget, size_t bytes_per_token);
+
+    bool enabled() const { return byte_budget_ > 0 && bytes_per_token_ > 0; }
+
+    // Finds the longest block-aligned cached prefix of `tokens` and marks
+    // its entry as recently used.
+    Match lookup(const std::vector<int32_t>& tokens);
+
+    // Retains `seq`, whose KV holds exactly `tokens`. Returns the sequences
+    // evicted to stay within budget (possibly including `seq` itself if it
+    // does not fit at all); they must be removed from the model.
+    std::vector<SequenceId> insert(SequenceId seq, std::vector<int32_t> tokens);
+
+    // Evicts least recently used entries until at least `bytes` are freed
+    // (or the cache is empty); returns their sequences for removal.
+    std::vector<SequenceId> shrink(size_t bytes);
+
+    // Drops every entry and returns their sequences for removal.
+    std::vector<SequenceId> clear();
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Entry {
+        SequenceId seq;
+        std::vector<int32_t> tokens;
+        std::vector<uint64_t> block_hashes;
+        size_t bytes;
+    };
+    using EntryList = std::list<Entry>;
+
+    struct IndexSlot {
+        EntryList::iterator entry;
+        size_t blocks; // prefix length in blocks this hash stands for
+    };
+
+    static uint64_t extend_hash(uint64_t hash, const int32_t* block, size_t count);
+    static std::vector<uint64_t> block_hashes(const std::vector<int32_t>& tokens);
+
+    void erase_entry(EntryList::iterator entry);
+
+    size_t byte_budget_;
+    size_t bytes_per_token_;
+
+    // Front is most recently used
+    EntryList lru_;
+    std::unordered_map<uint64_t, IndexSlot> index_;
+    Stats stats_;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Single-writer, many-reader seqlock for small trivially-copyable structs.
+//
+// Readers never block and never take a lock: they copy the payload word by
+// word and retry if a publish raced with them. Writers must be serialized by
+// the caller (publishers in this codebase already run under their own lock
+// or on a single thread).
+template <typename T>
+class PublishedSnapshot {
+    static_assert(std::is_trivially_copyable<T>::value, "snapshot payload must be trivially copyable");
+
+    static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    PublishedSnapshot() {
+        for (auto& word : words_) word.store(0, std::memory_order_relaxed);
+    }
+
+    void publish(const T& value) {
+        uint64_t buffer[kWords] = {};
+        std::memcpy(buffer, &value, sizeof(T));
+
+        const uint32_t seq = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < kWords; i++) {
+            words_[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        sequence_.store(seq + 2, std::memory_order_release);
+    }
+
+    // Returns false if nothing has been published yet.
+    bool read(T* out) const {
+        uint64_t buffer[kWords];
+        uint32_t before;
+        uint32_t after;
+        do {
+            before = sequence_.load(std::memory_order_acquire);
+            for (size_t i = 0; i < kWords; i++) {
+                buffer[i] = words_[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence_.load(std::memory_order_relaxed);
+        } while ((before & 1) != 0 || before != after);
+
+        if (before == 0) {
+            return false;
+        }
+        std::memcpy(out, buffer, sizeof(T));
+        return true;
+    }
+
+private:
+    std::atomic<uint32_t> sequence_{0};
+    std::atomic<uint64_t> words_[kWords];
+};
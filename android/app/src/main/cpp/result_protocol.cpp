@@ -0,0 +1,103 @@
+#include "result_protocol.h"
+
+#include <cstring>
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "result protocol is written in native byte order");
+
+ResultWriter::ResultWriter(void* data, size_t capacity, ResultKind kind)
+    : data_(static_cast<uint8_t*>(data)), capacity_(capacity) {
+    put_u32(kResultMagic);
+    const uint16_t header[2] = {kResultVersion, static_cast<uint16_t>(kind)};
+    put(header, sizeof(header));
+    put_u32(0); // payload size, patched by finish()
+}
+
+void ResultWriter::put(const void* bytes, size_t length) {
+    if (overflow_ || length > capacity_ - size_) {
+        overflow_ = true;
+        return;
+    }
+    std::memcpy(data_ + size_, bytes, length);
+    size_ += length;
+}
+
+int64_t ResultWriter::finish() {
+    if (overflow_) {
+        return -1;
+    }
+    const uint32_t payload = static_cast<uint32_t>(size_ - kResultHeaderBytes);
+    std::memcpy(data_ + 8, &payload, sizeof(payload));
+    return static_cast<int64_t>(size_);
+}
+
+int64_t encode_memory_stats(void* out, size_t capacity, const int64_t* fields, size_t count) {
+    ResultWriter writer(out, capacity, ResultKind::kMemoryStats);
+    writer.put_u32(static_cast<uint32_t>(count));
+    writer.put_u32(0);
+    writer.put_bytes(fields, count * sizeof(int64_t));
+    return writer.finish();
+}
+
+int64_t encode_stream_timings(void* out, size_t capacity, int64_t first_token_us, const int64_t* chunk_us,
+                              size_t chunk_count, int64_t draft_tokens, int64_t accepted_draft_tokens) {
+    ResultWriter writer(out, capacity, ResultKind::kStreamTimings);
+    writer.put_i64(first_token_us);
+    writer.put_u32(static_cast<uint32_t>(chunk_count));
+    writer.put_u32(0);
+    writer.put_bytes(chunk_us, chunk_count * sizeof(int64_t));
+    writer.put_i64(draft_tokens);
+    writer.put_i64(accepted_draft_tokens);
+    return writer.finish();
+}
+
+int64_t encode_thread_pool_stats(void* out, size_t capacity, const int64_t* fields, size_t workers,
+                                 size_t fields_per_worker) {
+    ResultWriter writer(out, capacity, ResultKind::kThreadPoolStats);
+    writer.put_u32(static_cast<uint32_t>(workers));
+    writer.put_u32(static_cast<uint32_t>(fields_per_worker));
+    writer.put_bytes(fields, workers * fields_per_worker * sizeof(int64_t));
+    return writer.finish();
+}
+
+int64_t encode_load_progress(void* out, size_t capacity, const ModelLoadTask::Progress& progress) {
+    ResultWriter writer(out, capacity, ResultKind::kLoadProgress);
+    writer.put_u32(static_cast<uint32_t>(progress.stage));
+    writer.put_u32((progress.finished ? kLoadFinished : 0u) | (progress.resident ? kLoadResident : 0u));
+    writer.put_i64(static_cast<int64_t>(progress.stage_fraction * 1e6));
+    writer.put_i64(static_cast<int64_t>(progress.overall * 1e6));
+    writer.put_u32(static_cast<uint32_t>(kLoadStageCount));
+    writer.put_u32(0);
+    writer.put_bytes(progress.stage_us, sizeof(progress.stage_us));
+    return writer.finish();
+}
+
+int64_t encode_token_batch(void* out, size_t capacity, const TokenEvent* events, size_t count, uint32_t flags,
+                           size_t* encoded) {
+    ResultWriter writer(out, capacity, ResultKind::kTokenBatch);
+    const size_t counts_offset = writer.size();
+    writer.put_u32(0); // token count and flags, patched below
+    writer.put_u32(0);
+
+    size_t written = 0;
+    for (; written < count; written++) {
+        const std::string& text = events[written].text;
+        size_t length = text.size();
+        if (writer.remaining() < 2 * sizeof(uint32_t) + length) {
+            // A piece larger than a whole batch is cut rather than stalling the stream
+            if (written > 0 || writer.remaining() <= 2 * sizeof(uint32_t)) break;
+            length = writer.remaining() - 2 * sizeof(uint32_t);
+            // ...at a character boundary, keeping the piece valid UTF-8
+            while (length > 0 && (static_cast<unsigned char>(text[length]) & 0xC0) == 0x80) length--;
+        }
+        writer.put_i32(events[written].token_id);
+        writer.put_u32(static_cast<uint32_t>(length));
+        writer.put_bytes(text.data(), length);
+    }
+    const uint32_t counts[2] = {static_cast<uint32_t>(written), written == count ? flags : 0u};
+    if (writer.size() >= counts_offset + sizeof(counts)) {
+        std::memcpy(writer.at(counts_offset), counts, sizeof(counts));
+    }
+    const int64_t size = writer.finish();
+    *encoded = size < 0 ? 0 : written;
+    return size;
+}
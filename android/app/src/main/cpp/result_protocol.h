@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "model_load.h"
+#include "token_stream.h"
+
+// Binary layout of results written into direct ByteBuffers owned by Java
+// (decoded by NativeProtocol.java; keep the two in sync).
+//
+// Every message is a 12-byte header followed by its payload, all fields
+// little-endian (every Android ABI is):
+//
+//   u32 magic "MLCB"   u16 version   u16 kind   u32 payload bytes
+//
+// kMemoryStats:   u32 field count, u32 reserved, i64 fields[count]
+//                 (MemoryStatsField order; new fields are only appended)
+// kTokenBatch:    u32 token count, u32 flags (TokenBatchFlags), then per
+//                 token: i32 id, u32 byte length, UTF-8 bytes (unpadded)
+// kStreamTimings: i64 first-token us, u32 chunk count, u32 reserved,
+//                 i64 prefill chunk us[count], i64 speculative draft
+//                 tokens, i64 accepted draft tokens
+// kThreadPoolStats: u32 worker count, u32 fields per worker, then per
+//                 worker i64 fields[per worker] (ThreadPoolStatsField order)
+// kLoadProgress:  u32 stage (LoadStage), u32 flags (LoadProgressFlags),
+//                 i64 stage and overall progress in millionths, u32 stage
+//                 count, u32 reserved, i64 stage us[count] (verify, map
+//                 weights, upload, warm-up)
+//
+// Readers reject another magic or a newer major version and ignore
+// trailing fields they do not know.
+constexpr uint32_t kResultMagic = 0x42434C4D; // "MLCB"
+constexpr uint16_t kResultVersion = 1;
+constexpr size_t kResultHeaderBytes = 12;
+
+enum class ResultKind : uint16_t {
+    kMemoryStats = 1,
+    kTokenBatch = 2,
+    kStreamTimings = 3,
+    kThreadPoolStats = 4,
+    kLoadProgress = 5,
+};
+
+enum TokenBatchFlags : uint32_t {
+    kTokenBatchFinished = 1u << 0, // no more tokens will follow
+    kTokenBatchFailed = 1u << 1,   // finished with an error (see getStreamErrorNative)
+};
+
+enum LoadProgressFlags : uint32_t {
+    kLoadFinished = 1u << 0, // ready, failed (see getModelLoadErrorNative) or cancelled
+    kLoadResident = 1u << 1, // switched to a model that was already loaded
+};
+
+enum MemoryStatsField : int {
+    kStatVramUsed = 0,
+    kStatVramTotal,
+    kStatSystemRam,
+    kStatSystemAvailable,
+    kStatProcessRss,
+    kStatProcessPeakRss,
+    kStatWeightsBytes,
+    kStatKvCacheBytes,
+    kStatScratchBytes,
+    kStatJniBytes,
+    kStatPoolCachedBytes,
+    kStatMemoryPressureEvents,
+    kMemoryStatsFieldCount,
+};
+
+enum ThreadPoolStatsField : int {
+    kPoolStatCpu = 0,    // -1 when unpinned
+    kPoolStatCoreClass,  // CoreClass: 0 performance, 1 efficiency
+    kPoolStatTasks,
+    kPoolStatSteals,
+    kPoolStatBusyUs,
+    kPoolStatUptimeUs,
+    kThreadPoolStatsFieldCount,
+};
+
+// Appends fields to a caller-owned buffer. Writes past the capacity are
+// dropped and make finish() fail, so encoders need no size checks of their own.
+class ResultWriter {
+public:
+    ResultWriter(void* data, size_t capacity, ResultKind kind);
+
+    void put_u32(uint32_t value) { put(&value, sizeof(value)); }
+    void put_i32(int32_t value) { put(&value, sizeof(value)); }
+    void put_i64(int64_t value) { put(&value, sizeof(value)); }
+    void put_bytes(const void* bytes, size_t length) { put(bytes, length); }
+
+    size_t size() const { return size_; }
+    size_t remaining() const { return overflow_ ? 0 : capacity_ - size_; }
+    uint8_t* at(size_t offset) { return data_ + offset; }
+
+    // Patches the payload size into the header. Returns the message size,
+    // or -1 if it did not fit.
+    int64_t finish();
+
+private:
+    void put(const void* bytes, size_t length);
+
+    uint8_t* data_;
+    size_t capacity_;
+    size_t size_ = 0;
+    bool overflow_ = false;
+};
+
+// Each returns the bytes written, or -1 if `capacity` is too small.
+int64_t encode_memory_stats(void* out, size_t capacity, const int64_t* fields, size_t count);
+int64_t encode_stream_timings(void* out, size_t capacity, int64_t first_token_us, const int64_t* chunk_us,
+                              size_t chunk_count, int64_t draft_tokens, int64_t accepted_draft_tokens);
+int64_t encode_thread_pool_stats(void* out, size_t capacity, const int64_t* fields, size_t workers,
+                                 size_t fields_per_worker);
+int64_t encode_load_progress(void* out, size_t capacity, const ModelLoadTask::Progress& progress);
+
+// Encodes as many of `events` as fit and reports how many in `encoded`; the
+// caller keeps the rest for the next batch. `flags` are only set when every
+// event fit. A single event larger than the buffer is truncated to fit.
+int64_t encode_token_batch(void* out, size_t capacity, const TokenEvent* events, size_t count, uint32_t flags,
+                           size_t* encoded);
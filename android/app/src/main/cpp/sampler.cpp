@@ -0,0 +1,513 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MLC_SAMPLER_NEON 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define MLC_SAMPLER_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MLC_SAMPLER_SSE2 1
+#endif
+
+namespace {
+
+// Cephes-style expf: x = n*ln2 + r with |r| <= ln2/2, a degree-6 polynomial
+// for e^r and the exponent bits for 2^n. Relative error is below 2e-7 over
+// the clamped range, which is plenty for sampling weights.
+constexpr float kExpMin = -87.3f;
+constexpr float kExpMax = 88.3f;
+constexpr float kLog2e = 1.44269504088896341f;
+constexpr float kLn2Hi = 0.693359375f;
+constexpr float kLn2Lo = -2.12194440e-4f;
+constexpr float kExpP0 = 1.9875691500e-4f;
+constexpr float kExpP1 = 1.3981999507e-3f;
+constexpr float kExpP2 = 8.3334519073e-3f;
+constexpr float kExpP3 = 4.1665795894e-2f;
+constexpr float kExpP4 = 1.6666665459e-1f;
+constexpr float kExpP5 = 5.0000001201e-1f;
+
+inline float exp_scalar(float x) {
+    x = std::min(std::max(x, kExpMin), kExpMax);
+    const float n = std::nearbyint(x * kLog2e);
+    const float r = x - n * kLn2Hi - n * kLn2Lo;
+    float p = kExpP0;
+    p = p * r + kExpP1;
+    p = p * r + kExpP2;
+    p = p * r + kExpP3;
+    p = p * r + kExpP4;
+    p = p * r + kExpP5;
+    const float y = p * r * r + r + 1.0f;
+    return std::ldexp(y, static_cast<int>(n));
+}
+
+#if MLC_SAMPLER_NEON
+
+inline float32x4_t exp_neon(float32x4_t x) {
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(kExpMin)), vdupq_n_f32(kExpMax));
+    const int32x4_t n = vcvtnq_s32_f32(vmulq_n_f32(x, kLog2e));
+    const float32x4_t nf = vcvtq_f32_s32(n);
+    float32x4_t r = vfmsq_f32(x, nf, vdupq_n_f32(kLn2Hi));
+    r = vfmsq_f32(r, nf, vdupq_n_f32(kLn2Lo));
+    float32x4_t p = vdupq_n_f32(kExpP0);
+    p = vfmaq_f32(vdupq_n_f32(kExpP1), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP2), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP3), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP4), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP5), p, r);
+    const float32x4_t y = vaddq_f32(vfmaq_f32(r, p, vmulq_f32(r, r)), vdupq_n_f32(1.0f));
+    const int32x4_t bias = vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23);
+    return vmulq_f32(y, vreinterpretq_f32_s32(bias));
+}
+
+#elif MLC_SAMPLER_AVX2
+
+inline __m256 fmadd256(__m256 a, __m256 b, __m256 c) {
+#ifdef __FMA__
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(kExpMin)), _mm256_set1_ps(kExpMax));
+    const __m256 nf = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(kLog2e)),
+                                      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(nf, _mm256_set1_ps(kLn2Hi)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(nf, _mm256_set1_ps(kLn2Lo)));
+    __m256 p = _mm256_set1_ps(kExpP0);
+    p = fmadd256(p, r, _mm256_set1_ps(kExpP1));
+    p = fmadd256(p, r, _mm256_set1_ps(kExpP2));
+    p = fmadd256(p, r, _mm256_set1_ps(kExpP3));
+    p = fmadd256(p, r, _mm256_set1_ps(kExpP4));
+    p = fmadd256(p, r, _mm256_set1_ps(kExpP5));
+    const __m256 y = _mm256_add_ps(fmadd256(p, _mm256_mul_ps(r, r), r), _mm256_set1_ps(1.0f));
+    const __m256i n = _mm256_cvtps_epi32(nf);
+    const __m256i bias = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(bias));
+}
+
+// For each 8-bit compare mask, the indices of its set lanes packed to the front
+struct CompactTable {
+    alignas(32) int32_t lanes[256][8];
+
+    CompactTable() {
+        for (int mask = 0; mask < 256; mask++) {
+            int count = 0;
+            for (int lane = 0; lane < 8; lane++) {
+                if (mask & (1 << lane)) lanes[mask][count++] = lane;
+            }
+            while (count < 8) lanes[mask][count++] = 0;
+        }
+    }
+};
+
+inline float hmax256(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+inline float hsum256(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#elif MLC_SAMPLER_SSE2
+
+inline __m128 exp_sse2(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(kExpMin)), _mm_set1_ps(kExpMax));
+    const __m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(kLog2e)));
+    const __m128 nf = _mm_cvtepi32_ps(n);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(nf, _mm_set1_ps(kLn2Hi)));
+    r = _mm_sub_ps(r, _mm_mul_ps(nf, _mm_set1_ps(kLn2Lo)));
+    __m128 p = _mm_set1_ps(kExpP0);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kExpP1));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kExpP2));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kExpP3));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kExpP4));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kExpP5));
+    const __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(r, r)), r), _mm_set1_ps(1.0f));
+    const __m128i bias = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(bias));
+}
+
+inline float hmax128(__m128 m) {
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+inline float hsum128(__m128 s) {
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#endif
+
+// Sum of the values that are >= threshold
+float mass_above(const float* values, size_t count, float threshold) {
+    size_t i = 0;
+    float total = 0.0f;
+#if MLC_SAMPLER_NEON
+    const float32x4_t t = vdupq_n_f32(threshold);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= count; i += 4) {
+        const float32x4_t v = vld1q_f32(values + i);
+        acc = vaddq_f32(acc, vreinterpretq_f32_u32(vandq_u32(vcgeq_f32(v, t), vreinterpretq_u32_f32(v))));
+    }
+    total = vaddvq_f32(acc);
+#elif MLC_SAMPLER_AVX2
+    const __m256 t = _mm256_set1_ps(threshold);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        const __m256 v = _mm256_loadu_ps(values + i);
+        acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_cmp_ps(v, t, _CMP_GE_OQ), v));
+    }
+    total = hsum256(acc);
+#elif MLC_SAMPLER_SSE2
+    const __m128 t = _mm_set1_ps(threshold);
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        const __m128 v = _mm_loadu_ps(values + i);
+        acc = _mm_add_ps(acc, _mm_and_ps(_mm_cmpge_ps(v, t), v));
+    }
+    total = hsum128(acc);
+#endif
+    for (; i < count; i++) {
+        if (values[i] >= threshold) total += values[i];
+    }
+    return total;
+}
+
+} // namespace
+
+Sampler::Sampler(uint64_t seed) : rng_state_(seed ? seed : 1) {}
+
+const char* Sampler::kernel_name() {
+#if MLC_SAMPLER_NEON
+    return "neon";
+#elif MLC_SAMPLER_AVX2
+    return "avx2";
+#elif MLC_SAMPLER_SSE2
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+float Sampler::max_value(const float* values, size_t count) {
+    size_t i = 0;
+    float best = std::numeric_limits<float>::lowest();
+#if MLC_SAMPLER_NEON
+    float32x4_t m0 = vdupq_n_f32(std::numeric_limits<float>::lowest()), m1 = m0;
+    for (; i + 8 <= count; i += 8) {
+        m0 = vmaxq_f32(m0, vld1q_f32(values + i));
+        m1 = vmaxq_f32(m1, vld1q_f32(values + i + 4));
+    }
+    best = vmaxvq_f32(vmaxq_f32(m0, m1));
+#elif MLC_SAMPLER_AVX2
+    __m256 m0 = _mm256_set1_ps(std::numeric_limits<float>::lowest()), m1 = m0;
+    for (; i + 16 <= count; i += 16) {
+        m0 = _mm256_max_ps(m0, _mm256_loadu_ps(values + i));
+        m1 = _mm256_max_ps(m1, _mm256_loadu_ps(values + i + 8));
+    }
+    best = hmax256(_mm256_max_ps(m0, m1));
+#elif MLC_SAMPLER_SSE2
+    __m128 m0 = _mm_set1_ps(std::numeric_limits<float>::lowest()), m1 = m0;
+    for (; i + 8 <= count; i += 8) {
+        m0 = _mm_max_ps(m0, _mm_loadu_ps(values + i));
+        m1 = _mm_max_ps(m1, _mm_loadu_ps(values + i + 4));
+    }
+    best = hmax128(_mm_max_ps(m0, m1));
+#endif
+    for (; i < count; i++) {
+        best = std::max(best, values[i]);
+    }
+    return best;
+}
+
+// Max first, then the first index holding it: two streaming passes beat
+// carrying an index vector through the reduction.
+size_t Sampler::argmax(const float* values, size_t count) {
+    if (count == 0) return 0;
+    const float best = max_value(values, count);
+    size_t i = 0;
+#if MLC_SAMPLER_NEON
+    const float32x4_t b = vdupq_n_f32(best);
+    for (; i + 4 <= count; i += 4) {
+        if (vmaxvq_u32(vceqq_f32(vld1q_f32(values + i), b)) != 0) break;
+    }
+#elif MLC_SAMPLER_AVX2
+    const __m256 b = _mm256_set1_ps(best);
+    for (; i + 8 <= count; i += 8) {
+        const int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(values + i), b, _CMP_EQ_OQ));
+        if (mask != 0) return i + __builtin_ctz(static_cast<unsigned>(mask));
+    }
+#elif MLC_SAMPLER_SSE2
+    const __m128 b = _mm_set1_ps(best);
+    for (; i + 4 <= count; i += 4) {
+        const int mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(values + i), b));
+        if (mask != 0) return i + __builtin_ctz(static_cast<unsigned>(mask));
+    }
+#endif
+    for (; i < count; i++) {
+        if (values[i] == best) return i;
+    }
+    // Only reachable if every value is NaN
+    return 0;
+}
+
+// Grammar masks are mostly all-zero words (32 tokens at once) with a few
+// partial ones; only the partial words need a per-lane select.
+void Sampler::apply_token_mask(float* logits, const uint32_t* mask, size_t vocab) {
+    const float neg_inf = -std::numeric_limits<float>::infinity();
+    const size_t full_words = vocab / 32;
+    for (size_t w = 0; w < full_words; w++) {
+        const uint32_t word = mask[w];
+        float* block = logits + w * 32;
+        if (word == ~uint32_t(0)) continue;
+        if (word == 0) {
+            std::fill(block, block + 32, neg_inf);
+            continue;
+        }
+#if MLC_SAMPLER_NEON
+        static const uint32_t kLaneBits[4] = {1, 2, 4, 8};
+        const uint32x4_t lanes = vld1q_u32(kLaneBits);
+        const float32x4_t inf = vdupq_n_f32(neg_inf);
+        for (int k = 0; k < 8; k++) {
+            const uint32x4_t keep = vtstq_u32(vdupq_n_u32(word >> (4 * k)), lanes);
+            vst1q_f32(block + 4 * k, vbslq_f32(keep, vld1q_f32(block + 4 * k), inf));
+        }
+#elif MLC_SAMPLER_AVX2
+        const __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        const __m256 inf = _mm256_set1_ps(neg_inf);
+        for (int k = 0; k < 4; k++) {
+            const __m256i bits = _mm256_and_si256(_mm256_set1_epi32(static_cast<int>(word >> (8 * k))), lanes);
+            const __m256 drop = _mm256_castsi256_ps(_mm256_cmpeq_epi32(bits, _mm256_setzero_si256()));
+            _mm256_storeu_ps(block + 8 * k, _mm256_blendv_ps(_mm256_loadu_ps(block + 8 * k), inf, drop));
+        }
+#elif MLC_SAMPLER_SSE2
+        const __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+        const __m128 inf = _mm_set1_ps(neg_inf);
+        for (int k = 0; k < 8; k++) {
+            const __m128i bits = _mm_and_si128(_mm_set1_epi32(static_cast<int>(word >> (4 * k))), lanes);
+            const __m128 drop = _mm_castsi128_ps(_mm_cmpeq_epi32(bits, _mm_setzero_si128()));
+            const __m128 v = _mm_loadu_ps(block + 4 * k);
+            _mm_storeu_ps(block + 4 * k, _mm_or_ps(_mm_andnot_ps(drop, v), _mm_and_ps(drop, inf)));
+        }
+#else
+        for (int lane = 0; lane < 32; lane++) {
+            if (((word >> lane) & 1) == 0) block[lane] = neg_inf;
+        }
+#endif
+    }
+    for (size_t t = full_words * 32; t < vocab; t++) {
+        if (((mask[t >> 5] >> (t & 31)) & 1) == 0) logits[t] = neg_inf;
+    }
+}
+
+float Sampler::exp_sum(float* values, size_t count, float shift, float scale) {
+    size_t i = 0;
+    float total = 0.0f;
+#if MLC_SAMPLER_NEON
+    const float32x4_t s = vdupq_n_f32(shift);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= count; i += 4) {
+        const float32x4_t e = exp_neon(vmulq_n_f32(vsubq_f32(vld1q_f32(values + i), s), scale));
+        vst1q_f32(values + i, e);
+        acc = vaddq_f32(acc, e);
+    }
+    total = vaddvq_f32(acc);
+#elif MLC_SAMPLER_AVX2
+    const __m256 s = _mm256_set1_ps(shift);
+    const __m256 k = _mm256_set1_ps(scale);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        const __m256 e = exp_avx2(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(values + i), s), k));
+        _mm256_storeu_ps(values + i, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    total = hsum256(acc);
+#elif MLC_SAMPLER_SSE2
+    const __m128 s = _mm_set1_ps(shift);
+    const __m128 k = _mm_set1_ps(scale);
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        const __m128 e = exp_sse2(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(values + i), s), k));
+        _mm_storeu_ps(values + i, e);
+        acc = _mm_add_ps(acc, e);
+    }
+    total = hsum128(acc);
+#endif
+    for (; i < count; i++) {
+        values[i] = exp_scalar((values[i] - shift) * scale);
+        total += values[i];
+    }
+    return total;
+}
+
+// Repetition penalty (CTRL-style, scales toward zero) once per distinct
+// token, then OpenAI-style presence and per-occurrence frequency penalties.
+void Sampler::apply_penalties(float* logits, size_t vocab, const SamplerConfig& config, const int32_t* history,
+                              size_t history_count) {
+    const bool repetition = config.repetition_penalty > 0.0f && config.repetition_penalty != 1.0f;
+    if (history_count == 0 || (!repetition && config.presence_penalty == 0.0f && config.frequency_penalty == 0.0f)) {
+        return;
+    }
+
+    history_sorted_.assign(history, history + history_count);
+    std::sort(history_sorted_.begin(), history_sorted_.end());
+
+    for (size_t i = 0; i < history_sorted_.size();) {
+        const int32_t token = history_sorted_[i];
+        size_t end = i + 1;
+        while (end < history_sorted_.size() && history_sorted_[end] == token) end++;
+        const size_t occurrences = end - i;
+        i = end;
+
+        if (token < 0 || static_cast<size_t>(token) >= vocab) continue;
+        float logit = logits[token];
+        if (repetition) {
+            logit = logit > 0.0f ? logit / config.repetition_penalty : logit * config.repetition_penalty;
+        }
+        logit -= config.presence_penalty + config.frequency_penalty * static_cast<float>(occurrences);
+        logits[token] = logit;
+    }
+}
+
+// Compacts the ids of all logits >= threshold into candidate_ids_
+size_t Sampler::collect_candidates(const float* logits, size_t vocab, float threshold) {
+    // Vector stores may write up to 8 lanes past the last kept id
+    if (candidate_ids_.size() < vocab + 8) candidate_ids_.resize(vocab + 8);
+    int32_t* out = candidate_ids_.data();
+    size_t count = 0;
+    size_t i = 0;
+#if MLC_SAMPLER_NEON
+    const float32x4_t t = vdupq_n_f32(threshold);
+    for (; i + 4 <= vocab; i += 4) {
+        const uint32x4_t ge = vcgeq_f32(vld1q_f32(logits + i), t);
+        if (vmaxvq_u32(ge) == 0) continue;
+        uint32_t lanes[4];
+        vst1q_u32(lanes, vshrq_n_u32(ge, 31));
+        for (int lane = 0; lane < 4; lane++) {
+            out[count] = static_cast<int32_t>(i + lane);
+            count += lanes[lane];
+        }
+    }
+#elif MLC_SAMPLER_AVX2
+    // Branchless left-pack: permute the lane indices selected by the mask to
+    // the front and advance by its popcount. A data-dependent branch here
+    // mispredicts on most vectors once a few percent of the vocab survives.
+    static const CompactTable table;
+    const __m256 t = _mm256_set1_ps(threshold);
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    for (; i + 8 <= vocab; i += 8) {
+        const unsigned mask = static_cast<unsigned>(
+            _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i), t, _CMP_GE_OQ)));
+        const __m256i order = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table.lanes[mask]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + count), _mm256_permutevar8x32_epi32(lanes, order));
+        count += static_cast<size_t>(__builtin_popcount(mask));
+        lanes = _mm256_add_epi32(lanes, step);
+    }
+#elif MLC_SAMPLER_SSE2
+    const __m128 t = _mm_set1_ps(threshold);
+    for (; i + 4 <= vocab; i += 4) {
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(logits + i), t)));
+        for (unsigned lane = 0; lane < 4; lane++) {
+            out[count] = static_cast<int32_t>(i + lane);
+            count += (mask >> lane) & 1;
+        }
+    }
+#endif
+    for (; i < vocab; i++) {
+        if (logits[i] >= threshold) out[count++] = static_cast<int32_t>(i);
+    }
+    return count;
+}
+
+// Largest probability t such that the tokens with p >= t still carry top_p
+// of the mass, by bisection over [0, max p]. Each probe is one vectorized
+// pass over the (already small) candidate set.
+float Sampler::top_p_threshold(float total, float top_p) const {
+    const float* probs = candidate_probs_.data();
+    const size_t count = candidate_probs_.size();
+    const float target = top_p * total;
+
+    float hi = max_value(probs, count);
+    if (mass_above(probs, count, hi) >= target) return hi;
+
+    float lo = 0.0f;
+    for (int iteration = 0; iteration < 24 && hi - lo > hi * 1e-6f; iteration++) {
+        const float mid = 0.5f * (lo + hi);
+        if (mass_above(probs, count, mid) >= target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// xorshift64*, top 24 bits as a float in [0, 1)
+float Sampler::next_uniform() {
+    rng_state_ ^= rng_state_ >> 12;
+    rng_state_ ^= rng_state_ << 25;
+    rng_state_ ^= rng_state_ >> 27;
+    const uint64_t bits = rng_state_ * 0x2545f4914f6cdd1dull;
+    return static_cast<float>(bits >> 40) * (1.0f / 16777216.0f);
+}
+
+int32_t Sampler::sample(float* logits, size_t vocab, const SamplerConfig& config, const int32_t* history,
+                        size_t history_count) {
+    if (vocab == 0) return 0;
+    apply_penalties(logits, vocab, config, history, history_count);
+
+    if (config.temperature <= 1e-5f || config.top_k == 1) {
+        return static_cast<int32_t>(argmax(logits, vocab));
+    }
+
+    const float max_logit = max_value(logits, vocab);
+    size_t count = collect_candidates(logits, vocab, max_logit - kLogitWindow * config.temperature);
+
+    if (config.top_k > 0 && count > static_cast<size_t>(config.top_k)) {
+        const size_t k = static_cast<size_t>(config.top_k);
+        std::nth_element(candidate_ids_.begin(), candidate_ids_.begin() + (k - 1), candidate_ids_.begin() + count,
+                         [logits](int32_t a, int32_t b) { return logits[a] > logits[b]; });
+        count = k;
+    }
+
+    candidate_probs_.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        candidate_probs_[i] = logits[candidate_ids_[i]];
+    }
+    float total = exp_sum(candidate_probs_.data(), count, max_logit, 1.0f / config.temperature);
+
+    float threshold = 0.0f;
+    if (config.top_p > 0.0f && config.top_p < 1.0f) {
+        threshold = top_p_threshold(total, config.top_p);
+        total = mass_above(candidate_probs_.data(), count, threshold);
+    }
+
+    const float target = next_uniform() * total;
+    float cumulative = 0.0f;
+    int32_t chosen = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (candidate_probs_[i] < threshold) continue;
+        chosen = candidate_ids_[i];
+        cumulative += candidate_probs_[i];
+        if (cumulative > target) break;
+    }
+    return chosen >= 0 ? chosen : static_cast<int32_t>(argmax(logits, vocab));
+}
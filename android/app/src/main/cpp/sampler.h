@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Settings for picking one token. temperature <= 0 or top_k == 1 is greedy;
+// top_k <= 0 and top_p >= 1 disable the respective filter.
+struct SamplerConfig {
+    float temperature = 0.7f;
+    float top_p = 0.9f;
+    int top_k = 40;
+
+    // Applied to tokens already generated by the request (model_config)
+    float repetition_penalty = 1.0f;
+    float presence_penalty = 0.0f;
+    float frequency_penalty = 0.0f;
+};
+
+// Token sampler over the full vocabulary (128256 entries for Llama-3), run
+// once per sequence per decode step.
+//
+// Nothing is ever sorted at vocab size: a vectorized pass finds the max
+// logit, a second pass keeps only tokens within kLogitWindow * temperature
+// of it (everything below has a relative probability under e^-kLogitWindow),
+// top-k is a partial selection over those survivors, the softmax is a
+// vectorized exp over the compacted candidates, and top-p bisects a
+// probability threshold instead of sorting by probability.
+//
+// Kernels use NEON on arm64 and AVX2 (or SSE2) on x86 hosts, with a scalar
+// fallback. Not thread-safe: each engine worker owns one.
+class Sampler {
+public:
+    static constexpr float kLogitWindow = 20.0f;
+
+    explicit Sampler(uint64_t seed = 0x853c49e6748fea9bull);
+
+    // Picks the next token. `logits` (vocab floats) are modified in place by
+    // the penalties; `history` is the request's generated tokens so far.
+    int32_t sample(float* logits, size_t vocab, const SamplerConfig& config, const int32_t* history,
+                   size_t history_count);
+
+    // Vectorized helpers, exposed for the benchmarks
+    static size_t argmax(const float* values, size_t count);
+    static float max_value(const float* values, size_t count);
+
+    // values[i] = exp((values[i] - shift) * scale); returns their sum
+    static float exp_sum(float* values, size_t count, float shift, float scale);
+
+    // Sets logits[t] to -inf for every token whose bit is clear in `mask`
+    // (bit t of mask[t / 32]); whole words are skipped or cleared at once
+    static void apply_token_mask(float* logits, const uint32_t* mask, size_t vocab);
+
+    // Name of the kernel set compiled in ("neon", "avx2", "sse2" or "scalar")
+    static const char* kernel_name();
+
+private:
+    void apply_penalties(float* logits, size_t vocab, const SamplerConfig& config, const int32_t* history,
+                         size_t history_count);
+    size_t collect_candidates(const float* logits, size_t vocab, float threshold);
+    float top_p_threshold(float total, float top_p) const;
+    float next_uniform();
+
+    uint64_t rng_state_;
+
+    // Scratch reused across calls
+    std::vector<int32_t> history_sorted_;
+    std::vector<int32_t> candidate_ids_;
+    std::vector<float> candidate_probs_;
+};
@@ -0,0 +1,305 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "mlc_log.h"
+#include "trace.h"
+
+namespace {
+
+// Rounds a worker spins through its class's deques before sleeping; decode
+// submits a parallel_for every few hundred microseconds, and a futex wake
+// costs more than that on some little cores
+constexpr int kSpinRounds = 2000;
+
+// parallel_for splits into up to this many chunks per thread, so a thread
+// that was descheduled does not hold up the whole step
+constexpr size_t kChunksPerThread = 4;
+
+// The worker running on this thread, if any, and its pool
+thread_local const void* t_pool = nullptr;
+thread_local void* t_worker = nullptr;
+
+int64_t read_number(const std::string& path) {
+    std::FILE* file = std::fopen(path.c_str(), "r");
+    if (file == nullptr) return -1;
+    long long value = -1;
+    if (std::fscanf(file, "%lld", &value) != 1) value = -1;
+    std::fclose(file);
+    return value;
+}
+
+std::mutex g_shared_mutex;
+std::shared_ptr<ThreadPool> g_shared;
+ThreadPoolOptions g_shared_options;
+
+} // namespace
+
+CpuTopology CpuTopology::detect(const std::string& root) {
+    std::vector<std::pair<int, int64_t>> cores; // id, capacity
+    if (DIR* dir = opendir(root.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            const char* name = entry->d_name;
+            if (std::strncmp(name, "cpu", 3) != 0 || name[3] < '0' || name[3] > '9') continue;
+            char* end = nullptr;
+            const long id = std::strtol(name + 3, &end, 10);
+            if (*end != '\0') continue;
+            const std::string cpu = root + "/" + name;
+            int64_t capacity = read_number(cpu + "/cpu_capacity");
+            if (capacity <= 0) capacity = read_number(cpu + "/cpufreq/cpuinfo_max_freq");
+            cores.emplace_back(static_cast<int>(id), capacity);
+        }
+        closedir(dir);
+    }
+    if (cores.empty()) {
+        const int count = std::max(1u, std::thread::hardware_concurrency());
+        for (int id = 0; id < count; id++) cores.emplace_back(id, -1);
+    }
+    std::sort(cores.begin(), cores.end());
+
+    int64_t largest = 0;
+    for (const auto& core : cores) largest = std::max(largest, core.second);
+    CpuTopology topology;
+    for (const auto& core : cores) {
+        // Unknown capacities leave the core with the big ones
+        const bool performance = core.second <= 0 || core.second * 2 > largest;
+        (performance ? topology.performance : topology.efficiency).push_back(core.first);
+    }
+    return topology;
+}
+
+bool pin_current_thread(const CpuTopology& topology, CoreClass core_class) {
+#if defined(__linux__)
+    const std::vector<int>& cores = topology.cores(core_class);
+    if (cores.empty()) return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cores) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        LOGW("⚠️ Failed to pin a thread to %s cores: %s",
+             core_class == CoreClass::kPerformance ? "performance" : "efficiency", std::strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void)topology;
+    (void)core_class;
+    return false;
+#endif
+}
+
+ThreadPool::ThreadPool(const ThreadPoolOptions& options, const CpuTopology& topology)
+    : topology_(topology), started_(std::chrono::steady_clock::now()) {
+    const int performance = options.performance_workers >= 0
+                                ? options.performance_workers
+                                : std::max(0, static_cast<int>(topology_.performance.size()) - 1);
+    const int efficiency = options.efficiency_workers >= 0 ? options.efficiency_workers : 1;
+
+    for (int i = 0; i < performance + efficiency; i++) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->core_class = i < performance ? CoreClass::kPerformance : CoreClass::kEfficiency;
+        const std::vector<int>& cores = topology_.cores(worker->core_class);
+        worker->cpu = cores.empty() ? -1 : cores.front();
+        queue(worker->core_class).workers.push_back(worker.get());
+        workers_.push_back(std::move(worker));
+    }
+    // Started only once every deque exists, since workers steal from all of them
+    for (auto& worker : workers_) {
+        worker->thread = std::thread(&ThreadPool::worker_loop, this, worker.get());
+    }
+    LOGI("🧵 Thread pool: %d performance workers on %zu cores, %d efficiency workers on %zu cores", performance,
+         topology_.performance.size(), efficiency, topology_.efficiency.size());
+}
+
+ThreadPool::~ThreadPool() {
+    stopping_.store(true);
+    for (ClassQueue& q : queues_) {
+        { std::lock_guard<std::mutex> lock(q.mutex); }
+        q.ready.notify_all();
+    }
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) worker->thread.join();
+    }
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::shared() {
+    std::lock_guard<std::mutex> lock(g_shared_mutex);
+    if (!g_shared) g_shared = std::make_shared<ThreadPool>(g_shared_options);
+    return g_shared;
+}
+
+void ThreadPool::configure_shared(const ThreadPoolOptions& options) {
+    std::shared_ptr<ThreadPool> previous;
+    {
+        std::lock_guard<std::mutex> lock(g_shared_mutex);
+        const bool same = options.performance_workers == g_shared_options.performance_workers &&
+                          options.efficiency_workers == g_shared_options.efficiency_workers;
+        g_shared_options = options;
+        if (same || !g_shared) return;
+        previous = std::move(g_shared);
+        g_shared = std::make_shared<ThreadPool>(options);
+    }
+    // The old pool drains and joins once its last user lets go
+}
+
+void ThreadPool::submit(CoreClass core_class, Task task) {
+    ClassQueue& q = queue(core_class);
+    if (q.workers.empty()) {
+        task();
+        return;
+    }
+    // A worker's own submissions stay on its deque, where it finds them first
+    Worker* target = nullptr;
+    if (t_pool == this && static_cast<Worker*>(t_worker)->core_class == core_class) {
+        target = static_cast<Worker*>(t_worker);
+    } else {
+        target = q.workers[q.next.fetch_add(1, std::memory_order_relaxed) % q.workers.size()];
+    }
+    {
+        std::lock_guard<std::mutex> lock(target->mutex);
+        target->tasks.push_back(std::move(task));
+    }
+    q.queued.fetch_add(1);
+    { std::lock_guard<std::mutex> lock(q.mutex); }
+    q.ready.notify_one();
+}
+
+void ThreadPool::parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+    if (count == 0) return;
+    grain = std::max<size_t>(grain, 1);
+    const size_t helpers = std::min(queue(CoreClass::kPerformance).workers.size(), (count - 1) / grain);
+    if (helpers == 0) {
+        fn(0, count);
+        return;
+    }
+
+    // Chunks are claimed from a shared counter, the caller included, so the
+    // caller never waits on a chunk nobody has started. Helpers that arrive
+    // after the last claim return without touching `fn`.
+    struct Job {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        size_t chunks = 0;
+        size_t chunk_size = 0;
+        size_t count = 0;
+        const std::function<void(size_t, size_t)>* fn = nullptr;
+
+        void run() {
+            for (size_t chunk; (chunk = next.fetch_add(1)) < chunks;) {
+                const size_t begin = chunk * chunk_size;
+                (*fn)(begin, std::min(count, begin + chunk_size));
+                done.fetch_add(1, std::memory_order_release);
+            }
+        }
+    };
+    auto job = std::make_shared<Job>();
+    const size_t target_chunks = (helpers + 1) * kChunksPerThread;
+    job->chunk_size = std::max(grain, (count + target_chunks - 1) / target_chunks);
+    job->chunks = (count + job->chunk_size - 1) / job->chunk_size;
+    job->count = count;
+    job->fn = &fn;
+
+    for (size_t i = 0; i < std::min(helpers, job->chunks - 1); i++) {
+        submit(CoreClass::kPerformance, [job] { job->run(); });
+    }
+    job->run();
+    // Whatever is left is already running on a helper
+    while (job->done.load(std::memory_order_acquire) < job->chunks) {
+        std::this_thread::yield();
+    }
+}
+
+size_t ThreadPool::worker_count(CoreClass core_class) const {
+    return queues_[static_cast<int>(core_class)].workers.size();
+}
+
+std::vector<ThreadPool::WorkerStats> ThreadPool::stats() const {
+    const int64_t uptime_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started_).count();
+    std::vector<WorkerStats> stats;
+    stats.reserve(workers_.size());
+    for (const auto& worker : workers_) {
+        WorkerStats entry;
+        entry.cpu = worker->cpu;
+        entry.core_class = worker->core_class;
+        entry.tasks = worker->executed.load(std::memory_order_relaxed);
+        entry.steals = worker->steals.load(std::memory_order_relaxed);
+        entry.busy_us = worker->busy_ns.load(std::memory_order_relaxed) / 1000;
+        entry.uptime_us = uptime_us;
+        stats.push_back(entry);
+    }
+    return stats;
+}
+
+// Own deque newest first, then the oldest task of another worker of the class
+bool ThreadPool::take(Worker* worker, Task* task) {
+    ClassQueue& q = queue(worker->core_class);
+    if (q.queued.load(std::memory_order_relaxed) <= 0) return false;
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if (!worker->tasks.empty()) {
+            *task = std::move(worker->tasks.back());
+            worker->tasks.pop_back();
+            q.queued.fetch_sub(1);
+            return true;
+        }
+    }
+    const size_t count = q.workers.size();
+    const size_t self = static_cast<size_t>(std::find(q.workers.begin(), q.workers.end(), worker) - q.workers.begin());
+    for (size_t i = 1; i < count; i++) {
+        Worker* victim = q.workers[(self + i) % count];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if (!victim->tasks.empty()) {
+            *task = std::move(victim->tasks.front());
+            victim->tasks.pop_front();
+            q.queued.fetch_sub(1);
+            worker->steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::worker_loop(Worker* worker) {
+    t_pool = this;
+    t_worker = worker;
+    pin_current_thread(topology_, worker->core_class);
+    const bool performance = worker->core_class == CoreClass::kPerformance;
+    trace_set_thread_name(std::string(performance ? "pool big " : "pool little ") + std::to_string(worker->cpu));
+    ClassQueue& q = queue(worker->core_class);
+
+    while (true) {
+        Task task;
+        bool found = false;
+        for (int round = 0; round < kSpinRounds && !found; round++) {
+            found = take(worker, &task);
+            if (!found && stopping_.load(std::memory_order_relaxed)) break;
+        }
+        if (!found) {
+            std::unique_lock<std::mutex> lock(q.mutex);
+            q.ready.wait(lock, [&] { return q.queued.load() > 0 || stopping_.load(); });
+            if (q.queued.load() <= 0 && stopping_.load()) break;
+            continue;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        task();
+        worker->busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - start).count(),
+                                  std::memory_order_relaxed);
+        worker->executed.fetch_add(1, std::memory_order_relaxed);
+    }
+    t_pool = nullptr;
+    t_worker = nullptr;
+}
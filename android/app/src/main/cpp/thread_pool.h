@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Performance or efficiency cores of a heterogeneous (big.LITTLE) SoC
+enum class CoreClass : int {
+    kPerformance = 0,
+    kEfficiency = 1,
+};
+
+// Core capacities from /sys/devices/system/cpu: cpuN/cpu_capacity where the
+// kernel exposes it (arm64 with energy-aware scheduling), otherwise the
+// cluster's cpufreq/cpuinfo_max_freq. Cores above half the largest capacity
+// count as performance cores; a homogeneous CPU (or one where nothing is
+// readable) is all performance cores.
+struct CpuTopology {
+    std::vector<int> performance; // cpu ids
+    std::vector<int> efficiency;
+
+    static CpuTopology detect(const std::string& root = "/sys/devices/system/cpu");
+
+    const std::vector<int>& cores(CoreClass core_class) const {
+        return core_class == CoreClass::kPerformance ? performance : efficiency;
+    }
+};
+
+// Pins the calling thread to the cores of a class (all cores when the class
+// is empty). Returns false if the kernel refused.
+bool pin_current_thread(const CpuTopology& topology, CoreClass core_class);
+
+// -1 counts are derived from the topology: one worker per performance core
+// but the caller's (parallel_for runs on the caller too), and one worker for
+// background work.
+struct ThreadPoolOptions {
+    int performance_workers = -1;
+    int efficiency_workers = -1;
+};
+
+// Work-stealing pool split by core class. Latency-critical work (the CPU
+// kernels of a decode step) runs on workers pinned to performance cores;
+// background work (publishing session snapshots, preloads) on workers
+// pinned to efficiency cores, so it never competes with decode for a big
+// core. Each worker owns a deque: it pops its own newest task and steals
+// the oldest from the other workers of its class when it runs dry.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    struct WorkerStats {
+        int cpu = -1; // first core of its affinity mask, -1 when unpinned
+        CoreClass core_class = CoreClass::kPerformance;
+        uint64_t tasks = 0;
+        uint64_t steals = 0;  // tasks taken from another worker's deque
+        int64_t busy_us = 0;  // time spent running tasks
+        int64_t uptime_us = 0;
+    };
+
+    explicit ThreadPool(const ThreadPoolOptions& options = ThreadPoolOptions(),
+                        const CpuTopology& topology = CpuTopology::detect());
+    ~ThreadPool(); // runs what is still queued, then joins
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Process-wide pool; configure_shared() replaces it (work already
+    // queued on the old one still runs). Tasks must not keep the shared
+    // pointer, since the last reference would then join from a worker.
+    static std::shared_ptr<ThreadPool> shared();
+    static void configure_shared(const ThreadPoolOptions& options);
+
+    // Runs `task` on a worker of the class; inline if the class has none
+    void submit(CoreClass core_class, Task task);
+
+    // Calls fn(begin, end) over [0, count) in chunks of at least `grain`
+    // on the performance workers and the calling thread, and returns when
+    // all are done. Safe to call from inside a task.
+    void parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+    size_t worker_count(CoreClass core_class) const;
+    const CpuTopology& topology() const { return topology_; }
+    std::vector<WorkerStats> stats() const;
+
+private:
+    struct Worker {
+        CoreClass core_class = CoreClass::kPerformance;
+        int cpu = -1;
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> steals{0};
+        std::atomic<int64_t> busy_ns{0};
+        std::thread thread;
+    };
+
+    // Sleeping workers of one class wait here for `queued` to rise
+    struct ClassQueue {
+        std::vector<Worker*> workers;
+        std::atomic<size_t> next{0}; // round-robin submission
+        std::atomic<int64_t> queued{0};
+        std::mutex mutex;
+        std::condition_variable ready;
+    };
+
+    void worker_loop(Worker* worker);
+    bool take(Worker* worker, Task* task);
+    ClassQueue& queue(CoreClass core_class) { return queues_[static_cast<int>(core_class)]; }
+
+    CpuTopology topology_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    ClassQueue queues_[2];
+    std::atomic<bool> stopping_{false};
+    std::chrono::steady_clock::time_point started_;
+};
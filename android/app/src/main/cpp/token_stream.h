@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "memory_accounting.h"
+
+// Lock-free single-producer/single-consumer ring buffer.
+//
+// The decode thread is the only producer and the Java drainer the only
+// consumer, so head and tail each have a single writer and need nothing
+// stronger than acquire/release ordering.
+template <typename T, size_t Capacity>
+class SpscRingBuffer {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "SpscRingBuffer capacity must be a power of two");
+
+public:
+    bool try_push(T&& value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots_[head & (Capacity - 1)] = std::move(value);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& out) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        out = std::move(slots_[tail & (Capacity - 1)]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::array<T, Capacity> slots_;
+};
+
+struct TokenEvent {
+    int32_t token_id = -1;
+    std::string text;
+};
+
+// One in-flight streaming generation. Shared between the JNI handle and the
+// engine request; the decode thread only touches `tokens` (as producer) and
+// the atomics. Text waiting in the ring is charged to MemoryCategory::kJni.
+struct TokenStream {
+    static constexpr size_t kCapacity = 1024;
+
+    TokenStream() = default;
+    TokenStream(const TokenStream&) = delete;
+    TokenStream& operator=(const TokenStream&) = delete;
+    ~TokenStream() {
+        MemoryAccounting::instance().sub(MemoryCategory::kJni, queued_bytes.load(std::memory_order_relaxed));
+    }
+
+    SpscRingBuffer<TokenEvent, kCapacity> tokens;
+    std::atomic<bool> cancel_requested{false};
+    std::atomic<bool> finished{false};
+    std::atomic<int64_t> queued_bytes{0};
+    int64_t trace_id = -1; // InferenceRequest::trace_id of the generation
+
+    // Written by the decode thread before `finished` is released.
+    bool failed = false;
+    std::string error;
+    int64_t first_token_us = -1;
+    int32_t generated_tokens = 0;
+    std::vector<int64_t> prefill_chunk_us;
+    int64_t draft_tokens = 0;          // speculative draft tokens verified
+    int64_t accepted_draft_tokens = 0; // ... and kept
+
+    // Consumer side only: drained tokens that did not fit the caller's buffer
+    std::vector<TokenEvent> undelivered;
+
+    // Producer side: blocks (yielding) while the consumer is behind, but gives
+    // up as soon as the stream is cancelled.
+    bool push(TokenEvent&& event) {
+        // Charged before publishing so the consumer never subtracts first
+        const int64_t bytes = static_cast<int64_t>(event.text.size());
+        queued_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        MemoryAccounting::instance().add(MemoryCategory::kJni, bytes);
+        while (!tokens.try_push(std::move(event))) {
+            if (cancel_requested.load(std::memory_order_relaxed)) {
+                queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                MemoryAccounting::instance().sub(MemoryCategory::kJni, bytes);
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    void finish(bool ok, const std::string& message = "") {
+        failed = !ok;
+        error = message;
+        finished.store(true, std::memory_order_release);
+    }
+
+    // Consumer side: pops up to `max_events`, waiting at most `timeout_ms`
+    // for the first one. Returns the number of events appended to `out`.
+    template <typename Container>
+    size_t drain(Container& out, size_t max_events, int timeout_ms) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        TokenEvent event;
+        size_t count = 0;
+        while (true) {
+            while (count < max_events && tokens.try_pop(event)) {
+                const int64_t bytes = static_cast<int64_t>(event.text.size());
+                queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                MemoryAccounting::instance().sub(MemoryCategory::kJni, bytes);
+                out.push_back(std::move(event));
+                count++;
+            }
+            if (count > 0 || is_drained() || std::chrono::steady_clock::now() >= deadline) {
+                return count;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    }
+
+    bool is_drained() const {
+        return finished.load(std::memory_order_acquire) && tokens.empty();
+    }
+};
@@ -0,0 +1,977 @@
+#include "tokenizer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#include "mapped_file.h"
+#include "mlc_log.h"
+
+namespace {
+
+// ---- tokenizer.json ----
+
+// Just enough JSON to read tokenizer.json: strings, integers, booleans and
+// skipping everything else. Fails closed on anything malformed.
+class JsonReader {
+public:
+    JsonReader(const char* data, size_t size) : p_(data), end_(data + size) {}
+
+    bool ok() const { return ok_; }
+
+    bool consume(char c) {
+        skip_space();
+        if (p_ < end_ && *p_ == c) {
+            p_++;
+            return true;
+        }
+        return false;
+    }
+
+    bool expect(char c) {
+        if (!consume(c)) ok_ = false;
+        return ok_;
+    }
+
+    char peek() {
+        skip_space();
+        return p_ < end_ ? *p_ : '\0';
+    }
+
+    // Iterates an object: call with first = true, then false until it
+    // returns false; `key` holds each member name
+    bool next_member(bool first, std::string* key) {
+        if (first) {
+            if (!expect('{')) return false;
+            if (consume('}')) return false;
+        } else {
+            if (consume('}')) return false;
+            if (!expect(',')) return false;
+        }
+        return read_string(key) && expect(':');
+    }
+
+    bool next_element(bool first) {
+        if (first) {
+            if (!expect('[')) return false;
+            return !consume(']');
+        }
+        if (consume(']')) return false;
+        return expect(',');
+    }
+
+    bool read_string(std::string* out) {
+        out->clear();
+        if (!expect('"')) return false;
+        while (p_ < end_) {
+            const char c = *p_++;
+            if (c == '"') return true;
+            if (c != '\\') {
+                out->push_back(c);
+                continue;
+            }
+            if (p_ >= end_) break;
+            const char escape = *p_++;
+            switch (escape) {
+                case '"': out->push_back('"'); break;
+                case '\\': out->push_back('\\'); break;
+                case '/': out->push_back('/'); break;
+                case 'b': out->push_back('\b'); break;
+                case 'f': out->push_back('\f'); break;
+                case 'n': out->push_back('\n'); break;
+                case 'r': out->push_back('\r'); break;
+                case 't': out->push_back('\t'); break;
+                case 'u': {
+                    uint32_t code = 0;
+                    if (!read_hex4(&code)) return fail();
+                    if (code >= 0xD800 && code < 0xDC00 && p_ + 6 <= end_ && p_[0] == '\\' && p_[1] == 'u') {
+                        p_ += 2;
+                        uint32_t low = 0;
+                        if (!read_hex4(&low)) return fail();
+                        if (low >= 0xDC00 && low < 0xE000) {
+                            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        } else {
+                            append_utf8(0xFFFD, out);
+                            code = low;
+                        }
+                    }
+                    append_utf8(code >= 0xD800 && code < 0xE000 ? 0xFFFD : code, out);
+                    break;
+                }
+                default: return fail();
+            }
+        }
+        return fail();
+    }
+
+    bool read_int(int64_t* out) {
+        skip_space();
+        bool negative = false;
+        if (p_ < end_ && *p_ == '-') {
+            negative = true;
+            p_++;
+        }
+        if (p_ >= end_ || *p_ < '0' || *p_ > '9') return fail();
+        int64_t value = 0;
+        while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+            value = value * 10 + (*p_++ - '0');
+            if (value > (int64_t(1) << 40)) return fail();
+        }
+        *out = negative ? -value : value;
+        return true;
+    }
+
+    bool read_bool(bool* out) {
+        skip_space();
+        if (end_ - p_ >= 4 && std::memcmp(p_, "true", 4) == 0) {
+            p_ += 4;
+            *out = true;
+            return true;
+        }
+        if (end_ - p_ >= 5 && std::memcmp(p_, "false", 5) == 0) {
+            p_ += 5;
+            *out = false;
+            return true;
+        }
+        return fail();
+    }
+
+    bool skip_value() {
+        const char c = peek();
+        if (c == '"') {
+            std::string ignored;
+            return read_string(&ignored);
+        }
+        if (c == '{') {
+            std::string key;
+            for (bool first = true; next_member(first, &key); first = false) {
+                if (!skip_value()) return false;
+            }
+            return ok_;
+        }
+        if (c == '[') {
+            for (bool first = true; next_element(first); first = false) {
+                if (!skip_value()) return false;
+            }
+            return ok_;
+        }
+        // number, true, false, null
+        const char* start = p_;
+        while (p_ < end_ && *p_ != ',' && *p_ != '}' && *p_ != ']' && !is_space(*p_)) p_++;
+        return p_ != start || fail();
+    }
+
+    static void append_utf8(uint32_t code, std::string* out) {
+        if (code < 0x80) {
+            out->push_back(static_cast<char>(code));
+        } else if (code < 0x800) {
+            out->push_back(static_cast<char>(0xC0 | code >> 6));
+            out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        } else if (code < 0x10000) {
+            out->push_back(static_cast<char>(0xE0 | code >> 12));
+            out->push_back(static_cast<char>(0x80 | (code >> 6 & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        } else {
+            out->push_back(static_cast<char>(0xF0 | code >> 18));
+            out->push_back(static_cast<char>(0x80 | (code >> 12 & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (code >> 6 & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+    }
+
+private:
+    static bool is_space(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+    void skip_space() {
+        while (p_ < end_ && is_space(*p_)) p_++;
+    }
+
+    bool read_hex4(uint32_t* out) {
+        if (end_ - p_ < 4) return false;
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            const char c = *p_++;
+            value <<= 4;
+            if (c >= '0' && c <= '9') value |= c - '0';
+            else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+            else return false;
+        }
+        *out = value;
+        return true;
+    }
+
+    bool fail() {
+        ok_ = false;
+        return false;
+    }
+
+    const char* p_;
+    const char* end_;
+    bool ok_ = true;
+};
+
+// Decodes one UTF-8 character; malformed input yields U+FFFD for one byte
+uint32_t decode_utf8(const unsigned char* p, size_t available, size_t* length) {
+    const unsigned char lead = p[0];
+    if (lead < 0x80) {
+        *length = 1;
+        return lead;
+    }
+    size_t needed;
+    uint32_t code;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        needed = 2;
+        code = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        needed = 3;
+        code = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        needed = 4;
+        code = lead & 0x07;
+    } else {
+        *length = 1;
+        return 0xFFFD;
+    }
+    if (available < needed) {
+        *length = 1;
+        return 0xFFFD;
+    }
+    for (size_t i = 1; i < needed; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *length = 1;
+            return 0xFFFD;
+        }
+        code = code << 6 | (p[i] & 0x3F);
+    }
+    const bool overlong = (needed == 3 && code < 0x800) || (needed == 4 && code < 0x10000);
+    if (overlong || code > 0x10FFFF || (code >= 0xD800 && code < 0xE000)) {
+        *length = 1;
+        return 0xFFFD;
+    }
+    *length = needed;
+    return code;
+}
+
+// GPT-2 byte-level alphabet: printable Latin-1 bytes stand for themselves,
+// the rest are shifted to U+0100 and up so every vocab string is printable.
+struct ByteAlphabet {
+    int16_t byte_of[324]; // code point -> byte, -1 if not in the alphabet
+
+    ByteAlphabet() {
+        std::fill(std::begin(byte_of), std::end(byte_of), int16_t(-1));
+        int shifted = 0;
+        for (int byte = 0; byte < 256; byte++) {
+            const bool printable = (byte >= 0x21 && byte <= 0x7E) || (byte >= 0xA1 && byte <= 0xAC) || byte >= 0xAE;
+            byte_of[printable ? byte : 256 + shifted++] = static_cast<int16_t>(byte);
+        }
+    }
+
+    // Vocab string -> raw token bytes; false if a character is outside the alphabet
+    bool decode(const std::string& text, std::string* bytes) const {
+        bytes->clear();
+        const auto* p = reinterpret_cast<const unsigned char*>(text.data());
+        for (size_t i = 0; i < text.size();) {
+            size_t length = 0;
+            const uint32_t code = decode_utf8(p + i, text.size() - i, &length);
+            if (code >= sizeof(byte_of) / sizeof(byte_of[0]) || byte_of[code] < 0) return false;
+            bytes->push_back(static_cast<char>(byte_of[code]));
+            i += length;
+        }
+        return true;
+    }
+};
+
+// ---- pre-tokenization ----
+
+enum class CharClass : uint8_t { kLetter, kNumber, kSpace, kOther };
+
+struct ClassRange {
+    uint32_t first;
+    uint32_t last;
+    CharClass value;
+};
+
+// Non-ASCII code points that are not letters, sorted. Covers Latin-1,
+// combining marks, general and CJK punctuation, symbols, arrows, box
+// drawing, dingbats, fullwidth forms and emoji; anything else is \p{L}.
+constexpr ClassRange kNonLetters[] = {
+    {0x0085, 0x0085, CharClass::kSpace},  {0x00A0, 0x00A0, CharClass::kSpace},
+    {0x00A1, 0x00A9, CharClass::kOther},  {0x00AB, 0x00B1, CharClass::kOther},
+    {0x00B2, 0x00B3, CharClass::kNumber}, {0x00B4, 0x00B4, CharClass::kOther},
+    {0x00B6, 0x00B8, CharClass::kOther},  {0x00B9, 0x00B9, CharClass::kNumber},
+    {0x00BB, 0x00BB, CharClass::kOther},  {0x00BC, 0x00BE, CharClass::kNumber},
+    {0x00BF, 0x00BF, CharClass::kOther},  {0x00D7, 0x00D7, CharClass::kOther},
+    {0x00F7, 0x00F7, CharClass::kOther},  {0x02C2, 0x02C5, CharClass::kOther},
+    {0x02D2, 0x02DF, CharClass::kOther},  {0x02E5, 0x02EB, CharClass::kOther},
+    {0x02ED, 0x02ED, CharClass::kOther},  {0x02EF, 0x036F, CharClass::kOther},
+    {0x0374, 0x0375, CharClass::kOther},  {0x037E, 0x037E, CharClass::kOther},
+    {0x0384, 0x0385, CharClass::kOther},  {0x0387, 0x0387, CharClass::kOther},
+    {0x03F6, 0x03F6, CharClass::kOther},  {0x0482, 0x0489, CharClass::kOther},
+    {0x055A, 0x055F, CharClass::kOther},  {0x0589, 0x058A, CharClass::kOther},
+    {0x0591, 0x05C7, CharClass::kOther},  {0x0600, 0x061F, CharClass::kOther},
+    {0x064B, 0x065F, CharClass::kOther},  {0x0660, 0x0669, CharClass::kNumber},
+    {0x066A, 0x066D, CharClass::kOther},  {0x06D4, 0x06D4, CharClass::kOther},
+    {0x06D6, 0x06ED, CharClass::kOther},  {0x06F0, 0x06F9, CharClass::kNumber},
+    {0x0900, 0x0903, CharClass::kOther},  {0x093A, 0x094F, CharClass::kOther},
+    {0x0951, 0x0957, CharClass::kOther},  {0x0962, 0x0965, CharClass::kOther},
+    {0x0966, 0x096F, CharClass::kNumber}, {0x0970, 0x0970, CharClass::kOther},
+    {0x09E6, 0x09EF, CharClass::kNumber}, {0x0E31, 0x0E31, CharClass::kOther},
+    {0x0E34, 0x0E3A, CharClass::kOther},  {0x0E3F, 0x0E3F, CharClass::kOther},
+    {0x0E47, 0x0E4F, CharClass::kOther},  {0x0E50, 0x0E59, CharClass::kNumber},
+    {0x0E5A, 0x0E5B, CharClass::kOther},  {0x1680, 0x1680, CharClass::kSpace},
+    {0x2000, 0x200A, CharClass::kSpace},  {0x200B, 0x2027, CharClass::kOther},
+    {0x2028, 0x2029, CharClass::kSpace},  {0x202A, 0x202E, CharClass::kOther},
+    {0x202F, 0x202F, CharClass::kSpace},  {0x2030, 0x205E, CharClass::kOther},
+    {0x205F, 0x205F, CharClass::kSpace},  {0x2060, 0x206F, CharClass::kOther},
+    {0x2070, 0x2070, CharClass::kNumber}, {0x2074, 0x2079, CharClass::kNumber},
+    {0x207A, 0x207E, CharClass::kOther},  {0x2080, 0x2089, CharClass::kNumber},
+    {0x208A, 0x208E, CharClass::kOther},  {0x20A0, 0x20FF, CharClass::kOther},
+    {0x2100, 0x2101, CharClass::kOther},  {0x2103, 0x2106, CharClass::kOther},
+    {0x2108, 0x2109, CharClass::kOther},  {0x2114, 0x2114, CharClass::kOther},
+    {0x2116, 0x2118, CharClass::kOther},  {0x211E, 0x2123, CharClass::kOther},
+    {0x2125, 0x2125, CharClass::kOther},  {0x2127, 0x2127, CharClass::kOther},
+    {0x2129, 0x2129, CharClass::kOther},  {0x212E, 0x212E, CharClass::kOther},
+    {0x213A, 0x213B, CharClass::kOther},  {0x2140, 0x2144, CharClass::kOther},
+    {0x214A, 0x214D, CharClass::kOther},  {0x214F, 0x214F, CharClass::kOther},
+    {0x2150, 0x2182, CharClass::kNumber}, {0x2185, 0x2189, CharClass::kNumber},
+    {0x218A, 0x245F, CharClass::kOther},  {0x2460, 0x249B, CharClass::kNumber},
+    {0x249C, 0x24E9, CharClass::kOther},  {0x24EA, 0x24FF, CharClass::kNumber},
+    {0x2500, 0x2775, CharClass::kOther},  {0x2776, 0x2793, CharClass::kNumber},
+    {0x2794, 0x2BFF, CharClass::kOther},  {0x2CE5, 0x2CEA, CharClass::kOther},
+    {0x2CEF, 0x2CF1, CharClass::kOther},  {0x2CF9, 0x2CFF, CharClass::kOther},
+    {0x2DE0, 0x2E2E, CharClass::kOther},  {0x2E30, 0x2E7F, CharClass::kOther},
+    {0x2E80, 0x2FFF, CharClass::kOther},  {0x3000, 0x3000, CharClass::kSpace},
+    {0x3001, 0x3004, CharClass::kOther},  {0x3007, 0x3007, CharClass::kNumber},
+    {0x3008, 0x3020, CharClass::kOther},  {0x3021, 0x3029, CharClass::kNumber},
+    {0x302A, 0x3030, CharClass::kOther},  {0x3036, 0x3037, CharClass::kOther},
+    {0x3038, 0x303A, CharClass::kNumber}, {0x303D, 0x303F, CharClass::kOther},
+    {0x3099, 0x309C, CharClass::kOther},  {0x30A0, 0x30A0, CharClass::kOther},
+    {0x30FB, 0x30FB, CharClass::kOther},  {0x3190, 0x3191, CharClass::kOther},
+    {0x3192, 0x3195, CharClass::kNumber}, {0x3196, 0x319F, CharClass::kOther},
+    {0x31C0, 0x31E3, CharClass::kOther},  {0x3200, 0x321E, CharClass::kOther},
+    {0x3220, 0x3229, CharClass::kNumber}, {0x322A, 0x3247, CharClass::kOther},
+    {0x3248, 0x324F, CharClass::kNumber}, {0x3250, 0x3250, CharClass::kOther},
+    {0x3251, 0x325F, CharClass::kNumber}, {0x3260, 0x327F, CharClass::kOther},
+    {0x3280, 0x3289, CharClass::kNumber}, {0x328A, 0x32B0, CharClass::kOther},
+    {0x32B1, 0x32BF, CharClass::kNumber}, {0x32C0, 0x33FF, CharClass::kOther},
+    {0x4DC0, 0x4DFF, CharClass::kOther},  {0xA490, 0xA4C6, CharClass::kOther},
+    {0xA700, 0xA716, CharClass::kOther},  {0xA720, 0xA721, CharClass::kOther},
+    {0xD800, 0xF8FF, CharClass::kOther},  {0xFB29, 0xFB29, CharClass::kOther},
+    {0xFD3E, 0xFD3F, CharClass::kOther},  {0xFE00, 0xFE6F, CharClass::kOther},
+    {0xFEFF, 0xFEFF, CharClass::kOther},  {0xFF01, 0xFF0F, CharClass::kOther},
+    {0xFF10, 0xFF19, CharClass::kNumber}, {0xFF1A, 0xFF20, CharClass::kOther},
+    {0xFF3B, 0xFF40, CharClass::kOther},  {0xFF5B, 0xFF65, CharClass::kOther},
+    {0xFFE0, 0xFFFF, CharClass::kOther},  {0x10100, 0x10102, CharClass::kOther},
+    {0x1D000, 0x1D24F, CharClass::kOther}, {0x1D360, 0x1D378, CharClass::kNumber},
+    {0x1D7CE, 0x1D7FF, CharClass::kNumber}, {0x1EC70, 0x1ECBF, CharClass::kOther},
+    {0x1F000, 0x1F0FF, CharClass::kOther}, {0x1F100, 0x1F10C, CharClass::kNumber},
+    {0x1F10D, 0x1FBEF, CharClass::kOther}, {0x1FBF0, 0x1FBF9, CharClass::kNumber},
+    {0xE0000, 0xE01EF, CharClass::kOther}, {0xF0000, 0x10FFFF, CharClass::kOther},
+};
+
+struct AsciiClasses {
+    CharClass value[128];
+
+    AsciiClasses() {
+        for (int c = 0; c < 128; c++) {
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) value[c] = CharClass::kLetter;
+            else if (c >= '0' && c <= '9') value[c] = CharClass::kNumber;
+            else if (c == ' ' || (c >= '\t' && c <= '\r')) value[c] = CharClass::kSpace;
+            else value[c] = CharClass::kOther;
+        }
+    }
+};
+
+const AsciiClasses kAscii;
+
+CharClass classify(uint32_t code) {
+    if (code < 128) return kAscii.value[code];
+    size_t low = 0;
+    size_t high = sizeof(kNonLetters) / sizeof(kNonLetters[0]);
+    while (low < high) {
+        const size_t mid = (low + high) / 2;
+        if (kNonLetters[mid].last < code) low = mid + 1;
+        else high = mid;
+    }
+    if (low < sizeof(kNonLetters) / sizeof(kNonLetters[0]) && kNonLetters[low].first <= code) {
+        return kNonLetters[low].value;
+    }
+    return CharClass::kLetter;
+}
+
+// Cursor over the code points of a piece of text
+struct Char {
+    size_t begin;
+    size_t end;
+    uint32_t code;
+    CharClass type;
+};
+
+class CharReader {
+public:
+    explicit CharReader(std::string_view text)
+        : p_(reinterpret_cast<const unsigned char*>(text.data())), size_(text.size()) {}
+
+    size_t size() const { return size_; }
+
+    Char at(size_t offset) const {
+        Char c;
+        c.begin = offset;
+        if (offset >= size_) {
+            c.end = offset;
+            c.code = 0;
+            c.type = CharClass::kOther;
+            return c;
+        }
+        if (p_[offset] < 0x80) {
+            c.end = offset + 1;
+            c.code = p_[offset];
+            c.type = kAscii.value[c.code];
+            return c;
+        }
+        size_t length = 0;
+        c.code = decode_utf8(p_ + offset, size_ - offset, &length);
+        c.end = offset + length;
+        c.type = classify(c.code);
+        return c;
+    }
+
+    unsigned char byte(size_t offset) const { return offset < size_ ? p_[offset] : 0; }
+
+private:
+    const unsigned char* p_;
+    size_t size_;
+};
+
+bool is_newline(uint32_t code) {
+    return code == '\r' || code == '\n';
+}
+
+char lower_ascii(unsigned char c) {
+    return static_cast<char>(c >= 'A' && c <= 'Z' ? c + 32 : c);
+}
+
+// Length of a contraction ('s 't 're 've 'm 'll 'd, any case) at `offset`, or 0
+size_t contraction_at(const CharReader& text, size_t offset) {
+    if (text.byte(offset) != '\'') return 0;
+    const char first = lower_ascii(text.byte(offset + 1));
+    if (first == 's' || first == 't' || first == 'm' || first == 'd') return 2;
+    const char second = lower_ascii(text.byte(offset + 2));
+    if ((first == 'r' && second == 'e') || (first == 'v' && second == 'e') || (first == 'l' && second == 'l')) return 3;
+    return 0;
+}
+
+// One match of the Llama-3 pattern starting at `offset`:
+//   (?i:'s|'t|'re|'ve|'m|'ll|'d) | [^\r\n\p{L}\p{N}]?\p{L}+ | \p{N}{1,3} |
+//   ' '?[^\s\p{L}\p{N}]+[\r\n]* | \s*[\r\n]+ | \s+(?!\S) | \s+
+size_t match_piece(const CharReader& text, size_t offset) {
+    if (const size_t contraction = contraction_at(text, offset)) return offset + contraction;
+
+    const Char first = text.at(offset);
+    const Char second = text.at(first.end);
+
+    // Letters, optionally led by one non-letter, non-digit, non-newline
+    if (first.type == CharClass::kLetter || (second.type == CharClass::kLetter && second.end > second.begin &&
+                                             first.type != CharClass::kNumber && !is_newline(first.code))) {
+        size_t end = first.type == CharClass::kLetter ? first.end : second.end;
+        for (Char c = text.at(end); c.end > c.begin && c.type == CharClass::kLetter; c = text.at(end)) end = c.end;
+        return end;
+    }
+
+    if (first.type == CharClass::kNumber) {
+        size_t end = first.end;
+        for (int digits = 1; digits < 3; digits++) {
+            const Char c = text.at(end);
+            if (c.end == c.begin || c.type != CharClass::kNumber) break;
+            end = c.end;
+        }
+        return end;
+    }
+
+    // Punctuation and symbols, optionally after a space, with trailing newlines
+    if (first.type == CharClass::kOther || (first.code == ' ' && second.type == CharClass::kOther && second.end > second.begin)) {
+        size_t end = first.type == CharClass::kOther ? first.end : second.end;
+        for (Char c = text.at(end); c.end > c.begin && c.type == CharClass::kOther; c = text.at(end)) end = c.end;
+        while (is_newline(text.byte(end))) end++;
+        return end;
+    }
+
+    // Whitespace: up to the last newline of the run; else all of it at the
+    // end of text; else all but its last character, which then leads the
+    // next piece (a lone space before a word was taken above)
+    size_t end = first.end;
+    size_t last_newline_end = is_newline(first.code) ? first.end : 0;
+    size_t last_begin = first.begin;
+    for (Char c = text.at(end); c.end > c.begin && c.type == CharClass::kSpace; c = text.at(end)) {
+        if (is_newline(c.code)) last_newline_end = c.end;
+        last_begin = c.begin;
+        end = c.end;
+    }
+    if (last_newline_end != 0) return last_newline_end;
+    if (end >= text.size() || last_begin == first.begin) return end;
+    return last_begin;
+}
+
+// Fibonacci hash of a token pair
+inline size_t pair_slot(uint64_t pair, size_t mask) {
+    uint64_t h = pair * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(h ^ (h >> 29)) & mask;
+}
+
+inline uint64_t make_pair_key(int32_t left, int32_t right) {
+    return static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32 | static_cast<uint32_t>(right);
+}
+
+// Below this many bytes a word is merged with a plain min-rank scan
+constexpr size_t kShortWordParts = 24;
+
+} // namespace
+
+// ---- BpeTokenizer ----
+
+std::unique_ptr<BpeTokenizer> BpeTokenizer::load(const std::string& path) {
+    MappedFile file;
+    if (!file.open(path)) return nullptr;
+    file.advise(MappedFile::Access::kSequential);
+    auto tokenizer = parse(reinterpret_cast<const char*>(file.data()), file.size());
+    if (tokenizer) {
+        LOGI("🔤 Loaded BPE tokenizer %s: %d tokens, %zu merges, %zu added", path.c_str(), tokenizer->vocab_size(),
+             tokenizer->merge_count_, tokenizer->special_.size());
+    }
+    return tokenizer;
+}
+
+std::unique_ptr<BpeTokenizer> BpeTokenizer::parse(const char* json, size_t size) {
+    if (json == nullptr || size == 0) return nullptr;
+
+    struct AddedToken {
+        int64_t id = -1;
+        std::string content;
+    };
+    std::vector<std::pair<std::string, int64_t>> vocab;
+    std::vector<std::pair<std::string, std::string>> merges;
+    std::vector<AddedToken> added;
+    std::string model_type;
+
+    JsonReader reader(json, size);
+    std::string key;
+    std::string value;
+    for (bool first = true; reader.next_member(first, &key); first = false) {
+        if (key == "added_tokens" && reader.peek() == '[') {
+            for (bool next = true; reader.next_element(next); next = false) {
+                AddedToken token;
+                std::string field;
+                for (bool member = true; reader.next_member(member, &field); member = false) {
+                    if (field == "id") reader.read_int(&token.id);
+                    else if (field == "content") reader.read_string(&token.content);
+                    else reader.skip_value();
+                }
+                if (token.id >= 0 && !token.content.empty()) added.push_back(std::move(token));
+            }
+        } else if (key == "model" && reader.peek() == '{') {
+            std::string field;
+            for (bool member = true; reader.next_member(member, &field); member = false) {
+                if (field == "type" && reader.peek() == '"') {
+                    reader.read_string(&model_type);
+                } else if (field == "vocab" && reader.peek() == '{') {
+                    std::string piece;
+                    for (bool entry = true; reader.next_member(entry, &piece); entry = false) {
+                        int64_t id = -1;
+                        if (!reader.read_int(&id)) break;
+                        vocab.emplace_back(piece, id);
+                    }
+                } else if (field == "merges" && reader.peek() == '[') {
+                    // "left right" (older files) or ["left", "right"]
+                    for (bool entry = true; reader.next_element(entry); entry = false) {
+                        std::string left;
+                        std::string right;
+                        if (reader.peek() == '[') {
+                            if (!reader.next_element(true) || !reader.read_string(&left) ||
+                                !reader.next_element(false) || !reader.read_string(&right) ||
+                                reader.next_element(false)) {
+                                break;
+                            }
+                        } else {
+                            if (!reader.read_string(&value)) break;
+                            const size_t space = value.find(' ', 1);
+                            if (space == std::string::npos) continue;
+                            left = value.substr(0, space);
+                            right = value.substr(space + 1);
+                        }
+                        merges.emplace_back(std::move(left), std::move(right));
+                    }
+                } else {
+                    reader.skip_value();
+                }
+            }
+        } else {
+            reader.skip_value();
+        }
+        if (!reader.ok()) break;
+    }
+    if (!reader.ok()) {
+        LOGE("❌ Malformed tokenizer.json");
+        return nullptr;
+    }
+    if (!model_type.empty() && model_type != "BPE") {
+        LOGW("⚠️ Unsupported tokenizer model %s", model_type.c_str());
+        return nullptr;
+    }
+    if (vocab.empty()) {
+        LOGW("⚠️ tokenizer.json has no BPE vocabulary");
+        return nullptr;
+    }
+
+    std::unique_ptr<BpeTokenizer> tokenizer(new BpeTokenizer());
+    int64_t max_id = 0;
+    for (const auto& entry : vocab) max_id = std::max(max_id, entry.second);
+    for (const auto& token : added) max_id = std::max(max_id, token.id);
+    if (max_id >= (int64_t(1) << 24)) {
+        LOGW("⚠️ tokenizer.json vocabulary too large (%lld)", (long long)max_id);
+        return nullptr;
+    }
+    tokenizer->tokens_.resize(static_cast<size_t>(max_id) + 1);
+
+    const ByteAlphabet alphabet;
+    std::string bytes;
+    for (const auto& entry : vocab) {
+        if (entry.second < 0) continue;
+        if (!alphabet.decode(entry.first, &bytes)) {
+            LOGW("⚠️ tokenizer.json is not byte-level BPE (token %lld)", (long long)entry.second);
+            return nullptr;
+        }
+        tokenizer->tokens_[static_cast<size_t>(entry.second)] = bytes;
+    }
+    for (const auto& token : added) tokenizer->tokens_[static_cast<size_t>(token.id)] = token.content;
+
+    // tokens_ is final from here on, so views into it stay valid
+    tokenizer->ids_.reserve(vocab.size());
+    for (const auto& entry : vocab) {
+        if (entry.second < 0) continue;
+        const std::string& text = tokenizer->tokens_[static_cast<size_t>(entry.second)];
+        tokenizer->ids_.emplace(std::string_view(text), static_cast<int32_t>(entry.second));
+    }
+    for (const auto& token : added) {
+        const std::string& text = tokenizer->tokens_[static_cast<size_t>(token.id)];
+        tokenizer->special_.emplace(std::string_view(text), static_cast<int32_t>(token.id));
+        tokenizer->special_first_byte_[static_cast<unsigned char>(text[0])] = true;
+        if (std::find(tokenizer->special_lengths_.begin(), tokenizer->special_lengths_.end(), text.size()) ==
+            tokenizer->special_lengths_.end()) {
+            tokenizer->special_lengths_.push_back(text.size());
+        }
+    }
+    std::sort(tokenizer->special_lengths_.begin(), tokenizer->special_lengths_.end(), std::greater<size_t>());
+
+    for (int byte = 0; byte < 256; byte++) {
+        const char c = static_cast<char>(byte);
+        const int32_t id = tokenizer->token_id(std::string_view(&c, 1));
+        if (id < 0) {
+            LOGW("⚠️ tokenizer.json has no token for byte 0x%02x", byte);
+            return nullptr;
+        }
+        tokenizer->byte_tokens_[byte] = id;
+    }
+
+    size_t capacity = 16;
+    while (capacity < merges.size() * 2) capacity <<= 1;
+    tokenizer->merges_.assign(capacity, MergeSlot());
+    tokenizer->merge_mask_ = capacity - 1;
+    std::string left;
+    std::string right;
+    size_t skipped = 0;
+    for (size_t rank = 0; rank < merges.size(); rank++) {
+        if (!alphabet.decode(merges[rank].first, &left) || !alphabet.decode(merges[rank].second, &right)) {
+            skipped++;
+            continue;
+        }
+        const int32_t left_id = tokenizer->token_id(left);
+        const int32_t right_id = tokenizer->token_id(right);
+        const int32_t merged_id = tokenizer->token_id(left + right);
+        if (left_id < 0 || right_id < 0 || merged_id < 0) {
+            skipped++;
+            continue;
+        }
+        tokenizer->add_merge(left_id, right_id, merged_id, static_cast<int32_t>(rank));
+    }
+    if (skipped > 0) LOGW("⚠️ Skipped %zu merges with unknown tokens", skipped);
+    return tokenizer;
+}
+
+void BpeTokenizer::add_merge(int32_t left, int32_t right, int32_t merged, int32_t rank) {
+    const uint64_t key = make_pair_key(left, right);
+    for (size_t slot = pair_slot(key, merge_mask_);; slot = (slot + 1) & merge_mask_) {
+        MergeSlot& entry = merges_[slot];
+        if (entry.pair == key) return; // the first (lowest) rank wins
+        if (entry.pair == kEmptyPair) {
+            entry.pair = key;
+            entry.rank = rank;
+            entry.merged = merged;
+            merge_count_++;
+            return;
+        }
+    }
+}
+
+const BpeTokenizer::MergeSlot* BpeTokenizer::find_merge(int32_t left, int32_t right) const {
+    const uint64_t key = make_pair_key(left, right);
+    for (size_t slot = pair_slot(key, merge_mask_);; slot = (slot + 1) & merge_mask_) {
+        const MergeSlot& entry = merges_[slot];
+        if (entry.pair == key) return &entry;
+        if (entry.pair == kEmptyPair) return nullptr;
+    }
+}
+
+const std::string& BpeTokenizer::token_bytes(int32_t token) const {
+    static const std::string empty;
+    if (token < 0 || token >= vocab_size()) return empty;
+    return tokens_[static_cast<size_t>(token)];
+}
+
+int32_t BpeTokenizer::token_id(std::string_view bytes) const {
+    const auto it = ids_.find(bytes);
+    if (it != ids_.end()) return it->second;
+    const auto special = special_.find(bytes);
+    return special != special_.end() ? special->second : -1;
+}
+
+void BpeTokenizer::set_cache_capacity(size_t words) {
+    cache_capacity_ = words;
+    cache_.clear();
+    cache_words_.clear();
+    stats_.cached_words = 0;
+}
+
+std::vector<int32_t> BpeTokenizer::encode(std::string_view text) {
+    std::vector<int32_t> tokens;
+    encode(text, &tokens);
+    return tokens;
+}
+
+void BpeTokenizer::encode(std::string_view text, std::vector<int32_t>* tokens) {
+    tokens->reserve(tokens->size() + text.size() / 3 + 1);
+    if (special_.empty()) {
+        encode_text(text, tokens);
+        return;
+    }
+
+    // Added tokens are cut out first, longest match wins
+    size_t start = 0;
+    size_t offset = 0;
+    while (offset < text.size()) {
+        if (!special_first_byte_[static_cast<unsigned char>(text[offset])]) {
+            offset++;
+            continue;
+        }
+        int32_t id = -1;
+        size_t length = 0;
+        for (const size_t candidate : special_lengths_) {
+            if (offset + candidate > text.size()) continue;
+            const auto it = special_.find(text.substr(offset, candidate));
+            if (it != special_.end()) {
+                id = it->second;
+                length = candidate;
+                break;
+            }
+        }
+        if (id < 0) {
+            offset++;
+            continue;
+        }
+        encode_text(text.substr(start, offset - start), tokens);
+        tokens->push_back(id);
+        offset += length;
+        start = offset;
+    }
+    encode_text(text.substr(start), tokens);
+}
+
+void BpeTokenizer::split(std::string_view text, std::vector<std::string_view>* pieces) {
+    const CharReader reader(text);
+    for (size_t offset = 0; offset < text.size();) {
+        const size_t end = match_piece(reader, offset);
+        pieces->push_back(text.substr(offset, end - offset));
+        offset = end;
+    }
+}
+
+void BpeTokenizer::encode_text(std::string_view text, std::vector<int32_t>* tokens) {
+    if (text.empty()) return;
+    pieces_.clear();
+    split(text, &pieces_);
+    for (const std::string_view piece : pieces_) encode_piece(piece, tokens);
+}
+
+void BpeTokenizer::encode_piece(std::string_view piece, std::vector<int32_t>* tokens) {
+    stats_.pieces++;
+    const auto whole = ids_.find(piece);
+    if (whole != ids_.end()) {
+        stats_.whole_words++;
+        tokens->push_back(whole->second);
+        return;
+    }
+    if (cache_capacity_ > 0) {
+        const auto cached = cache_.find(piece);
+        if (cached != cache_.end()) {
+            stats_.cache_hits++;
+            tokens->insert(tokens->end(), cached->second.begin(), cached->second.end());
+            return;
+        }
+    }
+
+    stats_.merged++;
+    scratch_.clear();
+    for (const char c : piece) scratch_.push_back(byte_tokens_[static_cast<unsigned char>(c)]);
+    if (scratch_.size() <= kShortWordParts) merge_short(scratch_);
+    else merge_long(scratch_);
+    tokens->insert(tokens->end(), scratch_.begin(), scratch_.end());
+
+    if (cache_capacity_ > 0) {
+        if (cache_.size() >= cache_capacity_) {
+            cache_.clear();
+            cache_words_.clear();
+        }
+        cache_words_.emplace_back(piece);
+        cache_.emplace(std::string_view(cache_words_.back()), scratch_);
+        stats_.cached_words = cache_.size();
+    }
+}
+
+void BpeTokenizer::merge_short(std::vector<int32_t>& parts) const {
+    while (parts.size() > 1) {
+        int32_t best_rank = INT32_MAX;
+        size_t best = 0;
+        int32_t merged = -1;
+        for (size_t i = 0; i + 1 < parts.size(); i++) {
+            const MergeSlot* merge = find_merge(parts[i], parts[i + 1]);
+            if (merge != nullptr && merge->rank < best_rank) {
+                best_rank = merge->rank;
+                best = i;
+                merged = merge->merged;
+            }
+        }
+        if (merged < 0) return;
+        parts[best] = merged;
+        parts.erase(parts.begin() + static_cast<std::ptrdiff_t>(best) + 1);
+    }
+}
+
+void BpeTokenizer::merge_long(std::vector<int32_t>& parts) const {
+    // Doubly linked parts and a min-heap of candidate merges; entries made
+    // stale by an earlier merge are recognised by their token ids and dropped
+    struct Candidate {
+        int32_t rank;
+        int32_t left;
+        int32_t left_token;
+        int32_t right_token;
+        bool operator>(const Candidate& other) const {
+            return rank != other.rank ? rank > other.rank : left > other.left;
+        }
+    };
+    const int32_t count = static_cast<int32_t>(parts.size());
+    std::vector<int32_t> next(static_cast<size_t>(count));
+    std::vector<int32_t> prev(static_cast<size_t>(count));
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> heap;
+    auto push = [&](int32_t left) {
+        const int32_t right = next[static_cast<size_t>(left)];
+        if (right < 0) return;
+        const MergeSlot* merge = find_merge(parts[static_cast<size_t>(left)], parts[static_cast<size_t>(right)]);
+        if (merge != nullptr) {
+            heap.push({merge->rank, left, parts[static_cast<size_t>(left)], parts[static_cast<size_t>(right)]});
+        }
+    };
+    for (int32_t i = 0; i < count; i++) {
+        next[static_cast<size_t>(i)] = i + 1 < count ? i + 1 : -1;
+        prev[static_cast<size_t>(i)] = i - 1;
+    }
+    for (int32_t i = 0; i + 1 < count; i++) push(i);
+
+    while (!heap.empty()) {
+        const Candidate top = heap.top();
+        heap.pop();
+        const size_t left = static_cast<size_t>(top.left);
+        const int32_t right = next[left];
+        if (parts[left] != top.left_token || right < 0 || parts[static_cast<size_t>(right)] != top.right_token) {
+            continue;
+        }
+        parts[left] = find_merge(top.left_token, top.right_token)->merged;
+        parts[static_cast<size_t>(right)] = -1;
+        next[left] = next[static_cast<size_t>(right)];
+        if (next[left] >= 0) prev[static_cast<size_t>(next[left])] = top.left;
+        if (prev[left] >= 0) push(prev[left]);
+        push(top.left);
+    }
+
+    size_t out = 0;
+    for (int32_t i = 0; i >= 0; i = next[static_cast<size_t>(i)]) parts[out++] = parts[static_cast<size_t>(i)];
+    parts.resize(out);
+}
+
+// ---- IncrementalDetokenizer ----
+
+namespace {
+
+constexpr char kReplacement[] = "\xEF\xBF\xBD";
+
+} // namespace
+
+void IncrementalDetokenizer::push(std::string_view piece, std::string* out) {
+    size_t i = 0;
+    while (i < piece.size()) {
+        // Runs of ASCII with nothing pending are copied in one go
+        if (pending_size_ == 0) {
+            size_t ascii = i;
+            while (ascii < piece.size() && static_cast<unsigned char>(piece[ascii]) < 0x80) ascii++;
+            out->append(piece.data() + i, ascii - i);
+            i = ascii;
+            if (i == piece.size()) break;
+        }
+        push_byte(static_cast<unsigned char>(piece[i++]), out);
+    }
+}
+
+void IncrementalDetokenizer::push_byte(unsigned char byte, std::string* out) {
+    if (pending_size_ > 0) {
+        // The second byte is range-checked so overlong forms, surrogates and
+        // code points past U+10FFFF are rejected as early as possible
+        const auto lead = static_cast<unsigned char>(pending_[0]);
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+        if (pending_size_ == 1) {
+            if (lead == 0xE0) low = 0xA0;
+            else if (lead == 0xED) high = 0x9F;
+            else if (lead == 0xF0) low = 0x90;
+            else if (lead == 0xF4) high = 0x8F;
+        }
+        if (byte >= low && byte <= high) {
+            pending_[pending_size_++] = static_cast<char>(byte);
+            if (pending_size_ == pending_needed_) {
+                out->append(pending_, pending_size_);
+                pending_size_ = 0;
+            }
+            return;
+        }
+        // One U+FFFD for the broken prefix, then the byte starts over
+        out->append(kReplacement);
+        pending_size_ = 0;
+    }
+
+    if (byte < 0x80) {
+        out->push_back(static_cast<char>(byte));
+    } else if (byte >= 0xC2 && byte <= 0xF4) {
+        pending_[0] = static_cast<char>(byte);
+        pending_size_ = 1;
+        pending_needed_ = byte < 0xE0 ? 2 : byte < 0xF0 ? 3 : 4;
+    } else {
+        out->append(kReplacement);
+    }
+}
+
+void IncrementalDetokenizer::finish(std::string* out) {
+    if (pending_size_ > 0) {
+        out->append(kReplacement);
+        pending_size_ = 0;
+    }
+}
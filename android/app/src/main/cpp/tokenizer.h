@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Native byte-level BPE tokenizer for the Llama-3 vocabulary, loaded from
+// the model's HuggingFace tokenizer.json, so prompts are tokenized without
+// a round trip through the model library for every request.
+//
+// Encoding splits the text on special tokens ("<|eot_id|>", ...), then into
+// pieces with the Llama-3 pre-tokenization pattern (contractions, letter
+// runs, up to three digits, punctuation runs, whitespace), implemented by
+// hand with an ASCII fast path instead of a regex engine. Each piece is
+// then, in order:
+//   - looked up whole in the vocabulary (most pieces are one token),
+//   - looked up in the per-word cache of earlier BPE results,
+//   - merged with the BPE merge table, an open-addressing hash keyed by
+//     the pair of token ids, lowest rank first and leftmost on ties.
+//
+// Letter, digit and space classes of non-ASCII text come from a compact
+// table of the punctuation, symbol, combining mark, digit and space
+// blocks common in chat text; any other code point counts as a letter.
+//
+// Not thread-safe (the word cache is updated on encode): owned by a chat
+// module, which callers serialize.
+class BpeTokenizer {
+public:
+    struct Stats {
+        uint64_t pieces = 0;      // pre-tokenized pieces encoded
+        uint64_t whole_words = 0; // of which a single vocabulary token
+        uint64_t cache_hits = 0;  // of which served from the word cache
+        uint64_t merged = 0;      // of which run through BPE
+        size_t cached_words = 0;
+    };
+
+    static constexpr size_t kDefaultCacheWords = 16384;
+
+    // Parses tokenizer.json ("model": {"vocab", "merges"}, "added_tokens");
+    // nullptr (logged) if it is not a byte-level BPE tokenizer.
+    static std::unique_ptr<BpeTokenizer> load(const std::string& path);
+    static std::unique_ptr<BpeTokenizer> parse(const char* json, size_t size);
+
+    int32_t vocab_size() const { return static_cast<int32_t>(tokens_.size()); }
+
+    // Appends the tokens of `text` to `tokens`.
+    void encode(std::string_view text, std::vector<int32_t>* tokens);
+    std::vector<int32_t> encode(std::string_view text);
+
+    // Raw bytes of a token; a piece of a multi-byte character for some.
+    const std::string& token_bytes(int32_t token) const;
+
+    // The token whose bytes are exactly `bytes`, or -1
+    int32_t token_id(std::string_view bytes) const;
+
+    // Pre-tokenization only, for tests: the pieces of a text without
+    // special tokens.
+    static void split(std::string_view text, std::vector<std::string_view>* pieces);
+
+    // Words kept in the BPE cache before it is cleared; 0 disables it.
+    void set_cache_capacity(size_t words);
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct MergeSlot {
+        uint64_t pair = kEmptyPair;
+        int32_t rank = 0;
+        int32_t merged = -1;
+    };
+
+    static constexpr uint64_t kEmptyPair = ~uint64_t(0);
+
+    BpeTokenizer() = default;
+
+    void add_merge(int32_t left, int32_t right, int32_t merged, int32_t rank);
+    const MergeSlot* find_merge(int32_t left, int32_t right) const;
+    void encode_text(std::string_view text, std::vector<int32_t>* tokens);
+    void encode_piece(std::string_view piece, std::vector<int32_t>* tokens);
+    void merge_short(std::vector<int32_t>& parts) const;
+    void merge_long(std::vector<int32_t>& parts) const;
+
+    std::vector<std::string> tokens_;                       // id -> bytes
+    std::unordered_map<std::string_view, int32_t> ids_;     // bytes -> id, views into tokens_
+    std::unordered_map<std::string_view, int32_t> special_; // added tokens matched before splitting
+    std::vector<size_t> special_lengths_;                   // distinct lengths, longest first
+    bool special_first_byte_[256] = {};
+    int32_t byte_tokens_[256];
+    std::vector<MergeSlot> merges_; // power-of-two open addressing
+    size_t merge_mask_ = 0;
+    size_t merge_count_ = 0;
+
+    // Word cache; keys view into cache_words_
+    std::unordered_map<std::string_view, std::vector<int32_t>> cache_;
+    std::deque<std::string> cache_words_;
+    size_t cache_capacity_ = kDefaultCacheWords;
+
+    std::vector<int32_t> scratch_;
+    std::vector<std::string_view> pieces_;
+    Stats stats_;
+};
+
+// Turns a stream of token byte pieces into text that only ever contains
+// complete UTF-8 characters. Each push() appends just the characters the
+// new piece completes, keeping at most three bytes of an unfinished
+// character, so streaming costs O(piece) per token instead of re-decoding
+// the whole reply. Malformed bytes become U+FFFD, as in HuggingFace decode.
+class IncrementalDetokenizer {
+public:
+    void push(std::string_view piece, std::string* out);
+
+    // Emits what is left of an unfinished character as U+FFFD.
+    void finish(std::string* out);
+
+    bool has_pending() const { return pending_size_ > 0; }
+
+private:
+    void push_byte(unsigned char byte, std::string* out);
+
+    char pending_[4] = {};
+    size_t pending_size_ = 0;
+    size_t pending_needed_ = 0; // length of the character being completed
+};
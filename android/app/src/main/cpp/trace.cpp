@@ -0,0 +1,206 @@
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+const char* trace_span_name(TraceSpan span) {
+    switch (span) {
+        case TraceSpan::kTokenize: return "tokenize";
+        case TraceSpan::kPrefillChunk: return "prefill_chunk";
+        case TraceSpan::kDecodeStep: return "decode_step";
+        case TraceSpan::kSample: return "sample";
+        case TraceSpan::kDetokenize: return "detokenize";
+        case TraceSpan::kJniReturn: return "jni_return";
+        case TraceSpan::kVerify: return "verify";
+        case TraceSpan::kSnapshotSave: return "snapshot_save";
+        case TraceSpan::kSnapshotRestore: return "snapshot_restore";
+        case TraceSpan::kGrammarMask: return "grammar_mask";
+        default: return "unknown";
+    }
+}
+
+static void write_trace_header(std::FILE* out) {
+    std::fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    std::fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"mlc_llm\"}}",
+                 static_cast<int>(getpid()));
+}
+
+#if MLC_TRACING
+
+static std::atomic<bool> g_tracing_enabled{false};
+
+// seq is 2 * index + 2 once span `index` is complete and odd while it is
+// being written; the exporter drops the slot if seq moved under it.
+struct TraceSlot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<int64_t> start_ns{0};
+    std::atomic<int64_t> duration_ns{0};
+    std::atomic<int64_t> request{-1};
+    std::atomic<uint64_t> packed{0}; // span (8 bits) | count (24 bits) | tid (32 bits)
+};
+
+struct TraceRing {
+    std::unique_ptr<TraceSlot[]> slots{new TraceSlot[kTraceRingEvents]};
+    std::atomic<uint64_t> head{0}; // written by the owning thread only
+
+    // Registry mutex
+    uint64_t exported = 0;
+    bool in_use = false;
+};
+
+// Rings outlive their threads (spans stay exportable) and are reused by
+// later threads, so the count is bounded by peak concurrency.
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::vector<std::pair<uint32_t, std::string>> thread_names;
+};
+
+// Never destroyed: detached threads may still record during exit
+static TraceRegistry& registry() {
+    static TraceRegistry* instance = new TraceRegistry();
+    return *instance;
+}
+
+struct ThreadRing {
+    TraceRing* ring = nullptr;
+    uint32_t tid = 0;
+
+    ~ThreadRing() {
+        if (ring == nullptr) return;
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        ring->in_use = false;
+    }
+};
+
+static thread_local ThreadRing t_ring;
+
+static ThreadRing& thread_ring() {
+    if (t_ring.ring == nullptr) {
+        TraceRegistry& traces = registry();
+        std::lock_guard<std::mutex> lock(traces.mutex);
+        for (auto& ring : traces.rings) {
+            if (!ring->in_use) {
+                t_ring.ring = ring.get();
+                break;
+            }
+        }
+        if (t_ring.ring == nullptr) {
+            traces.rings.emplace_back(new TraceRing());
+            t_ring.ring = traces.rings.back().get();
+        }
+        t_ring.ring->in_use = true;
+        t_ring.tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    }
+    return t_ring;
+}
+
+bool tracing_enabled() {
+    return g_tracing_enabled.load(std::memory_order_relaxed);
+}
+
+void set_tracing_enabled(bool enabled) {
+    g_tracing_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+// CLOCK_MONOTONIC, the clock Perfetto uses for atrace, so the two line up
+int64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_record(TraceSpan span, int64_t start_ns, int64_t end_ns, int64_t request, int64_t count) {
+    ThreadRing& local = thread_ring();
+    TraceRing& ring = *local.ring;
+    const uint64_t index = ring.head.load(std::memory_order_relaxed);
+    TraceSlot& slot = ring.slots[index % kTraceRingEvents];
+
+    const uint64_t clamped = static_cast<uint64_t>(std::min<int64_t>(std::max<int64_t>(count, 0), 0xFFFFFF));
+    slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.duration_ns.store(end_ns - start_ns, std::memory_order_relaxed);
+    slot.request.store(request, std::memory_order_relaxed);
+    slot.packed.store(static_cast<uint64_t>(span) << 56 | clamped << 32 | local.tid, std::memory_order_relaxed);
+    slot.seq.store(2 * index + 2, std::memory_order_release);
+    ring.head.store(index + 1, std::memory_order_release);
+}
+
+// Does not claim a ring, so naming a thread costs nothing while tracing is off
+void trace_set_thread_name(const std::string& name) {
+    const uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    TraceRegistry& traces = registry();
+    std::lock_guard<std::mutex> lock(traces.mutex);
+    for (auto& entry : traces.thread_names) {
+        if (entry.first == tid) {
+            entry.second = name;
+            return;
+        }
+    }
+    traces.thread_names.emplace_back(tid, name);
+}
+
+int64_t trace_write_chrome_json(std::FILE* out) {
+    TraceRegistry& traces = registry();
+    std::lock_guard<std::mutex> lock(traces.mutex);
+    const int pid = static_cast<int>(getpid());
+
+    write_trace_header(out);
+    for (const auto& entry : traces.thread_names) {
+        // Names are ours (model ids), but keep the JSON valid regardless
+        std::string name = entry.second;
+        std::replace(name.begin(), name.end(), '"', '\'');
+        std::replace(name.begin(), name.end(), '\\', '/');
+        std::fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                     pid, entry.first, name.c_str());
+    }
+
+    int64_t written = 0;
+    for (auto& ring : traces.rings) {
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        const uint64_t oldest = head > kTraceRingEvents ? head - kTraceRingEvents : 0;
+        for (uint64_t index = std::max(oldest, ring->exported); index < head; index++) {
+            TraceSlot& slot = ring->slots[index % kTraceRingEvents];
+            const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            const int64_t start_ns = slot.start_ns.load(std::memory_order_relaxed);
+            const int64_t duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+            const int64_t request = slot.request.load(std::memory_order_relaxed);
+            const uint64_t packed = slot.packed.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq != 2 * index + 2 || slot.seq.load(std::memory_order_relaxed) != seq) {
+                continue; // overwritten while we were reading
+            }
+
+            const TraceSpan span = static_cast<TraceSpan>(packed >> 56);
+            std::fprintf(out,
+                         ",\n{\"name\":\"%s\",\"cat\":\"mlc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+                         "\"tid\":%u,\"args\":{\"count\":%u",
+                         trace_span_name(span), start_ns / 1000.0, duration_ns / 1000.0, pid,
+                         static_cast<uint32_t>(packed), static_cast<uint32_t>(packed >> 32) & 0xFFFFFF);
+            if (request >= 0) std::fprintf(out, ",\"request\":%lld", static_cast<long long>(request));
+            std::fprintf(out, "}}");
+            written++;
+        }
+        ring->exported = head;
+    }
+    std::fprintf(out, "\n]}\n");
+    return std::ferror(out) ? -1 : written;
+}
+
+#else
+
+int64_t trace_write_chrome_json(std::FILE* out) {
+    write_trace_header(out);
+    std::fprintf(out, "\n]}\n");
+    return std::ferror(out) ? -1 : 0;
+}
+
+#endif
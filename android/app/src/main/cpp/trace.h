@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Hot-path tracing, exported as a Chrome / Perfetto JSON trace.
+//
+// Every thread records completed spans into its own fixed-size ring, so a
+// span costs two clock reads and a handful of relaxed stores: no lock, no
+// allocation, no formatting. The exporter reads all rings concurrently with
+// the writers (each slot is a tiny seqlock) and skips slots being overwritten.
+// Rings keep the most recent kTraceRingEvents spans per thread.
+//
+// Recording is off until set_tracing_enabled(true); while off, a span is a
+// single relaxed load. Building with MLC_TRACING=0 removes it entirely.
+#ifndef MLC_TRACING
+#define MLC_TRACING 1
+#endif
+
+enum class TraceSpan : uint8_t {
+    kTokenize = 0,
+    kPrefillChunk,
+    kDecodeStep,
+    kSample,
+    kDetokenize,
+    kJniReturn,
+    kVerify,
+    kSnapshotSave,
+    kSnapshotRestore,
+    kGrammarMask,
+    kCount,
+};
+
+const char* trace_span_name(TraceSpan span);
+
+constexpr size_t kTraceRingEvents = 8192;
+
+#if MLC_TRACING
+
+bool tracing_enabled();
+void set_tracing_enabled(bool enabled);
+
+// Monotonic clock shared by all spans
+int64_t trace_now_ns();
+
+// `request` ties spans to one generation (-1 for none); `count` is the
+// span's size in tokens, batch rows or bytes.
+void trace_record(TraceSpan span, int64_t start_ns, int64_t end_ns, int64_t request, int64_t count);
+
+// Names the calling thread in exported traces.
+void trace_set_thread_name(const std::string& name);
+
+// Writes every span still in the rings as a Chrome JSON trace and forgets
+// them. Returns the number of spans written, or -1 on a write error.
+int64_t trace_write_chrome_json(std::FILE* out);
+
+// Records the enclosing scope as one span if tracing was on when it began.
+class TraceScope {
+public:
+    explicit TraceScope(TraceSpan span, int64_t request = -1, int64_t count = 0)
+        : span_(span), request_(request), count_(count), start_ns_(tracing_enabled() ? trace_now_ns() : -1) {}
+    ~TraceScope() {
+        if (start_ns_ >= 0) trace_record(span_, start_ns_, trace_now_ns(), request_, count_);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    void set_count(int64_t count) { count_ = count; }
+
+private:
+    TraceSpan span_;
+    int64_t request_;
+    int64_t count_;
+    int64_t start_ns_;
+};
+
+#else
+
+inline bool tracing_enabled() { return false; }
+inline void set_tracing_enabled(bool) {}
+inline int64_t trace_now_ns() { return 0; }
+inline void trace_record(TraceSpan, int64_t, int64_t, int64_t, int64_t) {}
+inline void trace_set_thread_name(const std::string&) {}
+int64_t trace_write_chrome_json(std::FILE* out);
+
+class TraceScope {
+public:
+    explicit TraceScope(TraceSpan, int64_t = -1, int64_t = 0) {}
+    void set_count(int64_t) {}
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include "weight_loader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/registry.h>
+#include <tvm/runtime/relax_vm/ndarray_cache_support.h>
+
+#include "mapped_file.h"
+#include "mlc_log.h"
+#include "model_load.h"
+
+using tvm::runtime::relax_vm::NDArrayCacheMetadata;
+
+namespace {
+
+// TVM's NDArray::FromDLPack rejects data below this alignment
+constexpr size_t kTensorAlignment = 64;
+
+// Pages touched between progress reports and cancellation checks
+constexpr size_t kPrefaultChunkBytes = 16u << 20;
+
+// Keeps the shard mapped for as long as an aliasing NDArray is alive
+struct MappedTensor {
+    std::shared_ptr<MappedFile> file;
+    std::vector<int64_t> shape;
+    DLManagedTensor managed;
+};
+
+void delete_mapped_tensor(DLManagedTensor* managed) {
+    delete static_cast<MappedTensor*>(managed->manager_ctx);
+}
+
+tvm::runtime::NDArray alias_mapping(const std::shared_ptr<MappedFile>& file,
+                                    const NDArrayCacheMetadata::FileRecord::ParamRecord& record, DLDevice device) {
+    auto* holder = new MappedTensor();
+    holder->file = file;
+    holder->shape.assign(record.shape.begin(), record.shape.end());
+
+    DLTensor& tensor = holder->managed.dl_tensor;
+    tensor.data = const_cast<uint8_t*>(file->data() + record.byte_offset);
+    tensor.device = device;
+    tensor.ndim = static_cast<int32_t>(holder->shape.size());
+    tensor.dtype = record.dtype;
+    tensor.shape = holder->shape.data();
+    tensor.strides = nullptr;
+    tensor.byte_offset = 0;
+    holder->managed.manager_ctx = holder;
+    holder->managed.deleter = delete_mapped_tensor;
+    return tvm::runtime::NDArray::FromDLPack(&holder->managed);
+}
+
+} // namespace
+
+int load_model_weights(const std::string& model_dir, DLDevice device, WeightLoadStats* stats, ModelLoadTask* task) {
+    struct stat info;
+    if (stat((model_dir + "/ndarray-cache.json").c_str(), &info) != 0) {
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    *stats = WeightLoadStats();
+
+    try {
+        const tvm::runtime::PackedFunc* cache_update = tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.update");
+        if (cache_update == nullptr) {
+            LOGE("❌ TVM runtime has no vm.builtin.ndarray_cache.update");
+            task->set_error("TVM runtime has no ndarray cache");
+            return -1;
+        }
+
+        NDArrayCacheMetadata metadata = NDArrayCacheMetadata::Load(model_dir);
+        const bool on_cpu = device.device_type == kDLCPU;
+
+        std::vector<std::shared_ptr<MappedFile>> files;
+        size_t total_bytes = 0;
+        for (const auto& shard : metadata.records) {
+            auto file = std::make_shared<MappedFile>();
+            if (!file->open(model_dir + "/" + shard.data_path)) {
+                task->set_error("Cannot map weight shard " + shard.data_path);
+                return -1;
+            }
+            if (file->size() < static_cast<size_t>(shard.nbytes)) {
+                LOGE("❌ Weight shard %s is truncated (%zu of %lld bytes)", shard.data_path.c_str(), file->size(),
+                     (long long)shard.nbytes);
+                task->set_error("Weight shard " + shard.data_path + " is truncated");
+                return -1;
+            }
+            file->advise(MappedFile::Access::kSequential);
+            file->advise(MappedFile::Access::kWillNeed);
+            total_bytes += static_cast<size_t>(shard.nbytes);
+            files.push_back(std::move(file));
+            task->set_fraction(static_cast<double>(files.size()) / metadata.records.size());
+            if (task->cancelled()) return -1;
+        }
+
+        task->begin_stage(LoadStage::kUpload);
+        for (size_t i = 0; i < metadata.records.size(); i++) {
+            const auto& shard = metadata.records[i];
+            const std::shared_ptr<MappedFile>& file = files[i];
+
+            // Records that need a dtype conversion go through TVM's own loader,
+            // which wants the raw shard as a string; build it only if needed
+            std::unique_ptr<std::string> raw_shard;
+            tvm::runtime::Optional<tvm::runtime::NDArray> staging;
+
+            for (const auto& record : shard.records) {
+                if (task->cancelled()) return -1;
+                const uint8_t* bytes = file->data() + record.byte_offset;
+                tvm::runtime::NDArray array;
+
+                if (record.format != "raw") {
+                    if (!raw_shard) {
+                        raw_shard.reset(new std::string(reinterpret_cast<const char*>(file->data()), file->size()));
+                    }
+                    array = record.Load(device, raw_shard.get(), &staging);
+                } else if (on_cpu && reinterpret_cast<uintptr_t>(bytes) % kTensorAlignment == 0) {
+                    array = alias_mapping(file, record, device);
+                    stats->zero_copy_bytes += static_cast<size_t>(record.nbytes);
+                } else {
+                    array = tvm::runtime::NDArray::Empty(record.shape, record.dtype, device);
+                    array.CopyFromBytes(bytes, static_cast<size_t>(record.nbytes));
+                    file->release(static_cast<size_t>(record.byte_offset), static_cast<size_t>(record.nbytes));
+                }
+
+                (*cache_update)(record.name, array, true);
+                stats->tensors++;
+                stats->bytes += static_cast<size_t>(record.nbytes);
+                // The module library and chat module setup take the rest of the stage
+                task->set_fraction(0.9 * stats->bytes / std::max<size_t>(total_bytes, 1));
+            }
+            stats->shards++;
+        }
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception loading weights from %s: %s", model_dir.c_str(), e.what());
+        task->set_error(e.what());
+        return -1;
+    }
+
+    stats->micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return 0;
+}
+
+bool verify_model_files(const std::string& model_dir, ModelLoadTask* task) {
+    struct stat info;
+    if (stat(model_dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+        task->set_error("Model directory " + model_dir + " does not exist");
+        return false;
+    }
+    if (stat((model_dir + "/mlc-chat-config.json").c_str(), &info) != 0) {
+        task->set_error("mlc-chat-config.json is missing");
+        return false;
+    }
+    if (stat((model_dir + "/ndarray-cache.json").c_str(), &info) != 0) {
+        return true; // the model library carries its own weights
+    }
+
+    try {
+        NDArrayCacheMetadata metadata = NDArrayCacheMetadata::Load(model_dir);
+        for (size_t i = 0; i < metadata.records.size(); i++) {
+            const auto& shard = metadata.records[i];
+            if (stat((model_dir + "/" + shard.data_path).c_str(), &info) != 0 ||
+                info.st_size < static_cast<off_t>(shard.nbytes)) {
+                LOGE("❌ Weight shard %s is missing or truncated", shard.data_path.c_str());
+                task->set_error("Weight shard " + shard.data_path + " is missing or truncated");
+                return false;
+            }
+            task->set_fraction(static_cast<double>(i + 1) / metadata.records.size());
+        }
+    } catch (const std::exception& e) {
+        LOGE("❌ Cannot read ndarray-cache.json of %s: %s", model_dir.c_str(), e.what());
+        task->set_error(std::string("Cannot read ndarray-cache.json: ") + e.what());
+        return false;
+    }
+    return true;
+}
+
+void release_weight_cache() {
+    const tvm::runtime::PackedFunc* cache_clear = tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.clear");
+    if (cache_clear != nullptr) {
+        (*cache_clear)();
+    }
+}
+
+const void* MappedWeights::find(const std::string& name, size_t size) const {
+    auto it = tensors.find(name);
+    if (it == tensors.end() || it->second.second != size) {
+        return nullptr;
+    }
+    return it->second.first;
+}
+
+std::shared_ptr<MappedWeights> map_model_weights(const std::string& model_dir, ModelLoadTask* task) {
+    struct stat info;
+    if (stat((model_dir + "/ndarray-cache.json").c_str(), &info) != 0) {
+        LOGW("⚠️ %s has no ndarray-cache.json", model_dir.c_str());
+        return nullptr;
+    }
+
+    try {
+        NDArrayCacheMetadata metadata = NDArrayCacheMetadata::Load(model_dir);
+        auto weights = std::make_shared<MappedWeights>();
+        for (const auto& shard : metadata.records) {
+            if (task->cancelled()) return nullptr;
+            auto file = std::make_shared<MappedFile>();
+            if (!file->open(model_dir + "/" + shard.data_path)) {
+                return nullptr;
+            }
+            if (file->size() < static_cast<size_t>(shard.nbytes)) {
+                LOGE("❌ Weight shard %s is truncated (%zu of %lld bytes)", shard.data_path.c_str(), file->size(),
+                     (long long)shard.nbytes);
+                return nullptr;
+            }
+            // Every token reads every weight, so fault the shard in now
+            file->advise(MappedFile::Access::kWillNeed);
+            for (const auto& record : shard.records) {
+                if (record.format != "raw") {
+                    continue;
+                }
+                weights->tensors[record.name] = {file->data() + record.byte_offset, static_cast<size_t>(record.nbytes)};
+                weights->bytes += static_cast<size_t>(record.nbytes);
+            }
+            weights->shards.push_back(std::move(file));
+            task->set_fraction(static_cast<double>(weights->shards.size()) / metadata.records.size());
+        }
+        return weights;
+    } catch (const std::exception& e) {
+        LOGE("❌ Exception mapping weights from %s: %s", model_dir.c_str(), e.what());
+        return nullptr;
+    }
+}
+
+bool prefault_model_weights(const MappedWeights& weights, ModelLoadTask* task) {
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t total = 0;
+    for (const auto& file : weights.shards) total += file->size();
+
+    size_t done = 0;
+    for (const auto& file : weights.shards) {
+        const volatile uint8_t* data = file->data();
+        for (size_t offset = 0; offset < file->size(); offset += kPrefaultChunkBytes) {
+            if (task->cancelled()) return false;
+            const size_t end = std::min(file->size(), offset + kPrefaultChunkBytes);
+            uint8_t sink = 0;
+            for (size_t at = offset; at < end; at += page) sink ^= data[at];
+            (void)sink;
+            done += end - offset;
+            task->set_fraction(static_cast<double>(done) / std::max<size_t>(total, 1));
+        }
+    }
+    return true;
+}
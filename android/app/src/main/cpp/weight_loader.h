@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <dlpack/dlpack.h>
+
+class MappedFile;
+class ModelLoadTask;
+
+struct WeightLoadStats {
+    size_t shards = 0;
+    size_t tensors = 0;
+    size_t bytes = 0;
+    size_t zero_copy_bytes = 0; // CPU tensors served straight from the mapping
+    int64_t micros = 0;
+};
+
+// Loads the parameter shards listed in <model_dir>/ndarray-cache.json into
+// the TVM runtime's ndarray cache, where the chat module picks them up
+// instead of reading the shards itself.
+//
+// Shards are mmapped read-only and each tensor is uploaded straight from the
+// mapped pages, which are dropped from the RSS once the upload is done; no
+// shard is ever copied into a heap buffer first. On the CPU device, aligned
+// tensors alias the mapping and are not copied at all.
+//
+// Every shard is mapped first (LoadStage::kMapWeights), then the tensors are
+// uploaded (kUpload); progress goes to `task`, which is checked between
+// tensors. Returns 0 on success, 1 if the model ships no ndarray-cache.json
+// (the chat module then loads its own weights) and -1 on failure or cancel.
+int load_model_weights(const std::string& model_dir, DLDevice device, WeightLoadStats* stats, ModelLoadTask* task);
+
+// LoadStage::kVerify: mlc-chat-config.json is present and every shard in
+// ndarray-cache.json exists at its full size, so a half-extracted model
+// fails in milliseconds rather than halfway through an upload. False (with
+// the reason set on `task`) otherwise.
+bool verify_model_files(const std::string& model_dir, ModelLoadTask* task);
+
+// Drops the runtime cache's references once the chat module owns the weights.
+void release_weight_cache();
+
+// A model's parameter shards mapped read-only for the CPU backend, which
+// computes straight from the mapped bytes. Only "raw" records are listed.
+struct MappedWeights {
+    std::vector<std::shared_ptr<MappedFile>> shards;
+    std::unordered_map<std::string, std::pair<const uint8_t*, size_t>> tensors;
+    size_t bytes = 0;
+
+    // nullptr unless the tensor exists and is exactly `bytes` long
+    const void* find(const std::string& name, size_t bytes) const;
+};
+
+// nullptr (logged) if there is no ndarray-cache.json, a shard cannot be
+// mapped or `task` is cancelled.
+std::shared_ptr<MappedWeights> map_model_weights(const std::string& model_dir, ModelLoadTask* task);
+
+// Reads one byte of every page, so the first decode does not stall on page
+// faults. Reports the fraction on `task`; false once it is cancelled.
+bool prefault_model_weights(const MappedWeights& weights, ModelLoadTask* task);
@@ -3,15 +3,22 @@ package com.example.offline_ai_companion;
 import android.content.Context;
 import android.os.Handler;
 import android.os.Looper;
+import android.os.SystemClock;
 import android.util.Log;
 import io.flutter.plugin.common.EventChannel;
 import io.flutter.plugin.common.MethodCall;
 import io.flutter.plugin.common.MethodChannel;
+import java.io.BufferedInputStream;
 import java.io.File;
 import java.io.FileInputStream;
+import java.io.FileNotFoundException;
 import java.io.FileOutputStream;
 import java.io.IOException;
+import java.io.InputStream;
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
 import java.util.HashMap;
+import java.util.List;
 import java.util.Map;
 import java.util.concurrent.ExecutorService;
 import java.util.concurrent.Executors;
@@ -27,6 +34,33 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
     private static final String CHANNEL_NAME = "mlc_llm_channel";
     private static final String STREAM_CHANNEL_NAME = "mlc_llm_stream";
     
+    // Streaming drain tuning: tokens per poll and how long a poll may wait
+    private static final int STREAM_POLL_BATCH = 32;
+    private static final int STREAM_POLL_TIMEOUT_MS = 20;
+    
+    // Model load progress: a poll returns early on every published change
+    private static final int LOAD_POLL_TIMEOUT_MS = 250;
+    
+    // Direct buffers the native layer writes binary results into (see NativeProtocol)
+    private static final int STATS_BUFFER_BYTES = 256;
+    private static final int POOL_STATS_BUFFER_BYTES = 4096; // 48 bytes per worker
+    private static final int STREAM_BUFFER_BYTES = 64 * 1024;
+    private static final int LOAD_BUFFER_BYTES = 128;
+    
+    // Native request priority when the caller passes none
+    // (0 background, 1 normal, 2 interactive; see RequestPriority in inference_engine.h)
+    private static final int PRIORITY_INTERACTIVE = 2;
+    
+    // Native grammar kinds (see Grammar::Kind in grammar.h)
+    private static final int GRAMMAR_NONE = 0;
+    private static final int GRAMMAR_JSON_SCHEMA = 1;
+    private static final int GRAMMAR_EBNF = 2;
+    
+    // Model extraction: bounded copy buffer, and the marker written once every
+    // entry is in place (a partial extraction is redone on the next load)
+    private static final int EXTRACT_BUFFER_BYTES = 256 * 1024;
+    private static final String EXTRACTED_MARKER = ".extracted";
+    
     // Native library loading
     static {
         try {
@@ -39,6 +73,7 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
     
     private Context context;
     private ExecutorService executorService;
+    private ExecutorService streamExecutorService;
     private Handler mainHandler;
     private EventChannel.EventSink eventSink;
     
@@ -47,9 +82,35 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
     private String currentModelId = null;
     private Map<String, Object> deviceCapabilities;
     
+    // Native handle of the in-flight streaming generation (0 when idle).
+    // Guarded by streamHandleLock: a handle is only cancelled while it is
+    // still active, and its drainer clears it under the lock before
+    // releasing the native stream.
+    private final Object streamHandleLock = new Object();
+    private long activeStreamHandle = 0;
+    
+    // Tags every event of one stream, since a cancelled stream keeps draining
+    // into the shared event channel after its successor has started. Unlike
+    // native handles, ids are never reused.
+    private long nextStreamId = 1;
+    
+    // Native handle of the newest background model load (0 when idle),
+    // guarded by loadHandleLock like the stream handle
+    private final Object loadHandleLock = new Object();
+    private long activeLoadHandle = 0;
+    
+    // Reused for every poll. The stream buffer and scratch are only touched by
+    // the single stream executor thread; the stats buffers are locked on use.
+    private final ByteBuffer statsBuffer = NativeProtocol.allocate(STATS_BUFFER_BYTES);
+    private final ByteBuffer poolStatsBuffer = NativeProtocol.allocate(POOL_STATS_BUFFER_BYTES);
+    private final ByteBuffer streamBuffer = NativeProtocol.allocate(STREAM_BUFFER_BYTES);
+    private final byte[] streamScratch = new byte[256];
+    
     public MLCWrapper(Context context) {
         this.context = context;
-        this.executorService = Executors.newSingleThreadExecutor();
+        // Native engines serialize per model, so calls may run concurrently here
+        this.executorService = Executors.newCachedThreadPool();
+        this.streamExecutorService = Executors.newSingleThreadExecutor();
         this.mainHandler = new Handler(Looper.getMainLooper());
         this.deviceCapabilities = new HashMap<>();
     }
@@ -84,18 +145,42 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
             case "loadTVMModel":
                 handleLoadTVMModel(call, result);
                 break;
+            case "startModelLoad":
+                handleStartModelLoad(call, result);
+                break;
+            case "cancelModelLoad":
+                handleCancelModelLoad(result);
+                break;
+            case "preloadModel":
+                handlePreloadModel(call, result);
+                break;
             case "generateResponse":
                 handleGenerateResponse(call, result);
                 break;
             case "startStreamingResponse":
                 handleStartStreamingResponse(call, result);
                 break;
+            case "cancelStreamingResponse":
+                handleCancelStreamingResponse(result);
+                break;
             case "unloadModel":
                 handleUnloadModel(call, result);
                 break;
             case "getMemoryStats":
                 handleGetMemoryStats(result);
                 break;
+            case "getThreadPoolStats":
+                handleGetThreadPoolStats(result);
+                break;
+            case "setTracing":
+                handleSetTracing(call, result);
+                break;
+            case "dumpTrace":
+                handleDumpTrace(result);
+                break;
+            case "deleteSessionSnapshot":
+                handleDeleteSessionSnapshot(call, result);
+                break;
             case "dispose":
                 handleDispose(result);
                 break;
@@ -203,12 +288,16 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
     private void handleLoadTVMModel(MethodCall call, MethodChannel.Result result) {
         String modelId = call.argument("modelId");
         Boolean useGPU = call.argument("useGPU");
-        Integer maxVramBytes = call.argument("maxVramBytes");
+        // Dart ints arrive as Integer or Long depending on magnitude
+        Number maxVramBytes = call.argument("maxVramBytes");
+        Number gpuMemoryFraction = call.argument("gpuMemoryFraction");
         
         Log.i(TAG, "🧠 Loading TVM model: " + modelId + ", GPU: " + useGPU);
         
         try {
-            boolean success = loadTVMModelNative(modelId, useGPU != null ? useGPU : false, maxVramBytes != null ? maxVramBytes : 0);
+            boolean success = loadTVMModelNative(modelId, useGPU != null ? useGPU : false,
+                    maxVramBytes != null ? maxVramBytes.longValue() : 0L,
+                    gpuMemoryFraction != null ? gpuMemoryFraction.floatValue() : 1.0f);
             
             if (success) {
                 currentModelId = modelId;
@@ -231,6 +320,129 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
         }
     }
     
+    // Returns once the load is queued; progress, then loadDone, loadError or
+    // loadCancelled, arrive on the event channel. The current model keeps
+    // serving until the new one is ready.
+    private void handleStartModelLoad(MethodCall call, MethodChannel.Result result) {
+        String modelId = call.argument("modelId");
+        Boolean useGPU = call.argument("useGPU");
+        Number maxVramBytes = call.argument("maxVramBytes");
+        Number gpuMemoryFraction = call.argument("gpuMemoryFraction");
+        
+        Log.i(TAG, "🧠 Starting background load of TVM model: " + modelId + ", GPU: " + useGPU);
+        
+        // A newer load supersedes the previous one natively; its drain reports it cancelled
+        long handle = startModelLoadNative(modelId, useGPU != null ? useGPU : false,
+                maxVramBytes != null ? maxVramBytes.longValue() : 0L,
+                gpuMemoryFraction != null ? gpuMemoryFraction.floatValue() : 1.0f);
+        
+        Map<String, Object> response = new HashMap<>();
+        if (handle == 0) {
+            response.put("success", false);
+            response.put("error", "Failed to start loading TVM model");
+            mainHandler.post(() -> result.success(response));
+            return;
+        }
+        
+        synchronized (loadHandleLock) {
+            activeLoadHandle = handle;
+        }
+        executorService.execute(() -> drainModelLoad(handle, modelId));
+        
+        response.put("success", true);
+        mainHandler.post(() -> result.success(response));
+    }
+    
+    private void handleCancelModelLoad(MethodChannel.Result result) {
+        cancelActiveModelLoad();
+        
+        Map<String, Object> response = new HashMap<>();
+        response.put("success", true);
+        mainHandler.post(() -> result.success(response));
+    }
+    
+    private void cancelActiveModelLoad() {
+        synchronized (loadHandleLock) {
+            if (activeLoadHandle != 0) {
+                cancelModelLoadNative(activeLoadHandle);
+            }
+        }
+    }
+    
+    // Forwards stage changes of one load to the event channel until it finishes
+    private void drainModelLoad(long handle, String modelId) {
+        // Each drain owns its buffer, since a superseded load may still be draining
+        ByteBuffer buffer = NativeProtocol.allocate(LOAD_BUFFER_BYTES);
+        try {
+            NativeProtocol.LoadProgress progress;
+            Map<String, Object> event;
+            do {
+                int length = pollModelLoadNative(handle, buffer, LOAD_POLL_TIMEOUT_MS);
+                if (length < 0) {
+                    // Still a terminal event, or loadModel() would wait forever
+                    Log.e(TAG, "❌ Failed to poll native model load");
+                    event = new HashMap<>();
+                    event.put("modelId", modelId);
+                    event.put("type", "loadError");
+                    event.put("error", "Failed to poll native model load");
+                    postStreamEvent(event);
+                    return;
+                }
+                event = new HashMap<>();
+                event.put("modelId", modelId);
+                progress = NativeProtocol.decodeLoadProgress(buffer, length, event);
+                if (!progress.finished) {
+                    event.put("type", "loadProgress");
+                    postStreamEvent(event);
+                }
+            } while (!progress.finished);
+            
+            // The final event carries the stage timings of the whole load
+            if ("ready".equals(progress.stage)) {
+                currentModelId = modelId;
+                event.put("type", "loadDone");
+                event.put("resident", progress.resident);
+                Log.i(TAG, "✅ TVM model loaded successfully: " + modelId);
+            } else if ("cancelled".equals(progress.stage)) {
+                event.put("type", "loadCancelled");
+                Log.i(TAG, "⏹️ Load of TVM model cancelled: " + modelId);
+            } else {
+                String error = getModelLoadErrorNative(handle);
+                event.put("type", "loadError");
+                event.put("error", error != null ? error : "Failed to load TVM model");
+                Log.e(TAG, "❌ Failed to load TVM model " + modelId + ": " + error);
+            }
+            postStreamEvent(event);
+        } finally {
+            synchronized (loadHandleLock) {
+                if (activeLoadHandle == handle) {
+                    activeLoadHandle = 0;
+                }
+                releaseModelLoadNative(handle);
+            }
+        }
+    }
+    
+    private void handlePreloadModel(MethodCall call, MethodChannel.Result result) {
+        String modelId = call.argument("modelId");
+        
+        try {
+            // Returns immediately; the load runs on the native preload thread
+            boolean queued = preloadModelNative(modelId);
+            
+            Map<String, Object> response = new HashMap<>();
+            response.put("success", true);
+            response.put("queued", queued);
+            mainHandler.post(() -> result.success(response));
+        } catch (Exception e) {
+            Log.e(TAG, "❌ Failed to preload model", e);
+            Map<String, Object> response = new HashMap<>();
+            response.put("success", false);
+            response.put("error", e.getMessage());
+            mainHandler.post(() -> result.success(response));
+        }
+    }
+    
     private void handleGenerateResponse(MethodCall call, MethodChannel.Result result) {
         String prompt = call.argument("prompt");
         Integer maxTokens = call.argument("maxTokens");
@@ -238,6 +450,12 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
         Double topP = call.argument("topP");
         Integer topK = call.argument("topK");
         String modelId = call.argument("modelId");
+        Integer priority = call.argument("priority");
+        String sessionId = call.argument("sessionId");
+        String grammar = call.argument("grammar");
+        int grammarType = grammarType(call.argument("grammarType"), grammar);
+        Integer sinkTokens = call.argument("sinkTokens");
+        Integer windowTokens = call.argument("windowTokens");
         
         Log.i(TAG, "🔄 Generating response...");
         
@@ -247,7 +465,13 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
                 maxTokens != null ? maxTokens : 150,
                 temperature != null ? temperature.floatValue() : 0.7f,
                 topP != null ? topP.floatValue() : 0.9f,
-                topK != null ? topK : 40
+                topK != null ? topK : 40,
+                priority != null ? priority : PRIORITY_INTERACTIVE,
+                sessionId,
+                grammarType,
+                grammar,
+                sinkTokens != null ? sinkTokens : 4,
+                windowTokens != null ? windowTokens : 0
             );
             
             Log.i(TAG, "✅ Response generated: " + response.length() + " characters");
@@ -266,17 +490,141 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
         }
     }
     
+    // "json_schema" or "ebnf"; anything else, or no grammar text, is unconstrained
+    private static int grammarType(String type, String grammar) {
+        if (grammar == null || grammar.isEmpty()) return GRAMMAR_NONE;
+        if ("json_schema".equals(type)) return GRAMMAR_JSON_SCHEMA;
+        if ("ebnf".equals(type)) return GRAMMAR_EBNF;
+        return GRAMMAR_NONE;
+    }
+    
     private void handleStartStreamingResponse(MethodCall call, MethodChannel.Result result) {
-        // Implementation for streaming responses
-        // This would use the EventChannel to send tokens as they're generated
+        String prompt = call.argument("prompt");
+        Integer maxTokens = call.argument("maxTokens");
+        Double temperature = call.argument("temperature");
+        Double topP = call.argument("topP");
+        Integer topK = call.argument("topK");
+        Integer priority = call.argument("priority");
+        String sessionId = call.argument("sessionId");
+        String grammar = call.argument("grammar");
+        int grammarType = grammarType(call.argument("grammarType"), grammar);
+        Integer sinkTokens = call.argument("sinkTokens");
+        Integer windowTokens = call.argument("windowTokens");
+        
         Log.i(TAG, "🔄 Starting streaming response...");
         
-        // For now, return success and implement streaming later
+        // Only one stream feeds the event channel at a time
+        cancelActiveStream();
+        
+        long handle = startStreamingNative(
+            prompt,
+            maxTokens != null ? maxTokens : 150,
+            temperature != null ? temperature.floatValue() : 0.7f,
+            topP != null ? topP.floatValue() : 0.9f,
+            topK != null ? topK : 40,
+            priority != null ? priority : PRIORITY_INTERACTIVE,
+            sessionId,
+            grammarType,
+            grammar,
+            sinkTokens != null ? sinkTokens : 4,
+            windowTokens != null ? windowTokens : 0
+        );
+        
         Map<String, Object> response = new HashMap<>();
+        if (handle == 0) {
+            response.put("success", false);
+            response.put("error", "Failed to start streaming generation");
+            mainHandler.post(() -> result.success(response));
+            return;
+        }
+        
+        long streamId;
+        synchronized (streamHandleLock) {
+            activeStreamHandle = handle;
+            streamId = nextStreamId++;
+        }
+        streamExecutorService.execute(() -> drainStream(handle, streamId));
+        
         response.put("success", true);
+        response.put("streamId", streamId);
         mainHandler.post(() -> result.success(response));
     }
     
+    private void handleCancelStreamingResponse(MethodChannel.Result result) {
+        cancelActiveStream();
+        
+        Map<String, Object> response = new HashMap<>();
+        response.put("success", true);
+        mainHandler.post(() -> result.success(response));
+    }
+    
+    private void cancelActiveStream() {
+        synchronized (streamHandleLock) {
+            if (activeStreamHandle != 0) {
+                cancelStreamingNative(activeStreamHandle);
+            }
+        }
+    }
+    
+    // Pulls token batches out of the native ring buffer and forwards them to the event channel
+    private void drainStream(long handle, long streamId) {
+        try {
+            List<String> pieces = new ArrayList<>(STREAM_POLL_BATCH);
+            while (true) {
+                int length = pollStreamNative(handle, streamBuffer, STREAM_POLL_BATCH, STREAM_POLL_TIMEOUT_MS);
+                if (length < 0) {
+                    Log.e(TAG, "❌ Failed to poll native stream");
+                    break;
+                }
+                
+                pieces.clear();
+                NativeProtocol.TokenBatch batch =
+                        NativeProtocol.decodeTokenBatch(streamBuffer, length, pieces, streamScratch);
+                for (String piece : pieces) {
+                    Map<String, Object> event = new HashMap<>();
+                    event.put("streamId", streamId);
+                    event.put("type", "token");
+                    event.put("token", piece);
+                    postStreamEvent(event);
+                }
+                if (batch.finished) {
+                    break;
+                }
+            }
+            
+            String error = getStreamErrorNative(handle);
+            Map<String, Object> event = new HashMap<>();
+            event.put("streamId", streamId);
+            if (error != null) {
+                event.put("type", "error");
+                event.put("error", error);
+            } else {
+                event.put("type", "done");
+                
+                int length = getStreamTimingsNative(handle, streamBuffer);
+                if (length > 0) {
+                    NativeProtocol.decodeStreamTimings(streamBuffer, length, event);
+                }
+            }
+            postStreamEvent(event);
+        } finally {
+            synchronized (streamHandleLock) {
+                if (activeStreamHandle == handle) {
+                    activeStreamHandle = 0;
+                }
+                releaseStreamNative(handle);
+            }
+        }
+    }
+    
+    private void postStreamEvent(Map<String, Object> event) {
+        mainHandler.post(() -> {
+            if (eventSink != null) {
+                eventSink.success(event);
+            }
+        });
+    }
+    
     private void handleUnloadModel(MethodCall call, MethodChannel.Result result) {
         String modelId = call.argument("modelId");
         
@@ -301,7 +649,11 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
     
     private void handleGetMemoryStats(MethodChannel.Result result) {
         try {
-            Map<String, Object> stats = getMemoryStatsNative();
+            Map<String, Object> stats;
+            synchronized (statsBuffer) {
+                int length = getMemoryStatsNative(statsBuffer);
+                stats = length > 0 ? NativeProtocol.decodeMemoryStats(statsBuffer, length) : new HashMap<>();
+            }
             mainHandler.post(() -> result.success(stats));
         } catch (Exception e) {
             Log.e(TAG, "❌ Failed to get memory stats", e);
@@ -309,8 +661,64 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
         }
     }
     
+    private void handleGetThreadPoolStats(MethodChannel.Result result) {
+        try {
+            List<Map<String, Object>> workers;
+            synchronized (poolStatsBuffer) {
+                int length = getThreadPoolStatsNative(poolStatsBuffer);
+                workers = length > 0 ? NativeProtocol.decodeThreadPoolStats(poolStatsBuffer, length) : new ArrayList<>();
+            }
+            mainHandler.post(() -> result.success(workers));
+        } catch (Exception e) {
+            Log.e(TAG, "❌ Failed to get thread pool stats", e);
+            mainHandler.post(() -> result.success(new ArrayList<>()));
+        }
+    }
+    
+    private void handleSetTracing(MethodCall call, MethodChannel.Result result) {
+        Boolean enabled = call.argument("enabled");
+        setTracingEnabledNative(enabled != null && enabled);
+        
+        Map<String, Object> response = new HashMap<>();
+        response.put("success", true);
+        mainHandler.post(() -> result.success(response));
+    }
+    
+    // Chrome JSON trace of the native spans recorded since the last dump;
+    // pull it with adb and open it in Perfetto
+    private void handleDumpTrace(MethodChannel.Result result) {
+        Map<String, Object> response = new HashMap<>();
+        File traceFile = new File(context.getFilesDir(), "mlc_trace.json");
+        long spans = dumpTraceNative(traceFile.getAbsolutePath());
+        
+        response.put("success", spans >= 0);
+        if (spans >= 0) {
+            response.put("path", traceFile.getAbsolutePath());
+            response.put("spans", spans);
+            Log.i(TAG, "🔍 Trace written: " + spans + " spans to " + traceFile.getAbsolutePath());
+        } else {
+            response.put("error", "Failed to write trace file");
+        }
+        mainHandler.post(() -> result.success(response));
+    }
+    
+    // Drops the saved KV of a deleted conversation
+    private void handleDeleteSessionSnapshot(MethodCall call, MethodChannel.Result result) {
+        String sessionId = call.argument("sessionId");
+        if (sessionId != null) {
+            deleteSessionSnapshotNative(sessionId);
+        }
+        
+        Map<String, Object> response = new HashMap<>();
+        response.put("success", sessionId != null);
+        mainHandler.post(() -> result.success(response));
+    }
+    
     private void handleDispose(MethodChannel.Result result) {
         try {
+            cancelActiveStream();
+            cancelActiveModelLoad();
+            
             if (currentModelId != null) {
                 unloadModelNative();
                 currentModelId = null;
@@ -332,22 +740,83 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
         }
     }
     
-    // Helper method to extract ZIP model files
+    // Streams every ZIP entry straight to its final file under mlc_models/<modelId>
+    // through one bounded buffer; nothing is staged in memory or a temp copy.
+    // The native loader then mmaps the weight shards from there.
     private File extractModelZip(String zipFileName, String modelId) throws IOException {
-        File assetsDir = new File(context.getAssets().list("models")[0]); // This needs proper asset access
-        File zipFile = new File(assetsDir, zipFileName);
         File extractDir = new File(context.getFilesDir(), "mlc_models/" + modelId);
+        File marker = new File(extractDir, EXTRACTED_MARKER);
         
-        if (!extractDir.exists()) {
-            extractDir.mkdirs();
+        if (marker.exists()) {
+            Log.i(TAG, "✅ Model already extracted at: " + extractDir.getAbsolutePath());
+            return extractDir;
+        }
+        if (!extractDir.exists() && !extractDir.mkdirs()) {
+            throw new IOException("Cannot create " + extractDir.getAbsolutePath());
         }
         
-        // Extract ZIP file (implementation details would go here)
-        // This is a placeholder - real implementation would extract the ZIP
+        String rootPath = extractDir.getCanonicalPath() + File.separator;
+        byte[] buffer = new byte[EXTRACT_BUFFER_BYTES];
+        long startMs = SystemClock.elapsedRealtime();
+        long totalBytes = 0;
+        int extractedFiles = 0;
+        
+        try (InputStream source = new BufferedInputStream(openModelArchive(zipFileName), EXTRACT_BUFFER_BYTES);
+             ZipInputStream zipInputStream = new ZipInputStream(source)) {
+            ZipEntry entry;
+            while ((entry = zipInputStream.getNextEntry()) != null) {
+                File outputFile = new File(extractDir, entry.getName());
+                if (!outputFile.getCanonicalPath().startsWith(rootPath)) {
+                    throw new IOException("ZIP entry escapes the model directory: " + entry.getName());
+                }
+                
+                if (entry.isDirectory()) {
+                    outputFile.mkdirs();
+                    continue;
+                }
+                File parentDir = outputFile.getParentFile();
+                if (parentDir != null && !parentDir.exists()) {
+                    parentDir.mkdirs();
+                }
+                
+                try (FileOutputStream outputStream = new FileOutputStream(outputFile)) {
+                    int length;
+                    while ((length = zipInputStream.read(buffer)) > 0) {
+                        outputStream.write(buffer, 0, length);
+                        totalBytes += length;
+                    }
+                }
+                zipInputStream.closeEntry();
+                extractedFiles++;
+            }
+        }
         
+        if (!marker.createNewFile() && !marker.exists()) {
+            throw new IOException("Cannot write " + marker.getAbsolutePath());
+        }
+        Log.i(TAG, "🎉 Extracted " + extractedFiles + " files (" + (totalBytes / (1024 * 1024)) + " MB) in "
+                + (SystemClock.elapsedRealtime() - startMs) + " ms to " + extractDir.getAbsolutePath());
         return extractDir;
     }
     
+    // Downloaded archives are passed as absolute paths; bundled ones live in the APK assets
+    private InputStream openModelArchive(String zipFileName) throws IOException {
+        File file = new File(zipFileName);
+        if (file.isAbsolute() && file.exists()) {
+            return new FileInputStream(file);
+        }
+        
+        String[] assetPaths = {"models/" + zipFileName, "flutter_assets/assets/models/" + zipFileName};
+        for (String assetPath : assetPaths) {
+            try {
+                return context.getAssets().open(assetPath);
+            } catch (FileNotFoundException e) {
+                // try the next location
+            }
+        }
+        throw new FileNotFoundException("Model archive not found: " + zipFileName);
+    }
+    
     // EventChannel.StreamHandler implementation
     @Override
     public void onListen(Object arguments, EventChannel.EventSink events) {
@@ -365,9 +834,25 @@ public class MLCWrapper implements MethodChannel.MethodCallHandler, EventChannel
     private native boolean initializeTVMRuntime();
     private native Map<String, Object> queryDeviceCapabilities();
     private native boolean loadModelConfigNative(String modelId, String modelLib, Map<String, Object> config);
-    private native boolean loadTVMModelNative(String modelId, boolean useGPU, int maxVramBytes);
-    private native String generateResponseNative(String prompt, int maxTokens, float temperature, float topP, int topK);
+    private native boolean loadTVMModelNative(String modelId, boolean useGPU, long maxVramBytes, float gpuMemoryFraction);
+    private native long startModelLoadNative(String modelId, boolean useGPU, long maxVramBytes, float gpuMemoryFraction);
+    private native int pollModelLoadNative(long handle, ByteBuffer buffer, int timeoutMs);
+    private native void cancelModelLoadNative(long handle);
+    private native String getModelLoadErrorNative(long handle);
+    private native void releaseModelLoadNative(long handle);
+    private native boolean preloadModelNative(String modelId);
+    private native String generateResponseNative(String prompt, int maxTokens, float temperature, float topP, int topK, int priority, String sessionId, int grammarType, String grammar, int sinkTokens, int windowTokens);
+    private native long startStreamingNative(String prompt, int maxTokens, float temperature, float topP, int topK, int priority, String sessionId, int grammarType, String grammar, int sinkTokens, int windowTokens);
+    private native int pollStreamNative(long handle, ByteBuffer buffer, int maxTokens, int timeoutMs);
+    private native void cancelStreamingNative(long handle);
+    private native String getStreamErrorNative(long handle);
+    private native int getStreamTimingsNative(long handle, ByteBuffer buffer);
+    private native void releaseStreamNative(long handle);
     private native boolean unloadModelNative();
-    private native Map<String, Object> getMemoryStatsNative();
+    private native int getMemoryStatsNative(ByteBuffer buffer);
+    private native int getThreadPoolStatsNative(ByteBuffer buffer);
+    private native void setTracingEnabledNative(boolean enabled);
+    private native long dumpTraceNative(String path);
+    private native void deleteSessionSnapshotNative(String sessionId);
     private native void disposeTVMRuntime();
 }
@@ -0,0 +1,207 @@
+package com.example.offline_ai_companion;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+/**
+ * Decoder for the binary results the native layer writes into direct
+ * ByteBuffers (see result_protocol.h; keep the two in sync).
+ *
+ * Each message is a 12-byte header (magic "MLCB", u16 version, u16 kind,
+ * u32 payload bytes) and a little-endian payload. Buffers are allocated once
+ * and reused, so a poll costs one JNI call and no per-value boxing in native code.
+ */
+final class NativeProtocol {
+    static final int MAGIC = 0x42434C4D;
+    static final int VERSION = 1;
+    static final int HEADER_BYTES = 12;
+
+    static final int KIND_MEMORY_STATS = 1;
+    static final int KIND_TOKEN_BATCH = 2;
+    static final int KIND_STREAM_TIMINGS = 3;
+    static final int KIND_THREAD_POOL_STATS = 4;
+    static final int KIND_LOAD_PROGRESS = 5;
+
+    static final int FLAG_FINISHED = 1;
+    static final int FLAG_FAILED = 1 << 1;
+
+    static final int LOAD_FLAG_FINISHED = 1;
+    static final int LOAD_FLAG_RESIDENT = 1 << 1;
+
+    // Load stages by LoadStage value, and the keys of the timed ones' durations
+    private static final String[] LOAD_STAGE_NAMES = {
+        "queued", "verify", "map_weights", "upload", "warmup", "ready", "failed", "cancelled",
+    };
+    private static final String[] LOAD_STAGE_MS_KEYS = {"verifyMs", "mapWeightsMs", "uploadMs", "warmupMs"};
+
+    // Field order of the memory stats message (MemoryStatsField)
+    private static final String[] MEMORY_STATS_KEYS = {
+        "vramUsed", "vramTotal", "systemRam", "systemAvailable", "processRss", "processPeakRss",
+        "weightsBytes", "kvCacheBytes", "scratchBytes", "jniBytes", "poolCachedBytes", "memoryPressureEvents",
+    };
+
+    // Field order of each worker in the thread pool stats message (ThreadPoolStatsField)
+    private static final int POOL_FIELD_CPU = 0;
+    private static final int POOL_FIELD_CLASS = 1;
+    private static final int POOL_FIELD_TASKS = 2;
+    private static final int POOL_FIELD_STEALS = 3;
+    private static final int POOL_FIELD_BUSY_US = 4;
+    private static final int POOL_FIELD_UPTIME_US = 5;
+    private static final int POOL_FIELD_COUNT = 6;
+
+    private NativeProtocol() {}
+
+    static ByteBuffer allocate(int capacity) {
+        return ByteBuffer.allocateDirect(capacity).order(ByteOrder.LITTLE_ENDIAN);
+    }
+
+    /** Decoded token batch; pieces are appended to the caller's list. */
+    static final class TokenBatch {
+        boolean finished;
+        boolean failed;
+    }
+
+    /** Decoded load progress; stage is one of LOAD_STAGE_NAMES. */
+    static final class LoadProgress {
+        String stage;
+        boolean finished;
+        boolean resident;
+    }
+
+    // Validates the header and leaves the buffer positioned at the payload
+    private static void readHeader(ByteBuffer buffer, int length, int expectedKind) {
+        if (length < HEADER_BYTES) {
+            throw new IllegalStateException("Native result too short: " + length);
+        }
+        buffer.order(ByteOrder.LITTLE_ENDIAN).limit(length).position(0);
+        int magic = buffer.getInt();
+        int version = buffer.getShort() & 0xFFFF;
+        int kind = buffer.getShort() & 0xFFFF;
+        int payload = buffer.getInt();
+        if (magic != MAGIC || version > VERSION || kind != expectedKind || payload != length - HEADER_BYTES) {
+            throw new IllegalStateException("Unexpected native result: kind " + kind + ", version " + version);
+        }
+    }
+
+    static Map<String, Object> decodeMemoryStats(ByteBuffer buffer, int length) {
+        readHeader(buffer, length, KIND_MEMORY_STATS);
+        int count = buffer.getInt();
+        buffer.getInt(); // reserved
+
+        Map<String, Object> stats = new HashMap<>();
+        for (int i = 0; i < count; i++) {
+            long value = buffer.getLong();
+            if (i < MEMORY_STATS_KEYS.length) {
+                stats.put(MEMORY_STATS_KEYS[i], value);
+            }
+        }
+        return stats;
+    }
+
+    /** One map per worker; utilization is busy time over the pool's uptime. */
+    static List<Map<String, Object>> decodeThreadPoolStats(ByteBuffer buffer, int length) {
+        readHeader(buffer, length, KIND_THREAD_POOL_STATS);
+        int workers = buffer.getInt();
+        int fieldsPerWorker = buffer.getInt();
+        if (fieldsPerWorker < POOL_FIELD_COUNT) {
+            throw new IllegalStateException("Thread pool stats with " + fieldsPerWorker + " fields");
+        }
+
+        List<Map<String, Object>> stats = new ArrayList<>(workers);
+        long[] fields = new long[fieldsPerWorker];
+        for (int i = 0; i < workers; i++) {
+            for (int f = 0; f < fieldsPerWorker; f++) {
+                fields[f] = buffer.getLong();
+            }
+            long busyUs = fields[POOL_FIELD_BUSY_US];
+            long uptimeUs = fields[POOL_FIELD_UPTIME_US];
+            Map<String, Object> worker = new HashMap<>();
+            worker.put("cpu", fields[POOL_FIELD_CPU]);
+            worker.put("coreClass", fields[POOL_FIELD_CLASS] == 0 ? "performance" : "efficiency");
+            worker.put("tasks", fields[POOL_FIELD_TASKS]);
+            worker.put("steals", fields[POOL_FIELD_STEALS]);
+            worker.put("busyMs", busyUs / 1000.0);
+            worker.put("utilization", uptimeUs > 0 ? (double) busyUs / uptimeUs : 0.0);
+            stats.add(worker);
+        }
+        return stats;
+    }
+
+    static TokenBatch decodeTokenBatch(ByteBuffer buffer, int length, List<String> pieces, byte[] scratch) {
+        readHeader(buffer, length, KIND_TOKEN_BATCH);
+        int count = buffer.getInt();
+        int flags = buffer.getInt();
+
+        for (int i = 0; i < count; i++) {
+            buffer.getInt(); // token id
+            int bytes = buffer.getInt();
+            byte[] text = bytes <= scratch.length ? scratch : new byte[bytes];
+            buffer.get(text, 0, bytes);
+            pieces.add(new String(text, 0, bytes, StandardCharsets.UTF_8));
+        }
+
+        TokenBatch batch = new TokenBatch();
+        batch.finished = (flags & FLAG_FINISHED) != 0;
+        batch.failed = (flags & FLAG_FAILED) != 0;
+        return batch;
+    }
+
+    /**
+     * Adds firstTokenMs and prefillChunkMs to {@code event}, plus draftTokens
+     * and acceptedDraftTokens when the native side reports them.
+     */
+    static void decodeStreamTimings(ByteBuffer buffer, int length, Map<String, Object> event) {
+        readHeader(buffer, length, KIND_STREAM_TIMINGS);
+        long firstTokenUs = buffer.getLong();
+        int count = buffer.getInt();
+        buffer.getInt(); // reserved
+
+        List<Double> chunkMs = new ArrayList<>(count);
+        for (int i = 0; i < count; i++) {
+            chunkMs.add(buffer.getLong() / 1000.0);
+        }
+        event.put("firstTokenMs", firstTokenUs / 1000.0);
+        event.put("prefillChunkMs", chunkMs);
+        if (buffer.remaining() >= 16) {
+            event.put("draftTokens", buffer.getLong());
+            event.put("acceptedDraftTokens", buffer.getLong());
+        }
+    }
+
+    /**
+     * Adds stage, progress, overallProgress and stageMs (milliseconds spent
+     * in each stage so far) to {@code event}.
+     */
+    static LoadProgress decodeLoadProgress(ByteBuffer buffer, int length, Map<String, Object> event) {
+        readHeader(buffer, length, KIND_LOAD_PROGRESS);
+        int stage = buffer.getInt();
+        int flags = buffer.getInt();
+        long stagePpm = buffer.getLong();
+        long overallPpm = buffer.getLong();
+        int count = buffer.getInt();
+        buffer.getInt(); // reserved
+
+        Map<String, Object> stageMs = new HashMap<>();
+        for (int i = 0; i < count; i++) {
+            double ms = buffer.getLong() / 1000.0;
+            if (i < LOAD_STAGE_MS_KEYS.length) {
+                stageMs.put(LOAD_STAGE_MS_KEYS[i], ms);
+            }
+        }
+
+        LoadProgress progress = new LoadProgress();
+        progress.stage = stage >= 0 && stage < LOAD_STAGE_NAMES.length ? LOAD_STAGE_NAMES[stage] : "unknown";
+        progress.finished = (flags & LOAD_FLAG_FINISHED) != 0;
+        progress.resident = (flags & LOAD_FLAG_RESIDENT) != 0;
+        event.put("stage", progress.stage);
+        event.put("progress", stagePpm / 1e6);
+        event.put("overallProgress", overallPpm / 1e6);
+        event.put("stageMs", stageMs);
+        return progress;
+    }
+}
@@ -86,6 +86,9 @@ class MLCModels {
       'vocab_size': 128256,
       'max_batch_size': 128,
       'temperature': 0.6,
+      'presence_penalty': 0.0,
+      'frequency_penalty': 0.0,
+      'repetition_penalty': 1.0,
       'top_p': 0.9,
     },
   );
@@ -11,6 +11,9 @@ class MLCModelProvider with ChangeNotifier {
   bool _isGenerating = false;
   MLCModel? _selectedModel;
   String _loadingProgress = '';
+  String _loadStage = '';
+  double _loadFraction = 0.0;
+  bool _loadCancelRequested = false;
   String? _error;
   
   // Device capabilities
@@ -32,6 +35,7 @@ class MLCModelProvider with ChangeNotifier {
       
       // Set up progress callback
       _aiService.setProgressCallback(_updateProgress);
+      _aiService.setLoadProgressCallback(_updateLoadProgress);
       
       // Initialize AI service
       await _aiService.initialize();
@@ -119,6 +123,9 @@ class MLCModelProvider with ChangeNotifier {
 
     try {
       _setLoading(true, 'Loading ${model.name}...');
+      _loadStage = '';
+      _loadFraction = 0.0;
+      _loadCancelRequested = false;
       _clearError();
       
       print('MLCModelProvider: Selecting model: ${model.name}');
@@ -138,6 +145,11 @@ class MLCModelProvider with ChangeNotifier {
         _updateServiceInfo();
         _setLoading(false, '');
         print('MLCModelProvider: Model loaded successfully: ${model.name}');
+        _preloadNextModel(model);
+      } else if (_loadCancelRequested) {
+        // The previous model is still loaded and current
+        _setLoading(false, '');
+        print('MLCModelProvider: Model loading cancelled: ${model.name}');
       } else {
         throw Exception('Model loading failed');
       }
@@ -148,13 +160,36 @@ class MLCModelProvider with ChangeNotifier {
     }
   }
 
-  /// Generate AI response
+  /// Cancel the model load in progress; the previous model keeps serving
+  Future<void> cancelLoading() async {
+    if (!_isLoading) return;
+    _loadCancelRequested = true;
+    _updateProgress('Cancelling...');
+    await _aiService.cancelModelLoad();
+  }
+
+  /// Preload the model after [current] in the available list, so switching
+  /// to it is instant when both fit the VRAM budget (native decides)
+  void _preloadNextModel(MLCModel current) {
+    final models = getAvailableModels();
+    final index = models.indexWhere((m) => m.id == current.id);
+    if (models.length < 2) return;
+
+    final next = models[(index + 1) % models.length];
+    _aiService.preloadModel(next).then((queued) {
+      if (queued) print('MLCModelProvider: Preloading ${next.name} in the background');
+    });
+  }
+
+  /// Generate AI response. Passing the chat session's id as [sessionId]
+  /// keeps the conversation's KV cache across turns and restarts.
   Future<String> generateResponse(
     String prompt, {
     int maxTokens = 150,
     double temperature = 0.7,
     double topP = 0.9,
     int topK = 40,
+    String? sessionId,
   }) async {
     if (!_isInitialized || _selectedModel == null) {
       throw Exception('Service not ready or no model loaded');
@@ -170,6 +205,7 @@ class MLCModelProvider with ChangeNotifier {
         temperature: temperature,
         topP: topP,
         topK: topK,
+        sessionId: sessionId,
       );
       
       // Update memory stats after generation
@@ -191,6 +227,7 @@ class MLCModelProvider with ChangeNotifier {
     double temperature = 0.7,
     double topP = 0.9,
     int topK = 40,
+    String? sessionId,
   }) async* {
     if (!_isInitialized || _selectedModel == null) {
       throw Exception('Service not ready or no model loaded');
@@ -205,6 +242,7 @@ class MLCModelProvider with ChangeNotifier {
         temperature: temperature,
         topP: topP,
         topK: topK,
+        sessionId: sessionId,
       );
       
       // Update memory stats after generation
@@ -239,6 +277,11 @@ class MLCModelProvider with ChangeNotifier {
     }
   }
 
+  /// Drop the saved KV cache of a deleted conversation
+  Future<void> deleteSessionSnapshot(String sessionId) async {
+    await _aiService.deleteSessionSnapshot(sessionId);
+  }
+
   /// Helper methods for state management
   void _setLoading(bool loading, String progress) {
     _isLoading = loading;
@@ -266,6 +309,12 @@ class MLCModelProvider with ChangeNotifier {
     notifyListeners();
   }
 
+  void _updateLoadProgress(Map<String, dynamic> event) {
+    _loadStage = event['stage'] as String? ?? '';
+    _loadFraction = (event['overallProgress'] as num?)?.toDouble() ?? _loadFraction;
+    notifyListeners();
+  }
+
   /// Dispose provider and cleanup
   @override
   void dispose() {
@@ -279,6 +328,8 @@ class MLCModelProvider with ChangeNotifier {
   bool get isGenerating => _isGenerating;
   MLCModel? get selectedModel => _selectedModel;
   String get loadingProgress => _loadingProgress;
+  String get loadStage => _loadStage; // verify, map_weights, upload, warmup, ready...
+  double get loadFraction => _loadFraction; // 0..1 over all load stages
   String? get error => _error;
   bool get hasError => _error != null;
   
@@ -292,7 +343,8 @@ class MLCModelProvider with ChangeNotifier {
   Map<String, dynamic> get serviceInfo => _serviceInfo;
   
   // Status checks
-  bool get isReady => _isInitialized && _selectedModel != null && !_isLoading;
+  // The previous model keeps serving while another one loads
+  bool get isReady => _isInitialized && _selectedModel != null;
   bool get usesMLC => _serviceInfo['useMLC'] ?? false;
   bool get usesGPU => usesMLC && _supportsGPU;
   String get frameworkName => _aiService.frameworkName;
@@ -14,6 +14,7 @@ class MLCAIService {
   bool _useMLC = false;
   bool _useLegacy = false;
   Function(String)? _progressCallback;
+  Function(Map<String, dynamic>)? _loadProgressCallback;
 
   /// Initialize the AI service with MLC-LLM support
   Future<void> initialize() async {
@@ -47,6 +48,9 @@ class MLCAIService {
     if (_progressCallback != null) {
       _mlcService!.setProgressCallback(_progressCallback!);
     }
+    if (_loadProgressCallback != null) {
+      _mlcService!.setLoadProgressCallback(_loadProgressCallback!);
+    }
 
     await _mlcService!.initialize();
     _useMLC = true;
@@ -121,6 +125,12 @@ class MLCAIService {
     double temperature = 0.7,
     double topP = 0.9,
     int topK = 40,
+    int priority = MLCService.priorityInteractive,
+    String? sessionId,
+    String? jsonSchema,
+    String? grammar,
+    int sinkTokens = 4,
+    int windowTokens = 0,
   }) async {
     if (!_isInitialized || _currentModel == null) {
       throw Exception('AI service not ready or no model loaded');
@@ -135,6 +145,12 @@ class MLCAIService {
           temperature: temperature,
           topP: topP,
           topK: topK,
+          priority: priority,
+          sessionId: sessionId,
+          jsonSchema: jsonSchema,
+          grammar: grammar,
+          sinkTokens: sinkTokens,
+          windowTokens: windowTokens,
         );
       } else if (_useLegacy) {
         // Use legacy llama.cpp service
@@ -159,6 +175,11 @@ class MLCAIService {
     double temperature = 0.7,
     double topP = 0.9,
     int topK = 40,
+    String? sessionId,
+    String? jsonSchema,
+    String? grammar,
+    int sinkTokens = 4,
+    int windowTokens = 0,
   }) async* {
     if (!_isInitialized || _currentModel == null) {
       throw Exception('AI service not ready or no model loaded');
@@ -172,6 +193,11 @@ class MLCAIService {
         temperature: temperature,
         topP: topP,
         topK: topK,
+        sessionId: sessionId,
+        jsonSchema: jsonSchema,
+        grammar: grammar,
+        sinkTokens: sinkTokens,
+        windowTokens: windowTokens,
       );
     } else {
       // Legacy doesn't support streaming, return complete response
@@ -181,6 +207,10 @@ class MLCAIService {
         temperature: temperature,
         topP: topP,
         topK: topK,
+        jsonSchema: jsonSchema,
+        grammar: grammar,
+        sinkTokens: sinkTokens,
+        windowTokens: windowTokens,
       );
       yield response;
     }
@@ -223,6 +253,18 @@ class MLCAIService {
     };
   }
 
+  /// Load a model in the background (MLC only) so switching to it is instant
+  Future<bool> preloadModel(MLCModel model) async {
+    if (!_isInitialized || !_useMLC || _mlcService == null) return false;
+    return _mlcService!.preloadModel(model);
+  }
+
+  /// Cancel the in-flight model load (MLC only); the previous model stays current
+  Future<void> cancelModelLoad() async {
+    if (!_useMLC || _mlcService == null) return;
+    await _mlcService!.cancelModelLoad();
+  }
+
   /// Unload current model to free memory
   Future<void> unloadModel() async {
     if (_currentModel != null) {
@@ -237,6 +279,12 @@ class MLCAIService {
     }
   }
 
+  /// Delete a conversation's saved KV cache (MLC only)
+  Future<void> deleteSessionSnapshot(String sessionId) async {
+    if (!_useMLC || _mlcService == null) return;
+    await _mlcService!.deleteSessionSnapshot(sessionId);
+  }
+
   /// Dispose and cleanup service
   Future<void> dispose() async {
     await unloadModel();
@@ -264,6 +312,12 @@ class MLCAIService {
     _legacyService?.setProgressCallback(callback);
   }
 
+  /// Set callback for structured load stages and fractions (MLC only)
+  void setLoadProgressCallback(Function(Map<String, dynamic>) callback) {
+    _loadProgressCallback = callback;
+    _mlcService?.setLoadProgressCallback(callback);
+  }
+
   /// Get service status and performance info
   Map<String, dynamic> getServiceInfo() {
     return {
@@ -1,21 +1,41 @@
 import 'dart:io';
 import 'dart:async';
+import 'dart:convert';
 import 'package:flutter/services.dart';
 import 'package:offline_ai_companion/models/mlc_model.dart';
 
 /// MLC-LLM service for high-performance AI inference
 class MLCService {
   static const MethodChannel _channel = MethodChannel('mlc_llm_channel');
+  static const EventChannel _streamChannel = EventChannel('mlc_llm_stream');
+
+  /// Native request priorities; background requests share decode steps
+  /// with the foreground chat instead of queueing behind it
+  static const int priorityBackground = 0;
+  static const int priorityNormal = 1;
+  static const int priorityInteractive = 2;
   
   bool _isInitialized = false;
   MLCModel? _currentModel;
   Function(String)? _progressCallback;
+  Function(Map<String, dynamic>)? _loadProgressCallback;
+
+  /// Status lines for the native load stages (see LoadStage in model_load.h)
+  static const Map<String, String> _loadStageMessages = {
+    'verify': '🔍 Verifying model files...',
+    'map_weights': '🗺️ Mapping model weights...',
+    'upload': '📤 Loading weights onto the device...',
+    'warmup': '🔥 Warming up...',
+  };
   
   // Device capabilities
   int? _deviceVramBytes;
   bool? _supportsGPU;
   String? _deviceInfo;
 
+  // runtime_config section of assets/mlc-app-config.json
+  Map<String, dynamic>? _runtimeConfig;
+
   /// Initialize MLC-LLM runtime
   Future<void> initialize() async {
     try {
@@ -57,6 +77,21 @@ class MLCService {
     }
   }
 
+  /// Read the runtime_config section of the bundled MLC app config
+  Future<Map<String, dynamic>> _loadRuntimeConfig() async {
+    if (_runtimeConfig != null) return _runtimeConfig!;
+
+    try {
+      final json = await rootBundle.loadString('assets/mlc-app-config.json');
+      final config = jsonDecode(json) as Map<String, dynamic>;
+      _runtimeConfig = Map<String, dynamic>.from(config['runtime_config'] ?? {});
+    } catch (e) {
+      print('MLCService: Warning - Could not read runtime config: $e');
+      _runtimeConfig = {};
+    }
+    return _runtimeConfig!;
+  }
+
   /// Load MLC model (ZIP extraction + binary loading)
   Future<bool> loadModel(MLCModel model) async {
     if (!_isInitialized) {
@@ -72,59 +107,182 @@ class MLCService {
         _progressCallback?.call('⚠️ Warning: Model requires ${model.vramMB.toInt()}MB VRAM, device has ${(_deviceVramBytes! / 1024 / 1024).toInt()}MB');
       }
 
-      // Step 1: Extract model ZIP if needed
-      _progressCallback?.call('📦 Extracting model files...');
-      final extractResult = await _channel.invokeMethod('extractModel', {
-        'modelPath': model.filename,
-        'modelId': model.id,
-      });
+      // Steps 1-2: Extract model ZIP if needed and load its configuration
+      await _prepareModel(model);
+      final runtimeConfig = await _loadRuntimeConfig();
 
-      if (extractResult['success'] != true) {
-        throw Exception('Failed to extract model: ${extractResult['error']}');
+      // Step 3: Initialize TVM model in the background (instant if it is
+      // still resident); the current model keeps serving until it is ready
+      _progressCallback?.call('🧠 Initializing AI model...');
+      final done = await _runModelLoad(model, runtimeConfig);
+      if (done == null) {
+        print('MLCService: ⏹️ Model load cancelled: ${model.name}');
+        _progressCallback?.call('⏹️ Loading ${model.name} cancelled');
+        return false;
       }
 
-      // Step 2: Load model configuration
-      _progressCallback?.call('⚙️ Loading model configuration...');
-      final configResult = await _channel.invokeMethod('loadModelConfig', {
-        'modelId': model.id,
-        'modelLib': model.modelLib,
-        'config': model.modelConfig,
-      });
+      _currentModel = model;
+      print('MLCService: ✅ Model ${done['resident'] == true ? 'switched' : 'loaded'} successfully: ${model.name} '
+          '(stages: ${done['stageMs']})');
+      _progressCallback?.call('✅ ${model.name} ready!');
+      return true;
+    } catch (e) {
+      print('MLCService: ❌ Failed to load model: $e');
+      _progressCallback?.call('❌ Failed to load ${model.name}: $e');
+      return false;
+    }
+  }
 
-      if (configResult['success'] != true) {
-        throw Exception('Failed to load model config: ${configResult['error']}');
-      }
+  /// Starts the native load and forwards its progress events until the
+  /// final one. Returns that 'loadDone' event, or null when cancelled.
+  Future<Map<dynamic, dynamic>?> _runModelLoad(MLCModel model, Map<String, dynamic> runtimeConfig) async {
+    // Subscribe before starting so fast stages are not dropped
+    final events = StreamController<dynamic>();
+    final subscription = _streamChannel.receiveBroadcastStream().listen(
+      events.add,
+      onError: events.addError,
+    );
 
-      // Step 3: Initialize TVM model
-      _progressCallback?.call('🧠 Initializing AI model...');
-      final loadResult = await _channel.invokeMethod('loadTVMModel', {
+    try {
+      final result = await _channel.invokeMethod('startModelLoad', {
         'modelId': model.id,
         'useGPU': _supportsGPU ?? false,
         'maxVramBytes': _deviceVramBytes,
+        if (runtimeConfig['gpu_memory_fraction'] != null) 'gpuMemoryFraction': runtimeConfig['gpu_memory_fraction'],
       });
+      if (result['success'] != true) {
+        throw Exception('Failed to load TVM model: ${result['error']}');
+      }
 
-      if (loadResult['success'] == true) {
-        _currentModel = model;
-        print('MLCService: ✅ Model loaded successfully: ${model.name}');
-        _progressCallback?.call('✅ ${model.name} ready!');
-        return true;
-      } else {
-        throw Exception('Failed to load TVM model: ${loadResult['error']}');
+      String? stage;
+      await for (final event in events.stream) {
+        // Events of a superseded load of another model are not ours
+        if (event['modelId'] != model.id) continue;
+
+        switch (event['type']) {
+          case 'loadProgress':
+            _loadProgressCallback?.call(Map<String, dynamic>.from(event));
+            if (event['stage'] != stage) {
+              stage = event['stage'] as String?;
+              final message = _loadStageMessages[stage];
+              if (message != null) _progressCallback?.call(message);
+            }
+            break;
+          case 'loadDone':
+            _loadProgressCallback?.call(Map<String, dynamic>.from(event));
+            return event as Map<dynamic, dynamic>;
+          case 'loadCancelled':
+            _loadProgressCallback?.call(Map<String, dynamic>.from(event));
+            return null;
+          case 'loadError':
+            throw Exception('Failed to load TVM model: ${event['error']}');
+        }
       }
+      throw Exception('Model load event stream closed');
+    } finally {
+      await subscription.cancel();
+      await events.close();
+    }
+  }
+
+  /// Cancel the in-flight model load; its loadModel() call then returns
+  /// false and the previous model stays current
+  Future<void> cancelModelLoad() async {
+    try {
+      await _channel.invokeMethod('cancelModelLoad');
     } catch (e) {
-      print('MLCService: ❌ Failed to load model: $e');
-      _progressCallback?.call('❌ Failed to load ${model.name}: $e');
+      print('MLCService: ⚠️ Error cancelling model load: $e');
+    }
+  }
+
+  /// Load a model in the background so a later switch to it is instant.
+  /// Skipped natively when it would not fit next to the current model.
+  Future<bool> preloadModel(MLCModel model) async {
+    if (!_isInitialized || model.id == _currentModel?.id) return false;
+
+    try {
+      await _prepareModel(model, reportProgress: false);
+      final result = await _channel.invokeMethod('preloadModel', {
+        'modelId': model.id,
+      });
+      return result['queued'] == true;
+    } catch (e) {
+      print('MLCService: Warning - Could not preload ${model.name}: $e');
       return false;
     }
   }
 
-  /// Generate AI response using MLC inference
+  /// Extract the model ZIP (skipped once extracted) and hand its config to native
+  Future<void> _prepareModel(MLCModel model, {bool reportProgress = true}) async {
+    if (reportProgress) _progressCallback?.call('📦 Extracting model files...');
+    final extractResult = await _channel.invokeMethod('extractModel', {
+      'modelPath': model.filename,
+      'modelId': model.id,
+    });
+
+    if (extractResult['success'] != true) {
+      throw Exception('Failed to extract model: ${extractResult['error']}');
+    }
+
+    if (reportProgress) _progressCallback?.call('⚙️ Loading model configuration...');
+    final runtimeConfig = await _loadRuntimeConfig();
+    final configResult = await _channel.invokeMethod('loadModelConfig', {
+      'modelId': model.id,
+      'modelLib': model.modelLib,
+      'config': {
+        ...model.modelConfig,
+        // Native config reads flat numbers only
+        if (model.modelConfig['rope_scaling'] is Map)
+          for (final entry in (model.modelConfig['rope_scaling'] as Map).entries)
+            if (entry.value is num) 'rope_scaling_${entry.key}': entry.value,
+        'context_window_size': model.contextWindowSize,
+        'prefill_chunk_size': model.prefillChunkSize,
+        'estimated_vram_bytes': model.estimatedVramBytes,
+        if (runtimeConfig['cache_size_mb'] != null) 'cache_size_mb': runtimeConfig['cache_size_mb'],
+        if (runtimeConfig['max_concurrent_requests'] != null)
+          'max_concurrent_requests': runtimeConfig['max_concurrent_requests'],
+        if (runtimeConfig['enable_batching'] != null) 'enable_batching': runtimeConfig['enable_batching'],
+        for (final key in const [
+          'memory_low_watermark_mb',
+          'memory_high_watermark_mb',
+          'memory_min_available_mb',
+          'speculative_decoding',
+          'speculative_max_draft',
+          'speculative_max_ngram',
+          'kv_block_tokens',
+          'kv_cache_bits',
+          'kv_cache_mb',
+          'kv_snapshot_mb',
+          'cpu_performance_workers',
+          'cpu_efficiency_workers',
+        ])
+          if (runtimeConfig[key] != null) key: runtimeConfig[key],
+      },
+    });
+
+    if (configResult['success'] != true) {
+      throw Exception('Failed to load model config: ${configResult['error']}');
+    }
+  }
+
+  /// Generate AI response using MLC inference. With a [sessionId], the
+  /// conversation's KV cache is saved after the reply and restored on the
+  /// next turn, even after an app restart. A [jsonSchema] (or an EBNF
+  /// [grammar] with a `root` rule) constrains the reply to match it. A
+  /// [windowTokens] > 0 keeps the first [sinkTokens] plus that many recent
+  /// tokens in the KV cache, so a session can outgrow the context window.
   Future<String> generateResponse(
     String prompt, {
     int maxTokens = 150,
     double temperature = 0.7,
     double topP = 0.9,
     int topK = 40,
+    int priority = priorityInteractive,
+    String? sessionId,
+    String? jsonSchema,
+    String? grammar,
+    int sinkTokens = 4,
+    int windowTokens = 0,
   }) async {
     if (!_isInitialized || _currentModel == null) {
       throw Exception('MLC service not initialized or no model loaded');
@@ -143,6 +301,11 @@ class MLCService {
         'topP': topP,
         'topK': topK,
         'modelId': _currentModel!.id,
+        'priority': priority,
+        'sessionId': sessionId,
+        ..._grammarArguments(jsonSchema, grammar),
+        'sinkTokens': sinkTokens,
+        'windowTokens': windowTokens,
       });
 
       if (result['success'] == true) {
@@ -158,6 +321,18 @@ class MLCService {
     }
   }
 
+  /// Channel arguments for an optional output constraint; a JSON schema
+  /// takes precedence over an EBNF grammar
+  Map<String, dynamic> _grammarArguments(String? jsonSchema, String? grammar) {
+    if (jsonSchema != null) {
+      return {'grammarType': 'json_schema', 'grammar': jsonSchema};
+    }
+    if (grammar != null) {
+      return {'grammarType': 'ebnf', 'grammar': grammar};
+    }
+    return {};
+  }
+
   /// Format prompt with system message for LLaMA-3.2-Instruct
   String _formatPromptWithSystem(String userPrompt) {
     const systemPrompt = '''<|begin_of_text|><|start_header_id|>system<|end_header_id|>
@@ -204,6 +379,12 @@ Key guidelines:
     double temperature = 0.7,
     double topP = 0.9,
     int topK = 40,
+    int priority = priorityInteractive,
+    String? sessionId,
+    String? jsonSchema,
+    String? grammar,
+    int sinkTokens = 4,
+    int windowTokens = 0,
   }) async* {
     if (!_isInitialized || _currentModel == null) {
       throw Exception('MLC service not initialized or no model loaded');
@@ -212,31 +393,52 @@ Key guidelines:
     try {
       print('MLCService: Starting streaming response...');
       
-      // Set up event channel for streaming
-      const EventChannel streamChannel = EventChannel('mlc_llm_stream');
-      
       // Format prompt with system message for LLaMA-3.2-Instruct
       final formattedPrompt = _formatPromptWithSystem(prompt);
       
-      // Start streaming inference
-      await _channel.invokeMethod('startStreamingResponse', {
-        'prompt': formattedPrompt,
-        'maxTokens': maxTokens,
-        'temperature': temperature,
-        'topP': topP,
-        'topK': topK,
-        'modelId': _currentModel!.id,
-      });
+      // Subscribe before starting so the first tokens are not dropped
+      final events = StreamController<dynamic>();
+      final subscription = _streamChannel.receiveBroadcastStream().listen(
+        events.add,
+        onError: events.addError,
+      );
+      
+      try {
+        // Start streaming inference
+        final result = await _channel.invokeMethod('startStreamingResponse', {
+          'prompt': formattedPrompt,
+          'maxTokens': maxTokens,
+          'temperature': temperature,
+          'topP': topP,
+          'topK': topK,
+          'modelId': _currentModel!.id,
+          'priority': priority,
+          'sessionId': sessionId,
+          ..._grammarArguments(jsonSchema, grammar),
+          'sinkTokens': sinkTokens,
+          'windowTokens': windowTokens,
+        });
+
+        if (result['success'] != true) {
+          throw Exception('Failed to start streaming: ${result['error']}');
+        }
 
-      // Listen for tokens
-      await for (final event in streamChannel.receiveBroadcastStream()) {
-        if (event['type'] == 'token') {
-          yield event['token'] as String;
-        } else if (event['type'] == 'done') {
-          break;
-        } else if (event['type'] == 'error') {
-          throw Exception('Streaming error: ${event['error']}');
+        // Listen for tokens. A cancelled predecessor may still be draining
+        // into the same channel, so only this stream's events count.
+        final streamId = result['streamId'];
+        await for (final event in events.stream) {
+          if (event['streamId'] != streamId) continue;
+          if (event['type'] == 'token') {
+            yield event['token'] as String;
+          } else if (event['type'] == 'done') {
+            break;
+          } else if (event['type'] == 'error') {
+            throw Exception('Streaming error: ${event['error']}');
+          }
         }
+      } finally {
+        await subscription.cancel();
+        await events.close();
       }
     } catch (e) {
       print('MLCService: ❌ Streaming failed: $e');
@@ -244,6 +446,15 @@ Key guidelines:
     }
   }
 
+  /// Stop the in-flight streaming response; the stream then completes with 'done'
+  Future<void> cancelStreaming() async {
+    try {
+      await _channel.invokeMethod('cancelStreamingResponse');
+    } catch (e) {
+      print('MLCService: ⚠️ Error cancelling stream: $e');
+    }
+  }
+
   /// Unload current model to free memory
   Future<void> unloadModel() async {
     if (_currentModel != null) {
@@ -268,6 +479,15 @@ Key guidelines:
         'vramUsed': result['vramUsed'] ?? 0,
         'vramTotal': result['vramTotal'] ?? 0,
         'systemRam': result['systemRam'] ?? 0,
+        'systemAvailable': result['systemAvailable'] ?? 0,
+        'processRss': result['processRss'] ?? 0,
+        'processPeakRss': result['processPeakRss'] ?? 0,
+        'weightsBytes': result['weightsBytes'] ?? 0,
+        'kvCacheBytes': result['kvCacheBytes'] ?? 0,
+        'scratchBytes': result['scratchBytes'] ?? 0,
+        'jniBytes': result['jniBytes'] ?? 0,
+        'poolCachedBytes': result['poolCachedBytes'] ?? 0,
+        'memoryPressureEvents': result['memoryPressureEvents'] ?? 0,
         'modelSize': result['modelSize'] ?? 0,
       };
     } catch (e) {
@@ -276,6 +496,59 @@ Key guidelines:
     }
   }
 
+  /// Per-worker counters of the native CPU thread pool: core class
+  /// ('performance' or 'efficiency'), pinned cpu, tasks run, tasks stolen
+  /// from other workers, busyMs and utilization (busy share of the pool's
+  /// uptime)
+  Future<List<Map<String, dynamic>>> getThreadPoolStats() async {
+    try {
+      final result = await _channel.invokeMethod('getThreadPoolStats');
+      return [
+        for (final worker in (result as List? ?? const []))
+          Map<String, dynamic>.from(worker as Map),
+      ];
+    } catch (e) {
+      print('MLCService: Warning - Could not get thread pool stats: $e');
+      return [];
+    }
+  }
+
+  /// Start or stop recording native trace spans (tokenize, prefill, decode,
+  /// sampling, detokenize, JNI return)
+  Future<void> setTracing(bool enabled) async {
+    try {
+      await _channel.invokeMethod('setTracing', {'enabled': enabled});
+    } catch (e) {
+      print('MLCService: Warning - Could not toggle tracing: $e');
+    }
+  }
+
+  /// Write the spans recorded since the last dump as a Chrome/Perfetto JSON
+  /// trace. Returns the file path on the device, or null on failure.
+  Future<String?> dumpTrace() async {
+    try {
+      final result = await _channel.invokeMethod('dumpTrace');
+      if (result['success'] != true) {
+        print('MLCService: Warning - Could not dump trace: ${result['error']}');
+        return null;
+      }
+      print('MLCService: 🔍 ${result['spans']} trace spans written to ${result['path']}');
+      return result['path'] as String?;
+    } catch (e) {
+      print('MLCService: Warning - Could not dump trace: $e');
+      return null;
+    }
+  }
+
+  /// Delete the saved KV cache of a conversation, e.g. when it is deleted
+  Future<void> deleteSessionSnapshot(String sessionId) async {
+    try {
+      await _channel.invokeMethod('deleteSessionSnapshot', {'sessionId': sessionId});
+    } catch (e) {
+      print('MLCService: Warning - Could not delete session snapshot: $e');
+    }
+  }
+
   /// Cleanup and dispose service
   Future<void> dispose() async {
     await unloadModel();
@@ -296,6 +569,12 @@ Key guidelines:
     _progressCallback = callback;
   }
 
+  /// Set callback for structured load progress: stage, progress (within the
+  /// stage), overallProgress (0..1) and stageMs
+  void setLoadProgressCallback(Function(Map<String, dynamic>) callback) {
+    _loadProgressCallback = callback;
+  }
+
   /// Get current model info
   MLCModel? get currentModel => _currentModel;
   